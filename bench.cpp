@@ -0,0 +1,659 @@
+#include "lib.cpp" // Benchmarks the implementation directly, like test.cpp
+
+#include <random>
+
+// dircat_bench: generates a synthetic source tree and times every stage of
+// the pipeline on its own (walk, gitignore filtering, read, comment strip,
+// format, write) plus a full run. Results go to stdout as JSON or CSV, so
+// runs can be compared across versions; progress goes to stderr.
+
+// --- Benchmark Options ---
+
+enum class SizeDistribution { Fixed, Uniform, LogNormal };
+
+struct BenchOptions {
+  size_t files = 5000;
+  unsigned int depth = 3;  // Directory levels below the root
+  unsigned int fanout = 4; // Subdirectories per directory
+  SizeDistribution sizeDistribution = SizeDistribution::LogNormal;
+  size_t meanSizeB = 4096;
+  double gitignoreDensity = 0.1; // Fraction of directories with a .gitignore
+  double commentDensity = 0.3;   // Fraction of lines that carry a comment
+  uint32_t seed = 1;
+  fs::path workDir; // Holds the tree and the output; empty = system temp dir
+  bool keepTree = false;
+  std::vector<unsigned int> threadCounts = {0}; // 0 = hardware concurrency
+  unsigned int iterations = 5;
+  bool csv = false;
+};
+
+void print_bench_usage() {
+  std::cout
+      << "Usage: dircat_bench [options]\n\n"
+         "Tree generation:\n"
+         "  --files <n>              Number of files. Default: 5000.\n"
+         "  --depth <n>              Directory levels below the root. "
+         "Default: 3.\n"
+         "  --fanout <n>             Subdirectories per directory. Default: "
+         "4.\n"
+         "  --size-dist <fixed|uniform|lognormal>\n"
+         "                           File size distribution. Default: "
+         "lognormal.\n"
+         "  --mean-size <bytes>      Mean file size. Default: 4096.\n"
+         "  --gitignore-density <p>  Fraction of directories with a "
+         ".gitignore (0-1). Default: 0.1.\n"
+         "  --comment-density <p>    Fraction of lines with a comment (0-1). "
+         "Default: 0.3.\n"
+         "  --seed <n>               Random seed. Default: 1.\n"
+         "  --dir <path>             Work directory for the tree and output. "
+         "Default: <temp>/dircat_bench.\n"
+         "  --keep                   Keep the work directory afterwards.\n\n"
+         "Measurement:\n"
+         "  --threads <n[,n...]>     Thread counts to measure, 0 = one per "
+         "hardware thread. Default: 0.\n"
+         "  --iterations <n>         Runs per stage. Default: 5.\n"
+         "  --format <json|csv>      Result format on stdout. Default: json.\n";
+}
+
+BenchOptions parse_bench_arguments(int argc, char *argv[]) {
+  BenchOptions options;
+  auto value_of = [&](int &i, const std::string &arg) -> std::string {
+    if (i + 1 >= argc) {
+      std::cerr << "ERROR: " << arg << " requires a value.\n";
+      exit(1);
+    }
+    return argv[++i];
+  };
+  auto number_of = [&](int &i, const std::string &arg,
+                       unsigned long long min) -> unsigned long long {
+    const std::string value = value_of(i, arg);
+    unsigned long long number = 0;
+    const auto result =
+        std::from_chars(value.data(), value.data() + value.size(), number);
+    if (result.ec != std::errc() || result.ptr != value.data() + value.size() ||
+        number < min) {
+      std::cerr << "ERROR: Invalid value for " << arg << ": " << value << "\n";
+      exit(1);
+    }
+    return number;
+  };
+  auto fraction_of = [&](int &i, const std::string &arg) -> double {
+    const std::string value = value_of(i, arg);
+    try {
+      size_t used = 0;
+      const double fraction = std::stod(value, &used);
+      if (used == value.size() && fraction >= 0.0 && fraction <= 1.0)
+        return fraction;
+    } catch (const std::exception &) {
+    }
+    std::cerr << "ERROR: Invalid value for " << arg << " (expected 0-1): "
+              << value << "\n";
+    exit(1);
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      print_bench_usage();
+      exit(0);
+    } else if (arg == "--files") {
+      options.files = number_of(i, arg, 1);
+    } else if (arg == "--depth") {
+      options.depth = static_cast<unsigned int>(number_of(i, arg, 0));
+    } else if (arg == "--fanout") {
+      options.fanout = static_cast<unsigned int>(number_of(i, arg, 1));
+    } else if (arg == "--size-dist") {
+      const std::string value = value_of(i, arg);
+      if (value == "fixed") {
+        options.sizeDistribution = SizeDistribution::Fixed;
+      } else if (value == "uniform") {
+        options.sizeDistribution = SizeDistribution::Uniform;
+      } else if (value == "lognormal") {
+        options.sizeDistribution = SizeDistribution::LogNormal;
+      } else {
+        std::cerr << "ERROR: Invalid value for --size-dist: " << value
+                  << " (expected fixed, uniform or lognormal)\n";
+        exit(1);
+      }
+    } else if (arg == "--mean-size") {
+      options.meanSizeB = number_of(i, arg, 0);
+    } else if (arg == "--gitignore-density") {
+      options.gitignoreDensity = fraction_of(i, arg);
+    } else if (arg == "--comment-density") {
+      options.commentDensity = fraction_of(i, arg);
+    } else if (arg == "--seed") {
+      options.seed = static_cast<uint32_t>(number_of(i, arg, 0));
+    } else if (arg == "--dir") {
+      options.workDir = fs::absolute(value_of(i, arg)).lexically_normal();
+    } else if (arg == "--keep") {
+      options.keepTree = true;
+    } else if (arg == "--threads") {
+      const std::string value = value_of(i, arg);
+      options.threadCounts.clear();
+      std::stringstream list(value);
+      std::string item;
+      while (std::getline(list, item, ',')) {
+        unsigned int threads = 0;
+        const auto result =
+            std::from_chars(item.data(), item.data() + item.size(), threads);
+        if (item.empty() || result.ec != std::errc() ||
+            result.ptr != item.data() + item.size()) {
+          std::cerr << "ERROR: Invalid value for --threads: " << value
+                    << "\n";
+          exit(1);
+        }
+        options.threadCounts.push_back(threads);
+      }
+      if (options.threadCounts.empty()) {
+        std::cerr << "ERROR: Invalid value for --threads: " << value << "\n";
+        exit(1);
+      }
+    } else if (arg == "--iterations") {
+      options.iterations = static_cast<unsigned int>(number_of(i, arg, 1));
+    } else if (arg == "--format") {
+      const std::string value = value_of(i, arg);
+      if (value != "json" && value != "csv") {
+        std::cerr << "ERROR: Invalid value for --format: " << value
+                  << " (expected json or csv)\n";
+        exit(1);
+      }
+      options.csv = value == "csv";
+    } else {
+      std::cerr << "ERROR: Unknown option: " << arg << "\n";
+      print_bench_usage();
+      exit(1);
+    }
+  }
+  if (options.workDir.empty())
+    options.workDir = fs::temp_directory_path() / "dircat_bench";
+  return options;
+}
+
+// --- Synthetic Tree ---
+
+struct GeneratedTree {
+  fs::path root;
+  size_t files = 0;
+  size_t directories = 0;
+  size_t gitignores = 0;
+  unsigned long long bytes = 0;
+};
+
+// Marks a work directory as ours, so it can be cleared on the next run
+constexpr std::string_view kBenchMarker = ".dircat_bench";
+
+// Empties the work directory. Refuses to touch a non-empty directory that
+// was not created by dircat_bench.
+bool reset_work_directory(const fs::path &work_dir) {
+  std::error_code ec;
+  if (fs::exists(work_dir, ec)) {
+    if (!fs::is_directory(work_dir, ec) ||
+        (!fs::is_empty(work_dir, ec) &&
+         !fs::exists(work_dir / kBenchMarker, ec))) {
+      std::cerr << "ERROR: Work directory exists and was not created by "
+                   "dircat_bench: "
+                << normalize_path(work_dir) << "\n";
+      return false;
+    }
+    fs::remove_all(work_dir, ec);
+  }
+  fs::create_directories(work_dir, ec);
+  if (ec) {
+    std::cerr << "ERROR: Could not create work directory "
+              << normalize_path(work_dir) << ": " << ec.message() << "\n";
+    return false;
+  }
+  std::ofstream(work_dir / kBenchMarker).put('\n');
+  return true;
+}
+
+size_t draw_file_size(std::mt19937 &rng, const BenchOptions &options) {
+  const double mean = static_cast<double>(options.meanSizeB);
+  switch (options.sizeDistribution) {
+  case SizeDistribution::Fixed:
+    return options.meanSizeB;
+  case SizeDistribution::Uniform:
+    return std::uniform_int_distribution<size_t>(0, 2 * options.meanSizeB)(rng);
+  case SizeDistribution::LogNormal:
+    break;
+  }
+  if (mean <= 0.0)
+    return 0;
+  // Many small files and a long tail of large ones, with the requested mean
+  constexpr double sigma = 1.0;
+  std::lognormal_distribution<double> sizes(std::log(mean) - sigma * sigma / 2,
+                                            sigma);
+  return static_cast<size_t>(std::min(sizes(rng), 64.0 * 1024 * 1024));
+}
+
+// C++-like text of about `target` bytes. Comments (line and block) appear on
+// the given fraction of lines, and string literals containing "//" make the
+// comment stripper track literals too.
+std::string synthetic_source(std::mt19937 &rng, size_t target,
+                             double comment_density, size_t file_id) {
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+  std::string text;
+  text.reserve(target + 80);
+  for (size_t line = 0; text.size() < target; ++line) {
+    const std::string n = std::to_string(line);
+    const double pick = chance(rng);
+    if (pick < 0.08) {
+      text += '\n'; // Blank line
+      continue;
+    }
+    if (pick < 0.16) {
+      text += "  const char *url_" + n + " = \"https://example.com/" +
+              std::to_string(file_id) + "//" + n + "\";";
+    } else {
+      text += "  int value_" + n + " = compute(" + n + ", " +
+              std::to_string(file_id) + ");";
+    }
+    const double comment = chance(rng);
+    if (comment < comment_density / 2) {
+      text += " // note " + n + " about the value above";
+    } else if (comment < comment_density) {
+      text += " /* block " + n + "\n     spanning two lines */";
+    }
+    text += '\n';
+  }
+  return text;
+}
+
+// Creates `options.files` files spread over a tree of `depth` levels with
+// `fanout` subdirectories each. About one file in ten is named so that the
+// generated .gitignore rules can match it.
+bool generate_tree(const BenchOptions &options, GeneratedTree &tree) {
+  std::mt19937 rng(options.seed);
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+  tree.root = options.workDir / "tree";
+
+  std::vector<fs::path> dirs = {tree.root};
+  for (size_t level = 0, begin = 0; level < options.depth; ++level) {
+    const size_t end = dirs.size();
+    for (size_t i = begin; i < end; ++i) {
+      for (unsigned int child = 0; child < options.fanout; ++child)
+        dirs.push_back(dirs[i] / ("dir" + std::to_string(child)));
+    }
+    begin = end;
+  }
+  static const std::vector<std::string> rule_sets[] = {
+      {"*.log"}, {"tmp_*"}, {"*.log", "!keep.log"}, {"*.bak", "tmp_*"},
+      {"/build/", "*.log"}};
+  for (const auto &dir : dirs) {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+      std::cerr << "ERROR: Could not create " << normalize_path(dir) << ": "
+                << ec.message() << "\n";
+      return false;
+    }
+    // The root always gets one (unless the density is 0), so every tree
+    // has some files to filter
+    if (options.gitignoreDensity == 0.0 ||
+        (dir != tree.root && chance(rng) >= options.gitignoreDensity))
+      continue;
+    std::ofstream gitignore(dir / ".gitignore", std::ios::binary);
+    const auto &rules = rule_sets[rng() % std::size(rule_sets)];
+    for (const auto &rule : rules)
+      gitignore << rule << '\n';
+    ++tree.gitignores;
+  }
+  tree.directories = dirs.size();
+
+  static const char *extensions[] = {"cpp", "h", "py", "md"};
+  for (size_t i = 0; i < options.files; ++i) {
+    const fs::path &dir = dirs[rng() % dirs.size()];
+    const double kind = chance(rng);
+    std::string name;
+    if (kind < 0.05) {
+      name = "trace_" + std::to_string(i) + ".log";
+    } else if (kind < 0.1) {
+      name = "tmp_" + std::to_string(i) + ".cpp";
+    } else {
+      name = "file_" + std::to_string(i) + "." +
+             extensions[rng() % std::size(extensions)];
+    }
+    const std::string content = synthetic_source(
+        rng, draw_file_size(rng, options), options.commentDensity, i);
+    std::ofstream file(dir / name, std::ios::binary | std::ios::trunc);
+    file.write(content.data(), static_cast<std::streamsize>(content.size()));
+    if (!file) {
+      std::cerr << "ERROR: Could not write " << normalize_path(dir / name)
+                << "\n";
+      return false;
+    }
+    ++tree.files;
+    tree.bytes += content.size();
+  }
+  return true;
+}
+
+// --- Measurement ---
+
+struct StageResult {
+  std::string name;
+  unsigned int threads = 1; // Threads the stage actually used
+  size_t files = 0;
+  unsigned long long bytes = 0; // Input bytes of the stage
+  std::vector<double> millis;   // One entry per iteration
+};
+
+double median_of(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  const size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// Runs `body` `iterations` times and records the wall time of each run
+template <typename Body>
+StageResult time_stage(std::string name, unsigned int iterations,
+                       unsigned int threads, Body &&body) {
+  StageResult result;
+  result.name = std::move(name);
+  result.threads = threads;
+  for (unsigned int i = 0; i < iterations; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    body(result);
+    const auto stop = std::chrono::steady_clock::now();
+    result.millis.push_back(
+        std::chrono::duration<double, std::milli>(stop - start).count());
+  }
+  std::cerr << "  " << result.name << ": " << std::fixed
+            << std::setprecision(2) << median_of(result.millis) << " ms\n";
+  return result;
+}
+
+// Calls fn(index, scratch) for every index in [0, count) on `threads`
+// threads, claiming batches from a FileWorkQueue like the processing stage
+// does. `scratch` is one reused buffer per thread.
+template <typename Fn>
+void run_parallel(size_t count, unsigned int threads, Fn &&fn) {
+  FileWorkQueue queue(count, choose_batch_size(count, threads, 256));
+  auto worker = [&] {
+    std::string scratch;
+    size_t begin = 0, end = 0;
+    while (queue.claim(begin, end)) {
+      for (size_t index = begin; index < end; ++index)
+        fn(index, scratch);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned int i = 1; i < threads; ++i)
+    pool.emplace_back(worker);
+  worker();
+  for (auto &thread : pool)
+    thread.join();
+}
+
+// Gitignore rules and compiled patterns are cached for the whole process;
+// every measured walk starts cold, as a fresh dircat run does
+void clear_process_caches() {
+  rule_caches().clear();
+}
+
+std::vector<StageResult> run_stages(const GeneratedTree &tree,
+                                    const BenchOptions &options,
+                                    unsigned int requested_threads) {
+  Config config;
+  config.dirPath = tree.root;
+  config.numThreads = requested_threads;
+  config.outputFile = options.workDir / "out.md";
+  const unsigned int threads = resolve_thread_count(
+      config, std::numeric_limits<size_t>::max());
+  std::atomic<bool> stop{false};
+  std::vector<StageResult> results;
+  std::cerr << "Measuring with " << threads << " threads:\n";
+
+  // walk: listing and file checks without .gitignore handling
+  std::vector<fs::path> walked_dirs;
+  results.push_back(
+      time_stage("walk", options.iterations, threads, [&](StageResult &r) {
+        Config walk_config = config;
+        walk_config.disableGitignore = true;
+        clear_process_caches();
+        walked_dirs.clear();
+        auto [normal, last] =
+            collect_file_records(walk_config, stop, nullptr, &walked_dirs);
+        r.files = normal.size();
+        r.bytes = 0;
+        for (const auto &record : normal)
+          r.bytes += record.size;
+      }));
+
+  // gitignore: load every directory's scope and match every file against
+  // it, separately from the walk (single-threaded)
+  Config unfiltered_config = config;
+  unfiltered_config.disableGitignore = true;
+  const std::vector<FileRecord> all_files =
+      collect_file_records(unfiltered_config, stop).first;
+  struct DirScope {
+    fs::path path;
+    std::string relative;
+    std::string parent;
+  };
+  std::sort(walked_dirs.begin(), walked_dirs.end()); // Parents first
+  std::vector<DirScope> dir_scopes;
+  for (const auto &dir : walked_dirs) {
+    std::string relative = normalize_path(dir.lexically_relative(tree.root));
+    if (relative == ".")
+      relative.clear();
+    const size_t slash = relative.rfind('/');
+    std::string parent =
+        slash == std::string::npos ? std::string() : relative.substr(0, slash);
+    dir_scopes.push_back({dir, std::move(relative), std::move(parent)});
+  }
+  results.push_back(
+      time_stage("gitignore", options.iterations, 1, [&](StageResult &r) {
+        clear_process_caches();
+        std::unordered_map<std::string, GitignoreScope> scopes;
+        for (const auto &dir : dir_scopes) {
+          std::error_code ec;
+          const GitignoreScope parent =
+              dir.relative.empty() ? GitignoreScope() : scopes[dir.parent];
+          scopes[dir.relative] = enter_gitignore_scope(
+              parent, dir.path,
+              fs::is_regular_file(dir.path / ".gitignore", ec));
+        }
+        size_t ignored = 0;
+        for (const auto &record : all_files) {
+          const size_t slash = record.relativePath.rfind('/');
+          const std::string parent =
+              slash == std::string::npos ? std::string()
+                                         : record.relativePath.substr(0, slash);
+          const GitignoreScope &scope = scopes[parent];
+          if (scope && scope->is_ignored(record.relativePath))
+            ++ignored;
+        }
+        r.files = all_files.size();
+        r.bytes = ignored; // Reported as "ignored" below
+      }));
+
+  // The files a default run processes
+  const std::vector<FileRecord> files =
+      collect_file_records(config, stop).first;
+  unsigned long long file_bytes = 0;
+  for (const auto &record : files)
+    file_bytes += record.size;
+
+  results.push_back(
+      time_stage("read", options.iterations, threads, [&](StageResult &r) {
+        std::atomic<unsigned long long> read_bytes{0};
+        run_parallel(files.size(), threads, [&](size_t index, std::string &) {
+          thread_local FileBuffer buffer;
+          if (!buffer.load(files[index].absolutePath.c_str(), IoBackend::Auto))
+            read_bytes += buffer.view().size();
+          buffer.recycle();
+        });
+        r.files = files.size();
+        r.bytes = read_bytes.load();
+      }));
+
+  // Contents are loaded once; the transform stages work from memory
+  std::vector<std::string> contents(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    FileBuffer buffer;
+    if (!buffer.load(files[i].absolutePath.c_str(), IoBackend::Read))
+      contents[i] = std::string(buffer.view());
+  }
+
+  results.push_back(
+      time_stage("strip", options.iterations, threads, [&](StageResult &r) {
+        std::atomic<unsigned long long> kept{0};
+        run_parallel(files.size(), threads,
+                     [&](size_t index, std::string &scratch) {
+                       scratch.clear();
+                       append_file_content(scratch, contents[index], config,
+                                           true);
+                       kept += scratch.size();
+                     });
+        r.files = files.size();
+        r.bytes = file_bytes;
+        (void)kept.load();
+      }));
+
+  std::vector<std::string> blocks(files.size());
+  results.push_back(
+      time_stage("format", options.iterations, threads, [&](StageResult &r) {
+        run_parallel(files.size(), threads,
+                     [&](size_t index, std::string &) {
+                       std::string &block = blocks[index];
+                       block.clear(); // Keeps its capacity between iterations
+                       append_file_header(block, files[index], config);
+                       append_file_content(block, contents[index], config,
+                                           false);
+                       block += "```\n";
+                     });
+        r.files = files.size();
+        r.bytes = file_bytes;
+      }));
+
+  results.push_back(
+      time_stage("write", options.iterations, 1, [&](StageResult &r) {
+        OutputSink out; // The sink process_directory writes through
+        if (out.open(config.outputFile))
+          return;
+        r.bytes = 0;
+        for (const auto &block : blocks) {
+          out.write(block);
+          r.bytes += block.size();
+        }
+        out.close();
+        r.files = blocks.size();
+      }));
+
+  // The whole pipeline, as `dircat <tree> -o <work>/out.md` runs it
+  results.push_back(time_stage(
+      "end_to_end", options.iterations, threads, [&](StageResult &r) {
+        clear_process_caches();
+        std::stringstream discarded; // process_directory reports on stdout
+        std::streambuf *saved = std::cout.rdbuf(discarded.rdbuf());
+        process_directory(config, stop);
+        std::cout.rdbuf(saved);
+        r.files = files.size();
+        r.bytes = file_bytes;
+      }));
+  return results;
+}
+
+// --- Result Output ---
+
+// The contents of a JSON string for `text`: quotes, backslashes and control
+// characters escaped
+std::string json_escape(std::string_view text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char code[8];
+      std::snprintf(code, sizeof(code), "\\u%04x",
+                    static_cast<unsigned>(static_cast<unsigned char>(c)));
+      escaped += code;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+void print_results(const GeneratedTree &tree, const BenchOptions &options,
+                   const std::vector<StageResult> &results) {
+  std::cout << std::fixed << std::setprecision(3);
+  auto rate = [](double amount, double millis) {
+    return millis > 0 ? amount / (millis / 1000.0) : 0.0;
+  };
+  if (options.csv) {
+    std::cout << "stage,threads,files,bytes,iterations,min_ms,median_ms,"
+                 "mean_ms,files_per_s,mib_per_s\n";
+  } else {
+    std::cout << "{\n  \"tree\": {\"path\": \""
+              << json_escape(normalize_path(tree.root))
+              << "\", \"files\": " << tree.files
+              << ", \"directories\": " << tree.directories
+              << ", \"gitignores\": " << tree.gitignores
+              << ", \"bytes\": " << tree.bytes << ", \"seed\": " << options.seed
+              << "},\n  \"iterations\": " << options.iterations
+              << ",\n  \"stages\": [\n";
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    const StageResult &r = results[i];
+    const double min = *std::min_element(r.millis.begin(), r.millis.end());
+    const double median = median_of(r.millis);
+    double mean = 0;
+    for (double ms : r.millis)
+      mean += ms / r.millis.size();
+    // The gitignore stage counts ignored files instead of bytes
+    const bool counts_bytes = r.name != "gitignore";
+    const double files_per_s = rate(static_cast<double>(r.files), median);
+    const double mib_per_s =
+        counts_bytes ? rate(r.bytes / (1024.0 * 1024.0), median) : 0.0;
+    if (options.csv) {
+      std::cout << r.name << ',' << r.threads << ',' << r.files << ','
+                << (counts_bytes ? r.bytes : 0) << ',' << r.millis.size()
+                << ',' << min << ',' << median << ',' << mean << ','
+                << files_per_s << ',' << mib_per_s << '\n';
+      continue;
+    }
+    std::cout << "    {\"stage\": \"" << r.name
+              << "\", \"threads\": " << r.threads << ", \"files\": " << r.files
+              << ", " << (counts_bytes ? "\"bytes\": " : "\"ignored\": ")
+              << r.bytes << ", \"min_ms\": " << min
+              << ", \"median_ms\": " << median << ", \"mean_ms\": " << mean
+              << ", \"files_per_s\": " << files_per_s
+              << ", \"mib_per_s\": " << mib_per_s << "}"
+              << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  if (!options.csv)
+    std::cout << "  ]\n}\n";
+}
+
+int main(int argc, char *argv[]) {
+  const BenchOptions options = parse_bench_arguments(argc, argv);
+  if (!reset_work_directory(options.workDir))
+    return 1;
+
+  GeneratedTree tree;
+  std::cerr << "Generating " << options.files << " files in "
+            << normalize_path(options.workDir / "tree") << "...\n";
+  if (!generate_tree(options, tree))
+    return 1;
+  std::cerr << "Generated " << tree.files << " files (" << std::fixed
+            << std::setprecision(2) << tree.bytes / (1024.0 * 1024.0)
+            << " MiB) in " << tree.directories << " directories, "
+            << tree.gitignores << " with a .gitignore.\n";
+
+  std::vector<StageResult> results;
+  for (unsigned int threads : options.threadCounts) {
+    std::vector<StageResult> run = run_stages(tree, options, threads);
+    results.insert(results.end(), std::make_move_iterator(run.begin()),
+                   std::make_move_iterator(run.end()));
+  }
+  print_results(tree, options, results);
+
+  if (!options.keepTree) {
+    std::error_code ec;
+    fs::remove_all(options.workDir, ec);
+  }
+  return 0;
+}
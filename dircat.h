@@ -0,0 +1,167 @@
+// dircat: concatenates the files of a directory into one Markdown bundle.
+//
+// The interface of the dircat library (the dircat_lib target, built from
+// lib.cpp): the run options, the Engine that carries them out and the
+// BlockSink an embedding program can receive the bundle through. The
+// command-line tool in main.cpp is a thin front end over it.
+#ifndef DIRCAT_H
+#define DIRCAT_H
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// --- Configuration ---
+struct CompiledFilters; // Compiled -r/-d patterns, in lib.cpp
+class RunStats;         // --stats counters, in lib.cpp
+
+// How file contents are read (--io)
+enum class IoBackend {
+  Auto,   // Map large files, one read() into a sized buffer for the rest
+  Read,   // Always one read() into a buffer sized from the file size
+  Mmap,   // Always map the file (read() if mapping is not possible)
+  Stream, // std::ifstream, the portable fallback
+};
+
+// How --stats reports the run (on stderr)
+enum class StatsFormat { Off, Text, Json };
+
+// How the bundle is compressed (--compress, or implied by the -o name)
+enum class Compression { None, Gzip, Zstd };
+
+// One input of --batch and where its bundle goes
+struct BatchRoot {
+  fs::path dirPath;    // Input directory, stored as absolute
+  fs::path outputFile; // Its own -o file
+  Compression compression = Compression::None; // --compress or implied
+};
+
+struct Config {
+  fs::path dirPath; // Input path (file or directory), stored as absolute
+  unsigned long long maxFileSizeB = 0;
+  bool recursiveSearch = true;
+  std::vector<std::string> fileExtensions;         // Lowercase, no dot
+  std::vector<std::string> excludedFileExtensions; // Lowercase, no dot
+  std::vector<fs::path> ignoredFolders; // Relative paths from input dir
+  std::vector<fs::path>
+      ignoredFiles; // Relative paths or filenames from input dir
+  std::vector<std::string> regexFilters; // Exclude patterns for filename
+  std::vector<std::string>
+      filenameRegexFilters; // Include patterns for filename
+  bool removeComments = false;
+  bool removeEmptyLines = false;
+  bool showFilenameOnly = false;
+  std::vector<fs::path>
+      lastFiles; // Relative paths or filenames as provided by user
+  std::vector<fs::path> lastDirs; // Relative paths as provided by user
+  bool disableGitignore = false;
+  bool onlyLast = false;
+  fs::path outputFile; // Absolute or relative path
+  // Write a bundle for stdout to the descriptor itself rather than through
+  // std::cout. Only for a program that does not redirect std::cout, like
+  // the dircat tool, which sets it.
+  bool directStdout = false;
+  bool showLineNumbers = false;
+  bool dryRun = false;
+  bool useBackticks = false; // NEW: Option to wrap paths in backticks
+  bool showSummary = false;  // NEW: Option to show summary list at the end
+  size_t outputWindow = 256; // Max finished files buffered for ordered output
+  unsigned int numThreads = 0; // Processing threads, 0 = hardware concurrency
+  IoBackend ioBackend = IoBackend::Auto;
+  bool asyncIo = false; // --async-io: read each claimed batch ahead
+  unsigned long long maxTokens = 0; // --max-tokens: output budget, 0 = none
+  Compression compression = Compression::None; // --compress
+  bool dedupe = false; // --dedupe: write copies of a file as references
+  fs::path indexFile;  // --index: JSON manifest of the blocks, empty = off
+  size_t shards = 0;   // --shards: split the -o file into this many, 0 = off
+  unsigned long long shardSize = 0; // --shard-size: bytes per shard, 0 = off
+  unsigned long long timeoutMs = 0; // --timeout: stop the run, 0 = never
+  // --batch: inputs bundled by one run in place of dirPath/outputFile
+  std::vector<BatchRoot> batchRoots;
+  fs::path cacheDir; // --cache-dir: persistent block/listing cache, empty = off
+  bool watch = false; // --watch: keep the -o file updated until interrupted
+  bool includeBinary = false; // Skip the binary content prefilter
+  StatsFormat statsFormat = StatsFormat::Off; // --stats[=text|json]
+  // Counters of the current run, created by the run itself (null = off)
+  std::shared_ptr<RunStats> stats;
+  // -r/-d patterns compiled once by parse_arguments (null = compile on use)
+  std::shared_ptr<const CompiledFilters> compiledFilters;
+
+  // --- Performance Optimizations ---
+  // Sets for faster lookups in is_last_file (populated in parse_arguments)
+  std::unordered_set<std::string> lastFilesSetRel; // Normalized relative paths
+  std::unordered_set<std::string> lastFilesSetFilename; // Normalized filenames
+  std::unordered_set<std::string> lastDirsSetRel; // Normalized relative paths
+};
+
+// --- Engine ---
+struct EngineResources; // Caches and threads of an Engine, in lib.cpp
+
+// Receives the bundle of an Engine run as it is produced, in output order.
+// Calls come from the thread that called Engine::run.
+class BlockSink {
+public:
+  virtual ~BlockSink() = default;
+
+  // Bundle text outside the file blocks: the title, the -D listing and the
+  // -s summary
+  virtual void write_text(std::string_view text) = 0;
+
+  // Part of the block of one file (its "## File:" header and fenced
+  // content), as soon as the file is done and every earlier one written.
+  // Most blocks arrive in one call; the rest of a block, such as the body
+  // of a large file read in chunks, follows in calls for the same path.
+  virtual void write_block(std::string_view relative_path,
+                           std::string_view bytes) = 0;
+
+  // The closing status ("Processed N files ..."), which the tool prints
+  virtual void report(std::string_view message) { (void)message; }
+};
+
+// Runs bundles. An engine keeps its .gitignore rules, compiled patterns and
+// worker threads from one run to the next, so a program that bundles many
+// trees pays for them once. Runs may be started from several threads at
+// once; they share the engine's caches and threads.
+class Engine {
+public:
+  Engine();
+  ~Engine();
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+
+  // Does what the dircat tool does with `config`: writes the bundle of a
+  // file or directory to config.outputFile (stdout if empty), or keeps it
+  // updated with --watch, until done or `should_stop` is set. With
+  // config.batchRoots, does so for each of them instead. Returns false on
+  // failure, which has been reported on stderr.
+  bool run(const Config &config, std::atomic<bool> &should_stop);
+
+  // Bundles the directory config.dirPath into `sink` rather than a file.
+  // config.outputFile and config.compression do not apply, and --watch is
+  // not supported.
+  bool run(Config config, BlockSink &sink, std::atomic<bool> &should_stop);
+
+  // Forgets the cached .gitignore rules and patterns, for instance after
+  // the .gitignore files of a bundled tree changed. Runs in progress keep
+  // the caches they started with.
+  void clear_caches();
+
+private:
+  std::unique_ptr<EngineResources> resources;
+};
+
+// --- Command Line ---
+// Reads the options of the dircat tool; prints usage and exits on an error
+Config parse_arguments(int argc, char *argv[]);
+
+// Set by SIGINT (see signalHandler) to stop the run it points to
+extern std::atomic<bool> *globalShouldStop;
+void signalHandler(int signum);
+
+#endif // DIRCAT_H
@@ -1,6 +1,18 @@
+#include "dircat.h" // Config, Engine and BlockSink
+
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit> // For std::countr_zero, std::countl_zero
 #include <cctype> // For std::toupper
+#include <charconv> // For std::to_chars
+#include <chrono>
+#include <cmath> // For std::ceil
+#include <condition_variable> // For the ordered output window
+#include <cstdint>
+#include <cstdio>  // For std::snprintf
+#include <cstring> // For std::memcpy
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
@@ -9,8 +21,11 @@
 #include <ios> // Needed for std::ios_base
 #include <iostream>
 #include <limits> // Needed for numeric_limits
+#include <map>
+#include <memory>
 #include <mutex>
 #include <regex>
+#include <set>
 #include <shared_mutex> // For read-write mutex
 #include <span>
 #include <sstream>
@@ -24,44 +39,65 @@
 #include <utility> // For std::move
 #include <vector>
 
-namespace fs = std::filesystem;
-
-// --- Configuration ---
-struct Config {
-  fs::path dirPath; // Input path (file or directory), stored as absolute
-  unsigned long long maxFileSizeB = 0;
-  bool recursiveSearch = true;
-  std::vector<std::string> fileExtensions;         // Lowercase, no dot
-  std::vector<std::string> excludedFileExtensions; // Lowercase, no dot
-  std::vector<fs::path> ignoredFolders; // Relative paths from input dir
-  std::vector<fs::path>
-      ignoredFiles; // Relative paths or filenames from input dir
-  std::vector<std::string> regexFilters; // Exclude patterns for filename
-  std::vector<std::string>
-      filenameRegexFilters; // Include patterns for filename
-  bool removeComments = false;
-  bool removeEmptyLines = false;
-  bool showFilenameOnly = false;
-  std::vector<fs::path>
-      lastFiles; // Relative paths or filenames as provided by user
-  std::vector<fs::path> lastDirs; // Relative paths as provided by user
-  bool disableGitignore = false;
-  bool onlyLast = false;
-  fs::path outputFile; // Absolute or relative path
-  bool showLineNumbers = false;
-  bool dryRun = false;
-  bool useBackticks = false; // NEW: Option to wrap paths in backticks
-  bool showSummary = false;  // NEW: Option to show summary list at the end
-
-  // --- Performance Optimizations ---
-  // Sets for faster lookups in is_last_file (populated in parse_arguments)
-  std::unordered_set<std::string> lastFilesSetRel; // Normalized relative paths
-  std::unordered_set<std::string> lastFilesSetFilename; // Normalized filenames
-  std::unordered_set<std::string> lastDirsSetRel; // Normalized relative paths
-};
+// Platform file APIs for the read()/mmap I/O backends
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h> // _write, for the signal handler
+#include <windows.h>
+#else
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h> // writev
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h> // --watch notifications
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h> // --async-io, through the raw system calls
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_FAST_POLL) && defined(__NR_io_uring_setup)
+#define DIRCAT_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+// Compression libraries for --compress, found and enabled by the build
+#ifdef DIRCAT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DIRCAT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// SIMD kernels for the byte scanning helpers (scalar fallback otherwise)
+#if defined(__x86_64__) || defined(_M_X64)
+#define DIRCAT_SIMD_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define DIRCAT_SIMD_AVX2 1 // Compiled with target("avx2"), used if supported
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define DIRCAT_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
 
 // --- Utility Functions ---
 
+// How often a waiting thread looks at the stop flag. The flag is set from a
+// signal handler, which cannot wake a condition variable, so every wait that
+// a stop has to end is a timed one.
+constexpr auto kStopPollInterval = std::chrono::milliseconds(5);
+
 std::string trim(std::string_view str) {
   constexpr std::string_view whitespace = " \t\n\r\f\v";
   size_t start = str.find_first_not_of(whitespace);
@@ -80,42 +116,162 @@ std::string normalize_path(const fs::path &path) {
   return path_str;
 }
 
+// --- Engine Resources ---
+// What an Engine keeps between runs. A run finds it through thread_engine,
+// which the Engine sets on the calling thread and TaskGroup hands on to
+// the threads it starts; code running outside an Engine (the tests, the
+// benchmarks) falls back to one process-wide set of caches and plain
+// threads.
+
+class GitignoreMatcher;
+
 // --- Gitignore Caching (Improvement 2) ---
-// Static cache for loaded gitignore rules (norm_abs_path/gitignore -> rules)
-static std::unordered_map<std::string, std::vector<std::string>>
-    gitignore_rules_cache;
-static std::shared_mutex gitignore_cache_mutex;
-
-// Static cache for compiled regex patterns (rule string -> regex object)
-static std::unordered_map<std::string, std::regex> regex_cache;
-static std::shared_mutex regex_cache_mutex;
-
-// Static cache for accumulated gitignore rules (norm_abs_parent_dir_path ->
-// effective rules)
-static std::unordered_map<std::string, std::vector<std::string>>
-    accumulated_rules_cache;
-static std::shared_mutex accumulated_cache_mutex;
+struct RuleCaches {
+  // Loaded gitignore rules (norm_abs_path/gitignore -> rules)
+  std::unordered_map<std::string, std::vector<std::string>> gitignore_rules;
+  std::shared_mutex gitignore_mutex;
+  // Compiled regex patterns (rule string -> regex object)
+  std::unordered_map<std::string, std::regex> regexes;
+  std::shared_mutex regex_mutex;
+  // Accumulated gitignore rules (norm_abs_parent_dir_path -> matcher
+  // compiled from the effective rules)
+  std::unordered_map<std::string, std::shared_ptr<const GitignoreMatcher>>
+      accumulated_rules;
+  std::shared_mutex accumulated_mutex;
+
+  // Only while no run uses the caches: references into them are kept
+  void clear() {
+    gitignore_rules.clear();
+    regexes.clear();
+    accumulated_rules.clear();
+  }
+};
 // --- End Gitignore Caching ---
 
-// Loads rules from a specific .gitignore file, using cache
-std::vector<std::string> load_gitignore_rules(const fs::path &gitignore_path) {
-  std::string cache_key = normalize_path(fs::absolute(gitignore_path));
+// Threads kept for the runs of an Engine. A task starts at once, on an idle
+// thread or on a new one when all are busy, so the tasks of a run can wait
+// for each other just as plain threads can. Threads last as long as the
+// pool.
+class WorkerPool {
+public:
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto &thread : threads)
+      thread.join();
+  }
 
-  {
-    std::shared_lock<std::shared_mutex> lock(gitignore_cache_mutex);
-    auto it = gitignore_rules_cache.find(cache_key);
-    if (it != gitignore_rules_cache.end()) {
-      return it->second;
+  void start(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+      if (idle < tasks.size()) // Every queued task gets a thread
+        threads.emplace_back([this] { serve(); });
+    }
+    work_ready.notify_one();
+  }
+
+private:
+  void serve() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      ++idle;
+      work_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+      --idle;
+      if (tasks.empty())
+        return; // Stopping
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::deque<std::function<void()>> tasks;
+  size_t idle = 0; // Threads waiting for a task
+  bool stopping = false;
+  std::vector<std::thread> threads;
+};
+
+// What a run borrows from its Engine
+struct EngineContext {
+  std::shared_ptr<RuleCaches> caches; // Kept alive for the whole run
+  WorkerPool *pool;
+};
+
+// The Engine whose run the calling thread works for, or null
+thread_local const EngineContext *thread_engine = nullptr;
+
+// The caches of the calling thread's Engine, or the process-wide ones
+RuleCaches &rule_caches() {
+  static RuleCaches process_caches;
+  return thread_engine ? *thread_engine->caches : process_caches;
+}
+
+// Threads started together and joined together: pool threads of the
+// calling thread's Engine, or plain threads outside of one. Each task works
+// for the same Engine as the thread that started it.
+class TaskGroup {
+public:
+  TaskGroup() : engine(thread_engine) {}
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+  ~TaskGroup() { join(); }
+
+  void start(std::function<void()> task) {
+    if (!engine) {
+      threads.emplace_back(std::move(task));
+      return;
     }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++running;
+    }
+    engine->pool->start([this, task = std::move(task)] {
+      const EngineContext *previous = thread_engine;
+      thread_engine = engine;
+      task();
+      thread_engine = previous;
+      // Notified under the lock: join() may return, and the group go away,
+      // as soon as the lock is released
+      std::lock_guard<std::mutex> lock(mutex);
+      --running;
+      task_done.notify_all();
+    });
+  }
+
+  // Waits for every task started so far
+  void join() {
+    for (auto &thread : threads)
+      thread.join();
+    threads.clear();
+    std::unique_lock<std::mutex> lock(mutex);
+    task_done.wait(lock, [this] { return running == 0; });
   }
 
+private:
+  const EngineContext *engine;
+  std::vector<std::thread> threads; // Outside an Engine
+  std::mutex mutex;
+  std::condition_variable task_done;
+  size_t running = 0; // Pool tasks not finished yet
+};
+
+// Reads the rules of a single .gitignore file (no caching). Empty lines and
+// comments are dropped; a missing or unreadable file yields no rules.
+std::vector<std::string> read_gitignore_rules(const fs::path &gitignore_path) {
   std::vector<std::string> rules;
   std::ifstream file(gitignore_path); // Not binary mode
   if (!file.is_open()) {
-    // Cache empty rules even on error/not found to avoid re-checking file
-    // system
-    std::unique_lock<std::shared_mutex> lock(gitignore_cache_mutex);
-    gitignore_rules_cache[cache_key] = rules; // Cache empty vector
     return rules;
   }
 
@@ -127,11 +283,27 @@ std::vector<std::string> load_gitignore_rules(const fs::path &gitignore_path) {
       rules.push_back(line);
     }
   }
-  file.close();
+  return rules;
+}
+
+// Loads rules from a specific .gitignore file, using cache
+std::vector<std::string> load_gitignore_rules(const fs::path &gitignore_path) {
+  RuleCaches &caches = rule_caches();
+  std::string cache_key = normalize_path(fs::absolute(gitignore_path));
+
+  {
+    std::shared_lock<std::shared_mutex> lock(caches.gitignore_mutex);
+    auto it = caches.gitignore_rules.find(cache_key);
+    if (it != caches.gitignore_rules.end()) {
+      return it->second;
+    }
+  }
 
+  // Cache empty rules even on error/not found to avoid re-checking file system
+  std::vector<std::string> rules = read_gitignore_rules(gitignore_path);
   {
-    std::unique_lock<std::shared_mutex> lock(gitignore_cache_mutex);
-    gitignore_rules_cache[cache_key] = rules; // Cache loaded rules
+    std::unique_lock<std::shared_mutex> lock(caches.gitignore_mutex);
+    caches.gitignore_rules[cache_key] = rules; // Cache loaded rules
   }
   return rules;
 }
@@ -220,31 +392,33 @@ std::string gitignore_pattern_to_regex_string(const std::string &pattern) {
   return regex_str;
 }
 
-// Compiles and caches regex pattern
-std::regex compile_and_cache_regex(const std::string &pattern_key,
-                                   const std::string &regex_string) {
+// Compiles and caches regex pattern. Cached entries are never replaced, so the
+// returned reference stays valid without holding the lock.
+const std::regex &compile_and_cache_regex(const std::string &pattern_key,
+                                          const std::string &regex_string) {
+  RuleCaches &caches = rule_caches();
   {
-    std::shared_lock<std::shared_mutex> lock(regex_cache_mutex);
-    auto it = regex_cache.find(pattern_key);
-    if (it != regex_cache.end()) {
+    std::shared_lock<std::shared_mutex> lock(caches.regex_mutex);
+    auto it = caches.regexes.find(pattern_key);
+    if (it != caches.regexes.end()) {
       return it->second;
     }
   }
-  // Compile and cache (with write lock)
+  // Compile outside the lock, then cache (with write lock)
+  std::regex compiled;
   try {
-    std::regex compiled(regex_string, std::regex::icase | std::regex::optimize);
-    std::unique_lock<std::shared_mutex> lock(regex_cache_mutex);
-    regex_cache[pattern_key] = compiled; // Cache successful compilation
-    return compiled;
+    compiled =
+        std::regex(regex_string, std::regex::icase | std::regex::optimize);
   } catch (const std::regex_error &e) {
     std::cerr << "WARNING: Invalid regex generated from pattern '"
               << pattern_key << "': '" << regex_string << "' (" << e.what()
               << ")\n";
-    std::regex empty_regex; // Regex that matches nothing
-    std::unique_lock<std::shared_mutex> lock(regex_cache_mutex);
-    regex_cache[pattern_key] = empty_regex; // Cache empty on error
-    return empty_regex;
+    // Keep the empty regex: matches nothing
   }
+  std::unique_lock<std::shared_mutex> lock(caches.regex_mutex);
+  // Another thread may have cached it first; keep the existing entry
+  return caches.regexes.try_emplace(pattern_key, std::move(compiled))
+      .first->second;
 }
 
 // Checks if a normalized relative path matches a single gitignore rule string
@@ -266,12 +440,314 @@ bool matches_gitignore_rule(const std::string &normalized_relative_path,
 
   // Generate regex string from pattern
   std::string regex_str = gitignore_pattern_to_regex_string(pattern);
-  std::regex compiled_regex = compile_and_cache_regex(pattern, regex_str);
+  const std::regex &compiled_regex =
+      compile_and_cache_regex(pattern, regex_str);
 
   // Use regex_search as patterns often match parts of the path
   return std::regex_search(normalized_relative_path, compiled_regex);
 }
 
+// Applies effective gitignore rules (lowest precedence first) to a normalized
+// path relative to the base directory. This evaluates every rule through its
+// regex and is the reference for GitignoreMatcher below, which is what the
+// directory walk uses.
+bool matches_gitignore_rules(const std::string &normalized_relative_path,
+                             bool is_dir,
+                             const std::vector<std::string> &effective_rules) {
+  bool ignored = false;
+  // Iterate through rules. Last matching rule wins. Negation rules (`!`)
+  // override.
+  for (const auto &rule : effective_rules) {
+    std::string clean_rule = rule;
+    bool negate = false;
+    if (!clean_rule.empty() && clean_rule[0] == '!') {
+      negate = true;
+      clean_rule.erase(0, 1);
+    }
+
+    bool matched = false;
+    // If rule is a directory rule, check against the path itself and the path
+    // as if it were a directory entry
+    if (!clean_rule.empty() && clean_rule.back() == '/') {
+      matched = matches_gitignore_rule(
+                    normalized_relative_path, is_dir,
+                    clean_rule) || // Check if rule matches path directly (e.g.,
+                                   // "dir/" matches "dir/subdir")
+                matches_gitignore_rule(
+                    normalized_relative_path + "/", true,
+                    clean_rule); // Check if rule matches path + "/" (e.g.,
+                                 // "dir/" matches "dir/")
+    } else {
+      matched = matches_gitignore_rule(
+          normalized_relative_path, is_dir,
+          clean_rule); // Standard check for file patterns
+    }
+
+    if (matched) {
+      ignored = !negate; // If rule matches, set ignored based on negation
+    }
+  }
+  return ignored;
+}
+
+// --- Compiled Gitignore Matcher ---
+// Evaluates a fixed list of gitignore rules without std::regex. A rule is
+// split into its flags ('!' negation, leading '/' anchor, trailing '/'
+// directory marker) and a body, and the body is matched with the same
+// simplified semantics as gitignore_pattern_to_regex_string: '**' crosses
+// '/', '*' and '?' do not, everything else is literal and comparisons are
+// case-insensitive. A body matches when it starts at the beginning of the path
+// (or after any '/' unless anchored) and ends at a '/' or the end of the path.
+// Directory rules therefore behave like the rule without the trailing slash,
+// exactly as matches_gitignore_rules evaluates them.
+//
+// Rules are sorted into buckets so that most of them cost a hash lookup:
+//   - literal names ("build", "Thumbs.db")   -> lookup of each path component
+//   - extension globs ("*.log")              -> lookup of each component's
+//                                               extension
+//   - anchored literals ("/out", "/docs/api") -> lookup of each prefix that
+//                                               ends on a component boundary
+//   - everything else                        -> bit-parallel glob automaton
+// Every bucket reports the highest rule index that matched, so the last
+// matching rule still wins and its '!' decides the result.
+class GitignoreMatcher {
+public:
+  explicit GitignoreMatcher(std::vector<std::string> rules)
+      : source_rules(std::move(rules)) {
+    bodies.reserve(source_rules.size());
+    negated.reserve(source_rules.size());
+    for (const auto &rule : source_rules) {
+      add_rule(rule);
+    }
+    // Highest index first, so evaluation can stop at the first match
+    std::reverse(glob_rules.begin(), glob_rules.end());
+  }
+
+  // Bucket keys point into `bodies`, so the matcher is not copyable
+  GitignoreMatcher(const GitignoreMatcher &) = delete;
+  GitignoreMatcher &operator=(const GitignoreMatcher &) = delete;
+
+  // The rules this matcher was built from, lowest precedence first
+  const std::vector<std::string> &rules() const { return source_rules; }
+
+  // Checks a normalized path relative to the directory the rules apply to
+  bool is_ignored(std::string_view normalized_relative_path) const {
+    if (source_rules.empty())
+      return false;
+
+    thread_local std::string lowered;
+    lowered.assign(normalized_relative_path);
+    for (char &c : lowered) {
+      c = ascii_lower(c);
+    }
+    const std::string_view path(lowered);
+    const size_t n = path.size();
+
+    int best = -1;
+    auto consider = [&best](
+                        const std::unordered_map<std::string_view, int> &map,
+                        std::string_view key) {
+      auto it = map.find(key);
+      if (it != map.end() && it->second > best)
+        best = it->second;
+    };
+
+    // Literal names, extensions and anchored prefixes, one pass over the
+    // components of the path
+    size_t component_start = 0;
+    for (size_t pos = 0; pos <= n; ++pos) {
+      if (pos != n && path[pos] != '/')
+        continue;
+      std::string_view component =
+          path.substr(component_start, pos - component_start);
+      if (!name_rules.empty())
+        consider(name_rules, component);
+      if (!extension_rules.empty()) {
+        size_t dot = component.rfind('.');
+        if (dot != std::string_view::npos)
+          consider(extension_rules, component.substr(dot + 1));
+      }
+      if (!anchored_rules.empty())
+        consider(anchored_rules, path.substr(0, pos));
+      component_start = pos + 1;
+    }
+
+    for (const auto &glob : glob_rules) {
+      if (glob.index <= best)
+        break; // Only a later rule could change the result
+      if (glob.matches(path)) {
+        best = glob.index;
+        break;
+      }
+    }
+
+    return best >= 0 && !negated[static_cast<size_t>(best)];
+  }
+
+private:
+  static char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+  }
+
+  // Glob body compiled to a shift-and automaton: state k means "the first k
+  // tokens are matched", one bit per state, so at most 63 tokens fit.
+  struct GlobRule {
+    static constexpr size_t kMaxTokens = 63;
+
+    int index = 0;
+    bool anchored = false;
+    size_t token_count = 0;
+    uint64_t literal_masks[256] = {}; // Tokens matching a given character
+    uint64_t any_mask = 0;            // '?' tokens
+    uint64_t star_mask = 0;           // '*' tokens (repeat except '/')
+    uint64_t double_star_mask = 0;    // '**' tokens (repeat any character)
+
+    // Adds the states reachable without consuming input ('*' and '**' may
+    // match nothing)
+    uint64_t close(uint64_t states) const {
+      const uint64_t skippable = star_mask | double_star_mask;
+      uint64_t next = states | ((states & skippable) << 1);
+      while (next != states) {
+        states = next;
+        next = states | ((states & skippable) << 1);
+      }
+      return states;
+    }
+
+    bool matches(std::string_view path) const {
+      const uint64_t accept = uint64_t{1} << token_count;
+      const size_t n = path.size();
+      uint64_t states = 0;
+      for (size_t pos = 0;; ++pos) {
+        if (pos == 0 || (!anchored && path[pos - 1] == '/'))
+          states |= 1; // A match may start here
+        states = close(states);
+        if ((states & accept) && (pos == n || path[pos] == '/'))
+          return true;
+        if (pos == n || (states == 0 && anchored))
+          return false;
+
+        const unsigned char c = static_cast<unsigned char>(path[pos]);
+        uint64_t next = (states & literal_masks[c]) << 1;
+        if (c != '/') {
+          next |= (states & any_mask) << 1;
+          next |= states & star_mask;
+        }
+        if (c != '\n' && c != '\r') // Same as '.' in the reference regex
+          next |= states & double_star_mask;
+        states = next;
+      }
+    }
+  };
+
+  // Tokenizes a glob body; returns false if it needs too many states
+  static bool compile_glob(std::string_view body, GlobRule &glob) {
+    size_t k = 0;
+    for (size_t i = 0; i < body.size(); ++i, ++k) {
+      if (k >= GlobRule::kMaxTokens)
+        return false;
+      const uint64_t bit = uint64_t{1} << k;
+      const char c = body[i];
+      if (c == '*' && i + 1 < body.size() && body[i + 1] == '*') {
+        glob.double_star_mask |= bit;
+        ++i;
+        if (i + 1 < body.size() && body[i + 1] == '/')
+          ++i; // '**/' also matches no directory at all
+      } else if (c == '*') {
+        glob.star_mask |= bit;
+      } else if (c == '?') {
+        glob.any_mask |= bit;
+      } else {
+        glob.literal_masks[static_cast<unsigned char>(c)] |= bit;
+      }
+    }
+    glob.token_count = k;
+    return true;
+  }
+
+  static void record(std::unordered_map<std::string_view, int> &map,
+                     std::string_view key, int index) {
+    map[key] = index; // Rules arrive in order, the later one wins
+  }
+
+  void add_rule(const std::string &rule) {
+    const int index = static_cast<int>(negated.size());
+    std::string_view pattern(rule);
+    const bool negate = !pattern.empty() && pattern[0] == '!';
+    negated.push_back(negate);
+    if (negate)
+      pattern.remove_prefix(1);
+    bodies.emplace_back();
+    if (pattern.empty())
+      return; // Matches nothing
+
+    const bool anchored = pattern[0] == '/';
+    const size_t begin = anchored ? 1 : 0;
+    const size_t end = pattern.back() == '/' ? pattern.size() - 1
+                                             : pattern.size();
+    std::string &body = bodies.back();
+    if (end > begin)
+      body.assign(pattern.substr(begin, end - begin));
+    for (char &c : body) {
+      c = ascii_lower(c);
+    }
+    const std::string_view key(body);
+
+    const bool has_wildcard = key.find_first_of("*?") != std::string_view::npos;
+    if (!has_wildcard && anchored) {
+      record(anchored_rules, key, index);
+      return;
+    }
+    if (!has_wildcard && !key.empty() &&
+        key.find('/') == std::string_view::npos) {
+      record(name_rules, key, index);
+      return;
+    }
+    if (!anchored && key.size() >= 2 && key[0] == '*' && key[1] == '.' &&
+        key.find_first_of("*?/.", 2) == std::string_view::npos) {
+      record(extension_rules, key.substr(2), index);
+      return;
+    }
+
+    auto glob = std::make_unique<GlobRule>();
+    glob->index = index;
+    glob->anchored = anchored;
+    if (compile_glob(key, *glob)) {
+      glob_rules.push_back(GlobEntry{index, std::move(glob), nullptr});
+    } else {
+      // Too long for the automaton; keep the regex evaluation for this rule
+      glob_rules.push_back(GlobEntry{index, nullptr, &source_rules[index]});
+    }
+  }
+
+  struct GlobEntry {
+    int index;
+    std::unique_ptr<GlobRule> automaton;
+    const std::string *fallback_rule; // Set when automaton is null
+
+    bool matches(std::string_view path) const {
+      if (automaton)
+        return automaton->matches(path);
+      std::string clean_rule = *fallback_rule;
+      if (!clean_rule.empty() && clean_rule[0] == '!')
+        clean_rule.erase(0, 1);
+      std::string path_str(path);
+      if (!clean_rule.empty() && clean_rule.back() == '/')
+        return matches_gitignore_rule(path_str, true, clean_rule) ||
+               matches_gitignore_rule(path_str + "/", true, clean_rule);
+      return matches_gitignore_rule(path_str, false, clean_rule);
+    }
+  };
+
+  std::vector<std::string> source_rules;
+  std::vector<std::string> bodies; // Lowercased rule bodies, never resized
+  std::vector<bool> negated;
+  std::unordered_map<std::string_view, int> name_rules;
+  std::unordered_map<std::string_view, int> extension_rules;
+  std::unordered_map<std::string_view, int> anchored_rules;
+  std::vector<GlobEntry> glob_rules;
+};
+
 // Uses cached accumulated rules (Improvement 2)
 bool is_path_ignored_by_gitignore(
     const fs::path &absolute_path, // Path to check (must be absolute)
@@ -286,19 +762,20 @@ bool is_path_ignored_by_gitignore(
     return true;
   }
 
-  std::vector<std::string> effective_rules;
+  std::shared_ptr<const GitignoreMatcher> matcher;
   fs::path parent_dir = absolute_path.has_parent_path()
                             ? absolute_path.parent_path()
                             : absolute_path;
   std::string parent_dir_key = normalize_path(parent_dir);
 
   // --- Improvement 2: Check accumulated cache ---
+  RuleCaches &caches = rule_caches();
   bool found_in_cache = false;
   {
-    std::shared_lock<std::shared_mutex> lock(accumulated_cache_mutex);
-    auto cache_it = accumulated_rules_cache.find(parent_dir_key);
-    if (cache_it != accumulated_rules_cache.end()) {
-      effective_rules = cache_it->second;
+    std::shared_lock<std::shared_mutex> lock(caches.accumulated_mutex);
+    auto cache_it = caches.accumulated_rules.find(parent_dir_key);
+    if (cache_it != caches.accumulated_rules.end()) {
+      matcher = cache_it->second;
       found_in_cache = true;
     }
   }
@@ -340,20 +817,21 @@ bool is_path_ignored_by_gitignore(
 
     // --- Improvement 2: Store in accumulated cache ---
     {
-      std::unique_lock<std::shared_mutex> lock(accumulated_cache_mutex);
+      std::unique_lock<std::shared_mutex> lock(caches.accumulated_mutex);
       // Double check cache before inserting (another thread might have
       // finished)
-      if (accumulated_rules_cache.find(parent_dir_key) ==
-          accumulated_rules_cache.end()) {
-        accumulated_rules_cache[parent_dir_key] = rules_to_cache;
+      if (caches.accumulated_rules.find(parent_dir_key) ==
+          caches.accumulated_rules.end()) {
+        caches.accumulated_rules[parent_dir_key] =
+            std::make_shared<const GitignoreMatcher>(std::move(rules_to_cache));
       }
       // Use the rules (either freshly cached or computed by another thread)
-      effective_rules = accumulated_rules_cache[parent_dir_key];
+      matcher = caches.accumulated_rules[parent_dir_key];
     }
     // --- End Improvement 2 Store ---
   }
 
-  if (effective_rules.empty()) {
+  if (matcher->rules().empty()) {
     return false; // No gitignore rules apply up to this path's parent
   }
 
@@ -367,43 +845,7 @@ bool is_path_ignored_by_gitignore(
               << normalize_path(base_abs_path) << ": " << e.what() << '\n';
     return false; // Don't ignore if relative path fails
   }
-  std::string normalized_relative_path = normalize_path(relative_path);
-  bool is_dir = fs::is_directory(absolute_path); // Check if path is a directory
-
-  bool ignored = false;
-  // Iterate through rules. Last matching rule wins. Negation rules (`!`)
-  // override.
-  for (const auto &rule : effective_rules) {
-    std::string clean_rule = rule;
-    bool negate = false;
-    if (!clean_rule.empty() && clean_rule[0] == '!') {
-      negate = true;
-      clean_rule.erase(0, 1);
-    }
-
-    bool matched = false;
-    // If rule is a directory rule, check against the path itself and the path
-    // as if it were a directory entry
-    if (!clean_rule.empty() && clean_rule.back() == '/') {
-      matched = matches_gitignore_rule(
-                    normalized_relative_path, is_dir,
-                    clean_rule) || // Check if rule matches path directly (e.g.,
-                                   // "dir/" matches "dir/subdir")
-                matches_gitignore_rule(
-                    normalized_relative_path + "/", true,
-                    clean_rule); // Check if rule matches path + "/" (e.g.,
-                                 // "dir/" matches "dir/")
-    } else {
-      matched = matches_gitignore_rule(
-          normalized_relative_path, is_dir,
-          clean_rule); // Standard check for file patterns
-    }
-
-    if (matched) {
-      ignored = !negate; // If rule matches, set ignored based on negation
-    }
-  }
-  return ignored;
+  return matcher->is_ignored(normalize_path(relative_path));
 }
 
 // --- File Property Checks ---
@@ -413,168 +855,36 @@ bool is_file_size_valid(unsigned long long file_size,
   return max_file_size_b == 0 || file_size <= max_file_size_b;
 }
 
-bool is_file_extension_allowed(
-    const fs::path &path,
-    const std::vector<std::string> &allowed_extensions,  // lowercase, no dot
-    const std::vector<std::string> &excluded_extensions) // lowercase, no dot
-{
-  if (!path.has_extension()) {
-    // Allow files with no extension only if no specific extensions are required
-    // AND it's not explicitly excluded (though excluding no-extension is rare)
-    return allowed_extensions.empty();
-  }
-
-  std::string ext = path.extension().string();
-  if (ext.length() <= 1)
-    return allowed_extensions.empty(); // Only has dot, treat as no extension
-
-  std::string ext_no_dot = ext.substr(1);
-  std::transform(
-      ext_no_dot.begin(), ext_no_dot.end(), ext_no_dot.begin(),
-      [](unsigned char c) { return std::tolower(c); }); // Use lambda for safety
-
-  // Check exclusion first
-  if (std::find(excluded_extensions.begin(), excluded_extensions.end(),
-                ext_no_dot) != excluded_extensions.end()) {
-    return false;
-  }
-
-  // If allowed list is empty, allow everything not excluded
-  if (allowed_extensions.empty()) {
-    return true;
-  }
-
-  // Otherwise, check if it's in the allowed list
-  return std::find(allowed_extensions.begin(), allowed_extensions.end(),
-                   ext_no_dot) != allowed_extensions.end();
-}
-
-// Now uses cached gitignore check
-bool should_ignore_folder(
-    const fs::path &absolute_folder_path, // Must be absolute
-    bool disableGitignore,
-    const fs::path &base_abs_path,                   // Must be absolute
-    const std::vector<fs::path> &ignoredFolderPaths, // Relative paths
-    const std::unordered_map<std::string, std::vector<std::string>>
-        &dir_gitignore_rules // Raw rules map
-) {
-  // Check gitignore first (uses caching internally now)
-  if (!disableGitignore &&
-      is_path_ignored_by_gitignore(absolute_folder_path, base_abs_path,
-                                   dir_gitignore_rules)) {
-    return true;
-  }
-
-  // Check manually ignored folders (match relative path prefix)
-  fs::path relativePath;
-  try {
-    relativePath = fs::relative(absolute_folder_path, base_abs_path);
-  } catch (const std::exception &) {
-    // Folder not under base path? Should not happen in normal iteration.
-    return false;
-  }
-  std::string relativePathStr = normalize_path(relativePath);
-
-  for (const auto &ignoredRelativeFolder : ignoredFolderPaths) {
-    std::string ignoredStr = normalize_path(ignoredRelativeFolder);
-    // Ensure ignoredStr ends with '/' for directory matching logic
-    if (ignoredStr.empty())
-      continue;
-    // Check if the path being checked IS the ignored directory, OR
-    // if the path being checked STARTS WITH the ignored directory name + '/'
-    if (relativePathStr == ignoredStr ||
-        (!ignoredStr.empty() &&
-         relativePathStr.rfind(ignoredStr + '/', 0) == 0)) {
-      return true;
-    }
-  }
-
-  return false;
-}
-
-// Uses cached gitignore check and passed file size (Improvement 6)
-bool should_ignore_file(
-    const fs::path &absolute_file_path, // Must be absolute
-    unsigned long long file_size,       // Passed in
-    bool disableGitignore,
-    const fs::path &base_abs_path, // Must be absolute
-    unsigned long long maxFileSizeB,
-    const std::vector<fs::path>
-        &ignoredFilesOrPatterns, // Relative paths or filenames
-    const std::unordered_map<std::string, std::vector<std::string>>
-        &dir_gitignore_rules // Raw rules
-) {
-  // Check gitignore first (uses caching internally)
-
-  // Explicitly ignore .gitignore files themselves
-  if (absolute_file_path.filename() == ".gitignore") {
-    return true;
-  }
-
-  if (!disableGitignore &&
-      is_path_ignored_by_gitignore(absolute_file_path, base_abs_path,
-                                   dir_gitignore_rules)) {
-    return true;
-  }
-
-  // Check file size (using passed size)
-  if (!is_file_size_valid(file_size, maxFileSizeB)) {
-    return true;
-  }
+// --- Regex Filters ---
 
-  // Check manually ignored files/patterns
-  fs::path relativePath;
+// Compiles a -r/-d pattern. An invalid pattern is reported and yields an
+// empty regex, which matches nothing.
+std::regex compile_filter_regex(const std::string &regexStr) {
   try {
-    relativePath = fs::relative(absolute_file_path, base_abs_path);
-  } catch (const std::exception &) {
-    return false; // Path not under dirPath? Shouldn't happen.
-  }
-
-  std::string relativePathStr = normalize_path(relativePath);
-  std::string filenameStr = normalize_path(absolute_file_path.filename());
-
-  for (const auto &ignoredEntry : ignoredFilesOrPatterns) {
-    std::string ignoredStr = normalize_path(ignoredEntry);
-    if (ignoredStr.find('/') != std::string::npos) {
-      // Ignored entry contains path separator, treat as relative path
-      if (relativePathStr == ignoredStr)
-        return true;
-    } else {
-      // Ignored entry is just a filename
-      if (filenameStr == ignoredStr)
-        return true;
-    }
+    // Use optimize flag if available and potentially useful
+    return std::regex(regexStr, std::regex::optimize);
+  } catch (const std::regex_error &e) {
+    std::cerr << "ERROR: Invalid regex: '" << regexStr << "': " << e.what()
+              << '\n';
+    return std::regex(); // Matches nothing
   }
-
-  return false;
 }
 
-// --- Regex Filters ---
-
-// Helper to get/compile/cache regex
-std::regex get_compiled_regex(const std::string &regexStr) {
+// Helper to get/compile/cache regex. Cached entries are never replaced, so the
+// returned reference stays valid without holding the lock.
+const std::regex &get_compiled_regex(const std::string &regexStr) {
+  RuleCaches &caches = rule_caches();
   {
-    std::shared_lock<std::shared_mutex> lock(regex_cache_mutex);
-    auto it = regex_cache.find(regexStr);
-    if (it != regex_cache.end()) {
+    std::shared_lock<std::shared_mutex> lock(caches.regex_mutex);
+    auto it = caches.regexes.find(regexStr);
+    if (it != caches.regexes.end()) {
       return it->second;
     }
   }
-  // Compile and cache
-  try {
-    // Use optimize flag if available and potentially useful
-    std::regex compiled(regexStr, std::regex::optimize);
-    std::unique_lock<std::shared_mutex> lock(regex_cache_mutex);
-    regex_cache[regexStr] = compiled; // Cache success
-    return compiled;
-  } catch (const std::regex_error &e) {
-    std::cerr << "ERROR: Invalid regex: '" << regexStr << "': " << e.what()
-              << '\n';
-    std::regex empty; // Matches nothing
-    std::unique_lock<std::shared_mutex> lock(regex_cache_mutex);
-    regex_cache[regexStr] = empty; // Cache empty on error
-    return empty;
-  }
+  std::regex compiled = compile_filter_regex(regexStr); // Outside the lock
+  std::unique_lock<std::shared_mutex> lock(caches.regex_mutex);
+  return caches.regexes.try_emplace(regexStr, std::move(compiled))
+      .first->second;
 }
 
 // Check if filename matches any exclusion regex
@@ -585,7 +895,7 @@ bool matches_regex_filters(const fs::path &path,
 
   const std::string filename = path.filename().string(); // Get filename part
   for (const auto &regexStr : regex_filters) {
-    std::regex compiled_regex = get_compiled_regex(regexStr);
+    const std::regex &compiled_regex = get_compiled_regex(regexStr);
     if (std::regex_search(filename, compiled_regex)) { // search = find anywhere
       return true; // Exclude if any filter matches
     }
@@ -602,7 +912,7 @@ bool matches_filename_regex_filters(
 
   const std::string filename = path.filename().string();
   for (const auto &regexStr : filename_regex_filters) {
-    std::regex compiled_regex = get_compiled_regex(regexStr);
+    const std::regex &compiled_regex = get_compiled_regex(regexStr);
     // Use regex_match: the pattern must match the *entire* filename
     if (std::regex_match(filename, compiled_regex)) {
       return true; // Include if any filter matches
@@ -611,825 +921,6566 @@ bool matches_filename_regex_filters(
   return false; // Don't include if no filters matched
 }
 
-// --- File Content Processing ---
-
-// No change needed in logic, added reserve()
-std::string remove_cpp_comments(const std::string &code) {
-  std::string result;
-  result.reserve(code.length()); // Pre-allocate memory
-  bool inString = false;
-  bool inChar = false;
-  bool inSingleLineComment = false;
-  bool inMultiLineComment = false;
-
-  for (size_t i = 0; i < code.size(); ++i) {
-    char current_char = code[i];
-    char next_char = (i + 1 < code.size()) ? code[i + 1] : '\0';
-
-    if (inString) {
-      result += current_char;
-      if (current_char == '\\' && next_char != '\0') {
-        result += next_char;
-        ++i;
-      } else if (current_char == '"') {
-        inString = false;
-      }
-    } else if (inChar) {
-      result += current_char;
-      if (current_char == '\\' && next_char != '\0') {
-        result += next_char;
-        ++i;
-      } else if (current_char == '\'') {
-        inChar = false;
-      }
-    } else if (inSingleLineComment) {
-      if (current_char == '\n') {
-        inSingleLineComment = false;
-        result += current_char;
-      }
-    } else if (inMultiLineComment) {
-      if (current_char == '*' && next_char == '/') {
-        inMultiLineComment = false;
-        ++i;
-      }
-    } else {
-      if (current_char == '"') {
-        inString = true;
-        result += current_char;
-      } else if (current_char == '\'') {
-        inChar = true;
-        result += current_char;
-      } else if (current_char == '/' && next_char == '/') {
-        inSingleLineComment = true;
-        ++i;
-      } else if (current_char == '/' && next_char == '*') {
-        inMultiLineComment = true;
-        ++i;
+// Hashes std::string keys so that a set can be searched with a string_view
+struct StringViewHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view text) const {
+    return std::hash<std::string_view>{}(text);
+  }
+};
+using StringSet =
+    std::unordered_set<std::string, StringViewHash, std::equal_to<>>;
+
+// Normalized relative folder paths, stored by component, so that a path is
+// checked in one pass over its own components however many are stored
+class PathTrie {
+public:
+  // Adds a normalized relative path ('/'-separated, no trailing '/')
+  void insert(std::string_view path) {
+    if (nodes.empty())
+      nodes.emplace_back(); // The root
+    size_t node = 0;
+    while (true) {
+      const size_t slash = path.find('/');
+      const std::string_view component = path.substr(0, slash);
+      auto it = nodes[node].children.find(component);
+      if (it != nodes[node].children.end()) {
+        node = it->second;
       } else {
-        result += current_char;
+        const size_t child = nodes.size();
+        nodes[node].children.emplace(std::string(component), child);
+        nodes.emplace_back();
+        node = child;
       }
+      if (slash == std::string_view::npos)
+        break;
+      path.remove_prefix(slash + 1);
     }
+    nodes[node].stored = true;
   }
-  return result;
-}
 
-// Uses string_view for line processing (minor optimization)
-// Now accepts Config to check useBackticks
-std::string
-format_file_output(const fs::path &absolute_path,
-                   const fs::path &base_abs_path, // Base directory path
-                   const std::string &file_content, const Config &config) {
-  std::stringstream content_buffer; // Use stringstream for easier formatting
-  fs::path displayPath;
-  if (config.showFilenameOnly) {
-    displayPath = absolute_path.filename();
-  } else {
-    try {
-      // Calculate relative path from base for display
-      displayPath = fs::relative(absolute_path, base_abs_path);
-    } catch (const std::exception &) {
-      displayPath = absolute_path.filename(); // Fallback if relative fails
+  // Whether `path` is a stored path or lies inside one
+  bool covers(std::string_view path) const {
+    if (nodes.empty())
+      return false;
+    size_t node = 0;
+    while (true) {
+      const size_t slash = path.find('/');
+      const auto &children = nodes[node].children;
+      auto it = children.find(path.substr(0, slash));
+      if (it == children.end())
+        return false;
+      node = it->second;
+      if (nodes[node].stored)
+        return true;
+      if (slash == std::string_view::npos)
+        return false;
+      path.remove_prefix(slash + 1);
     }
   }
 
-  std::string normalizedDisplayPath = normalize_path(displayPath);
-  content_buffer << "\n## File: ";
-  if (config.useBackticks) {
-    content_buffer << "`" << normalizedDisplayPath << "`";
-  } else {
-    content_buffer << normalizedDisplayPath;
+  bool empty() const { return nodes.empty(); }
+
+private:
+  struct Node {
+    std::unordered_map<std::string, size_t, StringViewHash, std::equal_to<>>
+        children; // Component -> index in `nodes`
+    bool stored = false;
+  };
+  std::vector<Node> nodes; // nodes[0] is the root
+};
+
+// Every filename and path filter, compiled once: the -r and -d patterns,
+// the -e and -x extensions and the -i entries. The set is immutable after
+// construction and shared by all walk threads, so matching takes no lock
+// and copies no regex, and no check depends on the length of the lists.
+struct CompiledFilters {
+  std::vector<std::regex> excludeRegexes; // -r: searched in the filename
+  std::vector<std::regex> includeRegexes; // -d: must match the whole filename
+  StringSet allowedExtensions;  // -e: lowercase, no dot
+  StringSet excludedExtensions; // -x: lowercase, no dot
+  // -i: file entries match a file by name (no '/') or by relative path;
+  // folder entries match that folder and everything inside it
+  StringSet ignoredNames;
+  StringSet ignoredFilePaths;
+  PathTrie ignoredFolders;
+
+  // Checks an extension (without the dot, any case) against -e and -x. A
+  // file without one is only selected when -e is not given.
+  bool is_extension_selected(std::string_view extension) const {
+    if (extension.empty())
+      return allowedExtensions.empty();
+    if (allowedExtensions.empty() && excludedExtensions.empty())
+      return true;
+    std::string lowered; // Only when needed; extensions are mostly lowercase
+    if (std::any_of(extension.begin(), extension.end(),
+                    [](unsigned char c) { return std::isupper(c); })) {
+      lowered.assign(extension);
+      std::transform(lowered.begin(), lowered.end(), lowered.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      extension = lowered;
+    }
+    if (excludedExtensions.find(extension) != excludedExtensions.end())
+      return false;
+    return allowedExtensions.empty() ||
+           allowedExtensions.find(extension) != allowedExtensions.end();
   }
-  content_buffer << "\n\n```";
 
-  if (absolute_path.has_extension()) {
-    std::string ext = absolute_path.extension().string();
-    if (ext.length() > 1)
-      content_buffer << ext.substr(1); // Add extension without dot
+  // Checks a folder (normalized relative path) against -i
+  bool is_folder_ignored(std::string_view relative_path) const {
+    return ignoredFolders.covers(relative_path);
   }
-  content_buffer << "\n";
 
-  // Process content line by line using string_view
-  std::string_view content_view = file_content;
-  size_t line_start = 0;
-  int lineNumber = 1;
-  while (line_start < content_view.length()) {
-    size_t line_end = content_view.find('\n', line_start);
-    size_t current_line_len = (line_end == std::string_view::npos)
-                                  ? (content_view.length() - line_start)
-                                  : (line_end - line_start);
-    std::string_view line = content_view.substr(line_start, current_line_len);
+  // Checks a file (normalized relative path and name) against -i
+  bool is_file_ignored(std::string_view relative_path,
+                       std::string_view name) const {
+    return ignoredNames.find(name) != ignoredNames.end() ||
+           ignoredFilePaths.find(relative_path) != ignoredFilePaths.end();
+  }
 
-    // Trim potential trailing '\r'
-    if (!line.empty() && line.back() == '\r') {
-      line.remove_suffix(1);
+  // Applies both lists to a filename, like matches_regex_filters followed by
+  // matches_filename_regex_filters
+  bool is_filename_selected(const std::string &filename) const {
+    for (const auto &regex : excludeRegexes) {
+      if (std::regex_search(filename, regex))
+        return false;
     }
-
-    bool is_empty_line =
-        (line.find_first_not_of(" \t") == std::string_view::npos);
-
-    if (!config.removeEmptyLines || !is_empty_line) {
-      if (config.showLineNumbers) {
-        content_buffer << lineNumber++ << " | ";
-      }
-      content_buffer << line << '\n'; // Add the newline back
+    if (includeRegexes.empty())
+      return true;
+    for (const auto &regex : includeRegexes) {
+      if (std::regex_match(filename, regex))
+        return true;
     }
+    return false;
+  }
+};
 
-    if (line_end == std::string_view::npos)
-      break;                   // Reached end of string
-    line_start = line_end + 1; // Move past the newline character
+std::shared_ptr<const CompiledFilters>
+build_compiled_filters(const Config &config) {
+  auto filters = std::make_shared<CompiledFilters>();
+  filters->excludeRegexes.reserve(config.regexFilters.size());
+  for (const auto &regexStr : config.regexFilters) {
+    filters->excludeRegexes.push_back(compile_filter_regex(regexStr));
+  }
+  filters->includeRegexes.reserve(config.filenameRegexFilters.size());
+  for (const auto &regexStr : config.filenameRegexFilters) {
+    filters->includeRegexes.push_back(compile_filter_regex(regexStr));
+  }
+  filters->allowedExtensions.insert(config.fileExtensions.begin(),
+                                    config.fileExtensions.end());
+  filters->excludedExtensions.insert(config.excludedFileExtensions.begin(),
+                                     config.excludedFileExtensions.end());
+  for (const auto &folder : config.ignoredFolders) {
+    // Folder entries are compared as whole normalized paths, so one that
+    // keeps a trailing '/' matches no folder
+    std::string path = normalize_path(folder);
+    if (!path.empty() && path.back() != '/')
+      filters->ignoredFolders.insert(path);
   }
-  // Ensure a newline exists after the last line of code if content wasn't empty
-  // and didn't end with \n
-  if (!file_content.empty() && file_content.back() != '\n') {
-    // content_buffer << '\n'; // Add final newline if missing - loop handles
-    // this.
-  } else if (file_content.empty() && config.showLineNumbers) {
-    // content_buffer << "1 | \n"; // Show line number 1 for empty file? Let's
-    // show nothing.
-  } else if (file_content.empty()) {
-    // Add a newline for empty file for consistent formatting?
-    // content_buffer << "\n"; // Let's not add extra newline for empty files.
+  for (const auto &entry : config.ignoredFiles) {
+    std::string path = normalize_path(entry);
+    if (path.find('/') == std::string::npos)
+      filters->ignoredNames.insert(std::move(path));
+    else
+      filters->ignoredFilePaths.insert(std::move(path));
   }
+  return filters;
+}
 
-  content_buffer << "```\n";
-  return content_buffer.str();
+// --- Run Statistics (--stats) ---
+// Every thread that takes part in a run gets its own ThreadStats slot and
+// updates it without synchronization; the slots are only read after the
+// threads are joined. Hot paths find their slot through a thread_local
+// pointer, which is null without --stats, so the instrumentation costs one
+// load and a branch and never reads the clock when it is off.
+
+uint64_t stats_now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
 }
 
-// Removed redundant file size check (Improvement 6)
-// Now passes Config to format_file_output
-std::string
-process_single_file(const fs::path &absolute_path, // Must be absolute
-                    const Config &config,          // Pass config
-                    const fs::path &base_abs_path  // Base directory
-) {
-  if (config.dryRun) {
-    // For dry run, we just need to format the header part (or just return the
-    // path) For consistency with process_directory dry run, let's just return
-    // the path info needed there. The formatting happens in process_directory.
-    // However, process_single_file_entry needs formatting. Let's keep the
-    // formatting here for now.
-    return format_file_output(absolute_path, base_abs_path, "", config);
+// Durations on a log scale, four buckets per power of two (about 19%
+// resolution), so percentiles need no per-sample storage
+class LatencyHistogram {
+public:
+  void add(uint64_t ns) {
+    ++counts[bucket_of(ns)];
+    ++samples;
+    max_ns = std::max(max_ns, ns);
   }
 
-  std::ifstream file(absolute_path, std::ios::binary);
-  if (!file) {
-    // Use cerr for errors
-    std::cerr << "ERROR: Could not open file: " << normalize_path(absolute_path)
-              << '\n';
-    return ""; // Return empty string on error
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < kBuckets; ++i)
+      counts[i] += other.counts[i];
+    samples += other.samples;
+    max_ns = std::max(max_ns, other.max_ns);
   }
 
-  // Read the whole file - This remains a potential bottleneck for large files
-  // Consider using memory-mapped files for very large inputs if this is
-  // profiled as slow.
-  std::string fileContent((std::istreambuf_iterator<char>(file)),
-                          std::istreambuf_iterator<char>());
-  file.close(); // Close file ASAP
-
-  if (config.removeComments) {
-    fileContent = remove_cpp_comments(fileContent);
+  // Upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+  uint64_t percentile(double p) const {
+    if (samples == 0)
+      return 0;
+    const auto rank = static_cast<uint64_t>(
+        std::max(1.0, std::ceil(p / 100.0 * static_cast<double>(samples))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::min(bucket_upper(i), max_ns);
+    }
+    return max_ns;
   }
 
-  // Pass base path and config for relative path calculation and formatting
-  // options
-  return format_file_output(absolute_path, base_abs_path, fileContent, config);
-}
+  uint64_t count() const { return samples; }
+  uint64_t max() const { return max_ns; }
 
-// --- File Collection ---
+private:
+  static constexpr size_t kBuckets = 64 * 4;
 
-// Uses Config sets for faster lookup (Improvement 4)
-// Expects absolute path for absPath and config.dirPath
-bool is_last_file(const fs::path &absPath, const Config &config) {
-  if (!config.dirPath.is_absolute() || !absPath.is_absolute()) {
-    std::cerr << "WARNING: is_last_file called with non-absolute paths.\n";
-    return false;
+  static size_t bucket_of(uint64_t ns) {
+    if (ns < 8)
+      return static_cast<size_t>(ns);
+    const int msb = 63 - std::countl_zero(ns);
+    return static_cast<size_t>(msb) * 4 + ((ns >> (msb - 2)) & 3);
   }
-
-  fs::path relative_path;
-  try {
-    // Use lexically_relative if paths might be on different drives (Windows)
-    // relative() might throw if not hierarchically related.
-    relative_path = fs::relative(absPath, config.dirPath);
-  } catch (const std::exception &) {
-    return false; // Cannot be a last file if not relative to dirPath
+  static uint64_t bucket_upper(size_t bucket) {
+    if (bucket < 8)
+      return bucket;
+    const size_t msb = bucket / 4, quarter = bucket % 4;
+    return ((4 + quarter + 1) << (msb - 2)) - 1;
   }
 
-  std::string relPathStr = normalize_path(relative_path);
-  std::string filenameStr = normalize_path(absPath.filename());
+  std::array<uint64_t, kBuckets> counts{};
+  uint64_t samples = 0;
+  uint64_t max_ns = 0;
+};
 
-  // Check relative path set
-  if (config.lastFilesSetRel.count(relPathStr)) {
-    return true;
-  }
-  // Check filename set
-  if (config.lastFilesSetFilename.count(filenameStr)) {
-    return true;
+struct ThreadStats {
+  enum class Role { Walk, Worker, Writer };
+  Role role = Role::Worker;
+  std::string name;
+  // Walk
+  uint64_t directoriesListed = 0;
+  uint64_t entriesSeen = 0;
+  uint64_t walkNs = 0;
+  uint64_t gitignoreChecks = 0;
+  uint64_t gitignoreNs = 0;
+  // Workers
+  uint64_t filesRead = 0;
+  uint64_t filesBinary = 0; // Of filesRead, skipped as binary
+  uint64_t bytesRead = 0;
+  uint64_t readNs = 0;
+  LatencyHistogram readLatency;
+  uint64_t filesFormatted = 0;
+  uint64_t bytesFormatted = 0;
+  uint64_t transformNs = 0;    // Header, comment strip, line handling
+  uint64_t windowWaitNs = 0;   // Blocked until the output window had room
+  // Writer
+  uint64_t bytesWritten = 0;
+  uint64_t writeNs = 0;
+  uint64_t writerIdleNs = 0; // Waiting for the next file in order
+};
+
+// The calling thread's slot, or null when the run has no --stats
+thread_local ThreadStats *thread_stats = nullptr;
+
+class RunStats {
+public:
+  // A new slot; slots stay at the same address for the whole run
+  ThreadStats &add_thread(ThreadStats::Role role, std::string name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ThreadStats &stats = threads.emplace_back();
+    stats.role = role;
+    stats.name = std::move(name);
+    return stats;
   }
 
-  // Check if path is within any of the last directories
-  for (const auto &lastDirRelStr : config.lastDirsSetRel) {
-    // Check if relPathStr starts with lastDirRelStr + "/"
-    if (!lastDirRelStr.empty() && lastDirRelStr.back() != '/') {
-      if (relPathStr.rfind(lastDirRelStr + '/', 0) == 0)
-        return true;
-    } else { // lastDirRelStr already ends with / or is empty
-      if (relPathStr.rfind(lastDirRelStr, 0) == 0)
-        return true;
-    }
-    // Or if relPathStr *is* the directory name (less likely for a file)
-    if (relPathStr == lastDirRelStr)
-      return true;
+  // Wall time of one stage of the run ("collect", "process", "total")
+  void add_stage(std::string name, uint64_t ns) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stages.emplace_back(std::move(name), ns);
   }
 
-  return false;
-}
+  void print(std::ostream &out, StatsFormat format) const;
 
-// Passes file_size to should_ignore_file, uses optimized is_last_file
-// Returns pair of vectors containing ABSOLUTE paths
-std::pair<std::vector<fs::path>, std::vector<fs::path>>
-collect_files(const Config &config, std::atomic<bool> &should_stop) {
-  std::vector<fs::path> normalFiles;   // Absolute paths
-  std::vector<fs::path> lastFilesList; // Absolute paths
-  // Use normalized absolute path strings for uniqueness tracking during
-  // collection
-  std::unordered_set<std::string> collected_abs_paths_set;
+private:
+  mutable std::mutex mutex;
+  std::deque<ThreadStats> threads;
+  std::vector<std::pair<std::string, uint64_t>> stages;
+};
 
-  if (!fs::is_directory(config.dirPath)) {
-    std::cerr << "ERROR: collect_files called with a non-directory path: "
-              << normalize_path(config.dirPath) << std::endl;
-    return {{}, {}};
+// Points thread_stats at a new slot of `run` until the scope ends. Does
+// nothing (and builds no name) when `run` is null.
+class ThreadStatsScope {
+public:
+  ThreadStatsScope(RunStats *run, ThreadStats::Role role, const char *name,
+                   size_t index = std::numeric_limits<size_t>::max())
+      : previous(thread_stats) {
+    if (!run)
+      return;
+    std::string full_name = name;
+    if (index != std::numeric_limits<size_t>::max())
+      full_name += "-" + std::to_string(index);
+    thread_stats = &run->add_thread(role, std::move(full_name));
   }
-  const fs::path base_abs_path = config.dirPath; // Base is already absolute
+  ThreadStatsScope(const ThreadStatsScope &) = delete;
+  ThreadStatsScope &operator=(const ThreadStatsScope &) = delete;
+  ~ThreadStatsScope() { thread_stats = previous; }
 
-  // Preload gitignore rules for all relevant directories
-  std::unordered_map<std::string, std::vector<std::string>>
-      dir_gitignore_rules_map;
-  if (!config.disableGitignore) {
-    // accumulated_rules_cache.clear(); // Clear accumulated cache for this
-    // specific run? - No, share across runs if possible
+private:
+  ThreadStats *previous;
+};
 
-    try {
-      // Iterate non-recursively first to get top-level .gitignore
-      if (fs::exists(base_abs_path / ".gitignore")) {
-        dir_gitignore_rules_map[normalize_path(base_abs_path)] =
-            load_gitignore_rules(base_abs_path / ".gitignore");
-      }
-      // Then recursively find others if needed
-      if (config.recursiveSearch) {
-        fs::recursive_directory_iterator gitignore_it(
-            base_abs_path, fs::directory_options::follow_directory_symlink |
-                               fs::directory_options::skip_permission_denied);
-        fs::recursive_directory_iterator end_gitignore_it;
-        for (; gitignore_it != end_gitignore_it; ++gitignore_it) {
-          try {
-            const auto &current_path = gitignore_it->path();
-            // Skip iterating into directories that are gitignored (basic check)
-            if (gitignore_it->is_directory() &&
-                is_path_ignored_by_gitignore(current_path, base_abs_path,
-                                             dir_gitignore_rules_map)) {
-              gitignore_it.disable_recursion_pending();
-              continue;
-            }
-            if (!gitignore_it->is_directory() &&
-                gitignore_it->path().filename() == ".gitignore") {
-              std::string dir_key =
-                  normalize_path(gitignore_it->path().parent_path());
-              if (dir_gitignore_rules_map.find(dir_key) ==
-                  dir_gitignore_rules_map
-                      .end()) { // Avoid reloading if already done
-                dir_gitignore_rules_map[dir_key] =
-                    load_gitignore_rules(gitignore_it->path());
-              }
-            }
-          } catch (const fs::filesystem_error &fs_err) {
-            // Permissions error likely, report and continue if possible
-            std::cerr
-                << "WARNING: Filesystem error scanning for .gitignore near "
-                << normalize_path(gitignore_it->path()) << ": " << fs_err.what()
-                << std::endl;
-            // If it's a directory causing the error, try to skip it
-            if (gitignore_it.depth() > 0 && gitignore_it->is_directory()) {
-              gitignore_it.disable_recursion_pending();
-            } else if (gitignore_it.depth() == 0) {
-              // Error at top level, might need to stop iteration depending on
-              // error For now, just warn and continue
-            }
-          }
-        }
-      }
-    } catch (const std::exception &e) {
-      std::cerr << "WARNING: Error scanning for .gitignore files: " << e.what()
-                << std::endl;
-    }
+// Adds the duration of a scope to one counter of the calling thread's slot
+class StatSpan {
+public:
+  explicit StatSpan(uint64_t ThreadStats::*counter)
+      : stats(thread_stats), counter(counter),
+        start(stats ? stats_now_ns() : 0) {}
+  StatSpan(const StatSpan &) = delete;
+  StatSpan &operator=(const StatSpan &) = delete;
+  ~StatSpan() {
+    if (stats)
+      stats->*counter += stats_now_ns() - start;
   }
 
-  // Helper lambda for skipping directories (uses cached gitignore)
-  auto check_and_skip_directory = [&](const fs::path &absolute_dir_path) {
-    return should_ignore_folder(absolute_dir_path, config.disableGitignore,
-                                base_abs_path, config.ignoredFolders,
-                                dir_gitignore_rules_map);
-  };
-
-  // --- Handle --only-last separately ---
-  if (config.onlyLast) {
-    // Collect explicitly listed files
-    for (const auto &lastFileEntry : config.lastFiles) {
-      fs::path absPath =
-          base_abs_path / lastFileEntry; // Resolve relative to base
-      std::string normAbsPathStr = normalize_path(absPath);
+private:
+  ThreadStats *stats;
+  uint64_t ThreadStats::*counter;
+  uint64_t start;
+};
 
-      if (fs::exists(absPath) && fs::is_regular_file(absPath)) {
-        if (collected_abs_paths_set.find(normAbsPathStr) ==
-            collected_abs_paths_set.end()) {
-          lastFilesList.push_back(absPath);
-          collected_abs_paths_set.insert(normAbsPathStr);
-        }
-      } else {
-        std::cerr << "WARNING: --only-last specified file not found or not a "
-                     "regular file: "
-                  << normalize_path(lastFileEntry)
-                  << " (resolved to: " << normAbsPathStr << ")\n";
+void RunStats::print(std::ostream &out, StatsFormat format) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  ThreadStats total;
+  for (const auto &thread : threads) {
+    total.directoriesListed += thread.directoriesListed;
+    total.entriesSeen += thread.entriesSeen;
+    total.walkNs += thread.walkNs;
+    total.gitignoreChecks += thread.gitignoreChecks;
+    total.gitignoreNs += thread.gitignoreNs;
+    total.filesRead += thread.filesRead;
+    total.filesBinary += thread.filesBinary;
+    total.bytesRead += thread.bytesRead;
+    total.readNs += thread.readNs;
+    total.readLatency.merge(thread.readLatency);
+    total.filesFormatted += thread.filesFormatted;
+    total.bytesFormatted += thread.bytesFormatted;
+    total.transformNs += thread.transformNs;
+    total.windowWaitNs += thread.windowWaitNs;
+    total.bytesWritten += thread.bytesWritten;
+    total.writeNs += thread.writeNs;
+    total.writerIdleNs += thread.writerIdleNs;
+  }
+  auto ms = [](uint64_t ns) { return static_cast<double>(ns) / 1e6; };
+  auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1e3; };
+  auto mib = [](uint64_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+  };
+  const LatencyHistogram &latency = total.readLatency;
+  const std::ios_base::fmtflags saved_flags = out.flags();
+  const std::streamsize saved_precision = out.precision();
+  out << std::fixed << std::setprecision(2);
+
+  if (format == StatsFormat::Json) {
+    out << "{\"stages_ms\": {";
+    for (size_t i = 0; i < stages.size(); ++i) {
+      out << (i ? ", " : "") << '"' << stages[i].first
+          << "\": " << ms(stages[i].second);
+    }
+    out << "}, \"walk\": {\"directories\": " << total.directoriesListed
+        << ", \"entries\": " << total.entriesSeen
+        << ", \"thread_ms\": " << ms(total.walkNs)
+        << "}, \"gitignore\": {\"checks\": " << total.gitignoreChecks
+        << ", \"thread_ms\": " << ms(total.gitignoreNs)
+        << "}, \"read\": {\"files\": " << total.filesRead
+        << ", \"binary_files\": " << total.filesBinary
+        << ", \"bytes\": " << total.bytesRead
+        << ", \"thread_ms\": " << ms(total.readNs)
+        << ", \"latency_us\": {\"p50\": " << us(latency.percentile(50))
+        << ", \"p90\": " << us(latency.percentile(90))
+        << ", \"p99\": " << us(latency.percentile(99))
+        << ", \"max\": " << us(latency.max())
+        << "}}, \"transform\": {\"files\": " << total.filesFormatted
+        << ", \"bytes\": " << total.bytesFormatted
+        << ", \"thread_ms\": " << ms(total.transformNs)
+        << "}, \"output\": {\"bytes\": " << total.bytesWritten
+        << ", \"write_ms\": " << ms(total.writeNs)
+        << ", \"writer_idle_ms\": " << ms(total.writerIdleNs)
+        << ", \"window_wait_ms\": " << ms(total.windowWaitNs)
+        << "}, \"threads\": [";
+    for (size_t i = 0; i < threads.size(); ++i) {
+      const ThreadStats &t = threads[i];
+      out << (i ? ", " : "") << "{\"name\": \"" << t.name << '"';
+      switch (t.role) {
+      case ThreadStats::Role::Walk:
+        out << ", \"directories\": " << t.directoriesListed
+            << ", \"entries\": " << t.entriesSeen
+            << ", \"walk_ms\": " << ms(t.walkNs)
+            << ", \"gitignore_checks\": " << t.gitignoreChecks
+            << ", \"gitignore_ms\": " << ms(t.gitignoreNs);
+        break;
+      case ThreadStats::Role::Worker:
+        out << ", \"files_read\": " << t.filesRead
+            << ", \"bytes_read\": " << t.bytesRead
+            << ", \"read_ms\": " << ms(t.readNs)
+            << ", \"transform_ms\": " << ms(t.transformNs)
+            << ", \"window_wait_ms\": " << ms(t.windowWaitNs);
+        break;
+      case ThreadStats::Role::Writer:
+        out << ", \"bytes_written\": " << t.bytesWritten
+            << ", \"write_ms\": " << ms(t.writeNs)
+            << ", \"idle_ms\": " << ms(t.writerIdleNs);
+        break;
       }
+      out << '}';
     }
-
-    // Collect files from explicitly listed directories
-    for (const auto &lastDirEntry : config.lastDirs) {
-      fs::path absDirPath =
-          base_abs_path / lastDirEntry; // Resolve relative to base
-      if (!fs::exists(absDirPath) || !fs::is_directory(absDirPath)) {
-        std::cerr << "WARNING: --only-last specified directory not found or "
-                     "not a directory: "
-                  << normalize_path(lastDirEntry)
-                  << " (resolved to: " << normalize_path(absDirPath) << ")\n";
-        continue;
+    out << "]}\n";
+  } else {
+    out << "--- Stats ---\nStages:";
+    for (size_t i = 0; i < stages.size(); ++i) {
+      out << (i ? ", " : " ") << stages[i].first << ' ' << ms(stages[i].second)
+          << " ms";
+    }
+    out << "\nWalk: " << total.directoriesListed << " directories, "
+        << total.entriesSeen << " entries, " << ms(total.walkNs)
+        << " ms thread time\n"
+        << "Gitignore: " << total.gitignoreChecks << " checks, "
+        << ms(total.gitignoreNs) << " ms\n"
+        << "Read: " << total.filesRead << " files, "
+        << (total.filesBinary
+                ? std::to_string(total.filesBinary) + " of them binary, "
+                : std::string())
+        << mib(total.bytesRead) << " MiB, " << ms(total.readNs)
+        << " ms; latency p50 "
+        << us(latency.percentile(50)) << " us, p90 "
+        << us(latency.percentile(90)) << " us, p99 "
+        << us(latency.percentile(99)) << " us, max " << us(latency.max())
+        << " us\n"
+        << "Transform: " << total.filesFormatted << " files, "
+        << mib(total.bytesFormatted) << " MiB, " << ms(total.transformNs)
+        << " ms\n"
+        << "Output: " << mib(total.bytesWritten) << " MiB written in "
+        << ms(total.writeNs) << " ms, writer idle " << ms(total.writerIdleNs)
+        << " ms, workers blocked on the output window "
+        << ms(total.windowWaitNs) << " ms\n"
+        << "Threads:\n";
+    for (const auto &t : threads) {
+      out << "  " << t.name << ": ";
+      switch (t.role) {
+      case ThreadStats::Role::Walk:
+        out << t.directoriesListed << " directories, " << t.entriesSeen
+            << " entries, walk " << ms(t.walkNs) << " ms, gitignore "
+            << t.gitignoreChecks << " checks in " << ms(t.gitignoreNs)
+            << " ms";
+        break;
+      case ThreadStats::Role::Worker:
+        out << t.filesRead << " files, read " << ms(t.readNs)
+            << " ms, transform " << ms(t.transformNs) << " ms, blocked "
+            << ms(t.windowWaitNs) << " ms";
+        break;
+      case ThreadStats::Role::Writer:
+        out << "write " << ms(t.writeNs) << " ms, idle "
+            << ms(t.writerIdleNs) << " ms";
+        break;
       }
+      out << '\n';
+    }
+  }
+  out.flags(saved_flags);
+  out.precision(saved_precision);
+}
 
-      try {
-        auto dir_options = fs::directory_options::follow_directory_symlink |
-                           fs::directory_options::skip_permission_denied;
-        fs::recursive_directory_iterator dir_it(absDirPath, dir_options);
-        fs::recursive_directory_iterator end;
-        for (; dir_it != end && !should_stop; ++dir_it) {
-          try {
-            const auto &entry_path_abs = dir_it->path();
-
-            // Skip subdirectories if they match ignore rules
-            if (dir_it->is_directory() &&
-                check_and_skip_directory(entry_path_abs)) {
-              dir_it.disable_recursion_pending();
-              continue;
-            }
-
-            if (fs::is_regular_file(entry_path_abs)) {
-              std::string normEntryAbsPathStr = normalize_path(entry_path_abs);
-              if (collected_abs_paths_set.count(normEntryAbsPathStr))
-                continue; // Already added
-
-              unsigned long long file_size = 0;
-              std::error_code ec;
-              file_size = fs::file_size(entry_path_abs, ec);
-              if (ec) { /* ignore error, proceed with size 0 */
-                file_size = 0;
-              }
-
-              // Apply filters even within --only-last directories
-              if (is_file_extension_allowed(entry_path_abs,
-                                            config.fileExtensions,
-                                            config.excludedFileExtensions) &&
-                  !should_ignore_file(entry_path_abs, file_size,
-                                      config.disableGitignore, base_abs_path,
-                                      config.maxFileSizeB, config.ignoredFiles,
-                                      dir_gitignore_rules_map) &&
-                  !matches_regex_filters(entry_path_abs, config.regexFilters) &&
-                  matches_filename_regex_filters(entry_path_abs,
-                                                 config.filenameRegexFilters)) {
-                lastFilesList.push_back(entry_path_abs);
-                collected_abs_paths_set.insert(normEntryAbsPathStr);
-              }
-            }
-          } catch (const fs::filesystem_error &fs_err) {
-            std::cerr << "WARNING: Filesystem error iterating --only-last "
-                         "directory near "
-                      << normalize_path(dir_it->path()) << ": " << fs_err.what()
-                      << std::endl;
-            if (dir_it.depth() > 0 && dir_it->is_directory()) {
-              dir_it.disable_recursion_pending();
-            }
-          }
-        }
-      } catch (const std::exception &e) {
-        std::cerr << "WARNING: Error iterating --only-last directory "
-                  << normalize_path(lastDirEntry) << ": " << e.what() << '\n';
-      }
+// --- File Reading ---
+
+// Native path string (std::string, or std::wstring on Windows). File records
+// keep their absolute path in this form: an fs::path would also allocate its
+// list of components, once per file, for a path that is only ever opened.
+using NativePath = fs::path::string_type;
+
+// Files at least this large are memory-mapped by the auto I/O backend;
+// smaller ones are cheaper to read() than to map and unmap.
+constexpr unsigned long long kMmapThresholdB = 1024ULL * 1024ULL;
+
+// Decides from the first bytes of a file whether to skip it; true rejects
+constexpr size_t kSniffB = 8 * 1024; // Prefix length handed to a sniffer
+using ContentSniffer = bool (*)(std::string_view prefix);
+
+// Read-only contents of one file, either mapped into memory or read into an
+// owned buffer. Move-only; a mapping is released when the buffer goes away.
+// A mapped file that is truncated by another process while it is being read
+// faults, which is the usual trade-off of mmap.
+class FileBuffer {
+public:
+  FileBuffer() = default;
+  FileBuffer(const FileBuffer &) = delete;
+  FileBuffer &operator=(const FileBuffer &) = delete;
+  FileBuffer(FileBuffer &&other) noexcept { take(other); }
+  FileBuffer &operator=(FileBuffer &&other) noexcept {
+    if (this != &other) {
+      release();
+      take(other);
     }
-    return {{},
-            lastFilesList}; // Return empty normal files, populated last files
+    return *this;
   }
+  ~FileBuffer() { release(); }
 
-  // --- Normal processing (not --only-last) ---
-  try {
-    auto options = fs::directory_options::follow_directory_symlink |
-                   fs::directory_options::skip_permission_denied;
-
-    if (config.recursiveSearch) {
-      fs::recursive_directory_iterator it(base_abs_path, options);
-      fs::recursive_directory_iterator end;
-      for (; it != end && !should_stop; ++it) {
-        try {
-          const auto &entry_path_abs = it->path(); // Already absolute
-
-          // Skip directory if needed (before checking file properties)
-          if (it->is_directory() && check_and_skip_directory(entry_path_abs)) {
-            it.disable_recursion_pending();
-            continue;
-          }
+  std::string_view view() const {
+    return mapped ? std::string_view(static_cast<const char *>(mapped),
+                                     mapped_size)
+                  : std::string_view(owned);
+  }
+  bool is_mapped() const { return mapped != nullptr; }
+  // True if the last load() stopped because `reject` refused the prefix
+  bool was_rejected() const { return rejected; }
+
+  // Replaces the contents with those of `path`, read with `backend`. With a
+  // sniffer, the first kSniffB bytes are checked before the rest is read;
+  // a rejected file leaves the buffer empty.
+  std::error_code load(const NativePath::value_type *path, IoBackend backend,
+                       ContentSniffer reject = nullptr);
+  std::error_code load(const fs::path &path, IoBackend backend,
+                       ContentSniffer reject = nullptr) {
+    return load(path.c_str(), backend, reject);
+  }
 
-          // Explicitly skip .gitignore files
-          if (entry_path_abs.filename() == ".gitignore") {
-            continue;
-          }
-          if (fs::is_regular_file(entry_path_abs)) {
-            std::string normAbsPathStr = normalize_path(entry_path_abs);
-            if (collected_abs_paths_set.count(normAbsPathStr))
-              continue; // Already processed (e.g., as a 'last' file)
-
-            unsigned long long file_size = 0;
-            std::error_code ec_size;
-            file_size = fs::file_size(entry_path_abs, ec_size);
-            if (ec_size) {
-              // std::cerr << "WARNING: Cannot get file size for " <<
-              // normAbsPathStr << ": " << ec_size.message() << ". Skipping
-              // file.\n";
-              continue; // Skip file if size cannot be determined
-            }
+  // Replaces the contents with `contents`, read by someone else (see
+  // BatchReader), and applies `reject` like load() does. The strings are
+  // swapped, so `contents` keeps this buffer's old capacity for next time.
+  void adopt(std::string &contents, ContentSniffer reject = nullptr) {
+    release();
+    owned.swap(contents);
+    sniff_loaded(reject);
+  }
 
-            // Apply all filters
-            if (is_file_extension_allowed(entry_path_abs, config.fileExtensions,
-                                          config.excludedFileExtensions) &&
-                !should_ignore_file(entry_path_abs, file_size,
-                                    config.disableGitignore, base_abs_path,
-                                    config.maxFileSizeB, config.ignoredFiles,
-                                    dir_gitignore_rules_map) &&
-                !matches_regex_filters(entry_path_abs, config.regexFilters) &&
-                matches_filename_regex_filters(entry_path_abs,
-                                               config.filenameRegexFilters)) {
-              // Check if it's a 'last' file (using optimized check)
-              if (is_last_file(entry_path_abs, config)) {
-                lastFilesList.push_back(entry_path_abs);
-              } else {
-                normalFiles.push_back(entry_path_abs);
-              }
-              collected_abs_paths_set.insert(
-                  normAbsPathStr); // Mark as collected
-            }
-          }
-        } catch (const fs::filesystem_error &fs_err) {
-          std::cerr << "WARNING: Filesystem error during directory scan near "
-                    << normalize_path(it->path()) << ": " << fs_err.what()
-                    << std::endl;
-          if (it.depth() > 0 && it->is_directory()) {
-            it.disable_recursion_pending();
-          }
-        }
-      }
-    } else { // Non-recursive search
-      for (fs::directory_iterator it(base_abs_path, options), end;
-           it != end && !should_stop; ++it) {
-        try {
-          const auto &entry_path_abs = it->path();
+  // Moves a mapped file's contents into a new buffer, which then owns the
+  // mapping; this buffer stays empty with its read capacity intact
+  FileBuffer release_mapping() {
+    FileBuffer mapping;
+    mapping.mapped = mapped;
+    mapping.mapped_size = mapped_size;
+    mapped = nullptr;
+    mapped_size = 0;
+    return mapping;
+  }
 
-          // Skip ignored directories explicitly
-          if (fs::is_directory(entry_path_abs) &&
-              check_and_skip_directory(entry_path_abs)) {
-            continue;
-          }
+  // Empties the buffer for the next load(), unmapping a mapped file. The
+  // read buffer keeps its capacity unless one large file grew it.
+  void recycle() {
+    release();
+    if (owned.capacity() > kMaxRecycledReadB)
+      std::string().swap(owned);
+  }
 
-          if (fs::is_regular_file(entry_path_abs)) {
-            std::string normAbsPathStr = normalize_path(entry_path_abs);
-            if (collected_abs_paths_set.count(normAbsPathStr))
-              continue;
+private:
+  static constexpr size_t kMaxRecycledReadB = 4 * 1024 * 1024;
 
-            unsigned long long file_size = 0;
-            std::error_code ec_size;
-            file_size = fs::file_size(entry_path_abs, ec_size);
-            if (ec_size) {
-              // std::cerr << "WARNING: Cannot get file size for " <<
-              // normAbsPathStr << ": " << ec_size.message() << ". Skipping
-              // file.\n";
-              continue;
-            }
+  void take(FileBuffer &other) {
+    owned = std::move(other.owned);
+    mapped = other.mapped;
+    mapped_size = other.mapped_size;
+    rejected = other.rejected;
+    other.mapped = nullptr;
+    other.mapped_size = 0;
+  }
 
-            if (is_file_extension_allowed(entry_path_abs, config.fileExtensions,
-                                          config.excludedFileExtensions) &&
-                !should_ignore_file(entry_path_abs, file_size,
-                                    config.disableGitignore, base_abs_path,
-                                    config.maxFileSizeB, config.ignoredFiles,
-                                    dir_gitignore_rules_map) &&
-                !matches_regex_filters(entry_path_abs, config.regexFilters) &&
-                matches_filename_regex_filters(entry_path_abs,
-                                               config.filenameRegexFilters)) {
-              if (is_last_file(entry_path_abs, config)) {
-                lastFilesList.push_back(entry_path_abs);
-              } else {
-                normalFiles.push_back(entry_path_abs);
-              }
-              collected_abs_paths_set.insert(normAbsPathStr);
-            }
-          }
-        } catch (const fs::filesystem_error &fs_err) {
-          std::cerr
-              << "WARNING: Filesystem error during non-recursive scan near "
-              << normalize_path(it->path()) << ": " << fs_err.what()
-              << std::endl;
-          // Cannot disable recursion here, just continue
-        }
-      }
+  void release() {
+    if (mapped) {
+#ifdef _WIN32
+      UnmapViewOfFile(mapped);
+#else
+      ::munmap(mapped, mapped_size);
+#endif
+      mapped = nullptr;
+      mapped_size = 0;
     }
+    owned.clear();
+    rejected = false;
+  }
 
-  } catch (const fs::filesystem_error &e) {
-    std::cerr << "ERROR: Error scanning directory: "
-              << normalize_path(config.dirPath) << ": " << e.what() << '\n';
-  } catch (const std::exception &e) {
-    std::cerr << "ERROR: Unexpected error during file collection: " << e.what()
-              << '\n';
+  // Applies `reject` to the loaded contents, emptying the buffer if refused
+  void sniff_loaded(ContentSniffer reject) {
+    if (reject && reject(view().substr(0, kSniffB))) {
+      release();
+      rejected = true;
+    }
   }
 
-  // Sort normal files alphabetically by absolute path for consistent processing
-  // order
-  std::sort(normalFiles.begin(), normalFiles.end());
+  std::error_code load_stream(const fs::path &path);
 
-  return {normalFiles, lastFilesList};
-}
+  std::string owned;
+  void *mapped = nullptr;
+  size_t mapped_size = 0;
+  bool rejected = false;
+};
 
-// --- File Processing ---
+// Original ifstream path, kept for --io stream
+std::error_code FileBuffer::load_stream(const fs::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+  owned.assign(std::istreambuf_iterator<char>(file),
+               std::istreambuf_iterator<char>());
+  if (file.bad())
+    return std::make_error_code(std::errc::io_error);
+  return {};
+}
 
-// Modified to store index and use tuple (Improvement 1)
-void process_file_chunk(
-    std::span<const fs::path> file_paths_chunk_abs, // Absolute paths
-    size_t chunk_start_index,      // Starting index in the original sorted
-                                   // `normalFiles`
-    const Config &config,          // Pass config struct
-    const fs::path &base_abs_path, // Base directory for relative path calcs
-    std::vector<std::tuple<size_t, fs::path, std::string>>
-        &thread_local_results, // Thread-local buffer (tuple: index, abs_path,
-                               // content)
-    std::atomic<size_t> &processed_files_counter,
-    std::atomic<size_t> &total_bytes_counter,
-    std::atomic<bool> &should_stop_flag) {
-  thread_local_results.reserve(file_paths_chunk_abs.size()); // Pre-allocate
+#ifdef _WIN32
+std::error_code FileBuffer::load(const NativePath::value_type *path,
+                                 IoBackend backend, ContentSniffer reject) {
+  release();
+  if (backend == IoBackend::Stream) {
+    std::error_code ec = load_stream(path);
+    if (!ec)
+      sniff_loaded(reject);
+    return ec;
+  }
 
-  for (size_t i = 0; i < file_paths_chunk_abs.size(); ++i) {
-    if (should_stop_flag)
-      break;
+  auto last_error = [] {
+    return std::error_code(static_cast<int>(GetLastError()),
+                           std::system_category());
+  };
+  HANDLE file = CreateFileW(path, GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                FILE_SHARE_DELETE,
+                            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return last_error();
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size)) {
+    std::error_code ec = last_error();
+    CloseHandle(file);
+    return ec;
+  }
+  const auto size = static_cast<unsigned long long>(file_size.QuadPart);
+  if (size > std::numeric_limits<size_t>::max()) {
+    CloseHandle(file);
+    return std::make_error_code(std::errc::file_too_large);
+  }
 
-    const auto &absolute_path = file_paths_chunk_abs[i];
-    size_t original_index =
-        chunk_start_index + i; // Global index in sorted normalFiles
+  const bool want_map =
+      backend == IoBackend::Mmap ||
+      (backend == IoBackend::Auto && size >= kMmapThresholdB);
+  if (want_map && size > 0) { // Empty files cannot be mapped
+    HANDLE mapping =
+        CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping) {
+      void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping); // The view keeps the mapping alive
+      if (view) {
+        CloseHandle(file);
+        mapped = view;
+        mapped_size = static_cast<size_t>(size);
+        sniff_loaded(reject); // Touches only the first pages
+        return {};
+      }
+    }
+    // Mapping failed; read the file instead
+  }
 
-    try {
-      std::string file_content_output =
-          process_single_file(absolute_path, config, base_abs_path);
-
-      // Check if file processing actually yielded output (non-empty, not just
-      // header)
-      bool content_exists = !file_content_output.empty();
-      if (config.dryRun)
-        content_exists = true; // In dry run, always keep the "processed" entry
-
-      if (content_exists) {
-        // Add file size to total only if not dry run
-        if (!config.dryRun) {
-          std::error_code ec_size;
-          unsigned long long fsize = fs::file_size(absolute_path, ec_size);
-          if (!ec_size) {
-            total_bytes_counter += fsize;
-          }
-        }
-        // Store tuple: original index, absolute path, formatted content
-        thread_local_results.emplace_back(original_index, absolute_path,
-                                          std::move(file_content_output));
+  owned.resize(static_cast<size_t>(size));
+  size_t filled = 0;
+  // With a sniffer, read and check the prefix first
+  size_t sniff_at = reject ? std::min<size_t>(owned.size(), kSniffB) : 0;
+  while (filled < owned.size()) {
+    if (sniff_at && filled >= sniff_at) {
+      sniff_at = 0;
+      if (reject(std::string_view(owned.data(), filled))) {
+        CloseHandle(file);
+        owned.clear();
+        rejected = true;
+        return {};
       }
-      processed_files_counter++; // Increment even if content is empty but
-                                 // processing was attempted
-    } catch (const std::exception &e) {
-      // This error should be reported outside the thread or captured for later
-      // display For now, just increment counter
-      processed_files_counter++;
-      // Optionally: Store error message associated with the index?
-    } catch (...) {
-      processed_files_counter++;
-      // Optionally: Store generic error message?
     }
+    const size_t limit = sniff_at ? sniff_at : owned.size();
+    const DWORD chunk =
+        static_cast<DWORD>(std::min<size_t>(limit - filled, 1u << 30));
+    DWORD got = 0;
+    if (!ReadFile(file, owned.data() + filled, chunk, &got, nullptr)) {
+      std::error_code ec = last_error();
+      CloseHandle(file);
+      owned.clear();
+      return ec;
+    }
+    if (got == 0)
+      break; // File shrank since its size was taken
+    filled += got;
   }
+  owned.resize(filled);
+  CloseHandle(file);
+  if (sniff_at)
+    sniff_loaded(reject); // Smaller than the sniff window
+  return {};
 }
+#else
+std::error_code FileBuffer::load(const NativePath::value_type *path,
+                                 IoBackend backend, ContentSniffer reject) {
+  release();
+  if (backend == IoBackend::Stream) {
+    std::error_code ec = load_stream(path);
+    if (!ec)
+      sniff_loaded(reject);
+    return ec;
+  }
 
-// Uses stringstream buffering for output (Improvement 3)
-// Expects absolute paths in last_files_list
-// Returns the list of absolute paths sorted according to --last rules
-std::vector<fs::path>
-process_last_files(const std::vector<fs::path> &last_files_list_abs,
-                   const Config &config, std::atomic<bool> &should_stop,
-                   std::mutex &output_mutex, std::ostream &output_stream) {
-  if (last_files_list_abs.empty())
-    return {};
-
-  const fs::path base_abs_path = config.dirPath; // Base path is needed
-
-  // Helper to get the sorting position based on --last arguments order
-  // (Copied from process_directory for use here)
-  auto get_sort_position = [&](const fs::path &absPath) -> int {
-    fs::path relativePath;
-    try {
-      relativePath = fs::relative(absPath, base_abs_path);
-    } catch (...) {
-      return std::numeric_limits<int>::max();
-    } // Put at end if error
+  const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return {errno, std::generic_category()};
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    std::error_code ec(errno, std::generic_category());
+    ::close(fd);
+    return ec;
+  }
+  const auto size = static_cast<unsigned long long>(st.st_size);
+  if (size > std::numeric_limits<size_t>::max()) {
+    ::close(fd);
+    return std::make_error_code(std::errc::file_too_large);
+  }
 
-    std::string relPathStr = normalize_path(relativePath);
-    std::string filenameStr = normalize_path(absPath.filename());
+  const bool want_map =
+      backend == IoBackend::Mmap ||
+      (backend == IoBackend::Auto && size >= kMmapThresholdB);
+  if (want_map && size > 0) { // Empty files cannot be mapped
+    void *view = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+    if (view != MAP_FAILED) {
+      ::posix_madvise(view, static_cast<size_t>(size),
+                      POSIX_MADV_SEQUENTIAL);
+      ::close(fd); // The mapping stays valid after close
+      mapped = view;
+      mapped_size = static_cast<size_t>(size);
+      sniff_loaded(reject); // Touches only the first pages
+      return {};
+    }
+    // Mapping failed (e.g. special file system); read the file instead
+  }
 
-    // Check explicit file list first (--last file.txt)
-    for (size_t i = 0; i < config.lastFiles.size(); ++i) {
-      std::string configEntryStr = normalize_path(config.lastFiles[i]);
-      if (configEntryStr.find('/') != std::string::npos ||
-          config.lastFiles[i].has_parent_path()) { // Matches relative path
-        if (relPathStr == configEntryStr)
-          return config.lastDirs.size() + i;
-      } else { // Matches filename only
-        if (filenameStr == configEntryStr)
-          return config.lastDirs.size() + i;
+  // One read() for the size reported by fstat. Files that report size 0
+  // (e.g. under /proc) are read in chunks until EOF.
+  owned.resize(size > 0 ? static_cast<size_t>(size) : 64 * 1024);
+  size_t filled = 0;
+  // With a sniffer, the prefix is read and checked first, so a rejected
+  // file costs one small read
+  size_t sniff_at = reject ? std::min<size_t>(owned.size(), kSniffB) : 0;
+  while (true) {
+    if (sniff_at && filled >= sniff_at) {
+      sniff_at = 0;
+      if (reject(std::string_view(owned.data(), filled))) {
+        ::close(fd);
+        owned.clear();
+        rejected = true;
+        return {};
       }
     }
-
-    // Check explicit dir list (--last src/)
-    for (size_t i = 0; i < config.lastDirs.size(); ++i) {
-      std::string configDirRelStr = normalize_path(config.lastDirs[i]);
-      // Ensure trailing slash for prefix matching dirs
-      if (!configDirRelStr.empty() && configDirRelStr.back() != '/')
-        configDirRelStr += '/';
-
-      if (relPathStr.rfind(configDirRelStr, 0) == 0 ||
-          relPathStr == normalize_path(config.lastDirs[i])) {
-        return i; // Files within this dir get this group index
+    if (filled == owned.size()) {
+      if (size > 0)
+        break; // Read everything fstat reported
+      owned.resize(owned.size() * 2);
+    }
+    const size_t limit = sniff_at ? sniff_at : owned.size();
+    const ssize_t got = ::read(fd, owned.data() + filled, limit - filled);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      std::error_code ec(errno, std::generic_category());
+      ::close(fd);
+      owned.clear();
+      return ec;
+    }
+    if (got == 0)
+      break; // EOF (or the file shrank since fstat)
+    filled += static_cast<size_t>(got);
+  }
+  owned.resize(filled);
+  ::close(fd);
+  if (sniff_at)
+    sniff_loaded(reject); // Smaller than the sniff window
+  return {};
+}
+#endif
+
+// A file read from front to back in pieces, for files too large to hold at
+// once (see ContentStream). --io stream reads through std::ifstream, the
+// other backends with read() (ReadFile on Windows).
+class ChunkedFile {
+public:
+  ChunkedFile() = default;
+  ChunkedFile(const ChunkedFile &) = delete;
+  ChunkedFile &operator=(const ChunkedFile &) = delete;
+  ~ChunkedFile() { close(); }
+
+  std::error_code open(const NativePath::value_type *path, IoBackend backend) {
+    close();
+    if (backend == IoBackend::Stream) {
+      stream = std::make_unique<std::ifstream>(path, std::ios::binary);
+      if (!*stream) {
+        stream.reset();
+        return std::make_error_code(std::errc::no_such_file_or_directory);
       }
+      return {};
     }
-    // std::cerr << "WARNING: Could not determine sort position for last file: "
-    // << normalize_path(absPath) << std::endl;
-    return std::numeric_limits<int>::max(); // Should be found if collected
-                                            // correctly, put at end otherwise
-  };
-
-  std::vector<fs::path> sorted_last_files = last_files_list_abs;
-  std::sort(sorted_last_files.begin(), sorted_last_files.end(),
-            [&](const fs::path &a, const fs::path &b) {
-              int posA = get_sort_position(a);
-              int posB = get_sort_position(b);
-              if (posA != posB) {
-                return posA < posB; // Sort by --last group index
-              }
-              // If in the same group, sort alphabetically by absolute path
-              return normalize_path(a) < normalize_path(b);
-            });
-
-  // --- Improvement 3: Buffer output ---
-  std::stringstream last_files_buffer;
-  for (const auto &absolute_file_path : sorted_last_files) {
-    if (should_stop)
-      break;
+#ifdef _WIN32
+    handle = CreateFileW(path, GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE |
+                             FILE_SHARE_DELETE,
+                         nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                         nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+      return {static_cast<int>(GetLastError()), std::system_category()};
+#else
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return {errno, std::generic_category()};
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+    return {};
+  }
 
-    if (config.dryRun) {
-      // In dry run, list relative path, potentially with backticks
-      std::string relPathStr = "??"; // Default if relative fails
-      try {
-        relPathStr =
-            normalize_path(fs::relative(absolute_file_path, base_abs_path));
-      } catch (const std::exception &) {
-        relPathStr = normalize_path(absolute_file_path.filename()) +
-                     " (relative path failed)";
-      }
-      if (config.useBackticks) {
-        last_files_buffer << "`" << relPathStr << "`\n";
+  // Reads up to `size` bytes into `dest`, fewer only at the end of the
+  // file. Returns how many were read; 0 at the end.
+  size_t read(char *dest, size_t size, std::error_code &ec) {
+    size_t filled = 0;
+    while (filled < size) {
+      size_t got = 0;
+      if (stream) {
+        stream->read(dest + filled,
+                     static_cast<std::streamsize>(size - filled));
+        got = static_cast<size_t>(stream->gcount());
+        if (stream->bad()) {
+          ec = std::make_error_code(std::errc::io_error);
+          return filled;
+        }
       } else {
-        last_files_buffer << relPathStr << "\n";
-      }
-    } else {
-      // Process the file and append its formatted output
-      std::string file_output =
-          process_single_file(absolute_file_path, config, base_abs_path);
-      if (!file_output.empty()) {
-        last_files_buffer << file_output;
+#ifdef _WIN32
+        DWORD read_now = 0;
+        if (!ReadFile(handle, dest + filled,
+                      static_cast<DWORD>(std::min<size_t>(size - filled,
+                                                          1u << 30)),
+                      &read_now, nullptr)) {
+          ec = {static_cast<int>(GetLastError()), std::system_category()};
+          return filled;
+        }
+        got = read_now;
+#else
+        const ssize_t read_now = ::read(fd, dest + filled, size - filled);
+        if (read_now < 0) {
+          if (errno == EINTR)
+            continue;
+          ec = {errno, std::generic_category()};
+          return filled;
+        }
+        got = static_cast<size_t>(read_now);
+#endif
       }
+      if (got == 0)
+        break; // End of the file
+      filled += got;
     }
+    return filled;
   }
 
-  // Write buffered output with a single lock
-  if (last_files_buffer.tellp() > 0) { // Check if buffer has content
-    std::lock_guard<std::mutex> lock(output_mutex);
-    output_stream << last_files_buffer.str();
+  void close() {
+    stream.reset();
+#ifdef _WIN32
+    if (handle != INVALID_HANDLE_VALUE)
+      CloseHandle(handle);
+    handle = INVALID_HANDLE_VALUE;
+#else
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+#endif
   }
-  // --- End Improvement 3 ---
 
-  return sorted_last_files; // Return the sorted list
+private:
+  std::unique_ptr<std::ifstream> stream; // --io stream
+#ifdef _WIN32
+  HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+  int fd = -1;
+#endif
+};
+
+// --- Binary Detection ---
+// Files are sniffed from their first kSniffB bytes before the rest is read:
+// a NUL byte, a well-known binary signature, a UTF-16/UTF-32 byte order mark
+// or too many bytes that are neither text controls nor valid UTF-8 mark a
+// file as binary. Legacy 8-bit text (e.g. Latin-1) has few such bytes and
+// passes.
+
+// Percentage of suspicious bytes above which a prefix counts as binary
+constexpr size_t kMaxSuspiciousPercent = 10;
+
+bool has_binary_signature(std::string_view prefix) {
+  using namespace std::string_view_literals;
+  static constexpr std::string_view kSignatures[] = {
+      "\x89PNG\r\n\x1a\n"sv, "\xff\xd8\xff"sv,       // PNG, JPEG
+      "GIF87a"sv,           "GIF89a"sv,  "%PDF-"sv, // GIF, PDF
+      "PK\x03\x04"sv,       "PK\x05\x06"sv,         // Zip (jar, docx, ...)
+      "\x1f\x8b"sv,         "\xfd" "7zXZ\0"sv,      // gzip, xz
+      "\x28\xb5\x2f\xfd"sv, "7z\xbc\xaf\x27\x1c"sv, // zstd, 7-Zip
+      "Rar!\x1a\x07"sv,     "\x7f" "ELF"sv,         // RAR, ELF
+      "\xca\xfe\xba\xbe"sv,                         // Java class, Mach-O fat
+      "\xfe\xed\xfa\xce"sv, "\xfe\xed\xfa\xcf"sv,   // Mach-O
+      "\xce\xfa\xed\xfe"sv, "\xcf\xfa\xed\xfe"sv,   // Mach-O (little endian)
+      "!<arch>\n"sv,        "\0asm"sv,              // ar (.a, .deb), wasm
+      "SQLite format 3\0"sv,
+      "\xff\xfe"sv,         "\xfe\xff"sv, // UTF-16 (and UTF-32 LE) text
+  };
+  for (const auto signature : kSignatures) {
+    if (prefix.substr(0, signature.size()) == signature)
+      return true;
+  }
+  return false;
+}
+
+// Counts bytes that do not belong in UTF-8 text: control characters other
+// than the usual whitespace, and bytes of malformed UTF-8 sequences.
+// Returns SIZE_MAX on a NUL byte.
+size_t count_suspicious_bytes(std::string_view prefix) {
+  const auto *data = reinterpret_cast<const unsigned char *>(prefix.data());
+  const size_t size = prefix.size();
+  size_t suspicious = 0;
+  size_t i = 0;
+  while (i < size) {
+    // Printable ASCII fast path, eight bytes at a time
+    if (i + 8 <= size) {
+      uint64_t word;
+      std::memcpy(&word, data + i, sizeof(word));
+      constexpr uint64_t kOnes = 0x0101010101010101ULL;
+      constexpr uint64_t kHighBits = 0x8080808080808080ULL;
+      const uint64_t below_space = (word - kOnes * 0x20) & ~word & kHighBits;
+      if (((word & kHighBits) | below_space) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+    const unsigned char c = data[i];
+    if (c < 0x80) {
+      if (c == 0)
+        return std::numeric_limits<size_t>::max();
+      if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' &&
+          c != '\v' && c != '\b' && c != 0x1b)
+        ++suspicious;
+      ++i;
+      continue;
+    }
+    // Expected length of a multi-byte sequence from its lead byte
+    const size_t length = (c >= 0xc2 && c <= 0xdf)   ? 2
+                          : (c >= 0xe0 && c <= 0xef) ? 3
+                          : (c >= 0xf0 && c <= 0xf4) ? 4
+                                                     : 0;
+    if (length == 0) {
+      ++suspicious;
+      ++i;
+      continue;
+    }
+    if (i + length > size)
+      break; // Cut off by the end of the prefix
+    size_t k = 1;
+    while (k < length && (data[i + k] & 0xc0) == 0x80)
+      ++k;
+    if (k == length) {
+      i += length;
+    } else {
+      ++suspicious;
+      ++i;
+    }
+  }
+  return suspicious;
+}
+
+// ContentSniffer used unless --include-binary is given
+bool looks_binary(std::string_view prefix) {
+  if (has_binary_signature(prefix))
+    return true;
+  const size_t suspicious = count_suspicious_bytes(prefix);
+  return suspicious == std::numeric_limits<size_t>::max() ||
+         suspicious * 100 > prefix.size() * kMaxSuspiciousPercent;
+}
+
+// Files skipped by the binary prefilter, reported at the end of a run
+struct SkipCounters {
+  std::atomic<size_t> binaryFiles{0};
+  std::atomic<unsigned long long> binaryBytes{0};
+};
+
+// --- Persistent Cache (--cache-dir) ---
+// Two files per cache directory, both rebuilt at the end of every run so that
+// entries for deleted files and directories disappear:
+//   blocks-<id>.bin  formatted '## File:' blocks, keyed by normalized
+//                    relative path, size and mtime. <id> hashes the base
+//                    directory and
+//                    the flags that change a block (-c -l -L -b -f), so
+//                    different settings never share blocks.
+//   dirs-<id>.bin    directory listings keyed by directory mtime, used to
+//                    skip re-reading directories whose entries are unchanged.
+//                    <id> hashes the base directory, so the roots of a
+//                    --batch run sharing the cache keep their own listings.
+// Values are stored in native byte order; the cache is meant for the machine
+// that wrote it. A file or directory changed less than two seconds ago is not
+// cached, because a second change within the same mtime tick would be missed.
+
+// Size and modification time, enough to tell whether a file changed
+struct FileStamp {
+  unsigned long long size = 0;
+  long long mtime = 0; // file_time_type ticks
+  bool operator==(const FileStamp &other) const {
+    return size == other.size && mtime == other.mtime;
+  }
+};
+
+bool get_file_stamp(const fs::path &path, FileStamp &stamp) {
+  std::error_code ec;
+  stamp.size = fs::file_size(path, ec);
+  if (ec)
+    return false;
+  stamp.mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+  return !ec;
+}
+
+// True if `mtime` is far enough in the past to be trusted as a cache key
+bool is_mtime_settled(long long mtime) {
+  const auto now = fs::file_time_type::clock::now().time_since_epoch().count();
+  const auto margin = std::chrono::duration_cast<fs::file_time_type::duration>(
+                          std::chrono::seconds(2))
+                          .count();
+  return mtime < now - margin;
+}
+
+uint64_t fnv1a_64(std::string_view bytes) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : bytes) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Fixed-width fields of the cache files
+void cache_put_u64(std::string &buf, uint64_t value) {
+  char bytes[sizeof(value)];
+  std::memcpy(bytes, &value, sizeof(value));
+  buf.append(bytes, sizeof(value));
+}
+
+void cache_put_bytes(std::string &buf, std::string_view bytes) {
+  cache_put_u64(buf, bytes.size());
+  buf.append(bytes);
+}
+
+bool cache_get_u64(std::string_view &in, uint64_t &value) {
+  if (in.size() < sizeof(value))
+    return false;
+  std::memcpy(&value, in.data(), sizeof(value));
+  in.remove_prefix(sizeof(value));
+  return true;
+}
+
+bool cache_get_bytes(std::string_view &in, std::string_view &bytes) {
+  uint64_t length = 0;
+  if (!cache_get_u64(in, length) || length > in.size())
+    return false;
+  bytes = in.substr(0, static_cast<size_t>(length));
+  in.remove_prefix(static_cast<size_t>(length));
+  return true;
+}
+
+// Writes `contents` to `path` through a temporary file and a rename, so a
+// reader never sees a half-written cache
+bool write_file_atomically(const fs::path &path, std::string_view contents) {
+  fs::path temp_path = path;
+  temp_path += ".tmp";
+  {
+    std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+    if (!file.write(contents.data(),
+                    static_cast<std::streamsize>(contents.size())))
+      return false;
+  }
+  std::error_code ec;
+  fs::rename(temp_path, path, ec);
+  if (ec)
+    fs::remove(temp_path, ec);
+  return !ec;
+}
+
+// Names a cache file after a hash of what its contents depend on
+std::string cache_file_id(std::string_view signature) {
+  char id[17];
+  std::snprintf(id, sizeof(id), "%016llx",
+                static_cast<unsigned long long>(fnv1a_64(signature)));
+  return id;
+}
+
+// Formatted file blocks from the previous run, plus the ones produced by
+// this run. Lookups are lock-free once loaded; new blocks are streamed to a
+// temporary pack file so a cold run does not hold every block in memory.
+class BlockCache {
+public:
+  BlockCache(const fs::path &cache_dir, const fs::path &base_abs_path,
+             const Config &config) {
+    std::string signature = "dircat-blocks-1|" + normalize_path(base_abs_path);
+    signature += config.removeComments ? "|c" : "|-";
+    signature += config.removeEmptyLines ? "l" : "-";
+    signature += config.showLineNumbers ? "L" : "-";
+    signature += config.useBackticks ? "b" : "-";
+    signature += config.showFilenameOnly ? "f" : "-";
+    signature += config.includeBinary ? "B" : "-";
+    pack_path = cache_dir / ("blocks-" + cache_file_id(signature) + ".bin");
+    temp_path = pack_path;
+    temp_path += ".tmp";
+
+    load(signature);
+    pack_file.open(temp_path, std::ios::binary | std::ios::trunc);
+    if (!pack_file) {
+      std::cerr << "WARNING: Could not write block cache: "
+                << normalize_path(temp_path) << '\n';
+    } else {
+      std::string header;
+      cache_put_bytes(header, signature);
+      pack_file.write(header.data(),
+                      static_cast<std::streamsize>(header.size()));
+    }
+  }
+
+  BlockCache(const BlockCache &) = delete;
+  BlockCache &operator=(const BlockCache &) = delete;
+  ~BlockCache() { finish(); }
+
+  // Appends the cached block for `key` if the file is unchanged
+  bool append_cached(std::string &out, const std::string &key,
+                     const FileStamp &stamp) {
+    auto it = entries.find(key);
+    if (it == entries.end() || !(it->second.stamp == stamp))
+      return false;
+    out.append(it->second.block);
+    it->second.used.store(true, std::memory_order_relaxed);
+    hit_count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Records the freshly formatted block of a file
+  void store(const std::string &key, const FileStamp &stamp,
+             std::string_view block) {
+    if (!is_mtime_settled(stamp.mtime))
+      return;
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if (!pack_file || !written.insert(key).second)
+      return;
+    write_record(key, stamp, block);
+  }
+
+  size_t hits() const { return hit_count.load(std::memory_order_relaxed); }
+
+  // Carries over the blocks this run reused and replaces the old pack
+  void finish() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if (finished)
+      return;
+    finished = true;
+    if (pack_file) {
+      for (const auto &[key, entry] : entries) {
+        if (entry.used.load(std::memory_order_relaxed) && !written.count(key))
+          write_record(key, entry.stamp, entry.block);
+      }
+      pack_file.close();
+    }
+    const bool complete = !pack_file.fail();
+    entries.clear();
+    pack = FileBuffer(); // Unmap before replacing the file
+    std::error_code ec;
+    if (complete) {
+      fs::rename(temp_path, pack_path, ec);
+      if (ec)
+        std::cerr << "WARNING: Could not update block cache "
+                  << normalize_path(pack_path) << ": " << ec.message() << '\n';
+    }
+    if (!complete || ec)
+      fs::remove(temp_path, ec);
+  }
+
+private:
+  struct Entry {
+    FileStamp stamp;
+    std::string_view block; // Points into the mapped pack
+    std::atomic<bool> used{false};
+  };
+
+  void load(const std::string &signature) {
+    std::error_code exists_ec;
+    if (!fs::exists(pack_path, exists_ec))
+      return;
+    if (pack.load(pack_path, IoBackend::Auto)) {
+      std::cerr << "WARNING: Could not read block cache: "
+                << normalize_path(pack_path) << '\n';
+      return;
+    }
+    std::string_view in = pack.view();
+    std::string_view stored_signature;
+    if (!cache_get_bytes(in, stored_signature) ||
+        stored_signature != signature)
+      return; // Different format or settings; start over
+    while (!in.empty()) {
+      std::string_view key, block;
+      FileStamp stamp;
+      uint64_t size = 0, mtime = 0;
+      if (!cache_get_bytes(in, key) || !cache_get_u64(in, size) ||
+          !cache_get_u64(in, mtime) || !cache_get_bytes(in, block))
+        break; // Truncated; keep what was read completely
+      stamp.size = size;
+      stamp.mtime = static_cast<long long>(mtime);
+      Entry &entry = entries[std::string(key)];
+      entry.stamp = stamp;
+      entry.block = block;
+    }
+  }
+
+  void write_record(std::string_view key, const FileStamp &stamp,
+                    std::string_view block) {
+    std::string header;
+    cache_put_bytes(header, key);
+    cache_put_u64(header, stamp.size);
+    cache_put_u64(header, static_cast<uint64_t>(stamp.mtime));
+    cache_put_u64(header, block.size());
+    pack_file.write(header.data(), static_cast<std::streamsize>(header.size()));
+    pack_file.write(block.data(), static_cast<std::streamsize>(block.size()));
+  }
+
+  fs::path pack_path;
+  fs::path temp_path;
+  FileBuffer pack;
+  std::unordered_map<std::string, Entry> entries; // Read-only after load
+  std::atomic<size_t> hit_count{0};
+  std::mutex write_mutex;
+  std::ofstream pack_file;
+  std::unordered_set<std::string> written; // Keys stored by this run
+  bool finished = false;
+};
+
+// What a directory entry is, following symlinks like the walk does
+enum class EntryKind : unsigned char { Other = 0, File = 1, Directory = 2 };
+
+struct ListedEntry {
+  fs::path name; // Filename only
+  EntryKind kind = EntryKind::Other;
+  // Size and mtime (ns since the Unix epoch) of a file as seen by the
+  // directory scan; never cached, since they change without touching the
+  // directory
+  unsigned long long size = 0;
+  long long mtime = 0;
+  bool has_size = false;
+};
+
+// Directory listings keyed by the directory's mtime, which changes whenever
+// an entry is added, removed or renamed. File contents and sizes are not
+// part of a listing; they are still checked on every run.
+class DirectoryListingCache {
+public:
+  DirectoryListingCache(const fs::path &cache_dir,
+                        const fs::path &base_abs_path)
+      : file_path(cache_dir /
+                  ("dirs-" +
+                   cache_file_id("dircat-dirs-1|" +
+                                 normalize_path(base_abs_path)) +
+                   ".bin")) {
+    load();
+  }
+
+  // Copies the cached listing of `dir_key` if its mtime is unchanged
+  bool lookup(const std::string &dir_key, long long mtime,
+              std::vector<ListedEntry> &entries) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = listings.find(dir_key);
+    if (it == listings.end() || it->second.mtime != mtime)
+      return false;
+    it->second.used = true;
+    entries = it->second.entries;
+    for (auto &entry : entries)
+      entry.has_size = false;
+    return true;
+  }
+
+  void store(const std::string &dir_key, long long mtime,
+             const std::vector<ListedEntry> &entries) {
+    if (!is_mtime_settled(mtime))
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Listing &listing = listings[dir_key];
+    listing.mtime = mtime;
+    listing.entries = entries;
+    listing.used = true;
+  }
+
+  // Writes the listings used by this run (a partial, interrupted walk keeps
+  // the ones it did not reach as well)
+  void save(bool walk_complete) {
+    std::string contents;
+    cache_put_bytes(contents, kMagic);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &[key, listing] : listings) {
+      if (walk_complete && !listing.used)
+        continue; // Directory is gone or no longer walked
+      cache_put_bytes(contents, key);
+      cache_put_u64(contents, static_cast<uint64_t>(listing.mtime));
+      cache_put_u64(contents, listing.entries.size());
+      for (const auto &entry : listing.entries) {
+        contents += static_cast<char>(entry.kind);
+        const std::u8string name = entry.name.u8string();
+        cache_put_bytes(contents,
+                        std::string_view(
+                            reinterpret_cast<const char *>(name.data()),
+                            name.size()));
+      }
+    }
+    if (!write_file_atomically(file_path, contents)) {
+      std::cerr << "WARNING: Could not update directory cache: "
+                << normalize_path(file_path) << '\n';
+    }
+  }
+
+private:
+  static constexpr std::string_view kMagic = "dircat-dirs-1";
+
+  struct Listing {
+    long long mtime = 0;
+    std::vector<ListedEntry> entries;
+    bool used = false;
+  };
+
+  void load() {
+    std::error_code ec;
+    if (!fs::exists(file_path, ec))
+      return;
+    FileBuffer buffer;
+    if (buffer.load(file_path, IoBackend::Read))
+      return;
+    std::string_view in = buffer.view();
+    std::string_view magic;
+    if (!cache_get_bytes(in, magic) || magic != kMagic)
+      return;
+    while (!in.empty()) {
+      std::string_view key;
+      uint64_t mtime = 0, count = 0;
+      if (!cache_get_bytes(in, key) || !cache_get_u64(in, mtime) ||
+          !cache_get_u64(in, count) || count > in.size())
+        return;
+      Listing listing;
+      listing.mtime = static_cast<long long>(mtime);
+      listing.entries.reserve(static_cast<size_t>(count));
+      for (uint64_t i = 0; i < count; ++i) {
+        std::string_view name;
+        if (in.empty())
+          return;
+        const auto kind = static_cast<EntryKind>(in[0]);
+        in.remove_prefix(1);
+        if (!cache_get_bytes(in, name))
+          return;
+        listing.entries.push_back(
+            {fs::path(std::u8string(
+                 reinterpret_cast<const char8_t *>(name.data()), name.size())),
+             kind});
+      }
+      listings[std::string(key)] = std::move(listing);
+    }
+  }
+
+  fs::path file_path;
+  std::mutex mutex;
+  std::unordered_map<std::string, Listing> listings;
+};
+
+// --- Byte Scanning ---
+// Vectorized searches used by the content transforms. Each kernel returns the
+// offset of the first match in data[0, size), or `size` if there is none.
+// x86-64 always has SSE2; AVX2 is used when the CPU reports it (GCC/Clang
+// builds, chosen once at runtime). AArch64 uses NEON. Other targets use the
+// scalar loops.
+
+// First byte equal to `a`, `b` or `c` (pass a needle twice to search for two)
+size_t find_bytes_scalar(const char *data, size_t size, char a, char b,
+                         char c) {
+  for (size_t i = 0; i < size; ++i) {
+    const char ch = data[i];
+    if (ch == a || ch == b || ch == c)
+      return i;
+  }
+  return size;
+}
+
+// First byte that is neither ' ' nor '\t'
+size_t find_non_blank_scalar(const char *data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i] != ' ' && data[i] != '\t')
+      return i;
+  }
+  return size;
+}
+
+#if DIRCAT_SIMD_SSE2
+size_t find_bytes_sse2(const char *data, size_t size, char a, char b, char c) {
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  const __m128i vc = _mm_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    const __m128i eq = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+        _mm_cmpeq_epi8(chunk, vc));
+    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(eq));
+    if (mask)
+      return i + std::countr_zero(mask);
+  }
+  return i + find_bytes_scalar(data + i, size - i, a, b, c);
+}
+
+size_t find_non_blank_sse2(const char *data, size_t size) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    const __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                       _mm_cmpeq_epi8(chunk, tab));
+    const unsigned mask =
+        ~static_cast<unsigned>(_mm_movemask_epi8(blank)) & 0xFFFFu;
+    if (mask)
+      return i + std::countr_zero(mask);
+  }
+  return i + find_non_blank_scalar(data + i, size - i);
+}
+#endif
+
+#if DIRCAT_SIMD_AVX2
+__attribute__((target("avx2"))) size_t
+find_bytes_avx2(const char *data, size_t size, char a, char b, char c) {
+  const __m256i va = _mm256_set1_epi8(a);
+  const __m256i vb = _mm256_set1_epi8(b);
+  const __m256i vc = _mm256_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    const __m256i eq = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va),
+                        _mm256_cmpeq_epi8(chunk, vb)),
+        _mm256_cmpeq_epi8(chunk, vc));
+    const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(eq));
+    if (mask)
+      return i + std::countr_zero(mask);
+  }
+  return i + find_bytes_sse2(data + i, size - i, a, b, c);
+}
+
+__attribute__((target("avx2"))) size_t find_non_blank_avx2(const char *data,
+                                                           size_t size) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    const __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                          _mm256_cmpeq_epi8(chunk, tab));
+    const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(blank));
+    if (mask)
+      return i + std::countr_zero(mask);
+  }
+  return i + find_non_blank_sse2(data + i, size - i);
+}
+#endif
+
+#if DIRCAT_SIMD_NEON
+// NEON has no movemask; narrowing the comparison result by 4 bits per lane
+// gives a 64-bit mask with one nibble per byte.
+inline uint64_t neon_nibble_mask(uint8x16_t eq) {
+  return vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+size_t find_bytes_neon(const char *data, size_t size, char a, char b, char c) {
+  const uint8x16_t va = vdupq_n_u8(static_cast<uint8_t>(a));
+  const uint8x16_t vb = vdupq_n_u8(static_cast<uint8_t>(b));
+  const uint8x16_t vc = vdupq_n_u8(static_cast<uint8_t>(c));
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const uint8x16_t chunk =
+        vld1q_u8(reinterpret_cast<const uint8_t *>(data + i));
+    const uint8x16_t eq =
+        vorrq_u8(vorrq_u8(vceqq_u8(chunk, va), vceqq_u8(chunk, vb)),
+                 vceqq_u8(chunk, vc));
+    const uint64_t mask = neon_nibble_mask(eq);
+    if (mask)
+      return i + (std::countr_zero(mask) >> 2);
+  }
+  return i + find_bytes_scalar(data + i, size - i, a, b, c);
+}
+
+size_t find_non_blank_neon(const char *data, size_t size) {
+  const uint8x16_t space = vdupq_n_u8(' ');
+  const uint8x16_t tab = vdupq_n_u8('\t');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const uint8x16_t chunk =
+        vld1q_u8(reinterpret_cast<const uint8_t *>(data + i));
+    const uint8x16_t other =
+        vmvnq_u8(vorrq_u8(vceqq_u8(chunk, space), vceqq_u8(chunk, tab)));
+    const uint64_t mask = neon_nibble_mask(other);
+    if (mask)
+      return i + (std::countr_zero(mask) >> 2);
+  }
+  return i + find_non_blank_scalar(data + i, size - i);
+}
+#endif
+
+using FindBytesKernel = size_t (*)(const char *, size_t, char, char, char);
+using FindNonBlankKernel = size_t (*)(const char *, size_t);
+
+// Kernels chosen once for this CPU
+struct ScanKernels {
+  FindBytesKernel find_bytes = find_bytes_scalar;
+  FindNonBlankKernel find_non_blank = find_non_blank_scalar;
+  const char *name = "scalar";
+};
+
+const ScanKernels &scan_kernels() {
+  static const ScanKernels kernels = [] {
+    ScanKernels k;
+#if DIRCAT_SIMD_SSE2
+    k = {find_bytes_sse2, find_non_blank_sse2, "sse2"};
+#endif
+#if DIRCAT_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2"))
+      k = {find_bytes_avx2, find_non_blank_avx2, "avx2"};
+#endif
+#if DIRCAT_SIMD_NEON
+    k = {find_bytes_neon, find_non_blank_neon, "neon"};
+#endif
+    return k;
+  }();
+  return kernels;
+}
+
+// Position of the first of `a`, `b`, `c` in text at or after `pos`, or npos
+size_t find_first_of_bytes(std::string_view text, size_t pos, char a, char b,
+                           char c) {
+  if (pos >= text.size())
+    return std::string_view::npos;
+  const size_t offset =
+      scan_kernels().find_bytes(text.data() + pos, text.size() - pos, a, b, c);
+  return pos + offset == text.size() ? std::string_view::npos : pos + offset;
+}
+
+// True if the text contains only ' ' and '\t'
+bool is_blank_line(std::string_view line) {
+  if (line.empty())
+    return true;
+  if (line[0] != ' ' && line[0] != '\t')
+    return false; // Most lines start with code; skip the kernel call
+  return scan_kernels().find_non_blank(line.data(), line.size()) ==
+         line.size();
+}
+
+// --- File Records ---
+
+// Extension of a normalized filename, following fs::path::extension()
+// (".bashrc" has none), without the dot
+std::string_view filename_extension(std::string_view filename) {
+  const size_t dot = filename.rfind('.');
+  if (dot == std::string_view::npos || dot == 0 || filename == "..")
+    return {};
+  return filename.substr(dot + 1);
+}
+
+// A file's mtime as nanoseconds since the Unix epoch
+long long unix_time_ns(fs::file_time_type time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::file_clock::to_sys(time).time_since_epoch())
+      .count();
+}
+
+#ifndef _WIN32
+long long unix_time_ns(const struct stat &st) {
+#ifdef __APPLE__
+  return st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+#endif
+
+// Size and mtime (see unix_time_ns) of the file at `path`, following
+// symlinks, with one stat() where there is one
+bool stat_file(const fs::path &path, unsigned long long &size,
+               long long &mtime) {
+#ifdef _WIN32
+  std::error_code ec;
+  size = fs::file_size(path, ec);
+  if (ec)
+    return false;
+  const fs::file_time_type time = fs::last_write_time(path, ec);
+  mtime = ec ? 0 : unix_time_ns(time);
+  return true;
+#else
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    return false;
+  size = static_cast<unsigned long long>(st.st_size);
+  mtime = unix_time_ns(st);
+  return true;
+#endif
+}
+
+// A file selected by the walk, with everything the later stages need, so
+// that none of them has to stat the file or compute its relative path again.
+// The filename and extension are views into relativePath.
+struct FileRecord {
+  NativePath absolutePath;
+  std::string relativePath;    // Normalized, relative to the base
+  unsigned long long size = 0; // At discovery
+  long long mtime = 0;         // At discovery, see unix_time_ns (0 = unknown)
+
+  std::string_view filename() const {
+    const size_t slash = relativePath.rfind('/');
+    return slash == std::string::npos
+               ? std::string_view(relativePath)
+               : std::string_view(relativePath).substr(slash + 1);
+  }
+  // Without the dot, as spelled ("" if none)
+  std::string_view extension() const { return filename_extension(filename()); }
+};
+
+FileRecord make_file_record(NativePath absolute_path, std::string relative_path,
+                            unsigned long long size, long long mtime = 0) {
+  FileRecord record;
+  record.absolutePath = std::move(absolute_path);
+  record.relativePath = std::move(relative_path);
+  record.size = size;
+  record.mtime = mtime;
+  return record;
+}
+
+// Builds the record of a file known only by its path (single-file input,
+// explicit --only-last files): stats it and resolves it against the base
+FileRecord make_file_record(const fs::path &absolute_path,
+                            const fs::path &base_abs_path) {
+  fs::path relative_path;
+  try {
+    relative_path = fs::relative(absolute_path, base_abs_path);
+  } catch (const std::exception &) {
+    relative_path = absolute_path.filename(); // Fallback if relative fails
+  }
+  unsigned long long size = 0;
+  long long mtime = 0;
+  if (!stat_file(absolute_path, size, mtime))
+    size = mtime = 0;
+  return make_file_record(absolute_path.native(), normalize_path(relative_path),
+                          size, mtime);
+}
+
+// Orders native path strings the way fs::path compares them, component by
+// component: a separator sorts before every other character. Both strings
+// must be free of repeated separators.
+bool native_path_less(const NativePath &a, const NativePath &b) {
+  using Traits = NativePath::traits_type;
+  auto is_separator = [](NativePath::value_type c) {
+#ifdef _WIN32
+    return c == L'/' || c == L'\\';
+#else
+    return c == '/';
+#endif
+  };
+  const size_t common = std::min(a.size(), b.size());
+  for (size_t i = 0; i < common; ++i) {
+    const bool a_separator = is_separator(a[i]);
+    const bool b_separator = is_separator(b[i]);
+    if (a_separator || b_separator) {
+      if (a_separator != b_separator)
+        return a_separator;
+      continue;
+    }
+    if (!Traits::eq(a[i], b[i]))
+      return Traits::lt(a[i], b[i]);
+  }
+  return a.size() < b.size();
+}
+
+// Sorts records by absolute path (component-wise, as fs::path compares)
+void sort_by_path(std::vector<FileRecord> &records) {
+  std::sort(records.begin(), records.end(),
+            [](const FileRecord &a, const FileRecord &b) {
+              return native_path_less(a.absolutePath, b.absolutePath);
+            });
+}
+
+// Absolute paths of a record list, for callers that only need paths
+std::vector<fs::path> record_paths(const std::vector<FileRecord> &records) {
+  std::vector<fs::path> paths;
+  paths.reserve(records.size());
+  for (const auto &record : records)
+    paths.push_back(record.absolutePath);
+  return paths;
+}
+
+// --- Read-Ahead (--async-io) ---
+
+// With --async-io, a worker starts reading every file of the batch it
+// claimed before it formats the first one, so a cold tree keeps many reads
+// in flight instead of one per worker. On Linux the opens and reads of a
+// batch are submitted through io_uring; elsewhere, or where the kernel
+// refuses io_uring (old kernels, seccomp filters), a pool of reader threads
+// loads the files ahead of the workers.
+
+// Files a worker reads ahead at most; larger batches read the rest inline
+constexpr unsigned kReadAheadDepth = 32;
+// Reader threads per worker when io_uring is not used
+constexpr unsigned kReaderThreadsPerWorker = 4;
+
+// One file of a batch being read ahead
+struct ReadAheadSlot {
+  enum class State {
+    Pending, // Still being read
+    Ready,   // `buffer` and `error` hold the result
+    Inline,  // Not read ahead; the worker loads the file itself
+  };
+  State state = State::Inline;
+  FileBuffer buffer;
+  std::error_code error;
+  std::string data; // io_uring read target, swapped into `buffer`
+  int fd = -1;      // io_uring: descriptor open until the read completes
+  unsigned long long expected_size = 0; // io_uring: size seen by the walk
+};
+
+#ifdef DIRCAT_HAVE_IO_URING
+// A submission and completion queue pair over the raw io_uring system calls
+// (no liburing dependency), used by one thread.
+class IoUringQueue {
+public:
+  IoUringQueue() = default;
+  IoUringQueue(const IoUringQueue &) = delete;
+  IoUringQueue &operator=(const IoUringQueue &) = delete;
+  ~IoUringQueue() { close(); }
+
+  // Sets up a ring of `entries` submissions. Returns false if the kernel
+  // refuses, or predates IORING_OP_OPENAT and IORING_OP_READ (Linux 5.6;
+  // IORING_FEAT_FAST_POLL came with 5.7 and stands in for a probe).
+  bool open(unsigned entries) {
+    io_uring_params params{};
+    const long fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+      return false;
+    ring_fd = static_cast<int>(fd);
+    if (!(params.features & IORING_FEAT_FAST_POLL)) {
+      close();
+      return false;
+    }
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map)
+      sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+    auto map = [this](size_t size, off_t offset) -> void * {
+      void *area = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+      return area == MAP_FAILED ? nullptr : area;
+    };
+    sq_map = map(sq_map_size, IORING_OFF_SQ_RING);
+    cq_map = single_map ? sq_map : map(cq_map_size, IORING_OFF_CQ_RING);
+    sqes_map_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(map(sqes_map_size, IORING_OFF_SQES));
+    if (!sq_map || !cq_map || !sqes) {
+      close();
+      return false;
+    }
+
+    auto field = [](void *base, uint32_t offset) {
+      return reinterpret_cast<unsigned *>(static_cast<char *>(base) + offset);
+    };
+    sq_tail = field(sq_map, params.sq_off.tail);
+    sq_mask = *field(sq_map, params.sq_off.ring_mask);
+    sq_array = field(sq_map, params.sq_off.array);
+    cq_head = field(cq_map, params.cq_off.head);
+    cq_tail = field(cq_map, params.cq_off.tail);
+    cq_mask = *field(cq_map, params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cq_map) +
+                                            params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    local_tail = *sq_tail;
+    return true;
+  }
+
+  bool is_open() const { return ring_fd >= 0; }
+  unsigned capacity() const { return sq_entries; }
+
+  // Queues a zeroed submission; at most capacity() between two submit()s
+  io_uring_sqe &push(uint8_t opcode, uint64_t user_data) {
+    const unsigned index = local_tail & sq_mask;
+    io_uring_sqe &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.user_data = user_data;
+    sq_array[index] = index;
+    ++local_tail;
+    ++queued;
+    return sqe;
+  }
+
+  // Hands the queued submissions to the kernel, in order. Returns how many
+  // it took; the rest are withdrawn and never complete.
+  unsigned submit() {
+    std::atomic_ref<unsigned>(*sq_tail).store(local_tail,
+                                              std::memory_order_release);
+    unsigned taken = 0;
+    while (taken < queued) {
+      const long got = ::syscall(__NR_io_uring_enter, ring_fd, queued - taken,
+                                 0, 0, nullptr, 0);
+      if (got < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      taken += static_cast<unsigned>(got);
+    }
+    local_tail -= queued - taken;
+    std::atomic_ref<unsigned>(*sq_tail).store(local_tail,
+                                              std::memory_order_release);
+    queued = 0;
+    return taken;
+  }
+
+  // Waits for the next completion. Failing here means the ring itself is
+  // broken while requests may still write into their buffers, so it is fatal.
+  void wait(uint64_t &user_data, int &result) {
+    while (true) {
+      const unsigned head = *cq_head; // Only this thread moves the head
+      if (head !=
+          std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire)) {
+        const io_uring_cqe &cqe = cqes[head & cq_mask];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        std::atomic_ref<unsigned>(*cq_head).store(head + 1,
+                                                  std::memory_order_release);
+        return;
+      }
+      if (::syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+          errno != EINTR) {
+        std::cerr << "ERROR: io_uring wait failed: " << std::strerror(errno)
+                  << '\n';
+        std::abort();
+      }
+    }
+  }
+
+private:
+  void close() {
+    if (sqes)
+      ::munmap(sqes, sqes_map_size);
+    if (cq_map && cq_map != sq_map)
+      ::munmap(cq_map, cq_map_size);
+    if (sq_map)
+      ::munmap(sq_map, sq_map_size);
+    if (ring_fd >= 0)
+      ::close(ring_fd);
+    sqes = nullptr;
+    sq_map = cq_map = nullptr;
+    ring_fd = -1;
+  }
+
+  int ring_fd = -1;
+  void *sq_map = nullptr;
+  void *cq_map = nullptr;
+  size_t sq_map_size = 0, cq_map_size = 0, sqes_map_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  unsigned *sq_tail = nullptr, *sq_array = nullptr;
+  unsigned *cq_head = nullptr, *cq_tail = nullptr;
+  io_uring_cqe *cqes = nullptr;
+  unsigned sq_mask = 0, cq_mask = 0, sq_entries = 0;
+  unsigned local_tail = 0; // Tail including queued, unsubmitted entries
+  unsigned queued = 0;
+};
+#endif
+
+// Threads that load files for the workers' BatchReaders when io_uring is
+// not used. Shared by the workers of one run; the slots' states are guarded
+// by the pool's mutex.
+class ReaderPool {
+public:
+  ReaderPool(unsigned num_threads, IoBackend backend, ContentSniffer reject)
+      : backend(backend), reject(reject) {
+    threads.reserve(num_threads);
+    for (unsigned i = 0; i < num_threads; ++i)
+      threads.emplace_back([this] { run(); });
+  }
+  ReaderPool(const ReaderPool &) = delete;
+  ReaderPool &operator=(const ReaderPool &) = delete;
+  ~ReaderPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  // Queues the load of `record` into `slot`. `pending` counts the caller's
+  // loads that are queued or running.
+  void enqueue(ReadAheadSlot &slot, const FileRecord &record,
+               size_t &pending) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slot.state = ReadAheadSlot::State::Pending;
+      jobs.push_back({&slot, &record, &pending});
+      ++pending;
+    }
+    work_ready.notify_one();
+  }
+
+  // Waits until `slot` is no longer pending
+  void wait(const ReadAheadSlot &slot) {
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [&] {
+      return slot.state != ReadAheadSlot::State::Pending;
+    });
+  }
+
+  // Drops the caller's queued loads and waits for its running ones
+  void cancel(size_t &pending) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto it = jobs.begin(); it != jobs.end();) {
+      if (it->pending == &pending) {
+        it->slot->state = ReadAheadSlot::State::Inline;
+        --pending;
+        it = jobs.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    job_done.wait(lock, [&] { return pending == 0; });
+  }
+
+private:
+  struct Job {
+    ReadAheadSlot *slot;
+    const FileRecord *record;
+    size_t *pending;
+  };
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      work_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty())
+        return; // Stopping
+      const Job job = jobs.front();
+      jobs.pop_front();
+      lock.unlock();
+      std::error_code ec;
+      try {
+        ec = job.slot->buffer.load(job.record->absolutePath.c_str(), backend,
+                                   reject);
+      } catch (const std::exception &) {
+        ec = std::make_error_code(std::errc::not_enough_memory);
+      }
+      lock.lock();
+      job.slot->error = ec;
+      job.slot->state = ReadAheadSlot::State::Ready;
+      --*job.pending;
+      job_done.notify_all();
+    }
+  }
+
+  const IoBackend backend;
+  const ContentSniffer reject;
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable job_done;
+  std::deque<Job> jobs;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+};
+
+// Shared state of --async-io for one run: whether io_uring works here, or
+// the reader threads that stand in for it
+class ReadAheadEngine {
+public:
+  // `try_io_uring` = false always uses the reader threads (for tests)
+  ReadAheadEngine(const Config &config, unsigned num_workers,
+                  bool try_io_uring = true)
+      : backend(config.ioBackend),
+        reject(config.includeBinary ? nullptr : looks_binary) {
+#ifdef DIRCAT_HAVE_IO_URING
+    IoUringQueue probe;
+    if (try_io_uring && probe.open(kReadAheadDepth)) {
+      io_uring = true;
+      return;
+    }
+#else
+    (void)try_io_uring;
+#endif
+    const unsigned threads = std::clamp(
+        std::max(1u, num_workers) * kReaderThreadsPerWorker, 4u, 64u);
+    pool = std::make_unique<ReaderPool>(threads, backend, reject);
+  }
+
+  bool uses_io_uring() const { return io_uring; }
+  ReaderPool *reader_pool() const { return pool.get(); }
+
+  const IoBackend backend;
+  const ContentSniffer reject; // Applied to every file read ahead
+
+private:
+  bool io_uring = false;
+  std::unique_ptr<ReaderPool> pool;
+};
+
+// Per-worker side of --async-io: starts reading the files of a claimed
+// batch, then hands each one to the worker when it gets to it. A file the
+// reader does not take on (large files the worker maps, files that changed
+// size since the walk) is left to the worker's usual load.
+class BatchReader {
+public:
+  explicit BatchReader(ReadAheadEngine *engine) // Null: nothing is read ahead
+      : engine(engine) {
+#ifdef DIRCAT_HAVE_IO_URING
+    if (engine && engine->uses_io_uring())
+      ring.open(kReadAheadDepth); // Files are loaded inline if this fails
+#endif
+  }
+  BatchReader(const BatchReader &) = delete;
+  BatchReader &operator=(const BatchReader &) = delete;
+  ~BatchReader() { finish(); }
+
+  // Starts reading `batch`, replacing the previous one
+  void submit(std::span<const FileRecord> batch) {
+    if (!engine)
+      return;
+    finish();
+    batch_size = std::min<size_t>(batch.size(), kReadAheadDepth);
+    if (slots.size() < batch_size)
+      slots.resize(batch_size);
+    for (size_t i = 0; i < batch_size; ++i) {
+      slots[i].state = ReadAheadSlot::State::Inline;
+      slots[i].buffer.recycle();
+      slots[i].error.clear();
+    }
+#ifdef DIRCAT_HAVE_IO_URING
+    if (ring.is_open()) {
+      submit_to_ring(batch.first(batch_size));
+      return;
+    }
+#endif
+    if (ReaderPool *pool = engine->reader_pool())
+      for (size_t i = 0; i < batch_size; ++i)
+        pool->enqueue(slots[i], batch[i], pool_pending);
+  }
+
+  // Waits for file `index` of the batch. Returns false if it was not read
+  // ahead; otherwise points `buffer` at its contents and sets `error`.
+  bool take(size_t index, FileBuffer *&buffer, std::error_code &error) {
+    if (index >= batch_size)
+      return false;
+    ReadAheadSlot &slot = slots[index];
+#ifdef DIRCAT_HAVE_IO_URING
+    while (ring.is_open() && slot.state == ReadAheadSlot::State::Pending)
+      reap_one();
+#endif
+    if (ReaderPool *pool = engine->reader_pool())
+      pool->wait(slot);
+    if (slot.state != ReadAheadSlot::State::Ready)
+      return false;
+    buffer = &slot.buffer;
+    error = slot.error;
+    return true;
+  }
+
+private:
+  // Waits for (or cancels) everything still in flight
+  void finish() {
+    if (!engine)
+      return;
+#ifdef DIRCAT_HAVE_IO_URING
+    while (ring_in_flight > 0)
+      reap_one();
+#endif
+    if (ReaderPool *pool = engine->reader_pool())
+      pool->cancel(pool_pending);
+    batch_size = 0;
+  }
+
+#ifdef DIRCAT_HAVE_IO_URING
+  // Opens every file of the batch at once, then queues all the reads. The
+  // read of a file asks for one byte more than the walk saw, so a file that
+  // grew since is noticed and loaded inline instead of being cut short.
+  void submit_to_ring(std::span<const FileRecord> batch) {
+    size_t opens = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (batch[i].size == 0 || batch[i].size >= kMmapThresholdB)
+        continue; // Empty or /proc-like files, and files the worker maps
+      io_uring_sqe &sqe = ring.push(IORING_OP_OPENAT, i);
+      sqe.fd = AT_FDCWD;
+      sqe.addr = reinterpret_cast<uintptr_t>(batch[i].absolutePath.c_str());
+      sqe.open_flags = O_RDONLY | O_CLOEXEC;
+      ++opens;
+    }
+    if (opens == 0)
+      return;
+    opens = ring.submit();
+    for (size_t done = 0; done < opens; ++done) {
+      uint64_t index = 0;
+      int result = 0;
+      ring.wait(index, result);
+      ReadAheadSlot &slot = slots[index];
+      if (result < 0) {
+        slot.error = std::error_code(-result, std::generic_category());
+        slot.state = ReadAheadSlot::State::Ready; // Reported like load()
+      } else {
+        slot.fd = result;
+      }
+    }
+
+    reads.clear();
+    for (size_t i = 0; i < batch.size(); ++i) {
+      ReadAheadSlot &slot = slots[i];
+      if (slot.fd < 0)
+        continue;
+      slot.data.resize(static_cast<size_t>(batch[i].size) + 1);
+      io_uring_sqe &sqe = ring.push(IORING_OP_READ, i);
+      sqe.fd = slot.fd;
+      sqe.addr = reinterpret_cast<uintptr_t>(slot.data.data());
+      sqe.len = static_cast<uint32_t>(slot.data.size());
+      sqe.off = 0;
+      slot.state = ReadAheadSlot::State::Pending;
+      slot.expected_size = batch[i].size;
+      reads.push_back(i);
+    }
+    if (reads.empty())
+      return;
+    const unsigned taken = ring.submit();
+    ring_in_flight = taken;
+    for (size_t r = taken; r < reads.size(); ++r) { // Not submitted
+      ReadAheadSlot &slot = slots[reads[r]];
+      ::close(slot.fd);
+      slot.fd = -1;
+      slot.state = ReadAheadSlot::State::Inline;
+    }
+  }
+
+  // Completes one read of the ring
+  void reap_one() {
+    uint64_t index = 0;
+    int result = 0;
+    ring.wait(index, result);
+    --ring_in_flight;
+    ReadAheadSlot &slot = slots[index];
+    ::close(slot.fd);
+    slot.fd = -1;
+    if (result >= 0 &&
+        static_cast<unsigned long long>(result) == slot.expected_size) {
+      slot.data.resize(static_cast<size_t>(result));
+      slot.buffer.adopt(slot.data, engine->reject);
+      slot.state = ReadAheadSlot::State::Ready;
+    } else if (result < 0) {
+      slot.error = std::error_code(-result, std::generic_category());
+      slot.state = ReadAheadSlot::State::Ready;
+    } else {
+      slot.state = ReadAheadSlot::State::Inline; // Changed size since the walk
+    }
+  }
+
+  IoUringQueue ring;
+  size_t ring_in_flight = 0;
+  std::vector<size_t> reads; // Slots whose read was queued, in order
+#endif
+
+  ReadAheadEngine *engine;
+  std::vector<ReadAheadSlot> slots;
+  size_t batch_size = 0;
+  size_t pool_pending = 0; // Guarded by the pool's mutex
+};
+
+// --- File Content Processing ---
+
+// --- Content Transforms ---
+// -c, -l and -L run as one streaming pass: the comment stripper forwards the
+// bytes it keeps, as runs of the input, straight to the line stage, which
+// writes the final bytes into the output buffer. No intermediate copy of the
+// file is made. Input may arrive in chunks of any size; a byte whose meaning
+// depends on the next one is held back until that byte arrives.
+
+// Sink that appends bytes to a string unchanged
+struct StringSink {
+  std::string &out;
+  void write(std::string_view bytes) { out.append(bytes); }
+  void write(char c) { out += c; }
+};
+
+// Removes // and /* */ comments while keeping string and character literals.
+// Instead of visiting every byte, each state jumps straight to the next byte
+// that can change it (quotes and '/' in code, '\\' and the closing quote in
+// literals, '\n' in line comments, '*' in block comments).
+template <typename Sink> class CommentStripper {
+public:
+  explicit CommentStripper(Sink &sink) : sink(sink) {}
+
+  void feed(std::string_view chunk) {
+    const size_t size = chunk.size();
+    size_t i = 0;
+    if (pending && size > 0) {
+      pending = false;
+      i = resolve_pending(chunk[0]);
+    }
+
+    while (i < size) {
+      switch (state) {
+      case State::Code: {
+        // Copy everything up to the next quote or slash
+        const size_t stop = find_first_of_bytes(chunk, i, '"', '\'', '/');
+        if (stop == npos) {
+          sink.write(chunk.substr(i));
+          return;
+        }
+        const char c = chunk[stop];
+        if (c != '/') {
+          sink.write(chunk.substr(i, stop + 1 - i)); // Up to the quote
+          state = (c == '"') ? State::String : State::Char;
+          i = stop + 1;
+          break;
+        }
+        if (stop + 1 < size && chunk[stop + 1] != '/' &&
+            chunk[stop + 1] != '*') {
+          sink.write(chunk.substr(i, stop + 1 - i)); // A lone '/' is code
+          i = stop + 1;
+          break;
+        }
+        if (stop > i)
+          sink.write(chunk.substr(i, stop - i));
+        if (stop + 1 == size) {
+          pending = true; // '/' at the end of the chunk; wait for the next byte
+          return;
+        }
+        i = stop + 1 + enter_after_slash(chunk[stop + 1]);
+        break;
+      }
+      case State::String:
+      case State::Char: {
+        const char quote = (state == State::String) ? '"' : '\'';
+        const size_t stop = find_first_of_bytes(chunk, i, '\\', quote, quote);
+        if (stop == npos) {
+          sink.write(chunk.substr(i));
+          return;
+        }
+        if (chunk[stop] == quote) {
+          sink.write(chunk.substr(i, stop + 1 - i));
+          state = State::Code;
+          i = stop + 1;
+        } else if (stop + 1 == size) {
+          sink.write(chunk.substr(i)); // The escaped byte is in the next chunk
+          pending = true;
+          return;
+        } else {
+          sink.write(chunk.substr(i, stop + 2 - i)); // Escape pair
+          i = stop + 2;
+        }
+        break;
+      }
+      case State::LineComment: {
+        // Drop everything up to the newline, keep the newline
+        const size_t newline = chunk.find('\n', i);
+        if (newline == npos)
+          return;
+        sink.write('\n');
+        state = State::Code;
+        i = newline + 1;
+        break;
+      }
+      case State::BlockComment: {
+        // Look for a '*' that is followed by '/'
+        const size_t star = chunk.find('*', i);
+        if (star == npos)
+          return;
+        if (star + 1 == size) {
+          pending = true;
+          return;
+        }
+        if (chunk[star + 1] == '/') {
+          state = State::Code;
+          i = star + 2;
+        } else {
+          i = star + 1;
+        }
+        break;
+      }
+      }
+    }
+  }
+
+  // Ends the input. A '/' held back at the very end is kept; an unterminated
+  // comment or literal simply ends.
+  void finish() {
+    if (pending && state == State::Code)
+      sink.write('/');
+    pending = false;
+    state = State::Code;
+  }
+
+private:
+  enum class State { Code, String, Char, LineComment, BlockComment };
+  static constexpr size_t npos = std::string_view::npos;
+
+  // Handles the byte after a '/' in code; returns how many bytes it consumed
+  size_t enter_after_slash(char next) {
+    if (next == '/') {
+      state = State::LineComment;
+      return 1;
+    }
+    if (next == '*') {
+      state = State::BlockComment;
+      return 1;
+    }
+    sink.write('/'); // A lone '/'; `next` is processed normally
+    return 0;
+  }
+
+  // Completes the byte held back from the previous chunk given the first
+  // byte of this one; returns how many bytes of this chunk it consumed
+  size_t resolve_pending(char first) {
+    switch (state) {
+    case State::Code: // Held '/'
+      return enter_after_slash(first);
+    case State::String: // Held '\\' (already written); copy the escaped byte
+    case State::Char:
+      sink.write(first);
+      return 1;
+    case State::BlockComment: // Held '*'
+      if (first == '/') {
+        state = State::Code;
+        return 1;
+      }
+      return 0;
+    case State::LineComment:
+      break;
+    }
+    return 0;
+  }
+
+  Sink &sink;
+  State state = State::Code;
+  bool pending = false; // The last chunk ended in '/', '\\' or '*' (by state)
+};
+
+// Line stage for -l and -L. Drops one '\r' before each newline and at the
+// end, drops lines containing only ' ' and '\t' for -l, and numbers the
+// written lines for -L. A line's number is written as soon as the line
+// starts and cut off again if the line turns out to be blank, so lines are
+// never buffered separately. Every written line ends with '\n'.
+class LineFormatter {
+public:
+  LineFormatter(std::string &out, bool remove_empty_lines, bool line_numbers)
+      : out(out), remove_empty_lines(remove_empty_lines),
+        line_numbers(line_numbers) {}
+
+  void write(std::string_view bytes) {
+    size_t i = 0;
+    while (i < bytes.size()) {
+      if (!in_line)
+        begin_line();
+      const size_t newline = bytes.find('\n', i);
+      std::string_view segment = bytes.substr(
+          i, (newline == std::string_view::npos ? bytes.size() : newline) - i);
+      if (!segment.empty()) {
+        if (pending_cr) { // Not at the end of the line after all
+          out += '\r';
+          line_blank = false;
+          pending_cr = false;
+        }
+        if (segment.back() == '\r') { // Dropped if the line ends right here
+          pending_cr = true;
+          segment.remove_suffix(1);
+        }
+        if (remove_empty_lines && line_blank && !is_blank_line(segment))
+          line_blank = false;
+        out.append(segment);
+      }
+      if (newline == std::string_view::npos)
+        break;
+      end_line();
+      i = newline + 1;
+    }
+  }
+  void write(char c) { write(std::string_view(&c, 1)); }
+
+  // Ends the input; a final line without '\n' still gets one
+  void finish() {
+    if (in_line)
+      end_line();
+  }
+
+  // How many bytes at the front of `out` are final. A line that may still
+  // turn out blank (-l) stays in `out` until it ends.
+  size_t settled() const {
+    return remove_empty_lines && in_line && line_blank ? line_mark
+                                                       : out.size();
+  }
+
+  // Called after the first `n` settled bytes were taken out of `out`
+  void rebase(size_t n) { line_mark -= std::min(line_mark, n); }
+
+private:
+  void begin_line() {
+    in_line = true;
+    line_blank = true;
+    line_mark = out.size();
+    if (line_numbers) {
+      char digits[24];
+      auto result =
+          std::to_chars(digits, digits + sizeof(digits), next_line_number);
+      out.append(digits, result.ptr);
+      out += " | ";
+    }
+  }
+
+  void end_line() {
+    pending_cr = false;
+    in_line = false;
+    if (remove_empty_lines && line_blank) {
+      out.resize(line_mark); // Remove the line, including its number
+      return;
+    }
+    out += '\n';
+    ++next_line_number;
+  }
+
+  std::string &out;
+  const bool remove_empty_lines;
+  const bool line_numbers;
+  bool in_line = false;
+  bool line_blank = true;
+  bool pending_cr = false;
+  size_t line_mark = 0; // Where the current line starts in `out`
+  unsigned long long next_line_number = 1;
+};
+
+// The fused -c/-l/-L pipeline writing into `out`
+class ContentTransformer {
+public:
+  ContentTransformer(std::string &out, bool strip_comments,
+                     bool remove_empty_lines, bool line_numbers)
+      : lines(out, remove_empty_lines, line_numbers), comments(lines),
+        strip_comments(strip_comments) {}
+
+  void feed(std::string_view chunk) {
+    if (strip_comments)
+      comments.feed(chunk);
+    else
+      lines.write(chunk);
+  }
+
+  void finish() {
+    if (strip_comments)
+      comments.finish();
+    lines.finish();
+  }
+
+  // See LineFormatter::settled and rebase
+  size_t settled() const { return lines.settled(); }
+  void rebase(size_t n) { lines.rebase(n); }
+
+private:
+  LineFormatter lines;
+  CommentStripper<LineFormatter> comments;
+  const bool strip_comments;
+};
+
+// Returns the code with C++ comments removed (no line processing)
+std::string remove_cpp_comments(std::string_view code) {
+  std::string result;
+  result.reserve(code.length()); // Pre-allocate memory
+  StringSink sink{result};
+  CommentStripper<StringSink> stripper(sink);
+  stripper.feed(code);
+  stripper.finish();
+  return result;
+}
+
+// Appends the body of a file with no transform: whole runs of bytes are
+// copied at once, only a '\r' that ends a line is dropped, and a missing
+// final newline is added.
+void append_plain_content(std::string &out, std::string_view content) {
+  size_t run_start = 0;
+  size_t pos = content.find('\r');
+  while (pos != std::string_view::npos) {
+    if (pos + 1 == content.size() || content[pos + 1] == '\n') {
+      out.append(content.data() + run_start, pos - run_start);
+      run_start = pos + 1; // Skip the line-ending '\r'
+    }
+    pos = content.find('\r', pos + 1);
+  }
+  out.append(content.data() + run_start, content.size() - run_start);
+  if (!content.empty() && content.back() != '\n')
+    out += '\n'; // Every line ends with a newline, including the last
+}
+
+// Appends a file body, applying -l and -L (and -c if `strip_comments`)
+void append_file_content(std::string &out, std::string_view content,
+                         const Config &config, bool strip_comments) {
+  if (!strip_comments && !config.removeEmptyLines && !config.showLineNumbers) {
+    append_plain_content(out, content);
+    return;
+  }
+  ContentTransformer transformer(out, strip_comments, config.removeEmptyLines,
+                                 config.showLineNumbers);
+  transformer.feed(content);
+  transformer.finish();
+}
+
+// Appends the "## File:" line of a block and the blank line after it
+void append_file_title(std::string &out, const FileRecord &record,
+                       const Config &config) {
+  const std::string_view displayPath = config.showFilenameOnly
+                                           ? record.filename()
+                                           : record.relativePath;
+  out += "\n## File: ";
+  if (config.useBackticks) {
+    out += '`';
+    out += displayPath;
+    out += '`';
+  } else {
+    out += displayPath;
+  }
+  out += "\n\n";
+}
+
+// Appends the '## File:' header and the opening fence of a file block
+void append_file_header(std::string &out, const FileRecord &record,
+                        const Config &config) {
+  append_file_title(out, record, config);
+  out += "```";
+  out += record.extension();
+  out += '\n';
+}
+
+void append_file_header(std::string &out, const fs::path &absolute_path,
+                        const fs::path &base_abs_path, // Base directory path
+                        const Config &config) {
+  append_file_header(out, make_file_record(absolute_path, base_abs_path),
+                     config);
+}
+
+// Appends the formatted block of a file (header, fenced content) to `out`,
+// which lets workers format into a reused buffer. The content is used as
+// given (-c is applied by the caller); empty content produces an empty fence.
+void append_file_output(std::string &out, const fs::path &absolute_path,
+                        const fs::path &base_abs_path, // Base directory path
+                        std::string_view file_content, const Config &config) {
+  out.reserve(out.size() + file_content.size() + 64);
+  append_file_header(out, absolute_path, base_abs_path, config);
+  append_file_content(out, file_content, config, false);
+  out += "```\n";
+}
+
+// Returns the formatted block of a file; see append_file_output
+std::string
+format_file_output(const fs::path &absolute_path,
+                   const fs::path &base_abs_path, // Base directory path
+                   std::string_view file_content, const Config &config) {
+  std::string out;
+  append_file_output(out, absolute_path, base_abs_path, file_content, config);
+  return out;
+}
+
+// --- Large File Streaming ---
+// A file of kStreamThresholdB or more that has to be transformed (or that is
+// not mapped) is not formatted into one buffer. Its worker hands the writer
+// a block with just the header and a ContentStream, then reads, transforms
+// and queues the body in chunks, which the writer writes as its turn comes.
+// The worker waits while kStreamDepth chunks are queued, so a large file
+// costs a few MiB per worker however large it is.
+
+constexpr unsigned long long kStreamThresholdB = 32ULL * 1024 * 1024;
+constexpr size_t kStreamChunkB = 1024 * 1024;
+constexpr size_t kStreamDepth = 4; // Chunks queued for the writer
+
+class ContentStream {
+public:
+  // Streams a mapped file
+  explicit ContentStream(FileBuffer mapping) : mapping(std::move(mapping)) {}
+  // Streams an open file whose first chunk was already read
+  ContentStream(std::unique_ptr<ChunkedFile> file, std::string first_chunk,
+                const fs::path &path)
+      : file(std::move(file)), input(std::move(first_chunk)), path(path) {}
+
+  // Worker: transforms the body as configured and queues it, followed by
+  // the closing fence. Returns early on a stop or if the writer gave up.
+  void produce(const Config &config, const std::atomic<bool> &should_stop) {
+    struct Closer {
+      ContentStream &stream;
+      ~Closer() { stream.close(); } // Also when an exception escapes
+    } closer{*this};
+    std::string out; // Transformed, not yet queued
+    out.reserve(kStreamChunkB + kStreamChunkB / 4);
+    ContentTransformer transformer(out, config.removeComments,
+                                   config.removeEmptyLines,
+                                   config.showLineNumbers);
+    std::string_view chunk;
+    unsigned long long fed = 0; // Bytes of the contents transformed
+    while (!should_stop && next_input(chunk)) { // A chunk at a time
+      transformer.feed(chunk);
+      fed += chunk.size();
+      if (transformer.settled() >= kStreamChunkB &&
+          !push_settled(out, transformer, fed, should_stop))
+        return;
+    }
+    if (should_stop)
+      return;
+    transformer.finish();
+    out += "```\n";
+    if (push_settled(out, transformer, fed, should_stop)) {
+      std::lock_guard<std::mutex> lock(mutex);
+      complete = true;
+    }
+  }
+
+  // Writer: moves the next chunk into `chunk`, waiting for it. False once
+  // the body has ended, or on a stop.
+  bool pop(std::string &chunk, const std::atomic<bool> &should_stop) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (chunks.empty() && !closed) {
+      if (should_stop)
+        return false;
+      chunk_ready.wait_for(lock, kStopPollInterval);
+    }
+    if (chunks.empty()) {
+      delivered = complete;
+      return false;
+    }
+    chunk = std::move(chunks.front());
+    chunks.pop_front();
+    contents_delivered = chunk_contents.front();
+    chunk_contents.pop_front();
+    lock.unlock();
+    room_freed.notify_one();
+    return true;
+  }
+
+  // Writer: true once pop() has handed out the whole body, closing fence
+  // included
+  bool delivered_all() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return delivered;
+  }
+
+  // Writer: bytes of the file's contents that the chunks handed out so far
+  // were made from
+  unsigned long long contents_bytes_delivered() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return contents_delivered;
+  }
+
+  // Writer: drops the rest of the body; the worker stops producing it
+  void abandon() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      abandoned = true;
+      chunks.clear();
+      chunk_contents.clear();
+    }
+    room_freed.notify_all();
+  }
+
+private:
+  // The next piece of the file's contents; false at the end
+  bool next_input(std::string_view &chunk) {
+    if (mapping.is_mapped()) {
+      const std::string_view contents = mapping.view();
+      if (mapping_at == contents.size())
+        return false;
+      chunk = contents.substr(mapping_at, kStreamChunkB);
+      mapping_at += chunk.size();
+      return true;
+    }
+    if (first_pending) { // Read while the file was checked
+      first_pending = false;
+      chunk = input;
+      return !chunk.empty();
+    }
+    if (!file)
+      return false;
+    input.resize(kStreamChunkB);
+    ThreadStats *stats = thread_stats;
+    const uint64_t read_start = stats ? stats_now_ns() : 0;
+    std::error_code ec;
+    input.resize(file->read(input.data(), input.size(), ec));
+    if (stats) {
+      stats->readNs += stats_now_ns() - read_start;
+      stats->bytesRead += input.size();
+    }
+    if (ec) { // What was read is kept; the block still gets its fence
+      std::cerr << "ERROR: Could not read file: " << normalize_path(path)
+                << " (" << ec.message() << ")\n";
+      file.reset();
+    }
+    chunk = input;
+    return !chunk.empty();
+  }
+
+  // Queues the settled part of `out`, made from the first `fed` bytes of the
+  // contents, waiting for room
+  bool push_settled(std::string &out, ContentTransformer &transformer,
+                    unsigned long long fed,
+                    const std::atomic<bool> &should_stop) {
+    const size_t settled = transformer.settled();
+    std::string chunk;
+    if (settled == out.size()) {
+      chunk.swap(out); // The usual case: no copy
+      out.reserve(kStreamChunkB + kStreamChunkB / 4);
+    } else {
+      chunk.assign(out, 0, settled);
+      out.erase(0, settled);
+    }
+    transformer.rebase(settled);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (chunks.size() >= kStreamDepth && !abandoned) {
+      if (should_stop)
+        return false;
+      room_freed.wait_for(lock, kStopPollInterval);
+    }
+    if (abandoned)
+      return false;
+    chunks.push_back(std::move(chunk));
+    chunk_contents.push_back(fed);
+    lock.unlock();
+    chunk_ready.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    chunk_ready.notify_all();
+  }
+
+  FileBuffer mapping;    // Either the mapped file,
+  size_t mapping_at = 0; // and how far it was read,
+  std::unique_ptr<ChunkedFile> file; // or the file being read
+  std::string input;
+  bool first_pending = true;
+  fs::path path; // For error messages
+
+  std::mutex mutex;
+  std::condition_variable chunk_ready;
+  std::condition_variable room_freed;
+  std::deque<std::string> chunks;
+  std::deque<unsigned long long> chunk_contents; // `fed` of each chunk
+  unsigned long long contents_delivered = 0;     // Of the last chunk popped
+  bool closed = false;    // The worker is done
+  bool complete = false;  // ... and queued the fence
+  bool delivered = false; // The writer took every chunk of a complete body
+  bool abandoned = false; // The writer is done
+};
+
+// A formatted block on its way to the output. The contents of a mapped file
+// that need no transform are not copied into `text`: the mapping travels in
+// `body` and is written from where it is, spliced into `text` at `body_at`.
+struct OutputBlock {
+  std::string text;
+  FileBuffer body; // Empty unless the contents are written from the mapping
+  size_t body_at = 0;
+  unsigned long long tokens = 0; // --max-tokens: estimate, by the worker
+  // A large file's body, which follows `text` in chunks (see ContentStream)
+  std::shared_ptr<ContentStream> stream;
+  const FileRecord *record = nullptr; // For a BlockSink and --index
+  // --dedupe: the content's hash, if the file may have a copy
+  bool hashed = false;
+  uint64_t content_hash = 0;
+  unsigned long long content_size = 0;
+
+  bool empty() const { return text.empty(); }
+  size_t size() const { return text.size() + body.view().size(); }
+};
+
+// --- Deduplication (--dedupe) ---
+// Files with the same contents are written once: later copies get a short
+// block that names the first one. Only files whose size another file shares
+// are hashed, after they are read. The writer decides which copy comes
+// first, in output order, so the result does not depend on the threads.
+
+// XXH64 (seed 0) of data given in pieces. Lanes are read in the machine's
+// byte order, which matches the reference values on little-endian machines;
+// --dedupe only compares values within one run, --index between runs on the
+// same machine.
+class Xxh64 {
+public:
+  void update(std::string_view data) {
+    const char *p = data.data();
+    const char *const end = p + data.size();
+    total += data.size();
+    if (buffered > 0) { // Complete the stripe left over from the last piece
+      const size_t part = std::min<size_t>(kStripeB - buffered, end - p);
+      std::memcpy(stripe + buffered, p, part);
+      buffered += part;
+      p += part;
+      if (buffered < kStripeB)
+        return;
+      consume(stripe);
+      buffered = 0;
+    }
+    for (; end - p >= static_cast<ptrdiff_t>(kStripeB); p += kStripeB)
+      consume(p);
+    buffered = static_cast<size_t>(end - p);
+    std::memcpy(stripe, p, buffered);
+  }
+
+  uint64_t digest() const {
+    uint64_t hash;
+    if (total >= kStripeB) {
+      hash = std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) +
+             std::rotl(v[3], 18);
+      for (uint64_t lane : v)
+        hash = (hash ^ round(0, lane)) * kPrime1 + kPrime4;
+    } else {
+      hash = kPrime5;
+    }
+    hash += total;
+    const char *p = stripe;
+    const char *const end = stripe + buffered;
+    for (; end - p >= 8; p += 8)
+      hash = std::rotl(hash ^ round(0, read64(p)), 27) * kPrime1 + kPrime4;
+    if (end - p >= 4) {
+      uint32_t lane;
+      std::memcpy(&lane, p, sizeof(lane));
+      hash = std::rotl(hash ^ (lane * kPrime1), 23) * kPrime2 + kPrime3;
+      p += 4;
+    }
+    for (; p < end; ++p)
+      hash = std::rotl(hash ^ (static_cast<unsigned char>(*p) * kPrime5), 11) *
+             kPrime1;
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    return hash ^ (hash >> 32);
+  }
+
+private:
+  static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+  static constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+  static constexpr size_t kStripeB = 32;
+
+  static uint64_t read64(const char *p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    return std::rotl(acc + input * kPrime2, 31) * kPrime1;
+  }
+  void consume(const char *p) {
+    for (int lane = 0; lane < 4; ++lane)
+      v[lane] = round(v[lane], read64(p + 8 * lane));
+  }
+
+  uint64_t v[4] = {kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1};
+  char stripe[kStripeB];
+  size_t buffered = 0; // Bytes of `stripe` in use
+  uint64_t total = 0;
+};
+
+uint64_t content_hash(std::string_view data) {
+  Xxh64 hasher;
+  hasher.update(data);
+  return hasher.digest();
+}
+
+// Files smaller than this are repeated: their block is about as short as
+// a reference to another file
+constexpr unsigned long long kMinCopyB = 64;
+
+// Appends the block of a file whose contents are those of `first`
+void append_copy_reference(std::string &out, const FileRecord &record,
+                           const FileRecord &first, const Config &config) {
+  append_file_title(out, record, config);
+  out += "Same content as ";
+  out += config.useBackticks ? "`" + first.relativePath + "`"
+                             : first.relativePath;
+  out += ".\n";
+}
+
+// The copies of one run. Workers hash a file that may have a copy and
+// claim() its contents; a file with the contents of an earlier file is not
+// formatted. The writer then calls resolve() on every block in output order.
+class DuplicateIndex {
+public:
+  // `files` are in output order
+  DuplicateIndex(std::span<const FileRecord> files, const Config &config)
+      : files(files), config(config) {
+    std::unordered_map<unsigned long long, size_t> size_counts;
+    for (const auto &record : files)
+      if (record.size >= kMinCopyB)
+        ++size_counts[record.size];
+    for (const auto &[size, count] : size_counts)
+      if (count > 1)
+        shared_sizes.insert(size);
+  }
+
+  // Whether the file at `index` may have a copy, and should be hashed
+  bool may_have_copy(size_t index) const {
+    return shared_sizes.count(files[index].size) > 0;
+  }
+
+  // Records that the file at `index` holds the hashed contents of `block`.
+  // Returns the first index seen with them so far, possibly `index`.
+  size_t claim(size_t index, const OutputBlock &block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = claimed.try_emplace(key_of(block), index);
+    if (!inserted && index < it->second)
+      it->second = index;
+    return it->second;
+  }
+
+  // Replaces `block` (the file at `index`) by a reference if a file with the
+  // same contents was written before. Called in output order, by the writer.
+  void resolve(size_t index, OutputBlock &block) {
+    if (!block.hashed)
+      return;
+    auto [it, inserted] = written.try_emplace(key_of(block), index);
+    if (inserted)
+      return; // The first copy
+    if (block.stream) // Its worker stops streaming the body
+      block.stream->abandon();
+    block.stream.reset();
+    block.body = FileBuffer();
+    block.body_at = 0;
+    block.text.clear();
+    append_copy_reference(block.text, files[index], files[it->second],
+                          config);
+    ++copies;
+    copy_bytes += block.content_size;
+  }
+
+  size_t copies_written() const { return copies; }
+  unsigned long long copy_bytes_saved() const { return copy_bytes; }
+
+private:
+  struct Key {
+    uint64_t hash;
+    unsigned long long size;
+    bool operator==(const Key &) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return static_cast<size_t>(key.hash);
+    }
+  };
+  static Key key_of(const OutputBlock &block) {
+    return {block.content_hash, block.content_size};
+  }
+
+  const std::span<const FileRecord> files;
+  const Config &config;
+  std::unordered_set<unsigned long long> shared_sizes;
+  std::mutex mutex;
+  std::unordered_map<Key, size_t, KeyHash> claimed; // By the workers
+  std::unordered_map<Key, size_t, KeyHash> written; // By the writer
+  size_t copies = 0;
+  unsigned long long copy_bytes = 0;
+};
+
+// What a worker hands to process_file_record_into besides the file
+struct WorkerFileContext {
+  BatchReader *reader = nullptr; // --async-io: the batch being read ahead
+  size_t batch_index = 0;        // Position of the file in that batch
+  OutputBlock *block = nullptr;  // Takes a mapped body; `out` is its text
+  DuplicateIndex *copies = nullptr; // --dedupe; needs `block`
+  size_t index = 0;                 // Output index of the file
+  bool stream_large = false; // Large files may get a ContentStream in `block`
+};
+
+// Whether `record` is read in chunks (see ContentStream) rather than loaded:
+// a large file that is not mapped. --dedupe has to hash a file that may have
+// a copy before writing any of it, so such a file is still loaded whole.
+bool streams_unloaded(const FileRecord &record, const Config &config,
+                      const WorkerFileContext &worker) {
+  return worker.stream_large && worker.block &&
+         record.size >= kStreamThresholdB &&
+         !(worker.copies && worker.copies->may_have_copy(worker.index)) &&
+         (config.ioBackend == IoBackend::Read ||
+          config.ioBackend == IoBackend::Stream);
+}
+
+// Starts streaming `record` (see streams_unloaded): reads its first chunk,
+// checks it like FileBuffer::load would, and appends the header to `out`
+bool begin_file_stream(std::string &out, const FileRecord &record,
+                       const Config &config, SkipCounters *skips,
+                       const WorkerFileContext &worker) {
+  auto file = std::make_unique<ChunkedFile>();
+  ThreadStats *stats = thread_stats;
+  const uint64_t read_start = stats ? stats_now_ns() : 0;
+  std::error_code ec =
+      file->open(record.absolutePath.c_str(), config.ioBackend);
+  std::string first_chunk;
+  if (!ec) {
+    first_chunk.resize(kStreamChunkB);
+    first_chunk.resize(file->read(first_chunk.data(), first_chunk.size(), ec));
+  }
+  if (stats) {
+    const uint64_t read_ns = stats_now_ns() - read_start;
+    stats->readNs += read_ns;
+    stats->readLatency.add(read_ns);
+    ++stats->filesRead;
+    stats->bytesRead += first_chunk.size();
+  }
+  if (ec) {
+    std::cerr << "ERROR: Could not open file: "
+              << normalize_path(fs::path(record.absolutePath)) << " ("
+              << ec.message() << ")\n";
+    return false;
+  }
+  if (!config.includeBinary &&
+      looks_binary(std::string_view(first_chunk).substr(0, kSniffB))) {
+    if (skips) {
+      skips->binaryFiles.fetch_add(1, std::memory_order_relaxed);
+      skips->binaryBytes.fetch_add(record.size, std::memory_order_relaxed);
+    }
+    if (stats)
+      ++stats->filesBinary;
+    return false;
+  }
+  append_file_header(out, record, config);
+  worker.block->stream = std::make_shared<ContentStream>(
+      std::move(file), std::move(first_chunk), fs::path(record.absolutePath));
+  return true;
+}
+
+// Reads, transforms and formats one file, appending the result to `out`.
+// Returns false (leaving `out` unchanged) if the file could not be read.
+bool process_file_record_into(std::string &out, const FileRecord &record,
+                              const Config &config,
+                              SkipCounters *skips = nullptr,
+                              const WorkerFileContext &worker = {}) {
+  if (config.dryRun) {
+    // For dry run, we just need to format the header part (or just return the
+    // path) For consistency with process_directory dry run, let's just return
+    // the path info needed there. The formatting happens in process_directory.
+    // However, process_single_file_entry needs formatting. Let's keep the
+    // formatting here for now.
+    append_file_header(out, record, config);
+    out += "```\n";
+    return true;
+  }
+
+  if (streams_unloaded(record, config, worker))
+    return begin_file_stream(out, record, config, skips, worker);
+
+  // One read buffer per thread, so steady-state reads reuse its capacity
+  thread_local FileBuffer thread_buffer;
+  FileBuffer *loaded = &thread_buffer;
+  ThreadStats *stats = thread_stats;
+  const uint64_t read_start = stats ? stats_now_ns() : 0;
+  std::error_code ec;
+  if (!worker.reader || !worker.reader->take(worker.batch_index, loaded, ec))
+    ec = thread_buffer.load(record.absolutePath.c_str(), config.ioBackend,
+                            config.includeBinary ? nullptr : looks_binary);
+  FileBuffer &buffer = *loaded;
+  if (stats) { // With --async-io, the time spent waiting for the read
+    const uint64_t read_ns = stats_now_ns() - read_start;
+    stats->readNs += read_ns;
+    stats->readLatency.add(read_ns);
+    ++stats->filesRead;
+    stats->bytesRead += buffer.view().size();
+  }
+  if (ec) {
+    // Use cerr for errors
+    std::cerr << "ERROR: Could not open file: "
+              << normalize_path(fs::path(record.absolutePath)) << " ("
+              << ec.message() << ")\n";
+    return false;
+  }
+  if (buffer.was_rejected()) { // Binary; skipped before the full read
+    if (skips) {
+      skips->binaryFiles.fetch_add(1, std::memory_order_relaxed);
+      skips->binaryBytes.fetch_add(record.size, std::memory_order_relaxed);
+    }
+    if (stats)
+      ++stats->filesBinary;
+    return false;
+  }
+
+  // One pass from the file's bytes to the formatted block
+  const uint64_t transform_start = stats ? stats_now_ns() : 0;
+  const size_t block_start = out.size();
+  const std::string_view content = buffer.view();
+  if (worker.copies && worker.block &&
+      worker.copies->may_have_copy(worker.index)) {
+    worker.block->hashed = true;
+    worker.block->content_hash = content_hash(content);
+    worker.block->content_size = content.size();
+    const size_t first = worker.copies->claim(worker.index, *worker.block);
+    if (first != worker.index) {
+      // A copy of an earlier file; the writer names the actual first one
+      append_copy_reference(out, record, record, config);
+      buffer.recycle();
+      return true;
+    }
+  }
+  const bool plain = !config.removeComments && !config.removeEmptyLines &&
+                     !config.showLineNumbers;
+  if (worker.block && buffer.is_mapped() && plain &&
+      content.find('\r') == std::string_view::npos) {
+    // Written as is: the mapping goes to the writer instead of a copy
+    append_file_header(out, record, config);
+    worker.block->body_at = out.size();
+    if (!content.empty() && content.back() != '\n')
+      out += '\n';
+    out += "```\n";
+    worker.block->body = buffer.release_mapping();
+  } else if (worker.stream_large && worker.block && buffer.is_mapped() &&
+             content.size() >= kStreamThresholdB) {
+    // Transformed in chunks from the mapping, as the writer takes them
+    append_file_header(out, record, config);
+    worker.block->stream =
+        std::make_shared<ContentStream>(buffer.release_mapping());
+  } else {
+    out.reserve(out.size() + content.size() + 64);
+    append_file_header(out, record, config);
+    append_file_content(out, content, config, config.removeComments);
+    out += "```\n";
+  }
+  buffer.recycle(); // Unmaps a mapped file right away
+  if (stats) {
+    stats->transformNs += stats_now_ns() - transform_start;
+    ++stats->filesFormatted;
+    stats->bytesFormatted += out.size() - block_start +
+                             (worker.block ? worker.block->body.view().size()
+                                           : 0);
+  }
+  return true;
+}
+
+bool process_single_file_into(std::string &out,
+                              const fs::path &absolute_path, // Must be absolute
+                              const Config &config,
+                              const fs::path &base_abs_path, // Base directory
+                              SkipCounters *skips = nullptr) {
+  return process_file_record_into(
+      out, make_file_record(absolute_path, base_abs_path), config, skips);
+}
+
+// Returns the formatted block of a file, or an empty string on error
+std::string
+process_single_file(const fs::path &absolute_path, // Must be absolute
+                    const Config &config,          // Pass config
+                    const fs::path &base_abs_path  // Base directory
+) {
+  std::string out;
+  process_single_file_into(out, absolute_path, config, base_abs_path);
+  return out;
+}
+
+// Like process_file_record_into, but reuses the file's block from the cache
+// when its size and mtime are unchanged, and records freshly formatted blocks
+bool process_file_record_cached(std::string &out, const FileRecord &record,
+                                const Config &config,
+                                BlockCache *block_cache,
+                                SkipCounters *skips = nullptr,
+                                const WorkerFileContext &worker = {}) {
+  // A file that may have a copy is read, so that it can be hashed, and a
+  // streamed one is never held whole
+  if (!block_cache || config.dryRun ||
+      (worker.copies && worker.copies->may_have_copy(worker.index)) ||
+      (worker.stream_large && record.size >= kStreamThresholdB))
+    return process_file_record_into(out, record, config, skips, worker);
+  std::error_code ec;
+  FileStamp stamp; // The size is known from the walk; only the mtime is new
+  stamp.size = record.size;
+  stamp.mtime =
+      fs::last_write_time(record.absolutePath, ec).time_since_epoch().count();
+  if (ec)
+    return process_file_record_into(out, record, config, skips);
+
+  const std::string &key = record.relativePath; // The base is in the pack id
+  if (block_cache->append_cached(out, key, stamp))
+    return true;
+  const size_t block_start = out.size();
+  if (!process_file_record_into(out, record, config, skips))
+    return false;
+  block_cache->store(key, stamp, std::string_view(out).substr(block_start));
+  return true;
+}
+
+// --- File Collection ---
+
+// Checks a normalized relative path and filename against the --last sets
+bool is_last_relative_path(const std::string &relPathStr,
+                           const std::string &filenameStr,
+                           const Config &config) {
+  // Check relative path set
+  if (config.lastFilesSetRel.count(relPathStr)) {
+    return true;
+  }
+  // Check filename set
+  if (config.lastFilesSetFilename.count(filenameStr)) {
+    return true;
+  }
+
+  // Check if path is within any of the last directories
+  for (const auto &lastDirRelStr : config.lastDirsSetRel) {
+    // Check if relPathStr starts with lastDirRelStr + "/"
+    if (!lastDirRelStr.empty() && lastDirRelStr.back() != '/') {
+      if (relPathStr.size() > lastDirRelStr.size() &&
+          relPathStr[lastDirRelStr.size()] == '/' &&
+          relPathStr.compare(0, lastDirRelStr.size(), lastDirRelStr) == 0)
+        return true;
+    } else { // lastDirRelStr already ends with / or is empty
+      if (relPathStr.rfind(lastDirRelStr, 0) == 0)
+        return true;
+    }
+    // Or if relPathStr *is* the directory name (less likely for a file)
+    if (relPathStr == lastDirRelStr)
+      return true;
+  }
+
+  return false;
+}
+
+// Uses Config sets for faster lookup (Improvement 4)
+// Expects absolute path for absPath and config.dirPath
+bool is_last_file(const fs::path &absPath, const Config &config) {
+  if (!config.dirPath.is_absolute() || !absPath.is_absolute()) {
+    std::cerr << "WARNING: is_last_file called with non-absolute paths.\n";
+    return false;
+  }
+
+  fs::path relative_path;
+  try {
+    // Use lexically_relative if paths might be on different drives (Windows)
+    // relative() might throw if not hierarchically related.
+    relative_path = fs::relative(absPath, config.dirPath);
+  } catch (const std::exception &) {
+    return false; // Cannot be a last file if not relative to dirPath
+  }
+
+  return is_last_relative_path(normalize_path(relative_path),
+                               normalize_path(absPath.filename()), config);
+}
+
+// --- Directory Walk ---
+
+// Resolves --threads (0 = one per hardware thread), never more than the
+// number of work items
+unsigned int resolve_thread_count(const Config &config, size_t work_items) {
+  unsigned int num_threads = config.numThreads;
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  num_threads = std::max(1u, num_threads ? num_threads : 1u);
+  return static_cast<unsigned int>(std::max<size_t>(
+      1, std::min<size_t>(num_threads, work_items)));
+}
+
+// Gitignore rules in effect inside one directory: the rules inherited from
+// its parents followed by those of its own .gitignore, so later rules take
+// precedence, compiled once per directory that adds rules. Directories
+// without a .gitignore share their parent's scope.
+using GitignoreScope = std::shared_ptr<const GitignoreMatcher>;
+
+// Returns the scope for a directory being entered. Its .gitignore (if any) is
+// read once, here, instead of in a separate pre-scan of the tree.
+GitignoreScope enter_gitignore_scope(const GitignoreScope &parent_scope,
+                                     const fs::path &absolute_dir_path,
+                                     bool has_gitignore) {
+  if (!has_gitignore)
+    return parent_scope;
+  std::vector<std::string> own_rules =
+      read_gitignore_rules(absolute_dir_path / ".gitignore");
+  if (own_rules.empty())
+    return parent_scope;
+
+  std::vector<std::string> rules;
+  if (parent_scope) {
+    const auto &inherited = parent_scope->rules();
+    rules.reserve(inherited.size() + own_rules.size());
+    rules.insert(rules.end(), inherited.begin(), inherited.end());
+  }
+  rules.insert(rules.end(), std::make_move_iterator(own_rules.begin()),
+               std::make_move_iterator(own_rules.end()));
+  return std::make_shared<const GitignoreMatcher>(std::move(rules));
+}
+
+// Builds the scope of a directory below the base by entering every level
+// between them. Used when a walk starts below the base (--only-last dirs).
+GitignoreScope build_gitignore_scope(const fs::path &base_abs_path,
+                                     const fs::path &absolute_dir_path) {
+  GitignoreScope scope;
+  fs::path current = base_abs_path;
+  auto enter = [&](const fs::path &dir) {
+    std::error_code ec;
+    scope = enter_gitignore_scope(
+        scope, dir, fs::is_regular_file(dir / ".gitignore", ec));
+  };
+  enter(current);
+  for (const auto &component : absolute_dir_path.lexically_relative(
+           base_abs_path)) {
+    if (component.empty() || component == ".")
+      continue;
+    if (component == "..")
+      break; // Not below the base, only the base rules apply
+    current /= component;
+    enter(current);
+  }
+  return scope;
+}
+
+// Evaluates the gitignore rules of a scope, counted and timed for --stats
+bool is_ignored_in_scope(const GitignoreScope &scope,
+                         const std::string &relative_path) {
+  if (!scope)
+    return false;
+  ThreadStats *stats = thread_stats;
+  if (!stats)
+    return scope->is_ignored(relative_path);
+  const uint64_t start = stats_now_ns();
+  const bool ignored = scope->is_ignored(relative_path);
+  stats->gitignoreNs += stats_now_ns() - start;
+  ++stats->gitignoreChecks;
+  return ignored;
+}
+
+// Checks a folder found during the walk against .gitignore and -i rules
+bool is_walk_folder_ignored(const std::string &relative_path,
+                            const std::string &name,
+                            const GitignoreScope &scope, const Config &config,
+                            const CompiledFilters &filters) {
+  if (!config.disableGitignore) {
+    if (name == ".git")
+      return true; // Always skip the repository metadata directory
+    if (is_ignored_in_scope(scope, relative_path))
+      return true;
+  }
+  return filters.is_folder_ignored(relative_path);
+}
+
+// Applies every file filter to a file found during the walk
+bool is_walk_file_selected(const std::string &relative_path,
+                           const std::string &name,
+                           unsigned long long file_size,
+                           const GitignoreScope &scope, const Config &config,
+                           const CompiledFilters &filters) {
+  if (name == ".gitignore")
+    return false; // Explicitly skip .gitignore files
+  if (!filters.is_extension_selected(filename_extension(name)))
+    return false;
+  if (!config.disableGitignore &&
+      (name == ".git" || is_ignored_in_scope(scope, relative_path)))
+    return false;
+  if (!is_file_size_valid(file_size, config.maxFileSizeB))
+    return false;
+  if (filters.is_file_ignored(relative_path, name))
+    return false;
+  return filters.is_filename_selected(name);
+}
+
+// A directory waiting to be walked
+// A directory on the walk's current descent path. Reaching a directory that
+// is already on it means a symbolic link leads back up the tree, and walking
+// it again would never end.
+struct WalkAncestor {
+  unsigned long long device = 0;
+  unsigned long long inode = 0;
+  std::shared_ptr<const WalkAncestor> parent;
+};
+
+struct DirectoryTask {
+  fs::path absolute_path;
+  std::string relative_path; // Normalized, relative to the base ("" = base)
+  GitignoreScope parent_scope;
+  std::shared_ptr<const WalkAncestor> ancestors; // Null at a root
+};
+
+// Shared queue of directories for the parallel walk. Workers pop a directory,
+// list it, and push its subdirectories back. The walk is finished once the
+// queue is empty and no worker is still listing a directory.
+class DirectoryWalkQueue {
+public:
+  void push(DirectoryTask task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+      ++pending;
+    }
+    task_available.notify_one();
+  }
+
+  // Waits for the next directory. Returns false when the walk is finished or
+  // a stop was requested.
+  bool pop(DirectoryTask &task, const std::atomic<bool> &should_stop) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (tasks.empty()) {
+      if (pending == 0 || should_stop)
+        return false;
+      task_available.wait_for(lock, kStopPollInterval);
+    }
+    if (should_stop)
+      return false;
+    // LIFO keeps the walk roughly depth-first, bounding the queue size
+    task = std::move(tasks.back());
+    tasks.pop_back();
+    return true;
+  }
+
+  // Marks a popped directory as fully listed
+  void task_done() {
+    bool finished;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = (--pending == 0);
+    }
+    if (finished)
+      task_available.notify_all();
+  }
+
+private:
+  std::vector<DirectoryTask> tasks;
+  size_t pending = 0; // Queued plus in-progress directories
+  std::mutex mutex;
+  std::condition_variable task_available;
+};
+
+// Reads a directory's entries from the file system. Returns false (after
+// reporting the error) if the listing is incomplete. Directories that cannot
+// be opened for lack of permission list as empty.
+bool scan_directory(const fs::path &absolute_dir_path,
+                    std::vector<ListedEntry> &entries) {
+  auto report = [&](const std::error_code &ec) {
+    std::cerr << "WARNING: Filesystem error during directory scan near "
+              << normalize_path(absolute_dir_path) << ": " << ec.message()
+              << std::endl;
+    return false;
+  };
+#ifdef _WIN32
+  std::error_code ec;
+  fs::directory_iterator it(absolute_dir_path,
+                            fs::directory_options::skip_permission_denied, ec);
+  for (fs::directory_iterator end; !ec && it != end; it.increment(ec)) {
+    std::error_code type_ec;
+    ListedEntry entry{it->path().filename()};
+    if (it->is_directory(type_ec)) {
+      // Directory symlinks are not followed: there is no directory identity
+      // for the walk to notice a link back up the tree
+      if (!it->is_symlink(type_ec))
+        entry.kind = EntryKind::Directory;
+    } else if (it->is_regular_file(type_ec)) {
+      entry.kind = EntryKind::File;
+      std::error_code size_ec; // Cached by the scan
+      entry.size = it->file_size(size_ec);
+      entry.has_size = !size_ec;
+      const fs::file_time_type time = it->last_write_time(size_ec);
+      entry.mtime = size_ec ? 0 : unix_time_ns(time);
+    }
+    entries.push_back(std::move(entry));
+  }
+  return ec ? report(ec) : true;
+#else
+  // readdir() plus one fstatat() per entry that is not known to be a
+  // directory. Unlike fs::directory_iterator, no full path is built per
+  // entry; only the name is copied.
+  DIR *dir = ::opendir(absolute_dir_path.c_str());
+  if (!dir) {
+    if (errno == EACCES)
+      return true; // Like skip_permission_denied
+    return report({errno, std::generic_category()});
+  }
+  const int dir_fd = ::dirfd(dir);
+  errno = 0;
+  while (const dirent *ent = ::readdir(dir)) {
+    const char *name = ent->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue; // "." and ".."
+    }
+    ListedEntry entry{fs::path(name)};
+    bool known = false;
+#ifdef DT_DIR
+    if (ent->d_type == DT_DIR) {
+      entry.kind = EntryKind::Directory;
+      known = true;
+    }
+#endif
+    struct stat st;
+    if (!known && ::fstatat(dir_fd, name, &st, 0) == 0) { // Follows symlinks
+      if (S_ISDIR(st.st_mode)) {
+        entry.kind = EntryKind::Directory;
+      } else if (S_ISREG(st.st_mode)) {
+        entry.kind = EntryKind::File;
+        entry.size = static_cast<unsigned long long>(st.st_size);
+        entry.mtime = unix_time_ns(st);
+        entry.has_size = true;
+      }
+    }
+    entries.push_back(std::move(entry));
+    errno = 0;
+  }
+  const int read_error = errno;
+  ::closedir(dir);
+  return read_error ? report({read_error, std::generic_category()}) : true;
+#endif
+}
+
+// Gets the device and inode of a directory, following symlinks. Always false
+// on Windows, where scan_directory does not follow directory symlinks.
+bool directory_identity(const fs::path &absolute_dir_path,
+                        unsigned long long &device,
+                        unsigned long long &inode) {
+#ifdef _WIN32
+  (void)absolute_dir_path;
+  (void)device;
+  (void)inode;
+  return false;
+#else
+  struct stat st;
+  if (::stat(absolute_dir_path.c_str(), &st) != 0)
+    return false;
+  device = static_cast<unsigned long long>(st.st_dev);
+  inode = static_cast<unsigned long long>(st.st_ino);
+  return true;
+#endif
+}
+
+// Lists a directory's entries, from the listing cache when the directory's
+// mtime is unchanged. Read errors are reported and leave a partial listing.
+void list_directory(const fs::path &absolute_dir_path,
+                    DirectoryListingCache *listing_cache,
+                    std::vector<ListedEntry> &entries) {
+  std::string cache_key;
+  long long mtime = 0;
+  if (listing_cache) {
+    std::error_code ec;
+    mtime = fs::last_write_time(absolute_dir_path, ec)
+                .time_since_epoch()
+                .count();
+    if (ec) {
+      listing_cache = nullptr; // Cannot be keyed; list it directly
+    } else {
+      cache_key = normalize_path(absolute_dir_path);
+      if (listing_cache->lookup(cache_key, mtime, entries))
+        return;
+    }
+  }
+
+  if (!scan_directory(absolute_dir_path, entries))
+    return; // Do not cache a partial listing
+  if (listing_cache)
+    listing_cache->store(cache_key, mtime, entries);
+}
+
+// Per-thread state of a collection walk
+struct WalkContext {
+  const Config &config;
+  const CompiledFilters &filters;
+  DirectoryListingCache *listing_cache; // Null without --cache-dir
+  std::atomic<bool> &should_stop;
+  bool all_files_last; // --only-last: every selected file is a 'last' file
+  bool recurse;
+  std::vector<FileRecord> normalFiles;
+  std::vector<FileRecord> lastFilesList;
+  std::vector<fs::path> directories; // Every directory listed
+  std::vector<ListedEntry> entries;  // Scratch listing, reused per directory
+};
+
+// Walks one directory: reads its entries once, enters its .gitignore scope,
+// filters its files and queues its subdirectories.
+void walk_directory(WalkContext &ctx, const DirectoryTask &task,
+                    DirectoryWalkQueue &queue) {
+  StatSpan walk_span(&ThreadStats::walkNs);
+  std::shared_ptr<const WalkAncestor> ancestors = task.ancestors;
+  unsigned long long device = 0, inode = 0;
+  if (directory_identity(task.absolute_path, device, inode)) {
+    for (const WalkAncestor *a = ancestors.get(); a; a = a->parent.get()) {
+      if (a->device == device && a->inode == inode) {
+        std::cerr << "WARNING: Skipping a directory symlink loop: " +
+                         normalize_path(task.absolute_path) + '\n';
+        return;
+      }
+    }
+    ancestors = std::make_shared<const WalkAncestor>(
+        WalkAncestor{device, inode, std::move(ancestors)});
+  }
+  std::vector<ListedEntry> &entries = ctx.entries;
+  entries.clear();
+  list_directory(task.absolute_path, ctx.listing_cache, entries);
+  if (ThreadStats *stats = thread_stats) {
+    ++stats->directoriesListed;
+    stats->entriesSeen += entries.size();
+  }
+  ctx.directories.push_back(task.absolute_path);
+  const bool has_gitignore =
+      std::any_of(entries.begin(), entries.end(), [](const ListedEntry &e) {
+        return e.kind == EntryKind::File && e.name == ".gitignore";
+      });
+
+  const GitignoreScope scope =
+      ctx.config.disableGitignore
+          ? task.parent_scope
+          : enter_gitignore_scope(task.parent_scope, task.absolute_path,
+                                  has_gitignore);
+
+  // Absolute paths of the files are built as native strings from this
+  // prefix; only directories are turned into fs::path objects
+  NativePath dir_prefix = task.absolute_path.native();
+  if (!dir_prefix.empty() && dir_prefix.back() != fs::path::preferred_separator)
+    dir_prefix += fs::path::preferred_separator;
+
+  for (const auto &entry : entries) {
+    if (ctx.should_stop)
+      return;
+    // A directory entry is a single normal component already
+    const std::string name = entry.name.string();
+    std::string relative_path;
+    relative_path.reserve(task.relative_path.size() + 1 + name.size());
+    if (!task.relative_path.empty()) {
+      relative_path += task.relative_path;
+      relative_path += '/';
+    }
+    relative_path += name;
+
+    if (entry.kind == EntryKind::Directory) { // Follows directory symlinks
+      fs::path entry_path_abs = task.absolute_path / entry.name;
+      if (!ctx.config.cacheDir.empty() &&
+          entry_path_abs.lexically_normal() == ctx.config.cacheDir)
+        continue; // Never include our own cache files
+      if (ctx.recurse &&
+          !is_walk_folder_ignored(relative_path, name, scope, ctx.config,
+                                  ctx.filters)) {
+        queue.push(
+            {entry_path_abs, std::move(relative_path), scope, ancestors});
+      }
+      continue;
+    }
+    if (entry.kind != EntryKind::File)
+      continue;
+
+    unsigned long long file_size = entry.size;
+    long long mtime = entry.mtime;
+    if (!entry.has_size && // Listing came from the cache
+        !stat_file(task.absolute_path / entry.name, file_size, mtime))
+      continue; // Skip file if size cannot be determined
+
+    if (!is_walk_file_selected(relative_path, name, file_size, scope,
+                               ctx.config, ctx.filters))
+      continue;
+
+    const bool is_last = ctx.all_files_last ||
+                         is_last_relative_path(relative_path, name, ctx.config);
+    (is_last ? ctx.lastFilesList : ctx.normalFiles)
+        .push_back(make_file_record(dir_prefix + entry.name.native(),
+                                    std::move(relative_path), file_size,
+                                    mtime));
+  }
+}
+
+// Walks the given root directories with a pool of threads sharing one
+// directory queue, then merges the per-thread results.
+void run_directory_walk(const Config &config, std::atomic<bool> &should_stop,
+                        std::vector<DirectoryTask> roots, bool all_files_last,
+                        bool recurse, std::vector<FileRecord> &normalFiles,
+                        std::vector<FileRecord> &lastFilesList,
+                        DirectoryListingCache *listing_cache,
+                        std::vector<fs::path> *walked_dirs = nullptr) {
+  DirectoryWalkQueue queue;
+  for (auto &root : roots)
+    queue.push(std::move(root));
+
+  // A Config that did not come from parse_arguments has no compiled filters
+  // yet; compile them once for this walk
+  const std::shared_ptr<const CompiledFilters> filters =
+      config.compiledFilters ? config.compiledFilters
+                             : build_compiled_filters(config);
+
+  // Directory counts are unknown up front; size the pool like processing
+  const unsigned int num_threads = resolve_thread_count(
+      config, recurse ? std::numeric_limits<size_t>::max() : 1);
+  std::vector<WalkContext> contexts;
+  contexts.reserve(num_threads);
+  for (unsigned int i = 0; i < num_threads; ++i)
+    contexts.push_back({config, *filters, listing_cache, should_stop,
+                        all_files_last, recurse, {}, {}, {}, {}});
+
+  std::mutex error_mutex;
+  auto worker = [&](WalkContext &ctx) {
+    ThreadStatsScope stats_scope(config.stats.get(), ThreadStats::Role::Walk,
+                                 "walk",
+                                 static_cast<size_t>(&ctx - contexts.data()));
+    DirectoryTask task;
+    while (queue.pop(task, should_stop)) {
+      try {
+        walk_directory(ctx, task, queue);
+      } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        std::cerr << "ERROR: Unexpected error during file collection near "
+                  << normalize_path(task.absolute_path) << ": " << e.what()
+                  << '\n';
+      }
+      queue.task_done();
+    }
+  };
+
+  TaskGroup threads;
+  for (unsigned int i = 1; i < num_threads; ++i)
+    threads.start([&worker, &ctx = contexts[i]] { worker(ctx); });
+  worker(contexts[0]); // The calling thread walks too
+  threads.join();
+
+  for (auto &ctx : contexts) {
+    normalFiles.insert(normalFiles.end(),
+                       std::make_move_iterator(ctx.normalFiles.begin()),
+                       std::make_move_iterator(ctx.normalFiles.end()));
+    lastFilesList.insert(lastFilesList.end(),
+                         std::make_move_iterator(ctx.lastFilesList.begin()),
+                         std::make_move_iterator(ctx.lastFilesList.end()));
+    if (walked_dirs)
+      walked_dirs->insert(walked_dirs->end(),
+                          std::make_move_iterator(ctx.directories.begin()),
+                          std::make_move_iterator(ctx.directories.end()));
+  }
+}
+
+// Collects matching files with a single parallel walk of the tree. Each
+// directory's .gitignore is loaded when the walk enters that directory.
+// Returns the normal and the 'last' files, sorted by absolute path. With a
+// listing cache, directories whose mtime is unchanged are not read again.
+// `walked_dirs` receives every directory that was listed.
+std::pair<std::vector<FileRecord>, std::vector<FileRecord>>
+collect_file_records(const Config &config, std::atomic<bool> &should_stop,
+                     DirectoryListingCache *listing_cache = nullptr,
+                     std::vector<fs::path> *walked_dirs = nullptr) {
+  std::vector<FileRecord> normalFiles;
+  std::vector<FileRecord> lastFilesList;
+
+  if (!fs::is_directory(config.dirPath)) {
+    std::cerr << "ERROR: collect_files called with a non-directory path: "
+              << normalize_path(config.dirPath) << std::endl;
+    return {{}, {}};
+  }
+  const fs::path base_abs_path = config.dirPath; // Base is already absolute
+
+  // --- Handle --only-last separately ---
+  if (config.onlyLast) {
+    // Collect explicitly listed files
+    for (const auto &lastFileEntry : config.lastFiles) {
+      fs::path absPath =
+          base_abs_path / lastFileEntry; // Resolve relative to base
+      if (fs::exists(absPath) && fs::is_regular_file(absPath)) {
+        lastFilesList.push_back(make_file_record(absPath, base_abs_path));
+      } else {
+        std::cerr << "WARNING: --only-last specified file not found or not a "
+                     "regular file: "
+                  << normalize_path(lastFileEntry)
+                  << " (resolved to: " << normalize_path(absPath) << ")\n";
+      }
+    }
+
+    // Collect files from explicitly listed directories, applying filters
+    std::vector<DirectoryTask> roots;
+    for (const auto &lastDirEntry : config.lastDirs) {
+      fs::path absDirPath =
+          base_abs_path / lastDirEntry; // Resolve relative to base
+      if (!fs::exists(absDirPath) || !fs::is_directory(absDirPath)) {
+        std::cerr << "WARNING: --only-last specified directory not found or "
+                     "not a directory: "
+                  << normalize_path(lastDirEntry)
+                  << " (resolved to: " << normalize_path(absDirPath) << ")\n";
+        continue;
+      }
+      std::string relDirStr =
+          normalize_path(absDirPath.lexically_relative(base_abs_path));
+      while (!relDirStr.empty() && relDirStr.back() == '/')
+        relDirStr.pop_back();
+      if (relDirStr == ".")
+        relDirStr.clear();
+      GitignoreScope scope;
+      if (!config.disableGitignore)
+        scope = build_gitignore_scope(base_abs_path, absDirPath.parent_path());
+      roots.push_back({absDirPath, std::move(relDirStr), std::move(scope)});
+    }
+    // -Z directories are always searched recursively
+    run_directory_walk(config, should_stop, std::move(roots), true, true,
+                       normalFiles, lastFilesList, listing_cache, walked_dirs);
+
+    // Several -z entries can reach the same file; keep one occurrence (the
+    // final order is decided by sort_last_files)
+    sort_by_path(lastFilesList);
+    std::unordered_set<std::string> collected_abs_paths_set;
+    std::vector<FileRecord> uniqueLastFiles;
+    uniqueLastFiles.reserve(lastFilesList.size());
+    for (auto &record : lastFilesList) {
+      if (collected_abs_paths_set.insert(normalize_path(record.absolutePath))
+              .second)
+        uniqueLastFiles.push_back(std::move(record));
+    }
+    return {{},
+            uniqueLastFiles}; // Return empty normal files, populated last files
+  }
+
+  // --- Normal processing (not --only-last) ---
+  try {
+    run_directory_walk(config, should_stop, {{base_abs_path, "", nullptr}},
+                       false, config.recursiveSearch, normalFiles,
+                       lastFilesList, listing_cache, walked_dirs);
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: Unexpected error during file collection: " << e.what()
+              << '\n';
+  }
+
+  // Threads finish directories in any order; sort both lists so the result
+  // is deterministic (normal files alphabetically by absolute path)
+  sort_by_path(normalFiles);
+  sort_by_path(lastFilesList);
+
+  return {std::move(normalFiles), std::move(lastFilesList)};
+}
+
+// collect_file_records, returning only the ABSOLUTE paths
+std::pair<std::vector<fs::path>, std::vector<fs::path>>
+collect_files(const Config &config, std::atomic<bool> &should_stop,
+              DirectoryListingCache *listing_cache = nullptr,
+              std::vector<fs::path> *walked_dirs = nullptr) {
+  auto [normalFiles, lastFilesList] =
+      collect_file_records(config, should_stop, listing_cache, walked_dirs);
+  return {record_paths(normalFiles), record_paths(lastFilesList)};
+}
+
+// One line of the --summary list: the path relative to the base, wrapped in
+// backticks with -b
+std::string summary_entry(const FileRecord &record, const Config &config) {
+  return config.useBackticks ? "`" + record.relativePath + "`"
+                             : record.relativePath;
+}
+
+// --- Token Budget (--max-tokens) ---
+// With --max-tokens, files are decided in priority order: the -z files in
+// their --last order, then the other files from smallest to largest. A file
+// is taken if its formatted block fits in what is left of the budget, and
+// the blocks taken are written in the usual order at the end. A file that
+// cannot fit even by its size alone is never read, and the workers stop as
+// soon as no remaining file can fit.
+
+// Byte classes of the token estimate
+enum class TokenByteClass : unsigned char { Word, Space, Newline, Symbol };
+
+constexpr std::array<TokenByteClass, 256> make_token_byte_classes() {
+  std::array<TokenByteClass, 256> classes{};
+  for (int c = 0; c < 256; ++c) {
+    TokenByteClass cls = TokenByteClass::Symbol;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_' || c >= 0x80)
+      cls = TokenByteClass::Word; // Non-ASCII: UTF-8 text counts as words
+    else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v')
+      cls = TokenByteClass::Space;
+    else if (c == '\n')
+      cls = TokenByteClass::Newline;
+    classes[static_cast<size_t>(c)] = cls;
+  }
+  return classes;
+}
+constexpr std::array<TokenByteClass, 256> kTokenByteClasses =
+    make_token_byte_classes();
+
+// Estimates how many tokens an LLM tokenizer makes of `text`, from byte
+// classes alone: a run of letters, digits and non-ASCII bytes costs one token
+// per four bytes (rounded up), every other symbol one token, and a run of
+// line breaks one token. Spaces are free, since BPE vocabularies attach them
+// to the following word. Code and English text come out within about 20% of
+// common BPE tokenizers.
+unsigned long long estimate_tokens(std::string_view text) {
+  unsigned long long tokens = 0;
+  size_t word_length = 0;
+  bool in_line_breaks = false;
+  for (const char ch : text) {
+    const TokenByteClass cls =
+        kTokenByteClasses[static_cast<unsigned char>(ch)];
+    if (cls == TokenByteClass::Word) {
+      ++word_length;
+      in_line_breaks = false;
+      continue;
+    }
+    tokens += (word_length + 3) / 4;
+    word_length = 0;
+    if (cls == TokenByteClass::Newline) {
+      tokens += in_line_breaks ? 0 : 1;
+      in_line_breaks = true;
+    } else if (cls == TokenByteClass::Symbol) {
+      ++tokens;
+      in_line_breaks = false;
+    }
+  }
+  return tokens + (word_length + 3) / 4;
+}
+
+// Bytes per token assumed when a file is judged by its size before it is
+// read. Generous, so that a file is only left unread when it cannot fit.
+constexpr unsigned long long kMaxBytesPerToken = 6;
+
+// Decides, in priority order, which files the budget takes. Workers ask
+// may_fit() before reading a file; the consuming thread calls take() for
+// each formatted block in rank order. Since the budget only shrinks, a file
+// skipped unread would also have been refused at its turn, so the files
+// taken do not depend on the thread count.
+class TokenBudget {
+public:
+  // `files` are in priority order (see prioritize_for_budget); `fixed_tokens`
+  // are spent on output outside the file blocks (the title, and the heading
+  // of the -s summary). With -s, a file also costs its line of the summary.
+  TokenBudget(unsigned long long max_tokens,
+              std::span<const FileRecord> files, const Config &config,
+              unsigned long long fixed_tokens = 0)
+      : remaining(max_tokens - std::min(max_tokens, fixed_tokens)),
+        min_tokens(files.size()), summary_tokens(files.size(), 0),
+        min_tokens_after(files.size() + 1,
+                         std::numeric_limits<unsigned long long>::max()),
+        used(fixed_tokens) {
+    std::string header;
+    for (size_t rank = 0; rank < files.size(); ++rank) {
+      header.clear();
+      append_file_header(header, files[rank], config);
+      header += "```\n";
+      if (config.showSummary)
+        summary_tokens[rank] =
+            estimate_tokens(summary_entry(files[rank], config) + "\n");
+      min_tokens[rank] = estimate_tokens(header) +
+                         files[rank].size / kMaxBytesPerToken +
+                         summary_tokens[rank];
+    }
+    for (size_t rank = files.size(); rank-- > 0;)
+      min_tokens_after[rank] =
+          std::min(min_tokens_after[rank + 1], min_tokens[rank]);
+  }
+
+  // Whether the file at `rank` may still fit; false means it is not read
+  bool may_fit(size_t rank) const {
+    return min_tokens[rank] <= remaining.load(std::memory_order_relaxed);
+  }
+
+  // Takes the file at `rank`, whose block costs `tokens`, if it fits.
+  // Called by one thread, in increasing rank order.
+  bool take(size_t rank, unsigned long long tokens) {
+    tokens += summary_tokens[rank];
+    const unsigned long long left = remaining.load(std::memory_order_relaxed);
+    if (min_tokens[rank] > left || tokens > left)
+      return false;
+    remaining.store(left - tokens, std::memory_order_relaxed);
+    used += tokens;
+    ++taken;
+    return true;
+  }
+
+  // Whether no file after `rank` can fit any more
+  bool full_after(size_t rank) const {
+    return min_tokens_after[rank + 1] >
+           remaining.load(std::memory_order_relaxed);
+  }
+
+  unsigned long long used_tokens() const { return used; }
+  size_t taken_files() const { return taken; }
+
+private:
+  std::atomic<unsigned long long> remaining;
+  std::vector<unsigned long long> min_tokens; // Per rank, before reading
+  std::vector<unsigned long long> summary_tokens; // Per rank, with -s
+  std::vector<unsigned long long> min_tokens_after; // Suffix minimum
+  unsigned long long used = 0;
+  size_t taken = 0;
+};
+
+// Ranks files for --max-tokens: the last files (already in --last order,
+// from first_last_file on) first, then the normal files by size, smallest
+// first, then by output order. Returns the output indices in rank order.
+std::vector<size_t> prioritize_for_budget(std::span<const FileRecord> files,
+                                          size_t first_last_file) {
+  std::vector<size_t> order(files.size());
+  for (size_t i = first_last_file; i < files.size(); ++i)
+    order[i - first_last_file] = i;
+  const size_t last_count = files.size() - first_last_file;
+  for (size_t i = 0; i < first_last_file; ++i)
+    order[last_count + i] = i;
+  std::stable_sort(order.begin() + static_cast<std::ptrdiff_t>(last_count),
+                   order.end(), [&](size_t a, size_t b) {
+                     return files[a].size < files[b].size;
+                   });
+  return order;
+}
+
+// --- File Processing ---
+
+// --- Compression (--compress) ---
+// The bundle is cut into chunks of kCompressChunkB, and each chunk becomes a
+// complete gzip member or zstd frame of its own. Decompressors read
+// concatenated members (frames) as one stream, so the chunks can be
+// compressed on several threads and written in order.
+
+constexpr size_t kCompressChunkB = 1024 * 1024;
+constexpr int kZstdLevel = 3; // zstd's own default
+
+// Whether this build can write `method`
+bool compression_available(Compression method) {
+  switch (method) {
+  case Compression::None:
+    return true;
+  case Compression::Gzip:
+#ifdef DIRCAT_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+  case Compression::Zstd:
+#ifdef DIRCAT_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+const char *compression_name(Compression method) {
+  switch (method) {
+  case Compression::Gzip:
+    return "gzip";
+  case Compression::Zstd:
+    return "zstd";
+  default:
+    return "none";
+  }
+}
+
+#ifdef DIRCAT_HAVE_ZLIB
+// zlib's return codes (Z_STREAM_ERROR, Z_MEM_ERROR, ...) as error codes
+class ZlibErrorCategory : public std::error_category {
+public:
+  const char *name() const noexcept override { return "zlib"; }
+  std::string message(int code) const override {
+    return std::string("zlib: ") + zError(code);
+  }
+};
+
+const std::error_category &zlib_category() {
+  static const ZlibErrorCategory category;
+  return category;
+}
+#endif
+
+#ifdef DIRCAT_HAVE_ZSTD
+// zstd's error codes, as ZSTD_getErrorCode() numbers them; a failed call's
+// result is the negated code
+class ZstdErrorCategory : public std::error_category {
+public:
+  const char *name() const noexcept override { return "zstd"; }
+  std::string message(int code) const override {
+    return std::string("zstd: ") +
+           ZSTD_getErrorName(size_t{0} - static_cast<size_t>(code));
+  }
+};
+
+const std::error_category &zstd_category() {
+  static const ZstdErrorCategory category;
+  return category;
+}
+#endif
+
+// Compresses `data` (at most kCompressChunkB) into one gzip member or zstd
+// frame. Throws std::system_error with the library's error if it fails.
+std::string compress_frame(Compression method, std::string_view data) {
+  std::string frame;
+  switch (method) {
+  case Compression::None:
+    frame.assign(data);
+    break;
+  case Compression::Gzip: {
+#ifdef DIRCAT_HAVE_ZLIB
+    z_stream zs{};
+    // 15 + 16: the largest window, with a gzip header and trailer
+    const int init = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                  15 + 16, 8, Z_DEFAULT_STRATEGY);
+    if (init != Z_OK)
+      throw std::system_error(init, zlib_category(), "deflateInit2");
+    frame.resize(deflateBound(&zs, static_cast<uLong>(data.size())));
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = reinterpret_cast<Bytef *>(frame.data());
+    zs.avail_out = static_cast<uInt>(frame.size());
+    const int result = deflate(&zs, Z_FINISH);
+    frame.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (result != Z_STREAM_END) // Z_OK: the bound was too small
+      throw std::system_error(result == Z_OK ? Z_BUF_ERROR : result,
+                              zlib_category(), "deflate");
+#endif
+    break;
+  }
+  case Compression::Zstd: {
+#ifdef DIRCAT_HAVE_ZSTD
+    frame.resize(ZSTD_compressBound(data.size()));
+    const size_t size = ZSTD_compress(frame.data(), frame.size(), data.data(),
+                                      data.size(), kZstdLevel);
+    if (ZSTD_isError(size))
+      throw std::system_error(static_cast<int>(size_t{0} - size),
+                              zstd_category(), "ZSTD_compress");
+    frame.resize(size);
+#endif
+    break;
+  }
+  }
+  return frame;
+}
+
+// Compresses a whole bundle at once (--watch), in the chunks OutputSink uses
+std::string compress_text(Compression method, std::string_view text) {
+  if (method == Compression::None)
+    return std::string(text);
+  std::string compressed;
+  for (size_t at = 0; at < text.size(); at += kCompressChunkB)
+    compressed += compress_frame(method, text.substr(at, kCompressChunkB));
+  return compressed;
+}
+
+// Compresses chunks on a pool of threads. Chunks are taken back, compressed,
+// in the order they were submitted.
+class ChunkCompressor {
+public:
+  ChunkCompressor(Compression method, unsigned num_threads) : method(method) {
+    threads.reserve(num_threads);
+    for (unsigned i = 0; i < std::max(1u, num_threads); ++i)
+      threads.emplace_back([this] { run(); });
+  }
+  ChunkCompressor(const ChunkCompressor &) = delete;
+  ChunkCompressor &operator=(const ChunkCompressor &) = delete;
+  ~ChunkCompressor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  void submit(std::string chunk) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::make_unique<Job>());
+      jobs.back()->data = std::move(chunk);
+    }
+    work_ready.notify_one();
+  }
+
+  // Moves the oldest chunk, compressed, into `frame`. Without `wait`, only
+  // if it is done already. False if there is none to take.
+  bool take(std::string &frame, bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (jobs.empty())
+      return false;
+    if (wait)
+      job_done.wait(lock, [this] { return jobs.front()->done; });
+    else if (!jobs.front()->done)
+      return false;
+    frame = std::move(jobs.front()->data);
+    jobs.pop_front();
+    --next_job;
+    return true;
+  }
+
+  size_t queued() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.size();
+  }
+
+  // The error of the first chunk that failed to compress (its frame is
+  // left empty), if any
+  std::error_code error() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return first_error;
+  }
+
+private:
+  struct Job {
+    std::string data; // The chunk, then its frame
+    bool done = false;
+  };
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      work_ready.wait(lock,
+                      [this] { return stopping || next_job < jobs.size(); });
+      if (next_job == jobs.size())
+        return; // Stopping
+      Job &job = *jobs[next_job++];
+      lock.unlock();
+      std::string frame;
+      std::error_code failure;
+      try {
+        frame = compress_frame(method, job.data);
+      } catch (const std::system_error &e) {
+        failure = e.code();
+      } catch (const std::exception &) { // std::bad_alloc and the like
+        failure = std::make_error_code(std::errc::not_enough_memory);
+      }
+      lock.lock();
+      if (failure && !first_error)
+        first_error = failure;
+      job.data = std::move(frame);
+      job.done = true;
+      job_done.notify_all();
+    }
+  }
+
+  const Compression method;
+  mutable std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable job_done;
+  std::deque<std::unique_ptr<Job>> jobs; // Submission order
+  size_t next_job = 0;                   // First job no thread has started
+  bool stopping = false;
+  std::error_code first_error; // Guarded by `mutex`
+  std::vector<std::thread> threads;
+};
+
+// --- Bundle Index (--index) ---
+// A manifest written next to the bundle: where each file's block starts and
+// how long it is, in bytes of the uncompressed output, what the walk knew
+// about the file, and the XXH64 of the block. The output sink fills it in
+// as it writes the blocks, so it costs no extra pass over the files.
+
+// Appends `text` as a JSON string. Bytes outside ASCII are copied as they
+// are, so a path in UTF-8 gives valid JSON.
+void append_json_string(std::string &out, std::string_view text) {
+  out += '"';
+  for (const char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x",
+                    static_cast<unsigned>(static_cast<unsigned char>(c)));
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+class BundleIndex {
+public:
+  // A block of `record` starts at `offset`; ends the one before it
+  void begin(const FileRecord &record, unsigned long long offset) {
+    finish();
+    entries.push_back({&record, offset});
+    open = true;
+  }
+
+  // More bytes of the block begun last
+  void add(std::string_view data) {
+    if (!open)
+      return;
+    hasher.update(data);
+    entries.back().length += data.size();
+  }
+
+  size_t size() const { return entries.size(); }
+
+  // One line per block, in output order, so manifests diff well
+  std::string to_json(Compression compression) {
+    finish();
+    std::string json = "{\"version\": 1, \"compression\": \"";
+    json += compression_name(compression);
+    json += "\", \"files\": [";
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const Entry &entry = entries[i];
+      json += i ? ",\n  {\"path\": " : "\n  {\"path\": ";
+      append_json_string(json, entry.record->relativePath);
+      char fields[160];
+      std::snprintf(fields, sizeof(fields),
+                    ", \"offset\": %llu, \"length\": %llu, \"size\": %llu, "
+                    "\"mtime_ns\": %lld, \"xxh64\": \"%016llx\"}",
+                    entry.offset, entry.length, entry.record->size,
+                    static_cast<long long>(entry.record->mtime),
+                    static_cast<unsigned long long>(entry.hash));
+      json += fields;
+    }
+    json += entries.empty() ? "]}\n" : "\n]}\n";
+    return json;
+  }
+
+private:
+  struct Entry {
+    const FileRecord *record;
+    unsigned long long offset = 0;
+    unsigned long long length = 0;
+    uint64_t hash = 0;
+  };
+
+  void finish() {
+    if (!open)
+      return;
+    entries.back().hash = hasher.digest();
+    hasher = Xxh64();
+    open = false;
+  }
+
+  std::vector<Entry> entries;
+  Xxh64 hasher; // Of the open block
+  bool open = false;
+};
+
+// --- Output Sink ---
+
+// Where the bundle goes: the -o file or stdout. Small pieces are gathered in
+// a large user-space buffer, large ones (such as mapped file contents) are
+// written from where they are, and each flush hands everything pending to
+// one writev() call. Stdout goes through std::cout unless `direct_stdout`
+// (see Config::directStdout) says the descriptor can be written instead;
+// Windows always uses a stream. An embedding program gets the pieces
+// through a BlockSink instead.
+class OutputSink {
+public:
+  explicit OutputSink(bool direct_stdout = false)
+      : buffer(new char[kBufferB]) {
+#ifndef _WIN32
+    if (direct_stdout) {
+      std::cout.flush(); // Keep anything already printed in front
+      std::fflush(stdout);
+      fd = STDOUT_FILENO;
+      return;
+    }
+#else
+    (void)direct_stdout;
+#endif
+    stream = &std::cout;
+  }
+  OutputSink(const OutputSink &) = delete;
+  OutputSink &operator=(const OutputSink &) = delete;
+  ~OutputSink() { close(); }
+
+  // Writes to `path` (created or truncated) instead of stdout
+  std::error_code open(const fs::path &path) {
+#ifdef _WIN32
+    file_stream.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!file_stream.is_open())
+      return std::make_error_code(std::errc::permission_denied);
+    stream = &file_stream;
+#else
+    const int file =
+        ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (file < 0)
+      return {errno, std::generic_category()};
+    fd = file;
+    owns_fd = true;
+    stream = nullptr;
+#endif
+    return {};
+  }
+
+  // Hands everything from here on to `target` (see BlockSink), unbuffered
+  void forward(BlockSink *target) { forward_to = target; }
+
+  // Records every block written from here on in `target`
+  void index_into(BundleIndex *target) { index = target; }
+
+  // Compresses everything written from here on with `method`, on
+  // `num_threads` threads (see ChunkCompressor)
+  void compress(Compression method, unsigned num_threads) {
+    if (method != Compression::None) {
+      compressor = std::make_unique<ChunkCompressor>(method, num_threads);
+      max_in_flight = 2 * std::max(1u, num_threads);
+      chunk.reserve(kCompressChunkB);
+    }
+  }
+
+  // Reserves disk space for about `bytes` of output in the -o file, so a
+  // large bundle is laid out in few extents. Best effort, Linux only; the
+  // unused part is given back when the file is closed.
+  void reserve(unsigned long long bytes) {
+#ifdef __linux__
+    if (owns_fd && bytes > 0 && !compressor && // Compressed size is unknown
+        ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(bytes)) ==
+            0)
+      reserved = true;
+#else
+    (void)bytes;
+#endif
+  }
+
+  // Appends `data`; it may be reused as soon as this returns
+  void write(std::string_view data) {
+    position += data.size();
+    if (forward_to) {
+      forward_to->write_text(data);
+      return;
+    }
+    append(data);
+    if (holds_external)
+      write_pending();
+  }
+
+  // Appends finished blocks in order; they may be reused as soon as this
+  // returns
+  void write_blocks(std::span<const OutputBlock> blocks) {
+    for (const auto &block : blocks) {
+      if (index)
+        index_block(block);
+      position += block.size();
+    }
+    if (forward_to) {
+      for (const auto &block : blocks)
+        forward_block(block);
+      return;
+    }
+    for (const auto &block : blocks) {
+      if (block.body.view().empty()) {
+        append(block.text);
+        continue;
+      }
+      const std::string_view text(block.text);
+      append(text.substr(0, block.body_at));
+      append(block.body.view());
+      append(text.substr(block.body_at));
+    }
+    if (holds_external)
+      write_pending();
+  }
+
+  // Appends more of `block`, whose start was written already
+  void write_block_part(const OutputBlock &block, std::string_view data) {
+    if (index)
+      index->add(data);
+    if (forward_to) {
+      position += data.size();
+      forward_to->write_block(block.record->relativePath, data);
+    } else {
+      write(data);
+    }
+  }
+
+  bool has_buffered() const {
+    return !pieces.empty() || (compressor && compressor->queued() > 0);
+  }
+
+  // Writes out everything buffered; with compression, the chunks compressed
+  // so far. Returns the first error of the run.
+  std::error_code flush() {
+    if (compressor)
+      write_frames(false);
+    write_pending();
+    if (stream)
+      stream->flush();
+    if (stream && !*stream && !error)
+      error = std::make_error_code(std::errc::io_error);
+    return error;
+  }
+
+  // Flushes and closes the -o file. Returns the first error of the run.
+  std::error_code close() {
+    if (closed)
+      return error;
+    closed = true;
+    if (compressor) {
+      if (!chunk.empty())
+        compressor->submit(std::move(chunk));
+      while (compressor->queued() > 0)
+        write_frames(true);
+      compressor.reset();
+    }
+    flush();
+#ifdef _WIN32
+    if (file_stream.is_open()) {
+      file_stream.close();
+      if (!file_stream && !error)
+        error = std::make_error_code(std::errc::io_error);
+    }
+#else
+    if (owns_fd) {
+      // Truncating to the written size frees the unused reservation
+      if (reserved && !error &&
+          ::ftruncate(fd, static_cast<off_t>(written)) != 0)
+        error = std::error_code(errno, std::generic_category());
+      if (::close(fd) != 0 && !error)
+        error = std::error_code(errno, std::generic_category());
+      owns_fd = false;
+    }
+    fd = -1;
+#endif
+    return error;
+  }
+
+private:
+  static constexpr size_t kBufferB = 1024 * 1024;
+  static constexpr size_t kCopyLimitB = 64 * 1024; // Larger pieces: in place
+  static constexpr size_t kMaxPieces = 64;         // Per writev() call
+
+  void forward_block(const OutputBlock &block) {
+    const std::string_view path = block.record->relativePath;
+    const std::string_view text(block.text);
+    if (block.body.view().empty()) {
+      forward_to->write_block(path, text);
+      return;
+    }
+    forward_to->write_block(path, text.substr(0, block.body_at));
+    forward_to->write_block(path, block.body.view());
+    if (block.body_at < text.size())
+      forward_to->write_block(path, text.substr(block.body_at));
+  }
+
+  // Starts the index entry of `block`, which is written at `position`
+  void index_block(const OutputBlock &block) {
+    if (block.empty() || !block.record)
+      return;
+    index->begin(*block.record, position);
+    const std::string_view text(block.text);
+    index->add(text.substr(0, block.body.view().empty() ? text.size()
+                                                        : block.body_at));
+    if (!block.body.view().empty()) {
+      index->add(block.body.view());
+      index->add(text.substr(block.body_at));
+    }
+  }
+
+  // Queues a piece of the bundle, or adds it to the chunk being compressed
+  void append(std::string_view piece) {
+    if (!compressor) {
+      add(piece);
+      return;
+    }
+    while (!piece.empty()) {
+      const size_t part =
+          std::min(kCompressChunkB - chunk.size(), piece.size());
+      chunk.append(piece.substr(0, part));
+      piece.remove_prefix(part);
+      if (chunk.size() < kCompressChunkB)
+        continue;
+      compressor->submit(std::move(chunk));
+      chunk = std::string();
+      chunk.reserve(kCompressChunkB);
+      // Bounds the memory held by chunks in flight
+      write_frames(compressor->queued() > max_in_flight);
+    }
+  }
+
+  // Writes the compressed chunks that are done, in order. With
+  // `wait_oldest`, waits for the oldest one first.
+  void write_frames(bool wait_oldest) {
+    std::string frame;
+    while (compressor->take(frame, wait_oldest)) {
+      wait_oldest = false;
+      add(frame);
+      write_pending(); // `frame` is reused
+    }
+    if (!error)
+      error = compressor->error();
+  }
+
+  // Queues a piece: copied into the buffer if small, referenced otherwise
+  void add(std::string_view piece) {
+    if (piece.empty())
+      return;
+    if (piece.size() <= kCopyLimitB) {
+      if (buffered + piece.size() > kBufferB)
+        write_pending();
+      char *dest = buffer.get() + buffered;
+      std::memcpy(dest, piece.data(), piece.size());
+      buffered += piece.size();
+      if (last_piece_buffered)
+        pieces.back() = std::string_view(pieces.back().data(),
+                                         pieces.back().size() + piece.size());
+      else
+        pieces.emplace_back(dest, piece.size());
+      last_piece_buffered = true;
+    } else {
+      pieces.push_back(piece);
+      holds_external = true;
+      last_piece_buffered = false;
+    }
+    if (pieces.size() == kMaxPieces)
+      write_pending();
+  }
+
+  // Writes every queued piece, in order
+  void write_pending() {
+    if (!pieces.empty() && !error) {
+      if (stream) {
+        for (const auto &piece : pieces)
+          stream->write(piece.data(),
+                        static_cast<std::streamsize>(piece.size()));
+        if (!*stream)
+          error = std::make_error_code(std::errc::io_error);
+      } else {
+        write_vectored();
+      }
+    }
+    pieces.clear();
+    buffered = 0;
+    holds_external = false;
+    last_piece_buffered = false;
+  }
+
+  void write_vectored() {
+#ifndef _WIN32
+    std::array<iovec, kMaxPieces> iov;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      iov[i].iov_base = const_cast<char *>(pieces[i].data());
+      iov[i].iov_len = pieces[i].size();
+    }
+    size_t first = 0;
+    while (first < pieces.size()) {
+      const ssize_t got = ::writev(fd, iov.data() + first,
+                                   static_cast<int>(pieces.size() - first));
+      if (got < 0) {
+        if (errno == EINTR)
+          continue;
+        error = std::error_code(errno, std::generic_category());
+        return;
+      }
+      written += static_cast<unsigned long long>(got);
+      // Skip what was written; a partial write resumes mid-piece
+      size_t left = static_cast<size_t>(got);
+      while (first < pieces.size() && left >= iov[first].iov_len)
+        left -= iov[first++].iov_len;
+      if (left > 0) {
+        iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + left;
+        iov[first].iov_len -= left;
+      }
+    }
+#endif
+  }
+
+  std::unique_ptr<char[]> buffer;
+  size_t buffered = 0; // Bytes of `buffer` in use
+  // Pending output, in order: ranges of `buffer` or of the caller's memory
+  std::vector<std::string_view> pieces;
+  bool holds_external = false;      // Some piece is the caller's memory
+  bool last_piece_buffered = false; // pieces.back() ends at buffer+buffered
+  int fd = -1;
+  bool owns_fd = false;       // The -o file, opened by open()
+  std::ostream *stream = nullptr; // Used instead of fd when set
+#ifdef _WIN32
+  std::ofstream file_stream;
+#endif
+  unsigned long long written = 0; // Through fd
+  // --compress: the chunk being filled, and the threads compressing the rest
+  std::unique_ptr<ChunkCompressor> compressor;
+  std::string chunk;
+  size_t max_in_flight = 0; // Chunks
+  BlockSink *forward_to = nullptr;
+  BundleIndex *index = nullptr; // --index
+  unsigned long long position = 0; // Bytes written, before compression
+  bool reserved = false;
+  bool closed = false;
+  std::error_code error;
+};
+
+// --- Ordered Output (Streaming) ---
+
+// Reorder window between the processing threads and the output stream.
+// Workers finish files out of order; the writer emits each file as soon as
+// every earlier index has been written. At most `window` formatted files are
+// held in memory at once, and output starts as soon as the first file is done.
+class OrderedOutputWriter {
+public:
+  OrderedOutputWriter(size_t total_files, size_t window_size,
+                      size_t worker_count)
+      : total(total_files), active_workers(worker_count),
+        slots(std::max<size_t>(
+            1, std::min(std::max<size_t>(1, window_size), total_files))) {}
+
+  // Blocks a worker until `index` fits inside the window. Returns false if
+  // processing should stop instead.
+  bool wait_for_slot(size_t index, const std::atomic<bool> &should_stop) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (index >= next_index + slots.size()) {
+      if (should_stop)
+        return false;
+      slot_freed.wait_for(lock, kStopPollInterval);
+    }
+    return !should_stop;
+  }
+
+  // Hands a finished file to the writer. An empty block marks a file that
+  // produced no output (e.g. it could not be opened) and is skipped.
+  void submit(size_t index, OutputBlock block) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      Slot &slot = slots[index % slots.size()];
+      slot.block = std::move(block);
+      slot.ready = true;
+    }
+    slot_filled.notify_one();
+  }
+
+  // Returns an empty buffer for a worker to format into. Buffers that were
+  // already written out are handed back, so steady-state formatting reuses
+  // their capacity instead of allocating.
+  std::string acquire_buffer() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_buffers.empty())
+      return {};
+    std::string buffer = std::move(free_buffers.back());
+    free_buffers.pop_back();
+    return buffer;
+  }
+
+  // Called once by each worker when it runs out of files (or stops early)
+  void worker_finished() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (active_workers > 0)
+        --active_workers;
+    }
+    slot_filled.notify_one();
+  }
+
+  // Runs on the calling thread until every file has been written, all
+  // workers have finished, or a stop is requested. All blocks that are ready
+  // in order are taken at once and written with one call to the sink, which
+  // is flushed whenever the writer has to wait. `on_written` receives the
+  // index of every file whose content was written; `prepare`, if set, sees
+  // each block, in order, before it is written.
+  void write_all(
+      OutputSink &sink, const std::atomic<bool> &should_stop,
+      const std::function<void(size_t)> &on_written,
+      const std::function<void(size_t, OutputBlock &)> &prepare = {}) {
+    ThreadStats *stats = thread_stats;
+    drain(
+        should_stop,
+        [&](std::span<OutputBlock> batch, std::span<const size_t> indices) {
+          if (prepare)
+            for (size_t i = 0; i < batch.size(); ++i)
+              prepare(indices[i], batch[i]);
+          const uint64_t write_start = stats ? stats_now_ns() : 0;
+          size_t from = 0; // First block not written yet
+          for (size_t i = 0; i < batch.size(); ++i) {
+            if (!batch[i].stream)
+              continue;
+            // A streamed body follows its header, chunk by chunk
+            sink.write_blocks(batch.subspan(from, i + 1 - from));
+            std::string chunk;
+            bool at_line_start = true; // The header ends with a newline
+            while (batch[i].stream->pop(chunk, should_stop)) {
+              sink.write_block_part(batch[i], chunk);
+              if (!chunk.empty())
+                at_line_start = chunk.back() == '\n';
+              if (stats)
+                stats->bytesWritten += chunk.size();
+            }
+            // Stopped inside the body: the fence still closes it, and only
+            // the contents written count
+            if (!batch[i].stream->delivered_all()) {
+              sink.write_block_part(batch[i],
+                                    at_line_start ? "```\n" : "\n```\n");
+              const unsigned long long size =
+                  batch[i].record ? batch[i].record->size : 0;
+              const unsigned long long delivered =
+                  batch[i].stream->contents_bytes_delivered();
+              bytes_cut += size - std::min(size, delivered);
+            }
+            batch[i].stream->abandon(); // Frees the worker after a stop
+            from = i + 1;
+          }
+          sink.write_blocks(batch.subspan(from));
+          if (stats) {
+            stats->writeNs += stats_now_ns() - write_start;
+            for (const auto &block : batch)
+              stats->bytesWritten += block.size();
+          }
+          for (size_t index : indices)
+            on_written(index);
+        },
+        [&] {
+          if (!sink.has_buffered())
+            return;
+          const uint64_t flush_start = stats ? stats_now_ns() : 0;
+          sink.flush(); // Nothing ready; send what is buffered
+          if (stats)
+            stats->writeNs += stats_now_ns() - flush_start;
+        });
+  }
+
+  // Bytes of streamed files (by the walk's sizes) that a stop kept write_all
+  // from writing
+  unsigned long long unwritten_bytes() const { return bytes_cut; }
+
+  // Like write_all, but hands the blocks to `consume` in index order instead
+  // of writing them. It may keep a block by moving it out.
+  void consume_all(const std::atomic<bool> &should_stop,
+                   const std::function<void(size_t, OutputBlock &)> &consume) {
+    drain(
+        should_stop,
+        [&](std::span<OutputBlock> batch, std::span<const size_t> indices) {
+          for (size_t i = 0; i < batch.size(); ++i)
+            consume(indices[i], batch[i]);
+        },
+        [] {});
+  }
+
+private:
+  // The loop of write_all: takes every block that is ready in order, hands
+  // it to `consume_batch` outside the lock, and calls `on_idle` before it
+  // waits for the next one.
+  template <typename ConsumeBatch, typename OnIdle>
+  void drain(const std::atomic<bool> &should_stop,
+             ConsumeBatch &&consume_batch, OnIdle &&on_idle) {
+    ThreadStats *stats = thread_stats;
+    std::vector<OutputBlock> batch;
+    std::vector<size_t> batch_indices;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (next_index < total && !should_stop) {
+      const size_t first_index = next_index;
+      for (Slot *slot = &slots[next_index % slots.size()];
+           next_index < total && slot->ready;
+           slot = &slots[next_index % slots.size()]) {
+        if (!slot->block.empty()) { // Files without output are just skipped
+          batch.push_back(std::move(slot->block));
+          batch_indices.push_back(next_index);
+        }
+        slot->block = OutputBlock();
+        slot->ready = false;
+        ++next_index;
+      }
+      if (next_index == first_index) { // The next file is not done yet
+        if (active_workers == 0)
+          break; // Nobody left to fill this slot
+        lock.unlock();
+        on_idle();
+        lock.lock();
+        if (!slots[next_index % slots.size()].ready && active_workers > 0) {
+          const uint64_t idle_start = stats ? stats_now_ns() : 0;
+          slot_filled.wait_for(lock, kStopPollInterval);
+          if (stats)
+            stats->writerIdleNs += stats_now_ns() - idle_start;
+        }
+        continue;
+      }
+      lock.unlock();
+      slot_freed.notify_all();
+
+      // Consume outside the lock so workers keep filling the window
+      if (!batch.empty())
+        consume_batch(std::span<OutputBlock>(batch),
+                      std::span<const size_t>(batch_indices));
+      lock.lock();
+      // Keep at most one spare buffer per slot, and none that grew unusually
+      // large for a single big file. Mappings are released here.
+      for (auto &block : batch) {
+        block.text.clear();
+        if (block.text.capacity() <= kMaxRecycledBufferB &&
+            free_buffers.size() < slots.size())
+          free_buffers.push_back(std::move(block.text));
+      }
+      batch.clear();
+      batch_indices.clear();
+    }
+  }
+
+  static constexpr size_t kMaxRecycledBufferB = 4 * 1024 * 1024;
+
+  struct Slot {
+    OutputBlock block;
+    bool ready = false;
+  };
+
+  const size_t total;
+  size_t next_index = 0; // Next index to be written
+  size_t active_workers;
+  std::vector<Slot> slots; // Ring buffer keyed by index % window
+  std::vector<std::string> free_buffers; // Written buffers, ready for reuse
+  unsigned long long bytes_cut = 0;      // Only used by the writer thread
+  std::mutex mutex;
+  std::condition_variable slot_filled;
+  std::condition_variable slot_freed;
+};
+
+// Shared work queue for the processing threads. Indices are handed out in
+// small batches from an atomic cursor, so a thread that hits a run of large
+// files keeps working through them while the others move on.
+class FileWorkQueue {
+public:
+  FileWorkQueue(size_t total_files, size_t batch_size)
+      : total(total_files), batch(std::max<size_t>(1, batch_size)) {}
+
+  // Claims the next batch [begin, end). Returns false once the queue is empty.
+  bool claim(size_t &begin, size_t &end) {
+    begin = cursor.fetch_add(batch, std::memory_order_relaxed);
+    if (begin >= total)
+      return false;
+    end = std::min(begin + batch, total);
+    return true;
+  }
+
+private:
+  const size_t total;
+  const size_t batch;
+  std::atomic<size_t> cursor{0};
+};
+
+// Picks a batch size that amortizes the atomic claim without letting one
+// thread grab a large share of the output window.
+size_t choose_batch_size(size_t total_files, unsigned int num_threads,
+                         size_t window) {
+  const size_t threads = std::max(1u, num_threads);
+  size_t batch = total_files / (threads * 16);
+  batch = std::min<size_t>(batch, std::max<size_t>(1, window / threads));
+  return std::clamp<size_t>(batch, 1, 16);
+}
+
+// Worker loop: claims batches from the queue until it is drained. Claims are
+// made in increasing index order, so the lowest unwritten index is always
+// being worked on and the output window can never deadlock.
+void process_file_chunk(
+    std::span<const FileRecord> files, // All files, sorted
+    FileWorkQueue &queue,              // Shared cursor into files
+    const Config &config,              // Pass config struct
+    OrderedOutputWriter &writer,       // Receives formatted output by index
+    std::atomic<size_t> &processed_files_counter,
+    std::atomic<size_t> &total_bytes_counter,
+    std::atomic<bool> &should_stop_flag,
+    BlockCache *block_cache, // Null without --cache-dir
+    SkipCounters *skips,
+    ReadAheadEngine *read_ahead, // Null without --async-io
+    const TokenBudget *budget,   // Null without --max-tokens
+    DuplicateIndex *copies) {    // Null without --dedupe
+  BatchReader reader(read_ahead);
+  size_t batch_begin = 0, batch_end = 0;
+  while (!should_stop_flag && queue.claim(batch_begin, batch_end)) {
+    // Reads run while this worker waits for its first slot and formats
+    reader.submit(files.subspan(batch_begin, batch_end - batch_begin));
+    for (size_t original_index = batch_begin; original_index < batch_end;
+         ++original_index) {
+      if (should_stop_flag)
+        return;
+      {
+        StatSpan wait_span(&ThreadStats::windowWaitNs);
+        if (!writer.wait_for_slot(original_index, should_stop_flag))
+          return;
+      }
+
+      const FileRecord &record = files[original_index];
+      if (budget && !budget->may_fit(original_index)) {
+        writer.submit(original_index, OutputBlock()); // Cannot fit; not read
+        continue;
+      }
+      OutputBlock block;
+      block.text = writer.acquire_buffer();
+      block.record = &record;
+      try {
+        // A streamed file would wait for the writer, which --max-tokens
+        // only runs at the end
+        const WorkerFileContext worker{&reader, original_index - batch_begin,
+                                       &block, copies, original_index,
+                                       budget == nullptr};
+        // Add file size to total only if processing yielded output
+        if (process_file_record_cached(block.text, record, config,
+                                       block_cache, skips, worker) &&
+            !config.dryRun) {
+          total_bytes_counter += record.size; // Known from the walk
+          if (budget) // Estimated here, so the deciding thread stays cheap
+            block.tokens = estimate_tokens(block.text) +
+                           estimate_tokens(block.body.view());
+        }
+      } catch (...) {
+        // Errors are reported by process_single_file where possible; an empty
+        // result makes the writer skip this index instead of waiting on it.
+        block.text.clear();
+        block.body = FileBuffer();
+        block.stream.reset();
+      }
+      processed_files_counter++; // Increment even if content is empty but
+                                 // processing was attempted
+      // The block goes out first: the writer takes the body as it comes
+      std::shared_ptr<ContentStream> stream = block.stream;
+      writer.submit(original_index, std::move(block));
+      if (stream)
+        stream->produce(config, should_stop_flag);
+    }
+  }
+}
+
+// Sorts 'last' files by the order of their --last entries, and
+// alphabetically by relative path within one entry. The --last entries are
+// normalized once and each file's group is computed once, before the sort.
+std::vector<FileRecord>
+sort_last_files(std::vector<FileRecord> last_files, const Config &config) {
+  // --last file.txt entries follow the directory groups
+  struct LastFileEntry {
+    std::string path;
+    bool match_relative_path; // Otherwise matches the filename only
+  };
+  std::vector<LastFileEntry> file_entries;
+  file_entries.reserve(config.lastFiles.size());
+  for (const auto &entry : config.lastFiles) {
+    std::string entryStr = normalize_path(entry);
+    const bool by_path =
+        entryStr.find('/') != std::string::npos || entry.has_parent_path();
+    file_entries.push_back({std::move(entryStr), by_path});
+  }
+  // --last src/ entries: the exact path, and the prefix with a trailing slash
+  std::vector<std::pair<std::string, std::string>> dir_entries;
+  dir_entries.reserve(config.lastDirs.size());
+  for (const auto &entry : config.lastDirs) {
+    std::string exact = normalize_path(entry);
+    std::string prefix = exact;
+    if (!prefix.empty() && prefix.back() != '/')
+      prefix += '/';
+    dir_entries.emplace_back(std::move(exact), std::move(prefix));
+  }
+
+  auto get_sort_position = [&](const FileRecord &record) -> int {
+    // Check explicit file list first (--last file.txt)
+    for (size_t i = 0; i < file_entries.size(); ++i) {
+      const std::string_view target = file_entries[i].match_relative_path
+                                          ? record.relativePath
+                                          : record.filename();
+      if (target == file_entries[i].path)
+        return static_cast<int>(dir_entries.size() + i);
+    }
+    // Check explicit dir list (--last src/)
+    for (size_t i = 0; i < dir_entries.size(); ++i) {
+      if (record.relativePath.rfind(dir_entries[i].second, 0) == 0 ||
+          record.relativePath == dir_entries[i].first)
+        return static_cast<int>(i); // Files within this dir get this group
+    }
+    return std::numeric_limits<int>::max(); // Should be found if collected
+                                            // correctly, put at end otherwise
+  };
+
+  std::vector<std::pair<int, size_t>> keys; // (group, index into last_files)
+  keys.reserve(last_files.size());
+  for (size_t i = 0; i < last_files.size(); ++i)
+    keys.emplace_back(get_sort_position(last_files[i]), i);
+  std::sort(keys.begin(), keys.end(), [&](const auto &a, const auto &b) {
+    if (a.first != b.first)
+      return a.first < b.first; // Sort by --last group index
+    // Same group: all records share the base, so the relative path orders
+    // the same as the absolute path
+    return last_files[a.second].relativePath <
+           last_files[b.second].relativePath;
+  });
+
+  std::vector<FileRecord> sorted;
+  sorted.reserve(last_files.size());
+  for (const auto &key : keys)
+    sorted.push_back(std::move(last_files[key.second]));
+  return sorted;
+}
+
+// --- Sharded Output (--shards, --shard-size) ---
+// The output split into consecutive ranges of files, each written to its own
+// file by its own writer thread while the workers fill all of them. Every
+// shard starts with the title and, with -s, ends with the summary of its own
+// files, so each can be read on its own; read in order, the shards hold the
+// files in the usual output order.
+
+constexpr size_t kMaxShards = 1000;
+
+// The -o path with the shard number before the first extension, padded so
+// the names sort in order: out.md.gz -> out.03.md.gz
+fs::path shard_file_path(const fs::path &output, size_t shard,
+                         size_t shard_count) {
+  const std::string name = output.filename().string();
+  size_t dot = name.find('.', 1); // A leading dot starts no extension
+  if (dot == std::string::npos)
+    dot = name.size();
+  std::string number = std::to_string(shard);
+  const size_t width = std::to_string(shard_count - 1).size();
+  number.insert(0, width - number.size(), '0');
+  return output.parent_path() /
+         (name.substr(0, dot) + "." + number + name.substr(dot));
+}
+
+// How many directories two normalized relative paths have in common. Two
+// files in the same directory score one more than its depth, so a cut
+// between directories always scores lower than one inside a directory.
+size_t shared_directory_depth(std::string_view a, std::string_view b) {
+  auto directory = [](std::string_view path) {
+    const size_t slash = path.rfind('/');
+    return slash == std::string_view::npos ? std::string_view()
+                                           : path.substr(0, slash);
+  };
+  const std::string_view dir_a = directory(a), dir_b = directory(b);
+  if (dir_a == dir_b)
+    return dir_a.empty() ? 1
+                         : static_cast<size_t>(std::count(dir_a.begin(),
+                                                          dir_a.end(), '/')) +
+                               2;
+  size_t depth = 0;
+  for (size_t pos = 0;;) {
+    const size_t end_a = std::min(dir_a.find('/', pos), dir_a.size());
+    const size_t end_b = std::min(dir_b.find('/', pos), dir_b.size());
+    if (end_a != end_b || dir_a.substr(pos, end_a - pos) !=
+                              dir_b.substr(pos, end_b - pos))
+      return depth;
+    ++depth;
+    if (end_a == dir_a.size() || end_b == dir_b.size())
+      return depth;
+    pos = end_a + 1;
+  }
+}
+
+// Splits `files` (in output order) into shards: returns the first index of
+// each shard, then files.size(). --shards N asks for N shards of about the
+// same size, --shard-size fills each shard up to that many bytes and closes
+// it before the file that would pass them. Sizes are estimated from the
+// walk, as contents plus header, before anything is read. Each cut is made
+// within a quarter of a shard of its ideal place, between the two files that
+// share the fewest directories (the closest such pair on a tie), or at the
+// ideal place if no two files are that close. Every shard holds at least one
+// file, so a file larger than --shard-size gets a shard of its own and
+// --shards gives fewer shards when there are fewer files. Returns an empty
+// vector if --shard-size needs more than kMaxShards.
+std::vector<size_t> plan_shards(std::span<const FileRecord> files,
+                                const Config &config) {
+  std::vector<unsigned long long> before(files.size() + 1, 0); // Each file
+  for (size_t i = 0; i < files.size(); ++i)
+    before[i + 1] =
+        before[i] + files[i].size + files[i].relativePath.size() + 32;
+  const unsigned long long total = before.back();
+  const bool by_size = config.shards == 0;
+  const unsigned long long target =
+      by_size ? config.shardSize
+              : std::max<unsigned long long>(1, total / config.shards);
+  const unsigned long long slack = target / 4;
+
+  std::vector<size_t> starts{0};
+  while (true) {
+    const size_t previous = starts.back();
+    unsigned long long ideal = 0;
+    if (by_size) {
+      if (total - before[previous] <= target)
+        break; // The rest fits in this shard
+      ideal = before[previous] + target;
+    } else {
+      if (starts.size() == config.shards)
+        break;
+      ideal = starts.size() * target;
+    }
+    auto first_at = [&](unsigned long long bytes) {
+      return static_cast<size_t>(
+          std::lower_bound(before.begin() + previous, before.end(), bytes) -
+          before.begin());
+    };
+    size_t cut = std::min(first_at(ideal), files.size());
+    if (by_size) {
+      if (before[cut] > ideal)
+        --cut; // The last file that still fits
+    } else if (cut > previous &&
+               ideal - before[cut - 1] < before[cut] - ideal) {
+      --cut; // The cut at or before the ideal place is closer
+    }
+    size_t best_depth = std::numeric_limits<size_t>::max();
+    unsigned long long best_distance = 0;
+    for (size_t candidate = std::max<size_t>(
+             first_at(ideal > slack ? ideal - slack : 0), previous + 1);
+         candidate < files.size() && before[candidate] <= ideal + slack;
+         ++candidate) {
+      const size_t depth =
+          shared_directory_depth(files[candidate - 1].relativePath,
+                                 files[candidate].relativePath);
+      const unsigned long long distance = before[candidate] > ideal
+                                              ? before[candidate] - ideal
+                                              : ideal - before[candidate];
+      if (depth < best_depth ||
+          (depth == best_depth && distance < best_distance)) {
+        best_depth = depth;
+        best_distance = distance;
+        cut = candidate;
+      }
+    }
+    cut = std::max(cut, previous + 1); // Never an empty shard
+    if (cut >= files.size())
+      break; // No file left for another shard
+    starts.push_back(cut);
+    if (starts.size() > kMaxShards)
+      return {};
+  }
+  starts.push_back(files.size());
+  return starts;
+}
+
+// --- Main Processing Functions ---
+
+// Wrapper for single file processing used by main() if input is a file
+// Now handles summary output
+bool process_single_file_entry(const Config &config,
+                               std::ostream &output_stream) {
+  if (!fs::is_regular_file(config.dirPath)) {
+    std::cerr << "ERROR: process_single_file_entry called with non-file path: "
+              << normalize_path(config.dirPath) << std::endl;
+    return false;
+  }
+  const fs::path base_abs_path =
+      config.dirPath.parent_path(); // Base is parent dir
+
+  try {
+    if (config.dryRun) {
+      output_stream << "File to be processed:\n";
+      std::string normPath = normalize_path(config.dirPath);
+      if (config.useBackticks) {
+        output_stream << "`" << normPath << "`\n";
+      } else {
+        output_stream << normPath << "\n";
+      }
+    } else {
+      // Process the single file
+      std::string file_content_output;
+      SkipCounters skips;
+      {
+        RunStats run_stats; // --stats: one worker slot on this thread
+        const uint64_t start = stats_now_ns();
+        const bool with_stats = config.statsFormat != StatsFormat::Off;
+        {
+          ThreadStatsScope stats_scope(with_stats ? &run_stats : nullptr,
+                                       ThreadStats::Role::Worker, "main");
+          process_single_file_into(file_content_output, config.dirPath,
+                                   config, base_abs_path, &skips);
+        }
+        if (with_stats) {
+          run_stats.add_stage("total", stats_now_ns() - start);
+          run_stats.print(std::cerr, config.statsFormat);
+        }
+      }
+      if (skips.binaryFiles.load() > 0) {
+        std::cerr << "Input file looks binary and was skipped; use "
+                     "--include-binary to include it."
+                  << std::endl;
+      } else if (!file_content_output.empty()) {
+        output_stream << "# File generated by DirCat\n"; // Add header
+        output_stream << file_content_output;
+
+        // Add summary if requested
+        if (config.showSummary) {
+          output_stream << "\n---\nProcessed Files (1):\n";
+          std::string filename = normalize_path(config.dirPath.filename());
+          if (config.useBackticks) {
+            output_stream << "`" << filename << "`\n";
+          } else {
+            output_stream << filename << "\n";
+          }
+        }
+      } else {
+        // File was skipped or empty, print message to cerr if outputting to
+        // cout
+        if (&output_stream == &std::cout) {
+          std::cerr << "Input file processed but resulted in empty output."
+                    << std::endl;
+        }
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: Processing single file: "
+              << normalize_path(config.dirPath) << ": " << e.what() << '\n';
+    return false;
+  }
+  return true;
+}
+
+// Creates the --cache-dir directory and loads its listing cache. Returns null
+// (and clears config.cacheDir) when the cache is off or cannot be created.
+std::unique_ptr<DirectoryListingCache> open_listing_cache(Config &config) {
+  if (config.cacheDir.empty())
+    return nullptr;
+  std::error_code ec;
+  fs::create_directories(config.cacheDir, ec);
+  if (ec) {
+    std::cerr << "WARNING: Could not create cache directory "
+              << normalize_path(config.cacheDir) << ": " << ec.message()
+              << ". Continuing without the cache.\n";
+    config.cacheDir.clear();
+    return nullptr;
+  }
+  return std::make_unique<DirectoryListingCache>(config.cacheDir,
+                                                 config.dirPath);
+}
+
+// Main function for processing a directory
+// Streams normal files through an ordered output window as they finish
+// Now handles summary output
+// With a `block_sink`, the bundle and the closing status go to it instead of
+// the -o file or stdout.
+bool process_directory(Config config, std::atomic<bool> &should_stop,
+                       BlockSink *block_sink = nullptr) {
+  if (!fs::is_directory(config.dirPath)) {
+    std::cerr << "ERROR: process_directory called with non-directory path: "
+              << normalize_path(config.dirPath) << '\n';
+    return false;
+  }
+  const fs::path base_abs_path = config.dirPath; // Already absolute
+  const bool sharded = config.shards > 0 || config.shardSize > 0;
+  const uint64_t run_start = stats_now_ns();
+  if (config.statsFormat != StatsFormat::Off)
+    config.stats = std::make_shared<RunStats>();
+  // Prints --stats on every return once the run has been set up
+  struct StatsReport {
+    const Config &config;
+    uint64_t start;
+    ~StatsReport() {
+      if (!config.stats)
+        return;
+      config.stats->add_stage("total", stats_now_ns() - start);
+      config.stats->print(std::cerr, config.statsFormat);
+    }
+  } stats_report{config, run_start};
+
+  // --- Persistent cache (--cache-dir) ---
+  std::unique_ptr<DirectoryListingCache> listing_cache =
+      open_listing_cache(config);
+
+  // --- File Collection (uses optimized checks internally) ---
+  auto [normalFiles, lastFilesList] =
+      collect_file_records(config, should_stop, listing_cache.get());
+  if (listing_cache)
+    listing_cache->save(!should_stop);
+  if (config.stats)
+    config.stats->add_stage("collect", stats_now_ns() - run_start);
+
+  // --- Setup Output Sink ---
+  OutputSink output(config.directStdout && !block_sink);
+  if (block_sink) {
+    output.forward(block_sink);
+  } else if (!config.outputFile.empty()) {
+    fs::path absOutputPath = fs::absolute(config.outputFile);
+    fs::path parentPath = absOutputPath.parent_path();
+    if (!parentPath.empty() && !fs::exists(parentPath)) {
+      try {
+        fs::create_directories(parentPath);
+        std::cout << "Created output directory: "
+                  << normalize_path(parentPath) << std::endl;
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Failed to create output directory "
+                  << normalize_path(parentPath) << ": " << e.what() << '\n';
+        return false;
+      }
+    }
+    if (fs::exists(absOutputPath) && fs::is_directory(absOutputPath)) {
+      std::cerr << "ERROR: Output path is an existing directory: "
+                << normalize_path(absOutputPath) << '\n';
+      return false;
+    }
+    // Created or truncated (binary, so newlines are written as is). Shards
+    // are opened once the walk has decided which files they hold.
+    if (const std::error_code ec =
+            sharded ? std::error_code() : output.open(absOutputPath)) {
+      std::cerr << "ERROR: Could not open output file for writing: "
+                << normalize_path(absOutputPath) << " (" << ec.message()
+                << ")\n";
+      return false;
+    }
+  }
+  if (!sharded)
+    output.compress(config.compression,
+                    resolve_thread_count(config,
+                                         std::numeric_limits<size_t>::max()));
+  BundleIndex index; // --index, filled in by the sink
+  if (!config.indexFile.empty())
+    output.index_into(&index);
+
+  // --- Dry Run Handling ---
+  if (config.dryRun) {
+    std::string listing = "Files to be processed (" +
+                          std::to_string(normalFiles.size() +
+                                         lastFilesList.size()) +
+                          " total):\n";
+    listing += "--- Normal Files (" + std::to_string(normalFiles.size()) +
+               ") ---\n";
+    std::vector<std::string_view> normalRelativePaths;
+    normalRelativePaths.reserve(normalFiles.size());
+    for (const auto &record : normalFiles)
+      normalRelativePaths.push_back(record.relativePath);
+    std::sort(normalRelativePaths.begin(), normalRelativePaths.end());
+    for (const auto &relPath : normalRelativePaths) {
+      if (config.useBackticks) {
+        listing += '`';
+        listing += relPath;
+        listing += "`\n";
+      } else {
+        listing += relPath;
+        listing += '\n';
+      }
+    }
+
+    listing += "--- Last Files (" + std::to_string(lastFilesList.size()) +
+               ") ---\n";
+    for (const auto &record :
+         sort_last_files(std::move(lastFilesList), config)) {
+      listing += summary_entry(record, config);
+      listing += '\n';
+    }
+    output.write(listing);
+    return true; // Dry run finished; the sink flushes on the way out
+  }
+
+  // --- Actual Processing ---
+  if (normalFiles.empty() && lastFilesList.empty()) {
+    // Print message to cerr if outputting to cout
+    if (config.outputFile.empty()) {
+      std::cerr << "No matching files found in: "
+                << normalize_path(config.dirPath) << "\n";
+    }
+    return true;
+  }
+
+  constexpr std::string_view kOutputTitle = "# File generated by DirCat\n";
+
+  std::unique_ptr<BlockCache> block_cache;
+  if (!config.cacheDir.empty())
+    block_cache =
+        std::make_unique<BlockCache>(config.cacheDir, base_abs_path, config);
+
+  std::atomic<size_t> processedFiles{0};
+  std::atomic<size_t> totalBytes{0};
+  SkipCounters skips;
+  std::mutex output_mutex; // Mutex for final output stream writing AND for cerr
+                           // in threads
+
+  // Last files follow the normal files in output order, so both go through
+  // one work queue and one ordered writer: indices below total_normal_files
+  // are normal files, the rest are the sorted last files.
+  const size_t total_normal_files = normalFiles.size();
+  std::vector<FileRecord> outputFiles = std::move(normalFiles);
+  {
+    std::vector<FileRecord> sortedLast =
+        sort_last_files(std::move(lastFilesList), config);
+    outputFiles.insert(outputFiles.end(),
+                       std::make_move_iterator(sortedLast.begin()),
+                       std::make_move_iterator(sortedLast.end()));
+  }
+  const size_t total_files = outputFiles.size();
+
+  // --- Shards (--shards, --shard-size) ---
+  // Without them, the whole output is one shard, written by this thread
+  const std::vector<size_t> shard_starts =
+      sharded ? plan_shards(outputFiles, config)
+              : std::vector<size_t>{0, total_files};
+  if (shard_starts.empty()) {
+    std::cerr << "ERROR: --shard-size " << config.shardSize
+              << " would split the output into more than " << kMaxShards
+              << " files.\n";
+    return false;
+  }
+  const size_t shard_count = shard_starts.size() - 1;
+  std::vector<OutputSink *> sinks{&output}; // By shard
+  std::vector<std::unique_ptr<OutputSink>> more_sinks;
+  std::vector<fs::path> shard_paths;
+  if (sharded) {
+    const unsigned compress_threads = std::max<unsigned>(
+        1, resolve_thread_count(config, std::numeric_limits<size_t>::max()) /
+               static_cast<unsigned>(shard_count));
+    for (size_t shard = 0; shard < shard_count; ++shard) {
+      if (shard > 0) {
+        more_sinks.push_back(std::make_unique<OutputSink>());
+        sinks.push_back(more_sinks.back().get());
+      }
+      shard_paths.push_back(
+          shard_file_path(fs::absolute(config.outputFile), shard, shard_count));
+      if (const std::error_code ec = sinks[shard]->open(shard_paths.back())) {
+        std::cerr << "ERROR: Could not open output file for writing: "
+                  << normalize_path(shard_paths.back()) << " ("
+                  << ec.message() << ")\n";
+        return false;
+      }
+      sinks[shard]->compress(config.compression, compress_threads);
+    }
+  }
+  for (size_t shard = 0; shard < shard_count; ++shard) {
+    if (!config.outputFile.empty()) {
+      // Room for every file's contents plus its header and fence
+      unsigned long long expected_bytes = 0;
+      for (size_t i = shard_starts[shard]; i < shard_starts[shard + 1]; ++i)
+        expected_bytes += outputFiles[i].size +
+                          outputFiles[i].relativePath.size() + 32;
+      if (config.maxTokens > 0)
+        expected_bytes =
+            std::min(expected_bytes, config.maxTokens * kMaxBytesPerToken);
+      sinks[shard]->reserve(expected_bytes);
+    }
+    sinks[shard]->write(kOutputTitle);
+  }
+  const unsigned int num_threads = resolve_thread_count(config, total_files);
+  // --max-tokens: the workers see the files in priority order, and the
+  // blocks the budget takes are written in output order once all are decided
+  std::unique_ptr<TokenBudget> budget;
+  std::vector<size_t> rankedIndices; // Output index of each rank
+  std::vector<FileRecord> rankedFiles;
+  std::atomic<bool> budget_full{false}; // Stops the workers' reading
+  if (config.maxTokens > 0) {
+    rankedIndices = prioritize_for_budget(outputFiles, total_normal_files);
+    rankedFiles.reserve(total_files);
+    for (size_t index : rankedIndices)
+      rankedFiles.push_back(outputFiles[index]);
+    // The summary heading is charged for the most files it can count
+    const unsigned long long fixed_tokens =
+        estimate_tokens(kOutputTitle) +
+        (config.showSummary
+             ? estimate_tokens("\n---\nProcessed Files (" +
+                               std::to_string(total_files) + "):\n")
+             : 0);
+    budget = std::make_unique<TokenBudget>(config.maxTokens, rankedFiles,
+                                           config, fixed_tokens);
+  }
+  const std::vector<FileRecord> &workFiles = budget ? rankedFiles : outputFiles;
+  std::atomic<bool> &worker_stop = budget ? budget_full : should_stop;
+  // Files read ahead of the budget's decisions may be read for nothing, so
+  // --max-tokens keeps the window to a few files per thread
+  const size_t window =
+      budget ? std::min<size_t>(config.outputWindow, 4 * num_threads)
+             : config.outputWindow;
+  // Read-ahead only covers what the workers would read() anyway: not cached
+  // blocks, not the mmap or stream backends, and not --max-tokens, where a
+  // batch read ahead would include files the budget leaves unread
+  std::unique_ptr<ReadAheadEngine> read_ahead;
+  if (config.asyncIo && !config.dryRun && !block_cache && !config.maxTokens &&
+      (config.ioBackend == IoBackend::Auto ||
+       config.ioBackend == IoBackend::Read))
+    read_ahead = std::make_unique<ReadAheadEngine>(config, num_threads);
+
+  std::unique_ptr<DuplicateIndex> copies;
+  if (config.dedupe)
+    copies = std::make_unique<DuplicateIndex>(outputFiles, config);
+
+  // --- Stream all files through the ordered output window ---
+  // Each shard has its own queue and window; the shards share -w
+  struct Shard {
+    std::span<const FileRecord> files;
+    std::unique_ptr<FileWorkQueue> queue;
+    std::unique_ptr<OrderedOutputWriter> writer;
+    std::vector<size_t> writtenNormalIndices; // Output order, for the summary
+  };
+  std::vector<Shard> shards(shard_count);
+  for (size_t shard = 0; shard < shard_count; ++shard) {
+    const size_t count = shard_starts[shard + 1] - shard_starts[shard];
+    const size_t shard_window = std::max<size_t>(1, window / shard_count);
+    shards[shard].files =
+        std::span(workFiles).subspan(shard_starts[shard], count);
+    shards[shard].queue = std::make_unique<FileWorkQueue>(
+        count, choose_batch_size(count, num_threads, shard_window));
+    shards[shard].writer = std::make_unique<OrderedOutputWriter>(
+        count, shard_window, num_threads);
+  }
+  shards[0].writtenNormalIndices.reserve(total_normal_files);
+  std::vector<size_t> writtenLastIndices; // --max-tokens: last files taken
+
+  TaskGroup threads;
+  const uint64_t process_start = stats_now_ns();
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    threads.start(
+        // Capture output_mutex by reference for cerr locking
+        [&config, &processedFiles, &totalBytes, &worker_stop, &shards,
+         &output_mutex, &block_cache, &skips, &read_ahead, &budget, &copies,
+         i]() {
+          ThreadStatsScope stats_scope(config.stats.get(),
+                                       ThreadStats::Role::Worker, "worker", i);
+          try {
+            // Workers start on different shards, so that every shard's
+            // writer has work from the start
+            for (size_t k = 0; k < shards.size(); ++k) {
+              Shard &shard = shards[(i + k) % shards.size()];
+              process_file_chunk(shard.files, *shard.queue, config,
+                                 *shard.writer, processedFiles, totalBytes,
+                                 worker_stop, block_cache.get(), &skips,
+                                 read_ahead.get(), budget.get(), copies.get());
+            }
+          } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(output_mutex); // Lock cerr
+            std::cerr << "ERROR: Exception in processing thread: " << e.what()
+                      << '\n';
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "ERROR: Unknown exception in processing thread.\n";
+          }
+          for (Shard &shard : shards)
+            shard.writer->worker_finished();
+        });
+  }
+
+  // Shards after the first are written by threads of their own, each the
+  // only user of its sink
+  TaskGroup shard_writers;
+  for (size_t shard = 1; shard < shard_count; ++shard) {
+    shard_writers.start([&, shard] {
+      ThreadStatsScope stats_scope(config.stats.get(),
+                                   ThreadStats::Role::Writer, "writer", shard);
+      const size_t first = shard_starts[shard];
+      std::vector<size_t> &written = shards[shard].writtenNormalIndices;
+      shards[shard].writer->write_all(
+          *sinks[shard], should_stop, [&](size_t index) {
+            if (first + index < total_normal_files)
+              written.push_back(first + index);
+          });
+    });
+  }
+
+  // The calling thread writes results in order while the workers run. It is
+  // the only user of the output sink until the workers are joined, so
+  // output_mutex stays free for the workers' error reporting.
+  {
+    OrderedOutputWriter &writer = *shards[0].writer;
+    std::vector<size_t> &writtenNormalIndices = shards[0].writtenNormalIndices;
+    ThreadStatsScope stats_scope(config.stats.get(), ThreadStats::Role::Writer,
+                                 "writer");
+    if (budget) {
+      std::vector<OutputBlock> taken(total_files); // By output index
+      writer.consume_all(should_stop, [&](size_t rank, OutputBlock &block) {
+        if (budget->take(rank, block.tokens))
+          taken[rankedIndices[rank]] = std::move(block);
+        if (budget->full_after(rank))
+          budget_full = true; // Nothing left can fit; stop reading
+      });
+      budget_full = true;
+      unsigned long long taken_bytes = 0;
+      for (size_t index = 0; index < total_files; ++index) {
+        if (taken[index].empty())
+          continue;
+        (index < total_normal_files ? writtenNormalIndices : writtenLastIndices)
+            .push_back(index);
+        taken_bytes += outputFiles[index].size;
+      }
+      totalBytes = taken_bytes; // Only what made it into the output
+      if (!should_stop)
+        output.write_blocks(taken);
+    } else {
+      writer.write_all(
+          output, should_stop,
+          [&](size_t index) {
+            if (index < total_normal_files)
+              writtenNormalIndices.push_back(index);
+          },
+          [&](size_t index, OutputBlock &block) {
+            if (copies)
+              copies->resolve(index, block);
+          });
+    }
+  }
+  threads.join();
+  shard_writers.join();
+  if (config.stats)
+    config.stats->add_stage("process", stats_now_ns() - process_start);
+  for (const auto &shard : shards) // Streamed files cut short by a stop
+    totalBytes -= static_cast<size_t>(shard.writer->unwritten_bytes());
+
+  size_t cachedFiles = 0;
+  if (block_cache) {
+    cachedFiles = block_cache->hits();
+    block_cache->finish(); // Replace the pack with this run's blocks
+  }
+
+  // --- NEW: Append Summary List ---
+  // Each shard lists its own files
+  for (size_t shard = 0;
+       shard < shard_count && !should_stop && config.showSummary &&
+       !config.dryRun;
+       ++shard) {
+    const std::vector<size_t> &writtenNormalIndices =
+        shards[shard].writtenNormalIndices;
+    const size_t last_begin =
+        std::max(shard_starts[shard], total_normal_files);
+    const size_t last_end = std::max(shard_starts[shard + 1], last_begin);
+    std::vector<std::string> summaryRelativePaths;
+    summaryRelativePaths.reserve(writtenNormalIndices.size() + last_end -
+                                 last_begin);
+
+    // Add normal files (already sorted by output order)
+    for (size_t index : writtenNormalIndices) {
+      summaryRelativePaths.push_back(
+          summary_entry(outputFiles[index], config));
+    }
+
+    // Add last files (in --last order), listed whether or not they had
+    // output; with --max-tokens, only those the budget took
+    if (budget) {
+      for (size_t index : writtenLastIndices)
+        summaryRelativePaths.push_back(
+            summary_entry(outputFiles[index], config));
+    } else {
+      for (size_t index = last_begin; index < last_end; ++index) {
+        summaryRelativePaths.push_back(
+            summary_entry(outputFiles[index], config));
+      }
+    }
+
+    // Write summary section (needs lock if threads could still be writing
+    // errors?) Use the main output mutex for safety.
+    if (!summaryRelativePaths.empty()) {
+      std::lock_guard<std::mutex> lock(output_mutex);
+      std::string summary = "\n---\nProcessed Files (" +
+                            std::to_string(summaryRelativePaths.size()) +
+                            "):\n";
+      for (const auto &pathStr : summaryRelativePaths) {
+        summary += pathStr;
+        summary += '\n';
+      }
+      sinks[shard]->write(summary);
+    }
+  }
+  // --- End Summary List ---
+
+  // A stopped run leaves whole blocks only (see write_all), and says so
+  if (should_stop && !config.dryRun) {
+    for (OutputSink *sink : sinks)
+      sink->write("\n---\nStopped before all files were written.\n");
+  }
+
+  // --- Cleanup & Reporting ---
+  std::string final_message;
+  std::stringstream ss_msg;
+  // Files skipped as binary are reported on a line of their own
+  ss_msg << "Processed " << processedFiles.load() - skips.binaryFiles.load()
+         << " files (" << std::fixed
+         << std::setprecision(2) << (totalBytes.load() / (1024.0 * 1024.0))
+         << " MiB total).\n";
+  if (should_stop)
+    ss_msg << "Stopped early; the output ends with the last file written.\n";
+  if (const size_t binaryFiles = skips.binaryFiles.load()) {
+    ss_msg << "Skipped " << binaryFiles << " binary files ("
+           << (skips.binaryBytes.load() / (1024.0 * 1024.0))
+           << " MiB); use --include-binary to include them.\n";
+  }
+  if (copies && copies->copies_written() > 0) {
+    ss_msg << "Deduplicated " << copies->copies_written()
+           << " files with the same content as an earlier file ("
+           << (copies->copy_bytes_saved() / (1024.0 * 1024.0))
+           << " MiB not repeated).\n";
+  }
+  if (budget) {
+    ss_msg << "Token budget: about " << budget->used_tokens() << " of "
+           << config.maxTokens << " tokens, " << budget->taken_files()
+           << " of " << total_files << " files included.\n";
+  }
+  if (!config.cacheDir.empty()) {
+    ss_msg << "Reused " << cachedFiles << " cached file blocks from "
+           << normalize_path(config.cacheDir) << ".\n";
+  }
+
+  std::error_code write_error;
+  fs::path failed_path = config.outputFile;
+  for (size_t shard = 0; shard < shard_count; ++shard) {
+    const std::error_code ec = sinks[shard]->close();
+    if (ec && !write_error) {
+      write_error = ec;
+      if (sharded)
+        failed_path = shard_paths[shard];
+    }
+  }
+  // An index is only kept next to a complete bundle
+  if (!config.indexFile.empty()) {
+    std::error_code ec;
+    if (should_stop || write_error) {
+      fs::remove(config.indexFile, ec);
+    } else if (!write_file_atomically(config.indexFile,
+                                      index.to_json(config.compression))) {
+      std::cerr << "ERROR: Failed to write the index file: "
+                << normalize_path(config.indexFile) << '\n';
+      return false;
+    } else {
+      ss_msg << "Index of " << index.size() << " blocks written to: "
+             << normalize_path(fs::absolute(config.indexFile)) << '\n';
+    }
+  }
+  if (block_sink) {
+    block_sink->report(ss_msg.str());
+  } else if (!config.outputFile.empty()) {
+    if (write_error) { // Any failed write, or the close itself
+      std::cerr << "ERROR: Failed to write to output file: "
+                << normalize_path(failed_path) << " ("
+                << write_error.message() << ")" << std::endl;
+      return false; // Indicate failure if output write failed
+    }
+    if (sharded) {
+      ss_msg << "Output written to " << shard_count << " shards: "
+             << normalize_path(shard_paths.front());
+      if (shard_count > 1)
+        ss_msg << " to " << normalize_path(shard_paths.back());
+      ss_msg << std::endl;
+    } else {
+      ss_msg << "Output written to: "
+             << normalize_path(fs::absolute(config.outputFile)) << std::endl;
+    }
+    final_message = ss_msg.str();
+    // Print final message to console even if output went to file
+    std::cout << final_message;
+
+  } else {
+    // Print stats to console if output was stdout
+    ss_msg.seekp(0, std::ios_base::end); // Ensure writing at the end
+    ss_msg << "Output sent to stdout." << std::endl;
+    final_message = ss_msg.str();
+    // Use cerr for the final status message if output was stdout, to avoid
+    // mixing with content
+    std::cerr << "\n---\n" << final_message;
+  }
+
+  return true;
 }
 
-// --- Main Processing Functions ---
+// --- Watch Mode (--watch) ---
+// The tree is collected and formatted once. After that, change notifications
+// decide which directories are walked again and which '## File:' blocks are
+// formatted again; the -o file is reassembled from the blocks kept in memory
+// and replaced atomically, so readers never see a half-written file.
+
+enum class ChangeKind {
+  Contents, // A file was written
+  Entry,    // An entry was created, deleted or renamed
+  Listing,  // A directory's entries changed, names unknown (polling)
+  Overflow, // Notifications were lost; everything must be checked again
+};
 
-// Wrapper for single file processing used by main() if input is a file
-// Now handles summary output
-bool process_single_file_entry(const Config &config,
-                               std::ostream &output_stream) {
-  if (!fs::is_regular_file(config.dirPath)) {
-    std::cerr << "ERROR: process_single_file_entry called with non-file path: "
-              << normalize_path(config.dirPath) << std::endl;
-    return false;
+struct ChangeEvent {
+  ChangeKind kind;
+  fs::path path; // Absolute; the directory itself for Listing
+};
+
+// True if `path` is `root` or lies below it (component-wise, so "src2" is
+// not below "src")
+bool is_path_within(const fs::path &path, const fs::path &root) {
+  auto path_it = path.begin();
+  for (const auto &component : root) {
+    if (component.empty())
+      continue; // Trailing separator
+    if (path_it == path.end() || *path_it != component)
+      return false;
+    ++path_it;
   }
-  const fs::path base_abs_path =
-      config.dirPath.parent_path(); // Base is parent dir
+  return true;
+}
 
-  try {
-    if (config.dryRun) {
-      output_stream << "File to be processed:\n";
-      std::string normPath = normalize_path(config.dirPath);
-      if (config.useBackticks) {
-        output_stream << "`" << normPath << "`\n";
-      } else {
-        output_stream << normPath << "\n";
+// The collected file lists of a watched tree and the formatted block of
+// every file, kept up to date by apply()
+class WatchSession {
+public:
+  WatchSession(Config session_config, std::atomic<bool> &stop)
+      : config(std::move(session_config)), should_stop(stop) {
+    // Without a trailing separator, so walked paths compare equal to it
+    config.dirPath = config.dirPath.lexically_normal();
+    if (!config.dirPath.has_filename() && config.dirPath.has_relative_path())
+      config.dirPath = config.dirPath.parent_path();
+    if (!config.outputFile.empty())
+      output_path = fs::absolute(config.outputFile).lexically_normal();
+    if (!config.compiledFilters) // Shared by every walk of the session
+      config.compiledFilters = build_compiled_filters(config);
+  }
+
+  const Config &watch_config() const { return config; }
+
+  // Collects and formats the whole tree
+  void build(DirectoryListingCache *listing_cache, BlockCache *block_cache) {
+    std::vector<fs::path> walked;
+    auto [normal, last] =
+        collect_file_records(config, should_stop, listing_cache, &walked);
+    normal_files = std::move(normal);
+    last_files = sort_last_files(std::move(last), config);
+    directories = std::set<fs::path>(walked.begin(), walked.end());
+    drop_own_files();
+    blocks.clear();
+    format_missing_blocks(block_cache);
+  }
+
+  // Applies a batch of changes: walks the affected directories again and
+  // formats the blocks of changed files. Returns the number of blocks
+  // formatted.
+  size_t apply(const std::vector<ChangeEvent> &events) {
+    std::vector<std::pair<fs::path, bool>> rescans; // Directory, recursive
+    std::unordered_set<std::string> dirty; // Relative paths to format again
+    std::vector<fs::path> dirty_roots; // Every block below is formatted again
+    bool overflow = false;
+
+    for (const auto &event : events) {
+      if (event.kind == ChangeKind::Overflow) {
+        overflow = true;
+        continue;
+      }
+      if (is_own_file(event.path))
+        continue;
+      const fs::path parent = event.path.parent_path();
+      const bool is_gitignore = event.path.filename() == ".gitignore";
+      switch (event.kind) {
+      case ChangeKind::Contents:
+        if (is_gitignore) {
+          rescans.push_back({parent, true}); // Rules of the whole subtree
+        } else {
+          dirty.insert(relative_key(event.path));
+          if (config.maxFileSizeB > 0)
+            rescans.push_back({parent, false}); // May cross the -m limit
+        }
+        break;
+      case ChangeKind::Entry: {
+        std::error_code ec;
+        if (is_gitignore) {
+          rescans.push_back({parent, true});
+        } else if (fs::is_directory(event.path, ec) ||
+                   directories.count(event.path)) {
+          rescans.push_back({event.path, true});
+          dirty_roots.push_back(event.path); // May be a different tree now
+        } else {
+          rescans.push_back({parent, false});
+          dirty.insert(relative_key(event.path));
+        }
+        break;
+      }
+      case ChangeKind::Listing: {
+        rescans.push_back({event.path, false});
+        // New subdirectories are only visible in the listing itself
+        std::error_code ec;
+        fs::directory_iterator it(event.path, ec);
+        for (fs::directory_iterator end; !ec && it != end; it.increment(ec)) {
+          std::error_code type_ec;
+          if (it->is_directory(type_ec) && !directories.count(it->path()))
+            rescans.push_back({it->path(), true});
+        }
+        break;
+      }
+      case ChangeKind::Overflow:
+        break;
       }
+    }
+
+    if (overflow || (config.onlyLast && !rescans.empty())) {
+      // --only-last roots combine -z files and directories; collect again
+      std::vector<fs::path> walked;
+      auto [normal, last] =
+          collect_file_records(config, should_stop, nullptr, &walked);
+      normal_files = std::move(normal);
+      last_files = std::move(last);
+      directories = std::set<fs::path>(walked.begin(), walked.end());
+      if (overflow)
+        blocks.clear(); // Unknown which files changed
     } else {
-      // Process the single file
-      std::string file_content_output =
-          process_single_file(config.dirPath, config, base_abs_path);
-      if (!file_content_output.empty()) {
-        output_stream << "# File generated by DirCat\n"; // Add header
-        output_stream << file_content_output;
+      // Parents first, so a directory created together with its parent is
+      // walked once, from the parent
+      std::sort(rescans.begin(), rescans.end());
+      rescans.erase(std::unique(rescans.begin(), rescans.end()),
+                    rescans.end());
+      std::vector<fs::path> recursive_done;
+      for (const auto &[dir, recursive] : rescans) {
+        if (std::any_of(recursive_done.begin(), recursive_done.end(),
+                        [&](const fs::path &done) {
+                          return is_path_within(dir, done);
+                        }))
+          continue;
+        rescan(dir, recursive);
+        if (recursive)
+          recursive_done.push_back(dir);
+      }
+    }
 
-        // Add summary if requested
-        if (config.showSummary) {
-          output_stream << "\n---\nProcessed Files (1):\n";
-          std::string filename = normalize_path(config.dirPath.filename());
-          if (config.useBackticks) {
-            output_stream << "`" << filename << "`\n";
-          } else {
-            output_stream << filename << "\n";
+    auto same_path = [](const FileRecord &a, const FileRecord &b) {
+      return a.absolutePath == b.absolutePath;
+    };
+    sort_by_path(normal_files);
+    normal_files.erase(
+        std::unique(normal_files.begin(), normal_files.end(), same_path),
+        normal_files.end());
+    sort_by_path(last_files);
+    last_files.erase(
+        std::unique(last_files.begin(), last_files.end(), same_path),
+        last_files.end());
+    last_files = sort_last_files(std::move(last_files), config);
+    drop_own_files();
+
+    // Keep the blocks of files that are still listed and did not change
+    std::unordered_map<std::string, std::string> kept;
+    auto keep = [&](const FileRecord &file) {
+      auto it = blocks.find(file.relativePath);
+      if (it == blocks.end() || dirty.count(file.relativePath) ||
+          std::any_of(dirty_roots.begin(), dirty_roots.end(),
+                      [&](const fs::path &root) {
+                        return is_path_within(file.absolutePath, root);
+                      }))
+        return;
+      kept.emplace(file.relativePath, std::move(it->second));
+    };
+    for (const auto &file : normal_files)
+      keep(file);
+    for (const auto &file : last_files)
+      keep(file);
+    blocks = std::move(kept);
+    return format_missing_blocks(nullptr);
+  }
+
+  // The output of a full run over the current tree
+  std::string render() const {
+    std::string out;
+    if (normal_files.empty() && last_files.empty())
+      return out;
+    out += "# File generated by DirCat\n";
+    std::vector<std::string> summary;
+    for (const auto &file : normal_files) {
+      const std::string_view block = block_of(file);
+      if (block.empty())
+        continue; // Skipped, like an empty result in process_directory
+      out += block;
+      summary.push_back(summary_entry(file, config));
+    }
+    for (const auto &file : last_files) {
+      out += block_of(file);
+      summary.push_back(summary_entry(file, config));
+    }
+    if (config.showSummary && !summary.empty()) {
+      out += "\n---\nProcessed Files (" + std::to_string(summary.size()) +
+             "):\n";
+      for (const auto &entry : summary) {
+        out += entry;
+        out += '\n';
+      }
+    }
+    return out;
+  }
+
+  const std::set<fs::path> &walked_directories() const { return directories; }
+
+  std::vector<fs::path> files() const {
+    std::vector<fs::path> all = record_paths(normal_files);
+    for (const auto &file : last_files)
+      all.push_back(file.absolutePath);
+    return all;
+  }
+
+private:
+  // Empty for files not formatted yet (a stop during formatting)
+  std::string_view block_of(const FileRecord &file) const {
+    auto it = blocks.find(file.relativePath);
+    return it == blocks.end() ? std::string_view() : it->second;
+  }
+
+  // The key of a changed path in `blocks`
+  std::string relative_key(const fs::path &path) const {
+    return normalize_path(path.lexically_relative(config.dirPath));
+  }
+
+  // The -o file (and its temporary) and the cache directory may live inside
+  // the tree; they must never trigger or appear in the output
+  bool is_own_file(const fs::path &path) const {
+    if (!output_path.empty()) {
+      fs::path temp_path = output_path;
+      temp_path += ".tmp";
+      if (path == output_path || path == temp_path)
+        return true;
+    }
+    return !config.cacheDir.empty() && is_path_within(path, config.cacheDir);
+  }
+
+  void drop_own_files() {
+    auto own = [&](const FileRecord &file) {
+      return is_own_file(file.absolutePath);
+    };
+    std::erase_if(normal_files, own);
+    std::erase_if(last_files, own);
+  }
+
+  // A directory may be walked on its own if its parent was walked and the
+  // directory is not ignored there
+  bool is_walkable(const fs::path &dir, const fs::path &relative_dir) const {
+    std::error_code ec;
+    if (!fs::is_directory(dir, ec))
+      return false;
+    if (dir == config.dirPath)
+      return true;
+    if (!config.recursiveSearch || !is_path_within(dir, config.dirPath) ||
+        !directories.count(dir.parent_path()) || is_own_file(dir))
+      return false;
+    GitignoreScope scope;
+    if (!config.disableGitignore)
+      scope = build_gitignore_scope(config.dirPath, dir.parent_path());
+    return !is_walk_folder_ignored(normalize_path(relative_dir),
+                                   normalize_path(dir.filename()), scope,
+                                   config, *config.compiledFilters);
+  }
+
+  // Replaces the files of `dir` (and of its subtree if `recursive`) with a
+  // fresh walk of it
+  void rescan(const fs::path &dir, bool recursive) {
+    auto within = [&](const fs::path &path) {
+      return recursive ? is_path_within(path, dir) : path.parent_path() == dir;
+    };
+    auto record_within = [&](const FileRecord &file) {
+      return within(file.absolutePath);
+    };
+    std::erase_if(normal_files, record_within);
+    std::erase_if(last_files, record_within);
+    if (recursive)
+      std::erase_if(directories, within);
+
+    const fs::path relative_dir = dir.lexically_relative(config.dirPath);
+    if (!is_walkable(dir, relative_dir))
+      return;
+    std::string relative = normalize_path(relative_dir);
+    if (relative == ".")
+      relative.clear();
+    GitignoreScope parent_scope;
+    if (dir != config.dirPath && !config.disableGitignore)
+      parent_scope = build_gitignore_scope(config.dirPath, dir.parent_path());
+
+    std::vector<fs::path> walked;
+    run_directory_walk(config, should_stop,
+                       {{dir, std::move(relative), std::move(parent_scope)}},
+                       false, recursive && config.recursiveSearch,
+                       normal_files, last_files, nullptr, &walked);
+    directories.insert(walked.begin(), walked.end());
+  }
+
+  // Formats every listed file without a block, on the processing threads
+  size_t format_missing_blocks(BlockCache *block_cache) {
+    std::vector<const FileRecord *> pending;
+    for (const auto *list : {&normal_files, &last_files})
+      for (const auto &file : *list)
+        if (!blocks.count(file.relativePath))
+          pending.push_back(&file);
+    if (pending.empty())
+      return 0;
+
+    std::vector<std::string> results(pending.size());
+    const unsigned int num_threads =
+        resolve_thread_count(config, pending.size());
+    FileWorkQueue queue(pending.size(),
+                        choose_batch_size(pending.size(), num_threads,
+                                          config.outputWindow));
+    auto worker = [&]() {
+      size_t begin = 0, end = 0;
+      while (!should_stop && queue.claim(begin, end)) {
+        for (size_t i = begin; i < end; ++i) {
+          try {
+            if (!process_file_record_cached(results[i], *pending[i], config,
+                                            block_cache))
+              results[i].clear();
+          } catch (...) {
+            results[i].clear(); // Reported where possible; skip the file
           }
         }
-      } else {
-        // File was skipped or empty, print message to cerr if outputting to
-        // cout
-        if (&output_stream == &std::cout) {
-          std::cerr << "Input file processed but resulted in empty output."
-                    << std::endl;
+      }
+    };
+    TaskGroup threads;
+    for (unsigned int i = 1; i < num_threads; ++i)
+      threads.start(worker);
+    worker();
+    threads.join();
+
+    for (size_t i = 0; i < pending.size(); ++i)
+      blocks[pending[i]->relativePath] = std::move(results[i]);
+    return pending.size();
+  }
+
+  Config config;
+  std::atomic<bool> &should_stop;
+  fs::path output_path; // Absolute, empty without -o
+  std::vector<FileRecord> normal_files; // Sorted by path
+  std::vector<FileRecord> last_files;   // Sorted by --last order
+  std::set<fs::path> directories;     // Walked, so their changes matter
+  std::unordered_map<std::string, std::string> blocks; // By relative path
+};
+
+// Reports changes below the walked directories. Uses inotify on Linux; other
+// platforms, and Linux once inotify fails (e.g. at the watch limit), poll the
+// stamps of the collected files and the mtimes of the walked directories.
+class ChangeWatcher {
+public:
+  ChangeWatcher() {
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+  }
+  ChangeWatcher(const ChangeWatcher &) = delete;
+  ChangeWatcher &operator=(const ChangeWatcher &) = delete;
+  ~ChangeWatcher() {
+#ifdef __linux__
+    if (inotify_fd >= 0)
+      ::close(inotify_fd);
+#endif
+  }
+
+  bool uses_notifications() const {
+#ifdef __linux__
+    return inotify_fd >= 0;
+#else
+    return false;
+#endif
+  }
+
+  // Starts watching newly walked directories, or records the state the
+  // polling fallback compares against
+  void track(const std::set<fs::path> &dirs,
+             const std::vector<fs::path> &files) {
+#ifdef __linux__
+    if (inotify_fd >= 0) {
+      constexpr uint32_t kMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                 IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE |
+                                 IN_ATTRIB;
+      for (const auto &dir : dirs) {
+        if (watched.count(dir))
+          continue;
+        const int wd = inotify_add_watch(inotify_fd, dir.c_str(), kMask);
+        if (wd >= 0) {
+          watch_dirs[wd] = dir;
+          watched.insert(dir);
+        } else if (errno == ENOSPC || errno == ENOMEM) {
+          std::cerr << "WARNING: inotify watch limit reached; polling for "
+                       "changes instead.\n";
+          ::close(inotify_fd);
+          inotify_fd = -1;
+          break;
         }
       }
+      if (inotify_fd >= 0)
+        return;
     }
-  } catch (const std::exception &e) {
-    std::cerr << "ERROR: Processing single file: "
-              << normalize_path(config.dirPath) << ": " << e.what() << '\n';
+#endif
+    dir_mtimes.clear();
+    for (const auto &dir : dirs) {
+      std::error_code ec;
+      dir_mtimes[dir] =
+          fs::last_write_time(dir, ec).time_since_epoch().count();
+    }
+    file_stamps.clear();
+    for (const auto &file : files) {
+      FileStamp stamp;
+      if (get_file_stamp(file, stamp))
+        file_stamps[file] = stamp;
+    }
+  }
+
+  // Waits for changes, then keeps collecting until they stop arriving for a
+  // short while, so a burst of writes (an editor saving, a checkout) becomes
+  // one update. Returns false once a stop is requested.
+  bool wait(std::vector<ChangeEvent> &events,
+            const std::atomic<bool> &should_stop) {
+    bool found = false;
+    auto quiet_since = std::chrono::steady_clock::now();
+    const auto burst_start = quiet_since;
+    while (!should_stop) {
+      if (collect(events)) {
+        found = true;
+        quiet_since = std::chrono::steady_clock::now();
+      } else if (found &&
+                 (std::chrono::steady_clock::now() - quiet_since >= kSettle ||
+                  std::chrono::steady_clock::now() - burst_start >=
+                      kMaxBurst)) {
+        return true;
+      }
+      pause(found ? std::chrono::milliseconds(20) : kPollInterval,
+            should_stop);
+    }
+    return false;
+  }
+
+private:
+  static constexpr auto kSettle = std::chrono::milliseconds(100);
+  static constexpr auto kMaxBurst = std::chrono::milliseconds(1000);
+  static constexpr auto kPollInterval = std::chrono::milliseconds(250);
+
+  bool collect(std::vector<ChangeEvent> &events) {
+#ifdef __linux__
+    if (inotify_fd >= 0)
+      return read_notifications(events);
+#endif
+    return poll_changes(events);
+  }
+
+  // Sleeps up to `duration`, waking early when notifications arrive or a
+  // stop is requested
+  void pause(std::chrono::milliseconds duration,
+             const std::atomic<bool> &should_stop) {
+    const auto until = std::chrono::steady_clock::now() + duration;
+    for (auto now = std::chrono::steady_clock::now();
+         now < until && !should_stop; now = std::chrono::steady_clock::now()) {
+      const auto slice = std::min<std::chrono::steady_clock::duration>(
+          until - now, kStopPollInterval);
+#ifdef __linux__
+      if (inotify_fd >= 0) {
+        pollfd fd{inotify_fd, POLLIN, 0};
+        const auto ms =
+            std::chrono::ceil<std::chrono::milliseconds>(slice).count();
+        if (::poll(&fd, 1, static_cast<int>(ms)) > 0)
+          return;
+        continue;
+      }
+#endif
+      std::this_thread::sleep_for(slice);
+    }
+  }
+
+#ifdef __linux__
+  bool read_notifications(std::vector<ChangeEvent> &events) {
+    alignas(inotify_event) char buffer[64 * 1024];
+    bool found = false;
+    for (;;) {
+      const ssize_t length = ::read(inotify_fd, buffer, sizeof(buffer));
+      if (length <= 0)
+        return found; // EAGAIN: nothing more queued
+      for (const char *p = buffer; p < buffer + length;) {
+        const auto *event = reinterpret_cast<const inotify_event *>(p);
+        p += sizeof(inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          events.push_back({ChangeKind::Overflow, {}});
+          found = true;
+          continue;
+        }
+        auto it = watch_dirs.find(event->wd);
+        if (it == watch_dirs.end())
+          continue;
+        if (event->mask & IN_IGNORED) { // Directory gone or unwatched
+          watched.erase(it->second);
+          watch_dirs.erase(it);
+          continue;
+        }
+        if (event->len == 0)
+          continue; // About the directory itself; its parent reports it
+        const fs::path path = it->second / event->name;
+        if (event->mask &
+            (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+          events.push_back({ChangeKind::Entry, path});
+        } else if (!(event->mask & IN_ISDIR)) {
+          events.push_back({ChangeKind::Contents, path});
+        } else {
+          continue;
+        }
+        found = true;
+      }
+    }
+  }
+
+  int inotify_fd = -1;
+  std::unordered_map<int, fs::path> watch_dirs; // Watch descriptor -> dir
+  std::set<fs::path> watched;
+#endif
+
+  // Compares the current stamps with the tracked ones, updating them
+  bool poll_changes(std::vector<ChangeEvent> &events) {
+    bool found = false;
+    for (auto it = dir_mtimes.begin(); it != dir_mtimes.end();) {
+      std::error_code ec;
+      const long long mtime =
+          fs::last_write_time(it->first, ec).time_since_epoch().count();
+      if (ec) {
+        events.push_back({ChangeKind::Entry, it->first});
+        it = dir_mtimes.erase(it);
+        found = true;
+        continue;
+      }
+      if (mtime != it->second) {
+        events.push_back({ChangeKind::Listing, it->first});
+        it->second = mtime;
+        found = true;
+      }
+      ++it;
+    }
+    for (auto it = file_stamps.begin(); it != file_stamps.end();) {
+      FileStamp stamp;
+      if (!get_file_stamp(it->first, stamp)) {
+        events.push_back({ChangeKind::Entry, it->first});
+        it = file_stamps.erase(it);
+        found = true;
+        continue;
+      }
+      if (!(stamp == it->second)) {
+        events.push_back({ChangeKind::Contents, it->first});
+        it->second = stamp;
+        found = true;
+      }
+      ++it;
+    }
+    return found;
+  }
+
+  std::map<fs::path, long long> dir_mtimes;
+  std::map<fs::path, FileStamp> file_stamps;
+};
+
+// Entry point of --watch: writes the -o file once, then keeps it up to date
+// until a stop is requested
+bool watch_directory(Config config, std::atomic<bool> &should_stop) {
+  if (!fs::is_directory(config.dirPath)) {
+    std::cerr << "ERROR: --watch requires a directory input: "
+              << normalize_path(config.dirPath) << '\n';
+    return false;
+  }
+  const fs::path output_path = fs::absolute(config.outputFile);
+
+  WatchSession session(config, should_stop);
+  {
+    std::unique_ptr<DirectoryListingCache> listing_cache =
+        open_listing_cache(config);
+    std::unique_ptr<BlockCache> block_cache;
+    if (!config.cacheDir.empty())
+      block_cache = std::make_unique<BlockCache>(
+          config.cacheDir, session.watch_config().dirPath, config);
+    session.build(listing_cache.get(), block_cache.get());
+    if (listing_cache)
+      listing_cache->save(!should_stop);
+  }
+  if (should_stop)
+    return true;
+
+  std::string output = session.render();
+  if (!write_file_atomically(output_path,
+                             compress_text(config.compression, output))) {
+    std::cerr << "ERROR: Could not write output file: "
+              << normalize_path(output_path) << '\n';
     return false;
   }
+
+  ChangeWatcher watcher;
+  watcher.track(session.walked_directories(), session.files());
+  std::cout << "Output written to: " << normalize_path(output_path) << '\n'
+            << "Watching " << normalize_path(config.dirPath) << " for changes ("
+            << (watcher.uses_notifications() ? "notifications" : "polling")
+            << "). Press Ctrl+C to stop." << std::endl;
+
+  std::vector<ChangeEvent> events;
+  while (watcher.wait(events, should_stop)) {
+    const size_t formatted = session.apply(events);
+    events.clear();
+    watcher.track(session.walked_directories(), session.files());
+    std::string updated = session.render();
+    if (updated == output)
+      continue;
+    output = std::move(updated);
+    if (!write_file_atomically(output_path,
+                               compress_text(config.compression, output))) {
+      std::cerr << "WARNING: Could not update output file: "
+                << normalize_path(output_path) << '\n';
+      continue;
+    }
+    std::cout << "Updated output (" << formatted << " file blocks formatted)."
+              << std::endl;
+  }
+  std::cout << "Stopped watching " << normalize_path(config.dirPath) << '.'
+            << std::endl;
   return true;
 }
 
-// Main function for processing a directory
-// Uses optimized sort and chunk processing (Improvement 1)
-// Now handles summary output
-bool process_directory(Config config, std::atomic<bool> &should_stop) {
-  if (!fs::is_directory(config.dirPath)) {
-    std::cerr << "ERROR: process_directory called with non-directory path: "
-              << normalize_path(config.dirPath) << '\n';
-    return false;
+// --- Engine ---
+
+// The caches and threads an Engine keeps between runs
+struct EngineResources {
+  std::mutex mutex; // Guards `caches`, which clear_caches() replaces
+  std::shared_ptr<RuleCaches> caches = std::make_shared<RuleCaches>();
+  WorkerPool pool;
+};
+
+// Makes the calling thread work for `resources` until the scope ends
+class EngineScope {
+public:
+  explicit EngineScope(EngineResources &resources)
+      : previous(thread_engine) {
+    {
+      std::lock_guard<std::mutex> lock(resources.mutex);
+      context.caches = resources.caches;
+    }
+    context.pool = &resources.pool;
+    thread_engine = &context;
   }
-  const fs::path base_abs_path = config.dirPath; // Already absolute
+  EngineScope(const EngineScope &) = delete;
+  EngineScope &operator=(const EngineScope &) = delete;
+  ~EngineScope() { thread_engine = previous; }
 
-  // --- File Collection (uses optimized checks internally) ---
-  auto [normalFilesAbs, lastFilesListAbs] = collect_files(config, should_stop);
+private:
+  EngineContext context;
+  const EngineContext *previous;
+};
+
+Engine::Engine() : resources(std::make_unique<EngineResources>()) {}
+Engine::~Engine() = default;
+
+// --timeout: sets the run's stop flag from a thread of its own once the time
+// is up, unless the run ends first
+class RunDeadline {
+public:
+  RunDeadline(unsigned long long timeout_ms, std::atomic<bool> &should_stop) {
+    if (timeout_ms == 0)
+      return;
+    timer = std::thread([this, timeout_ms, &should_stop] {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!run_ended.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                              [this] { return ended; })) {
+        expired = true;
+        should_stop = true;
+      }
+    });
+  }
+  RunDeadline(const RunDeadline &) = delete;
+  RunDeadline &operator=(const RunDeadline &) = delete;
+  ~RunDeadline() { finish(); }
+
+  // Called when the run has ended. Returns true if the time ran out first.
+  bool finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ended = true;
+    }
+    run_ended.notify_all();
+    if (timer.joinable())
+      timer.join();
+    return expired;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable run_ended;
+  bool ended = false;
+  bool expired = false;
+  std::thread timer;
+};
+
+// Reports an expired --timeout; the run's result becomes a failure
+bool report_timeout(const Config &config) {
+  std::cerr << "ERROR: --timeout: stopped after " << config.timeoutMs
+            << " ms; the output holds what was written until then.\n";
+  return false;
+}
 
-  // --- Setup Output Stream ---
+// The engine's run without its --timeout: the -o file, then the input path
+bool run_input(const Config &config, std::atomic<bool> &should_stop) {
   std::ofstream outputFileStream;
-  std::ostream *outputPtr = &std::cout;
-  if (!config.outputFile.empty()) {
+  std::ostream *outputPtr = &std::cout; // Default to stdout
+  // Shards are opened by the run, under names of their own
+  if (!config.outputFile.empty() && config.shards == 0 &&
+      config.shardSize == 0) {
+    // Resolve potential relative path for output file
     fs::path absOutputPath = fs::absolute(config.outputFile);
     fs::path parentPath = absOutputPath.parent_path();
+
+    // Create output directory if it doesn't exist
     if (!parentPath.empty() && !fs::exists(parentPath)) {
       try {
         fs::create_directories(parentPath);
-        // Only print if outputting to console originally
-        if (&std::cout == outputPtr) {
-          std::cout << "Created output directory: "
-                    << normalize_path(parentPath) << std::endl;
-        }
+        std::cout << "Info: Created output directory: "
+                  << normalize_path(parentPath) << std::endl;
       } catch (const std::exception &e) {
         std::cerr << "ERROR: Failed to create output directory "
                   << normalize_path(parentPath) << ": " << e.what() << '\n';
         return false;
       }
     }
+
+    // Check if output path is an existing directory
     if (fs::exists(absOutputPath) && fs::is_directory(absOutputPath)) {
       std::cerr << "ERROR: Output path is an existing directory: "
                 << normalize_path(absOutputPath) << '\n';
       return false;
     }
-    // Open in binary mode and truncate
+
+    // Binary mode for consistent cross-platform newline handling, truncate
     outputFileStream.open(absOutputPath,
                           std::ios::binary | std::ios::out | std::ios::trunc);
     if (!outputFileStream.is_open()) {
@@ -1439,254 +7490,277 @@ bool process_directory(Config config, std::atomic<bool> &should_stop) {
     }
     outputPtr = &outputFileStream;
   }
-  std::ostream &output_stream = *outputPtr;
-
-  // --- Dry Run Handling ---
-  if (config.dryRun) {
-    output_stream << "Files to be processed ("
-                  << (normalFilesAbs.size() + lastFilesListAbs.size())
-                  << " total):\n";
-    output_stream << "--- Normal Files (" << normalFilesAbs.size() << ") ---\n";
-    std::vector<std::string> normalRelativePaths;
-    normalRelativePaths.reserve(normalFilesAbs.size());
-    for (const auto &absFile : normalFilesAbs) {
-      try {
-        normalRelativePaths.push_back(
-            normalize_path(fs::relative(absFile, base_abs_path)));
-      } catch (...) {
-        normalRelativePaths.push_back(normalize_path(absFile.filename()) +
-                                      " (relative error)");
-      }
-    }
-    std::sort(normalRelativePaths.begin(), normalRelativePaths.end());
-    for (const auto &relPath : normalRelativePaths) {
-      if (config.useBackticks) {
-        output_stream << "`" << relPath << "`\n";
-      } else {
-        output_stream << relPath << "\n";
-      }
-    }
 
-    output_stream << "--- Last Files (" << lastFilesListAbs.size() << ") ---\n";
-    std::mutex output_mutex_dry; // Dummy mutex needed for function signature
-    // process_last_files handles its own dry run output formatting now
-    process_last_files(lastFilesListAbs, config, should_stop, output_mutex_dry,
-                       output_stream);
-    return true; // Dry run finished
+  try {
+    if (fs::is_regular_file(config.dirPath))
+      return process_single_file_entry(config, *outputPtr);
+    // A directory's run opens the -o file itself; --watch replaces it on
+    // every update
+    outputFileStream.close();
+    if (config.watch)
+      return watch_directory(config, should_stop);
+    if (fs::is_directory(config.dirPath))
+      return process_directory(config, should_stop);
+    // Other file types (sockets, devices, ...)
+    std::cerr << "ERROR: Invalid input path type: "
+              << normalize_path(config.dirPath)
+              << ". Expecting a regular file or directory.\n";
+  } catch (const std::exception &e) {
+    // The processing functions report their own errors; this is a last resort
+    std::cerr << "ERROR: Unhandled exception during processing: " << e.what()
+              << std::endl;
+  } catch (...) {
+    std::cerr << "ERROR: Unknown unhandled exception during processing."
+              << std::endl;
   }
+  return false;
+}
 
-  // --- Actual Processing ---
-  if (normalFilesAbs.empty() && lastFilesListAbs.empty()) {
-    // Print message to cerr if outputting to cout
-    if (outputPtr == &std::cout) {
-      std::cerr << "No matching files found in: "
-                << normalize_path(config.dirPath) << "\n";
+// --batch: bundles each of config.batchRoots into its own output, up to -j
+// roots at once (default: one per hardware thread), in list order. The -j
+// threads are split between the roots running at once. The runs share the
+// engine's threads and caches and the patterns compiled once by
+// parse_arguments, so a root that finishes early frees its threads for the
+// next one. A root that fails is reported and the others carry on.
+bool run_batch(const Config &config, std::atomic<bool> &should_stop) {
+  const std::vector<BatchRoot> &roots = config.batchRoots;
+  std::atomic<size_t> next_root{0};
+  std::atomic<size_t> finished{0};
+  std::atomic<size_t> failed{0};
+  {
+    TaskGroup runs;
+    const unsigned int total_threads =
+        resolve_thread_count(config, std::numeric_limits<size_t>::max());
+    const unsigned int at_once = resolve_thread_count(config, roots.size());
+    for (unsigned int k = 0; k < at_once; ++k) {
+      // Each concurrent root gets its share, the first ones the remainder
+      const unsigned int root_threads =
+          total_threads / at_once + (k < total_threads % at_once ? 1 : 0);
+      runs.start([&, root_threads] {
+        while (!should_stop) {
+          const size_t i = next_root++;
+          if (i >= roots.size())
+            return;
+          bool success = false;
+          if (fs::is_directory(roots[i].dirPath)) {
+            Config root_config = config;
+            root_config.batchRoots.clear();
+            root_config.dirPath = roots[i].dirPath;
+            root_config.numThreads = root_threads;
+            root_config.outputFile = roots[i].outputFile;
+            root_config.compression = roots[i].compression;
+            success = run_input(root_config, should_stop);
+          } else {
+            std::cerr << "ERROR: --batch: not a directory, skipped: "
+                      << normalize_path(roots[i].dirPath) << '\n';
+          }
+          if (!success)
+            ++failed;
+          ++finished;
+        }
+      });
     }
-    return true;
   }
 
-  // --- Improvement 1: Use tuple for results (index, abs_path, content) ---
-  std::vector<std::tuple<size_t, fs::path, std::string>> orderedResults;
-  orderedResults.reserve(normalFilesAbs.size());
-  // --- End Improvement 1 ---
+  std::string message = "Batch: " +
+                        std::to_string(finished - failed) + " of " +
+                        std::to_string(roots.size()) + " roots written";
+  if (failed > 0)
+    message += ", " + std::to_string(failed) + " failed";
+  if (finished < roots.size())
+    message += ", " + std::to_string(roots.size() - finished) +
+               " not started (stopped)";
+  std::cout << message + ".\n";
+  return failed == 0 && finished == roots.size();
+}
 
-  output_stream << "# File generated by DirCat\n";
+bool Engine::run(const Config &config, std::atomic<bool> &should_stop) {
+  const EngineScope scope(*resources);
+  RunDeadline deadline(config.timeoutMs, should_stop);
+  const bool success = config.batchRoots.empty()
+                           ? run_input(config, should_stop)
+                           : run_batch(config, should_stop);
+  return deadline.finish() ? report_timeout(config) : success;
+}
 
-  std::atomic<size_t> processedFiles{0};
-  std::atomic<size_t> totalBytes{0};
-  std::mutex output_mutex; // Mutex for final output stream writing AND for cerr
-                           // in threads
+bool Engine::run(Config config, BlockSink &sink,
+                 std::atomic<bool> &should_stop) {
+  if (config.watch || !fs::is_directory(config.dirPath)) {
+    std::cerr << "ERROR: A block sink needs a directory and no --watch: "
+              << normalize_path(config.dirPath) << '\n';
+    return false;
+  }
+  config.outputFile.clear();
+  config.compression = Compression::None;
+  config.shards = 0;
+  config.shardSize = 0;
+  const EngineScope scope(*resources);
+  RunDeadline deadline(config.timeoutMs, should_stop);
+  try {
+    const bool success = process_directory(config, should_stop, &sink);
+    return deadline.finish() ? report_timeout(config) : success;
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: Unhandled exception during processing: " << e.what()
+              << std::endl;
+  } catch (...) {
+    std::cerr << "ERROR: Unknown unhandled exception during processing."
+              << std::endl;
+  }
+  return false;
+}
 
-  unsigned int num_threads = std::thread::hardware_concurrency();
-  num_threads = std::max(
-      1u, std::min(num_threads ? num_threads : 1u, 16u)); // Ensure >= 1, max 16
+void Engine::clear_caches() {
+  std::lock_guard<std::mutex> lock(resources->mutex);
+  resources->caches = std::make_shared<RuleCaches>();
+}
 
-  std::vector<std::thread> threads;
-  threads.reserve(num_threads);
-  const size_t total_normal_files = normalFilesAbs.size();
-  const size_t files_per_thread =
-      (total_normal_files == 0)
-          ? 0
-          : (total_normal_files + num_threads - 1) / num_threads;
-
-  // Vector to hold thread-local results before merging
-  std::vector<std::vector<std::tuple<size_t, fs::path, std::string>>>
-      thread_results(num_threads);
-
-  for (unsigned int i = 0; i < num_threads && files_per_thread > 0; ++i) {
-    const size_t start_index = i * files_per_thread;
-    if (start_index >= total_normal_files)
-      break;
-    const size_t end_index =
-        std::min(start_index + files_per_thread, total_normal_files);
-    std::span<const fs::path> chunk_span = {normalFilesAbs.data() + start_index,
-                                            end_index - start_index};
+// --- Signal Handling ---
 
-    threads.emplace_back(
-        // Capture output_mutex by reference for cerr locking
-        [&config, &base_abs_path, &processedFiles, &totalBytes, &should_stop,
-         &results_buffer = thread_results[i], &output_mutex](
-            std::span<const fs::path> chunk, size_t chunk_idx_start) {
-          try {
-            process_file_chunk(chunk, chunk_idx_start, config, base_abs_path,
-                               results_buffer, processedFiles, totalBytes,
-                               should_stop);
-          } catch (const std::exception &e) {
-            std::lock_guard<std::mutex> lock(output_mutex); // Lock cerr
-            std::cerr << "ERROR: Exception in processing thread: " << e.what()
-                      << '\n';
-          } catch (...) {
-            std::lock_guard<std::mutex> lock(output_mutex);
-            std::cerr << "ERROR: Unknown exception in processing thread.\n";
-          }
-        },
-        chunk_span, start_index);
-  }
+std::atomic<bool> *globalShouldStop = nullptr;
 
-  // --- Join Threads and Merge Results ---
-  for (auto &thread : threads) {
-    if (thread.joinable())
-      thread.join();
-  }
-  // Merge results into the main vector
-  for (const auto &local_results : thread_results) {
-    // Use move iterators for potentially better performance transferring
-    // strings
-    orderedResults.insert(orderedResults.end(),
-                          std::make_move_iterator(local_results.begin()),
-                          std::make_move_iterator(local_results.end()));
-  }
-  thread_results.clear(); // Free memory
+// Only calls what a signal handler may call: a lock-free atomic store,
+// write() and _Exit(). Messages go to stderr so they don't mix with the
+// output on stdout.
+void signalHandler(int signum) {
+  static_assert(std::atomic<bool>::is_always_lock_free);
+  const bool first = globalShouldStop && !globalShouldStop->load();
+  if (first)
+    *globalShouldStop = true; // Before the message, so the run stops sooner
+
+  char message[96];
+  size_t length = 0;
+  auto append = [&](const char *text) {
+    for (; *text && length < sizeof(message); ++text)
+      message[length++] = *text;
+  };
+  char digits[12];
+  size_t digit_count = 0;
+  for (unsigned value = signum > 0 ? static_cast<unsigned>(signum) : 0;
+       digit_count == 0 || value > 0; value /= 10)
+    digits[digit_count++] = static_cast<char>('0' + value % 10);
+  append("\nInterrupt signal (");
+  while (digit_count > 0 && length < sizeof(message))
+    message[length++] = digits[--digit_count];
+  append(first ? ") received, stopping gracefully...\n"
+               : ") received again, forcing exit.\n");
+#ifdef _WIN32
+  _write(2, message, static_cast<unsigned>(length));
+#else
+  const ssize_t written = ::write(STDERR_FILENO, message, length);
+  (void)written; // Nothing to do about a failed message
+#endif
+  if (!first)
+    std::_Exit(128 + signum); // Standard exit code for signals
+}
 
-  // --- Improvement 1: Sort based on original index ---
-  std::sort(orderedResults.begin(), orderedResults.end(),
-            [](const auto &a, const auto &b) {
-              return std::get<0>(a) < std::get<0>(b);
-            });
-  // --- End Improvement 1 ---
+// --- Argument Parsing (Adds population of Config sets - Improvement 4) ---
 
-  // --- Write Sorted Normal File Results ---
-  {
-    std::lock_guard<std::mutex> lock(
-        output_mutex); // Lock for writing normal files batch
-    for (const auto &result_tuple : orderedResults) {
-      if (should_stop)
-        break; // Check stop flag before writing each file's content
-      output_stream << std::get<2>(
-          result_tuple); // Write the formatted string content
+// A byte count with an optional K, M or G suffix (binary units), as taken by
+// -m and --shard-size. Throws std::invalid_argument or std::out_of_range.
+unsigned long long parse_byte_size(std::string size_str) {
+  unsigned long long multiplier = 1;
+  if (!size_str.empty()) {
+    // Handle potential negative sign before suffix check
+    bool negative = size_str[0] == '-';
+    if (negative)
+      throw std::invalid_argument("Size cannot be negative");
+
+    char suffix = std::toupper(size_str.back());
+    if (!std::isdigit(static_cast<unsigned char>(
+            suffix))) { // Check if last char is non-digit
+      if (suffix == 'K') {
+        multiplier = 1024ULL;
+        size_str.pop_back();
+      } else if (suffix == 'M') {
+        multiplier = 1024ULL * 1024ULL;
+        size_str.pop_back();
+      } else if (suffix == 'G') {
+        multiplier = 1024ULL * 1024ULL * 1024ULL;
+        size_str.pop_back();
+      } else {
+        throw std::invalid_argument("Invalid size suffix (use K, M, G)");
+      }
     }
   }
 
-  // --- Process and Write Last Files (handles own locking/buffering) ---
-  std::vector<fs::path> sortedLastFilesAbs; // To store for summary
-  if (!should_stop) {
-    sortedLastFilesAbs = process_last_files(
-        lastFilesListAbs, config, should_stop, output_mutex, output_stream);
+  if (!size_str.empty()) {
+    // Use stoull for unsigned long long
+    return std::stoull(size_str) * multiplier;
+  } else if (multiplier > 1) { // Handle cases like "-m M" meaning 1M
+    return multiplier;
   }
+  throw std::invalid_argument("Empty size value");
+}
 
-  // --- NEW: Append Summary List ---
-  if (!should_stop && config.showSummary && !config.dryRun) {
-    std::vector<std::string> summaryRelativePaths;
-    summaryRelativePaths.reserve(orderedResults.size() +
-                                 sortedLastFilesAbs.size());
-
-    // Add normal files (already sorted by output order)
-    for (const auto &result_tuple : orderedResults) {
-      const auto &absPath = std::get<1>(result_tuple);
-      try {
-        std::string relPathStr =
-            normalize_path(fs::relative(absPath, base_abs_path));
-        if (config.useBackticks) {
-          summaryRelativePaths.push_back("`" + relPathStr + "`");
-        } else {
-          summaryRelativePaths.push_back(relPathStr);
-        }
-      } catch (...) {
-        summaryRelativePaths.push_back(normalize_path(absPath.filename()) +
-                                       " (relative error)");
-      }
+// Reads the list of a --batch run: one "<directory><TAB><output file>" line
+// per root, relative paths taken from the current directory. Blank lines and
+// lines starting with # are skipped. Prints the problem and exits on an
+// error, which includes an output file inside another root, where that
+// root's run would bundle it half-written. Roots that are not directories
+// are reported by the run instead.
+std::vector<BatchRoot> read_batch_list(const fs::path &list_path) {
+  std::ifstream in(list_path, std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "ERROR: Could not read the --batch list: "
+              << normalize_path(list_path) << '\n';
+    exit(1);
+  }
+  std::vector<BatchRoot> roots;
+  std::vector<size_t> line_numbers;
+  std::unordered_set<std::string> outputs;
+  std::string line;
+  for (size_t line_number = 1; std::getline(in, line); ++line_number) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line[0] == '#')
+      continue;
+    const size_t tab = line.find('\t');
+    if (tab == 0 || tab == std::string::npos || tab + 1 == line.size()) {
+      std::cerr << "ERROR: --batch list " << normalize_path(list_path)
+                << ", line " << line_number
+                << ": expected <directory><TAB><output file>, got '" << line
+                << "'\n";
+      exit(1);
     }
-
-    // Add last files (already sorted by process_last_files)
-    for (const auto &absPath : sortedLastFilesAbs) {
-      try {
-        std::string relPathStr =
-            normalize_path(fs::relative(absPath, base_abs_path));
-        if (config.useBackticks) {
-          summaryRelativePaths.push_back("`" + relPathStr + "`");
-        } else {
-          summaryRelativePaths.push_back(relPathStr);
-        }
-      } catch (...) {
-        summaryRelativePaths.push_back(normalize_path(absPath.filename()) +
-                                       " (relative error)");
-      }
+    BatchRoot root;
+    try {
+      root.dirPath = fs::absolute(line.substr(0, tab));
+      root.outputFile = fs::absolute(line.substr(tab + 1)).lexically_normal();
+    } catch (const std::exception &e) {
+      std::cerr << "ERROR: --batch list " << normalize_path(list_path)
+                << ", line " << line_number << ": " << e.what() << '\n';
+      exit(1);
     }
-
-    // Write summary section (needs lock if threads could still be writing
-    // errors?) Use the main output mutex for safety.
-    if (!summaryRelativePaths.empty()) {
-      std::lock_guard<std::mutex> lock(output_mutex);
-      output_stream << "\n---\nProcessed Files (" << summaryRelativePaths.size()
-                    << "):\n";
-      for (const auto &pathStr : summaryRelativePaths) {
-        output_stream << pathStr << "\n";
-      }
+    if (!outputs.insert(normalize_path(root.outputFile)).second) {
+      std::cerr << "ERROR: --batch list " << normalize_path(list_path)
+                << ", line " << line_number << ": output file already used: "
+                << normalize_path(root.outputFile) << '\n';
+      exit(1);
     }
+    roots.push_back(std::move(root));
+    line_numbers.push_back(line_number);
   }
-  // --- End Summary List ---
-
-  // --- Cleanup & Reporting ---
-  std::string final_message;
-  std::stringstream ss_msg;
-  ss_msg << "Processed " << processedFiles.load() << " files (" << std::fixed
-         << std::setprecision(2) << (totalBytes.load() / (1024.0 * 1024.0))
-         << " MiB total).\n";
-
-  if (outputFileStream.is_open()) {
-    outputFileStream.close();
-    if (!outputFileStream) { // Check for errors on close
-      std::cerr << "ERROR: Failed to write to output file: "
-                << normalize_path(config.outputFile) << std::endl;
-      return false; // Indicate failure if output write failed
+  for (size_t i = 0; i < roots.size(); ++i) {
+    for (size_t j = 0; j < roots.size(); ++j) {
+      if (i == j || !is_path_within(roots[i].outputFile,
+                                    roots[j].dirPath.lexically_normal()))
+        continue;
+      std::cerr << "ERROR: --batch list " << normalize_path(list_path)
+                << ", line " << line_numbers[i]
+                << ": output file lies inside the root of line "
+                << line_numbers[j] << ": "
+                << normalize_path(roots[i].outputFile) << '\n';
+      exit(1);
     }
-    ss_msg << "Output written to: "
-           << normalize_path(fs::absolute(config.outputFile)) << std::endl;
-    final_message = ss_msg.str();
-    // Print final message to console even if output went to file
-    std::cout << final_message;
-
-  } else {
-    // Print stats to console if output was stdout
-    ss_msg.seekp(0, std::ios_base::end); // Ensure writing at the end
-    ss_msg << "Output sent to stdout." << std::endl;
-    final_message = ss_msg.str();
-    // Use cerr for the final status message if output was stdout, to avoid
-    // mixing with content
-    std::cerr << "\n---\n" << final_message;
   }
-
-  return true;
-}
-
-// --- Signal Handling ---
-
-std::atomic<bool> *globalShouldStop = nullptr;
-void signalHandler(int signum) {
-  if (globalShouldStop && !globalShouldStop->load()) {
-    // Use cerr for signal message so it doesn't mix with potential stdout
-    // output
-    std::cerr << "\nInterrupt signal (" << signum
-              << ") received, stopping gracefully...\n";
-    *globalShouldStop = true;
-  } else {
-    std::cerr << "\nInterrupt signal (" << signum
-              << ") received again, forcing exit.\n";
-    std::exit(128 + signum); // Standard exit code for signals
+  if (roots.empty()) {
+    std::cerr << "ERROR: The --batch list names no roots: "
+              << normalize_path(list_path) << '\n';
+    exit(1);
   }
+  return roots;
 }
 
-// --- Argument Parsing (Adds population of Config sets - Improvement 4) ---
 // Updated with --backticks and --summary
 Config parse_arguments(int argc, char *argv[]) {
   Config config;
@@ -1695,7 +7769,8 @@ Config parse_arguments(int argc, char *argv[]) {
   // (Keep the print_usage lambda from the thought process step)
   auto print_usage_internal = [&]() {
     std::cerr << "Usage: " << argv[0]
-              << " <directory_path | file_path> [options]\n";
+              << " <directory_path | file_path> [options]\n"
+              << "       " << argv[0] << " --batch <list_file> [options]\n";
     std::cerr
         << "Concatenates files in a directory based on specified criteria.\n\n";
     std::cerr << "Options:\n";
@@ -1742,6 +7817,60 @@ Config parse_arguments(int argc, char *argv[]) {
         {"-s, --summary",
          "Append a summary list of processed files at the end (normal run "
          "only)."}, // NEW
+        {"-j, --threads <n>",
+         "Number of processing threads. Default: one per hardware thread."},
+        {"-w, --window <files>",
+         "Max number of finished files buffered for ordered output. Bounds "
+         "memory use. Default: 256."},
+        {"--max-tokens <n>",
+         "Keep the output within about <n> LLM tokens (estimated). Files are "
+         "taken by priority: -z files first, then smaller files before "
+         "larger ones. Files that cannot fit are not read."},
+        {"--dedupe",
+         "Write files whose content is the same as an earlier file's as a "
+         "short reference to that file instead of repeating it."},
+        {"--index <file>",
+         "Also write a JSON manifest of the output to <file>: each file's "
+         "offset and length in the (uncompressed) output, size, mtime and "
+         "the XXH64 of its block."},
+        {"--timeout <seconds>",
+         "Stop after <seconds> (fractions allowed), keeping the files "
+         "written so far, and exit with an error."},
+        {"--shards <n>",
+         "Split the output into <n> -o files (out.0.md, out.1.md, ...), "
+         "each written by its own thread. Cuts prefer directory boundaries."},
+        {"--shard-size <bytes>",
+         "Like --shards, with as many shards as it takes for about <bytes> "
+         "of files each (e.g., 64M)."},
+        {"--compress <method>",
+         "Compress the output: none, gzip or zstd (if built in). Implied "
+         "by an -o name ending in .gz or .zst."},
+        {"--cache-dir <dir>",
+         "Keep formatted file blocks and directory listings in <dir>, so "
+         "later runs only re-read files whose size or mtime changed."},
+        {"--include-binary",
+         "Include files that look binary (NUL bytes, known binary formats, "
+         "mostly invalid UTF-8). By default they are skipped after reading "
+         "their first 8 KiB."},
+        {"--stats[=text|json]",
+         "Print per-stage timings and counters (walk, gitignore checks, "
+         "reads with latency percentiles, transforms, output) per thread on "
+         "stderr when the run ends. Default format: text."},
+        {"--watch",
+         "Keep running and update the -o file whenever files change, "
+         "formatting only the changed files again. Stop with Ctrl+C."},
+        {"--io <auto|read|mmap|stream>",
+         "How files are read. auto maps files of 1 MiB or more and reads "
+         "smaller ones with a single read(). Default: auto."},
+        {"--async-io",
+         "Read each batch of files ahead of formatting: through io_uring on "
+         "Linux, by a pool of reader threads elsewhere. Helps on cold caches "
+         "and network file systems. Not used with --cache-dir, --watch or "
+         "--io mmap|stream."},
+        {"--batch <list_file>",
+         "In place of the input path: bundle every directory of <list_file> "
+         "(one '<directory><TAB><output file>' per line) in one process, "
+         "sharing threads and caches. Up to -j roots run at once."},
         {"-h, --help", "Show this help message."}};
 
     size_t max_option_length = 0;
@@ -1769,20 +7898,31 @@ Config parse_arguments(int argc, char *argv[]) {
     }
   }
 
-  try {
-    config.dirPath = fs::absolute(argv[1]); // Use absolute path internally
-    if (!fs::exists(config.dirPath)) {
-      std::cerr << "ERROR: Input path does not exist: "
-                << normalize_path(config.dirPath) << '\n';
+  // --batch <list_file> takes the place of the input path
+  const bool batch = std::string_view(argv[1]) == "--batch";
+  if (batch) {
+    if (argc < 3) {
+      std::cerr << "ERROR: --batch requires a list file.\n";
+      exit(1);
+    }
+    config.batchRoots = read_batch_list(argv[2]);
+  } else {
+    try {
+      config.dirPath = fs::absolute(argv[1]); // Use absolute path internally
+      if (!fs::exists(config.dirPath)) {
+        std::cerr << "ERROR: Input path does not exist: "
+                  << normalize_path(config.dirPath) << '\n';
+        exit(1);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "ERROR: Invalid input path '" << argv[1]
+                << "': " << e.what() << '\n';
       exit(1);
     }
-  } catch (const std::exception &e) {
-    std::cerr << "ERROR: Invalid input path '" << argv[1] << "': " << e.what()
-              << '\n';
-    exit(1);
   }
 
-  for (int i = 2; i < argc; ++i) {
+  bool compression_given = false; // --compress, rather than the -o name
+  for (int i = batch ? 3 : 2; i < argc; ++i) {
     std::string_view arg = argv[i];
     std::function<void(std::vector<std::string> &)> parse_multi_arg;
     std::function<void(std::vector<fs::path> &)> parse_multi_path_arg;
@@ -1801,43 +7941,9 @@ Config parse_arguments(int argc, char *argv[]) {
         };
     parse_multi_path_arg = parse_multi_path_arg_internal;
 
-    if ((arg == "-m" || arg == "--max-size") &&
-        i + 1 < argc) { /* ... (Size parsing with K/M/G same as before) ... */
-      std::string size_str = argv[++i];
+    if ((arg == "-m" || arg == "--max-size") && i + 1 < argc) {
       try {
-        unsigned long long multiplier = 1;
-        if (!size_str.empty()) {
-          // Handle potential negative sign before suffix check
-          bool negative = size_str[0] == '-';
-          if (negative)
-            throw std::invalid_argument("Size cannot be negative");
-
-          char suffix = std::toupper(size_str.back());
-          if (!std::isdigit(static_cast<unsigned char>(
-                  suffix))) { // Check if last char is non-digit
-            if (suffix == 'K') {
-              multiplier = 1024ULL;
-              size_str.pop_back();
-            } else if (suffix == 'M') {
-              multiplier = 1024ULL * 1024ULL;
-              size_str.pop_back();
-            } else if (suffix == 'G') {
-              multiplier = 1024ULL * 1024ULL * 1024ULL;
-              size_str.pop_back();
-            } else {
-              throw std::invalid_argument("Invalid size suffix (use K, M, G)");
-            }
-          }
-        }
-
-        if (!size_str.empty()) {
-          // Use stoull for unsigned long long
-          config.maxFileSizeB = std::stoull(size_str) * multiplier;
-        } else if (multiplier > 1) { // Handle cases like "-m M" meaning 1M
-          config.maxFileSizeB = multiplier;
-        } else {
-          throw std::invalid_argument("Empty size value");
-        }
+        config.maxFileSizeB = parse_byte_size(argv[++i]);
       } catch (const std::exception &e) {
         std::cerr << "ERROR: Invalid max-size value: '" << argv[i]
                   << "'. Use positive integer bytes or suffix K/M/G. Error: "
@@ -1872,7 +7978,7 @@ Config parse_arguments(int argc, char *argv[]) {
       std::vector<fs::path> items;
       parse_multi_path_arg(items);
       for (auto &item : items) {
-        // Store raw paths, logic in should_ignore_* handles folder/file
+        // Store raw paths, build_compiled_filters sorts them
         std::string norm_item = normalize_path(item);
         if (!norm_item.empty() && norm_item.back() == '/') {
           config.ignoredFolders.push_back(
@@ -1917,6 +8023,145 @@ Config parse_arguments(int argc, char *argv[]) {
       config.useBackticks = true;
     } else if (arg == "-s" || arg == "--summary") { // NEW
       config.showSummary = true;
+    } else if ((arg == "-j" || arg == "--threads") && i + 1 < argc) {
+      std::string threads_str = argv[++i];
+      try {
+        if (threads_str.empty() || threads_str[0] == '-')
+          throw std::invalid_argument("Thread count must be positive");
+        unsigned long threads = std::stoul(threads_str);
+        if (threads == 0 || threads > std::numeric_limits<unsigned int>::max())
+          throw std::out_of_range("Thread count must be positive");
+        config.numThreads = static_cast<unsigned int>(threads);
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Invalid thread count: '" << threads_str
+                  << "'. Use a positive integer. Error: " << e.what() << "\n";
+        exit(1);
+      }
+    } else if ((arg == "-w" || arg == "--window") && i + 1 < argc) {
+      std::string window_str = argv[++i];
+      try {
+        if (window_str.empty() || window_str[0] == '-')
+          throw std::invalid_argument("Window must be positive");
+        config.outputWindow = std::stoull(window_str);
+        if (config.outputWindow == 0)
+          throw std::invalid_argument("Window must be positive");
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Invalid window value: '" << window_str
+                  << "'. Use a positive number of files. Error: " << e.what()
+                  << "\n";
+        exit(1);
+      }
+    } else if (arg == "--max-tokens" && i + 1 < argc) {
+      std::string tokens_str = argv[++i];
+      try {
+        if (tokens_str.empty() || tokens_str[0] == '-')
+          throw std::invalid_argument("Token budget must be positive");
+        config.maxTokens = std::stoull(tokens_str);
+        if (config.maxTokens == 0)
+          throw std::invalid_argument("Token budget must be positive");
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Invalid token budget: '" << tokens_str
+                  << "'. Use a positive number of tokens. Error: " << e.what()
+                  << "\n";
+        exit(1);
+      }
+    } else if (arg == "--cache-dir" && i + 1 < argc) {
+      fs::path cache_dir = fs::absolute(argv[++i]).lexically_normal();
+      if (!cache_dir.has_filename() && cache_dir.has_parent_path())
+        cache_dir = cache_dir.parent_path(); // Drop a trailing separator
+      config.cacheDir = cache_dir;
+    } else if (arg == "--include-binary") {
+      config.includeBinary = true;
+    } else if (arg == "--stats" || arg == "--stats=text") {
+      config.statsFormat = StatsFormat::Text;
+    } else if (arg == "--stats=json") {
+      config.statsFormat = StatsFormat::Json;
+    } else if (arg.rfind("--stats=", 0) == 0) {
+      std::cerr << "ERROR: Invalid value for --stats: " << arg.substr(8)
+                << " (expected text or json)\n";
+      exit(1);
+    } else if (arg == "--watch") {
+      config.watch = true;
+    } else if (arg == "--async-io") {
+      config.asyncIo = true;
+    } else if (arg == "--io" && i + 1 < argc) {
+      std::string backend_str = argv[++i];
+      if (backend_str == "auto") {
+        config.ioBackend = IoBackend::Auto;
+      } else if (backend_str == "read") {
+        config.ioBackend = IoBackend::Read;
+      } else if (backend_str == "mmap") {
+        config.ioBackend = IoBackend::Mmap;
+      } else if (backend_str == "stream") {
+        config.ioBackend = IoBackend::Stream;
+      } else {
+        std::cerr << "ERROR: Invalid I/O backend: '" << backend_str
+                  << "'. Use auto, read, mmap or stream.\n";
+        exit(1);
+      }
+    } else if (arg == "--dedupe") {
+      config.dedupe = true;
+    } else if (arg == "--index" && i + 1 < argc) {
+      config.indexFile = argv[++i];
+    } else if (arg == "--timeout" && i + 1 < argc) {
+      std::string timeout_str = argv[++i];
+      try {
+        size_t parsed = 0;
+        const double seconds = std::stod(timeout_str, &parsed);
+        if (parsed != timeout_str.size() || !(seconds > 0) ||
+            seconds > 1e9) // Also rejects NaN
+          throw std::invalid_argument("Timeout must be positive");
+        config.timeoutMs = static_cast<unsigned long long>(
+            std::max(1.0, std::ceil(seconds * 1000)));
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Invalid timeout: '" << timeout_str
+                  << "'. Use a positive number of seconds. Error: "
+                  << e.what() << "\n";
+        exit(1);
+      }
+    } else if (arg == "--shards" && i + 1 < argc) {
+      std::string shards_str = argv[++i];
+      try {
+        if (shards_str.empty() || shards_str[0] == '-')
+          throw std::invalid_argument("Shard count must be positive");
+        config.shards = std::stoull(shards_str);
+        if (config.shards == 0 || config.shards > kMaxShards)
+          throw std::out_of_range("Shard count must be 1 to " +
+                                  std::to_string(kMaxShards));
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Invalid shard count: '" << shards_str
+                  << "'. Use a positive integer. Error: " << e.what() << "\n";
+        exit(1);
+      }
+    } else if (arg == "--shard-size" && i + 1 < argc) {
+      try {
+        config.shardSize = parse_byte_size(argv[++i]);
+        if (config.shardSize == 0)
+          throw std::invalid_argument("Shard size must be positive");
+      } catch (const std::exception &e) {
+        std::cerr << "ERROR: Invalid shard size: '" << argv[i]
+                  << "'. Use positive integer bytes or suffix K/M/G. Error: "
+                  << e.what() << "\n";
+        exit(1);
+      }
+    } else if (arg == "--compress" && i + 1 < argc) {
+      std::string method_str = argv[++i];
+      if (method_str == "none") {
+        config.compression = Compression::None;
+      } else if (method_str == "gzip") {
+        config.compression = Compression::Gzip;
+      } else if (method_str == "zstd") {
+        config.compression = Compression::Zstd;
+      } else {
+        std::cerr << "ERROR: Invalid compression: '" << method_str
+                  << "'. Use none, gzip or zstd.\n";
+        exit(1);
+      }
+      compression_given = true;
+    } else if (arg == "--batch") {
+      std::cerr << "ERROR: --batch takes the place of the input path and "
+                   "must come first.\n";
+      exit(1);
     } else {
       std::cerr << "ERROR: Unknown or invalid option: " << arg << "\n\n";
       print_usage();
@@ -1939,17 +8184,109 @@ Config parse_arguments(int argc, char *argv[]) {
     config.lastDirsSetRel.insert(normalize_path(p));
   }
 
+  // Compile -r/-d once; the walk threads share the result read-only
+  config.compiledFilters = build_compiled_filters(config);
+
   // --- Final Validation ---
+  // The roots of --batch are checked to be directories when their turn comes
+  const bool directory_input = batch || fs::is_directory(config.dirPath);
+  if (batch && (!config.outputFile.empty() || config.watch || config.dryRun ||
+                !config.indexFile.empty() ||
+                config.statsFormat != StatsFormat::Off)) {
+    std::cerr << "ERROR: --batch takes the output files from its list, and "
+                 "cannot be combined with -o, --watch, --dry-run, --index or "
+                 "--stats.\n";
+    exit(1);
+  }
   if (config.onlyLast && config.lastFiles.empty() && config.lastDirs.empty()) {
     std::cerr
         << "ERROR: --only-last specified, but no items provided via --last.\n";
     exit(1);
   }
-  if (config.onlyLast && !fs::is_directory(config.dirPath)) {
+  if (config.onlyLast && !directory_input) {
     std::cerr << "ERROR: --only-last option requires the input path to be a "
                  "directory.\n";
     exit(1);
   }
+  if (config.watch &&
+      (config.outputFile.empty() || config.dryRun ||
+       !directory_input)) {
+    std::cerr << "ERROR: --watch requires a directory input and an output "
+                 "file (-o), and cannot be combined with --dry-run.\n";
+    exit(1);
+  }
+  if (config.watch && config.statsFormat != StatsFormat::Off) {
+    std::cerr << "ERROR: --stats cannot be combined with --watch.\n";
+    exit(1);
+  }
+  if (config.maxTokens > 0 &&
+      (config.watch || config.dryRun || !directory_input)) {
+    std::cerr << "ERROR: --max-tokens requires a directory input, and cannot "
+                 "be combined with --watch or --dry-run.\n";
+    exit(1);
+  }
+  if (config.dedupe && (config.watch || config.maxTokens > 0)) {
+    std::cerr << "ERROR: --dedupe cannot be combined with --watch or "
+                 "--max-tokens.\n";
+    exit(1);
+  }
+  if (!config.indexFile.empty() &&
+      (config.watch || config.dryRun || !directory_input)) {
+    std::cerr << "ERROR: --index requires a directory input, and cannot be "
+                 "combined with --watch or --dry-run.\n";
+    exit(1);
+  }
+  if (!config.indexFile.empty() && !config.outputFile.empty() &&
+      fs::absolute(config.indexFile).lexically_normal() ==
+          fs::absolute(config.outputFile).lexically_normal()) {
+    std::cerr << "ERROR: --index and -o name the same file: "
+              << normalize_path(config.indexFile) << '\n';
+    exit(1);
+  }
+  if (config.shards > 0 && config.shardSize > 0) {
+    std::cerr << "ERROR: Use either --shards or --shard-size, not both.\n";
+    exit(1);
+  }
+  if ((config.shards > 0 || config.shardSize > 0) &&
+      ((config.outputFile.empty() && !batch) || config.watch ||
+       config.dryRun || config.maxTokens > 0 || config.dedupe ||
+       !config.indexFile.empty() || !directory_input)) {
+    std::cerr << "ERROR: --shards and --shard-size require a directory input "
+                 "and an output file (-o), and cannot be combined with "
+                 "--watch, --dry-run, --max-tokens, --dedupe or --index.\n";
+    exit(1);
+  }
+  // An -o name ending in .gz or .zst implies --compress, as do the output
+  // names of a --batch list, each for its own root
+  auto output_compression = [&](const fs::path &output) {
+    if (compression_given)
+      return config.compression;
+    const fs::path extension = output.extension();
+    const Compression implied = extension == ".gz"    ? Compression::Gzip
+                                : extension == ".zst" ? Compression::Zstd
+                                                      : Compression::None;
+    if (compression_available(implied))
+      return implied;
+    std::cerr << "WARNING: This build has no " << compression_name(implied)
+              << " support; writing " << normalize_path(output)
+              << " uncompressed.\n";
+    return Compression::None;
+  };
+  if (!config.outputFile.empty() && directory_input)
+    config.compression = output_compression(config.outputFile);
+  for (BatchRoot &root : config.batchRoots)
+    root.compression = output_compression(root.outputFile);
+  if (!compression_available(config.compression)) {
+    std::cerr << "ERROR: This build has no "
+              << compression_name(config.compression)
+              << " support; rebuild with zlib (gzip) or libzstd (zstd).\n";
+    exit(1);
+  }
+  if (config.compression != Compression::None &&
+      !directory_input) {
+    std::cerr << "ERROR: --compress requires a directory input.\n";
+    exit(1);
+  }
 
   return config;
 }
\ No newline at end of file
@@ -28,9 +28,7 @@ void cleanup_test_directories() {
   fs::remove("summary_output.txt", ec);
   // Clear static caches between test runs if necessary (can affect gitignore
   // tests)
-  gitignore_rules_cache.clear();
-  accumulated_rules_cache.clear();
-  regex_cache.clear();
+  rule_caches().clear();
 }
 
 // Creates a test file, ensuring parent directory exists
@@ -133,6 +131,41 @@ std::string capture_stdout(const std::function<void()> &func) {
   return buffer.str();
 }
 
+#ifndef _WIN32
+// Captures what is written to the stdout descriptor itself, bypassing
+// std::cout, through a temporary file
+std::string capture_stdout_descriptor(const std::function<void()> &func) {
+  const fs::path path = fs::temp_directory_path() / "dircat_stdout_fd.txt";
+  std::cout.flush();
+  std::fflush(stdout);
+  const int saved = ::dup(STDOUT_FILENO);
+  const int file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  assert(saved >= 0 && file >= 0);
+  ::dup2(file, STDOUT_FILENO);
+  ::close(file);
+  func();
+  std::cout.flush();
+  std::fflush(stdout);
+  ::dup2(saved, STDOUT_FILENO);
+  ::close(saved);
+  std::ifstream in(path, std::ios::binary);
+  std::string text((std::istreambuf_iterator<char>(in)), {});
+  in.close();
+  fs::remove(path);
+  return text;
+}
+#endif
+
+// Captures stderr
+std::string capture_stderr(const std::function<void()> &func) {
+  std::stringstream buffer;
+  std::streambuf *oldCerr = std::cerr.rdbuf();
+  std::cerr.rdbuf(buffer.rdbuf());
+  func();
+  std::cerr.rdbuf(oldCerr);
+  return buffer.str();
+}
+
 // Helper to create a default Config for tests
 Config get_default_config(const fs::path &base_path) {
   Config config;
@@ -261,6 +294,92 @@ void test_is_path_ignored_by_gitignore_multi_level() {
   std::cout << " Passed\n";
 }
 
+void test_gitignore_nested_precedence() {
+  std::cout << "Test: Nested .gitignore rules take precedence..."
+            << std::flush;
+  create_test_directory_gitignore_structure();
+  fs::path base_abs = TEST_GITIGNORE_DIR_PATH / "precedence";
+  create_test_file(base_abs / ".gitignore", "*.md\n");
+  create_test_file(base_abs / "a" / ".gitignore", "!h.md\nb/\n");
+  create_test_file(base_abs / "top.md", "top\n");
+  create_test_file(base_abs / "a" / "h.md", "h\n");
+  create_test_file(base_abs / "a" / "g.md", "g\n");
+  create_test_file(base_abs / "a" / "y.cpp", "y\n");
+  create_test_file(base_abs / "a" / "b" / "x.cpp", "x\n");
+  create_test_file(base_abs / "b" / "z.cpp", "z\n");
+
+  // As in git, a child's rules come after its parent's: its negation
+  // brings back a file the parent ignores, and its directory rule applies
+  // below it only
+  auto rules_map = build_gitignore_map(base_abs);
+  auto check_ignored = [&](const fs::path &relative_path_from_base) {
+    return is_path_ignored_by_gitignore(base_abs / relative_path_from_base,
+                                        base_abs, rules_map);
+  };
+  assert(check_ignored("top.md") == true);
+  assert(check_ignored("a/h.md") == false); // Negated by a/.gitignore
+  assert(check_ignored("a/g.md") == true);
+  assert(check_ignored("a/b/x.cpp") == true); // b/ rule in a
+  assert(check_ignored("b/z.cpp") == false);
+
+  // The walk agrees
+  Config config = get_default_config(base_abs);
+  std::atomic<bool> stop_flag{false};
+  auto [normal, last] = collect_file_records(config, stop_flag);
+  std::vector<std::string> paths;
+  for (const auto &record : normal)
+    paths.push_back(record.relativePath);
+  assert(paths ==
+         std::vector<std::string>({"a/h.md", "a/y.cpp", "b/z.cpp"}));
+
+  std::cout << " Passed\n";
+}
+
+void test_gitignore_matcher_matches_regex_rules() {
+  std::cout << "Test: Compiled gitignore matcher agrees with regex rules..."
+            << std::flush;
+  const std::vector<std::string> patterns = {
+      "*.txt",   "/build",   "build/",    "Thumbs.DB", "a/**/b",  "**/x",
+      "foo?",    "dir/",     "!keep.txt", "a/b",       "*.tar.gz", "[x]",
+      "/docs/api", "*.",     "/",         "src/*.c",   "**",       "x/**",
+      "!/build/keep", "*",   "???",       "a*b*c",     "!dir/ok"};
+  const std::vector<std::string> paths = {
+      "notes.txt",      "dir/notes.TXT",  "build",         "build/out.o",
+      "src/build",      "src/build/a.o",  "thumbs.db",     "a/b",
+      "a/x/y/b",        "a/bb",           "x",             "deep/x/file",
+      "food",           "foo",            "dir",           "dir/ok",
+      "keep.txt",       "pkg.tar.gz",     "[x]",           "docs/api/v1",
+      "docs/apis",      "trailing.",      "src/main.c",    "src/sub/main.c",
+      "build/keep",     "abc",            "a_b_c",         "ab/c",
+      "x/y",            "plain"};
+
+  // Every single pattern on its own, then growing prefixes of the list so
+  // negations interact with earlier rules
+  for (const auto &pattern : patterns) {
+    GitignoreMatcher matcher({pattern});
+    for (const auto &path : paths) {
+      assert(matcher.is_ignored(path) ==
+             matches_gitignore_rules(path, false, {pattern}));
+    }
+  }
+  for (size_t count = 1; count <= patterns.size(); ++count) {
+    std::vector<std::string> rules(patterns.begin(),
+                                   patterns.begin() + count);
+    GitignoreMatcher matcher(rules);
+    for (const auto &path : paths) {
+      assert(matcher.is_ignored(path) ==
+             matches_gitignore_rules(path, false, rules));
+    }
+  }
+
+  // Globs too long for the automaton fall back to the regex evaluation
+  std::string long_glob(70, '?');
+  GitignoreMatcher long_matcher({long_glob});
+  assert(long_matcher.is_ignored(std::string(70, 'a')));
+  assert(!long_matcher.is_ignored(std::string(69, 'a')));
+  std::cout << " Passed\n";
+}
+
 void test_is_file_size_valid() {
   std::cout << "Test: Is file size valid..." << std::flush;
   // Function signature changed, test needs to provide size
@@ -273,31 +392,30 @@ void test_is_file_size_valid() {
 
 void test_is_file_extension_allowed() {
   std::cout << "Test: Is file extension allowed..." << std::flush;
-  std::vector<std::string> allowed_exts = {"cpp", "hpp"}; // lowercase, no dot
-  std::vector<std::string> excluded_exts = {"excluded"};  // lowercase, no dot
-
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.cpp", allowed_exts,
-                                   excluded_exts) == true);
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.CPP", allowed_exts,
-                                   excluded_exts) ==
-         true); // Case insensitive check
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.hpp", allowed_exts,
-                                   excluded_exts) == true);
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.txt", allowed_exts,
-                                   excluded_exts) == false);
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.excluded",
-                                   allowed_exts, excluded_exts) ==
-         false); // Explicitly excluded
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.excluded", {}, {}) ==
-         true); // Allowed if no rules
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file", allowed_exts,
-                                   excluded_exts) ==
+  Config config;
+  config.fileExtensions = {"cpp", "hpp"};       // lowercase, no dot
+  config.excludedFileExtensions = {"excluded"}; // lowercase, no dot
+  const auto filters = build_compiled_filters(config);
+  Config excluding_config;
+  excluding_config.excludedFileExtensions = config.excludedFileExtensions;
+  const auto excluding = build_compiled_filters(excluding_config);
+  const auto no_rules = build_compiled_filters(Config());
+  // As the walk checks a filename
+  auto allowed = [](const CompiledFilters &set, std::string_view name) {
+    return set.is_extension_selected(filename_extension(name));
+  };
+
+  assert(allowed(*filters, "file.cpp") == true);
+  assert(allowed(*filters, "file.CPP") == true); // Case insensitive check
+  assert(allowed(*filters, "file.hpp") == true);
+  assert(allowed(*filters, "file.txt") == false);
+  assert(allowed(*filters, "file.excluded") == false); // Explicitly excluded
+  assert(allowed(*no_rules, "file.excluded") == true); // Allowed if no rules
+  assert(allowed(*filters, "file") ==
          false); // No extension, but allowed_exts is not empty
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file", {}, excluded_exts) ==
+  assert(allowed(*excluding, "file") ==
          true); // No extension, allowed_exts is empty
-  assert(is_file_extension_allowed(TEST_DIR_PATH / "file.", allowed_exts,
-                                   excluded_exts) ==
-         false); // Only dot, no extension
+  assert(allowed(*filters, "file.") == false); // Only dot, no extension
 
   std::cout << " Passed\n";
 }
@@ -306,29 +424,28 @@ void test_should_ignore_folder() {
   std::cout << "Test: Should ignore folder..." << std::flush;
   create_test_directory_structure();
   fs::path base_abs = TEST_DIR_PATH;
-  auto rules_map = build_gitignore_map(base_abs);
   Config config = get_default_config(base_abs); // Use default config
+  // As the walk checks a folder, with the .gitignore scope of its parent
+  auto ignored = [&](const std::string &relative_path) {
+    const fs::path folder = base_abs / relative_path;
+    const GitignoreScope scope =
+        build_gitignore_scope(base_abs, folder.parent_path());
+    const auto filters = build_compiled_filters(config);
+    return is_walk_folder_ignored(relative_path,
+                                  normalize_path(folder.filename()), scope,
+                                  config, *filters);
+  };
 
   // Gitignored folders
-  assert(should_ignore_folder(base_abs / ".hidden_dir", config.disableGitignore,
-                              base_abs, config.ignoredFolders,
-                              rules_map) == true);
-  assert(should_ignore_folder(base_abs / "ignored_folder",
-                              config.disableGitignore, base_abs,
-                              config.ignoredFolders, rules_map) == true);
+  assert(ignored(".hidden_dir") == true);
+  assert(ignored("ignored_folder") == true);
   // Not ignored folder
-  assert(should_ignore_folder(base_abs / "not_ignored_folder",
-                              config.disableGitignore, base_abs,
-                              config.ignoredFolders, rules_map) == false);
+  assert(ignored("not_ignored_folder") == false);
   // Manually ignored folder (relative path)
   config.ignoredFolders.push_back("subdir1"); // Add relative path
-  assert(should_ignore_folder(base_abs / "subdir1", config.disableGitignore,
-                              base_abs, config.ignoredFolders,
-                              rules_map) == true);
+  assert(ignored("subdir1") == true);
   // Nested under manually ignored folder
-  assert(should_ignore_folder(base_abs / "subdir1" / "subsub",
-                              config.disableGitignore, base_abs,
-                              config.ignoredFolders, rules_map) == true);
+  assert(ignored("subdir1/subsub") == true);
 
   std::cout << " Passed\n";
 }
@@ -337,15 +454,23 @@ void test_should_ignore_file() {
   std::cout << "Test: Should ignore file..." << std::flush;
   create_test_directory_structure();
   fs::path base_abs = TEST_DIR_PATH;
-  auto rules_map = build_gitignore_map(base_abs);
   Config config = get_default_config(base_abs);
   config.maxFileSizeB = 2048; // Set max size
+  // As the walk checks a file, with the .gitignore scope of its directory
+  auto ignored = [&](const fs::path &relative_path,
+                     unsigned long long file_size) {
+    const fs::path file = base_abs / relative_path;
+    const GitignoreScope scope =
+        build_gitignore_scope(base_abs, file.parent_path());
+    const auto filters = build_compiled_filters(config);
+    return !is_walk_file_selected(normalize_path(relative_path),
+                                  normalize_path(file.filename()), file_size,
+                                  scope, config, *filters);
+  };
 
   // Get file sizes manually for the test
   unsigned long long size_file1_cpp = fs::file_size(base_abs / "file1.cpp");
   unsigned long long size_file2_txt = fs::file_size(base_abs / "file2.txt");
-  unsigned long long size_large_file = fs::file_size(
-      base_abs / "large_file.cpp"); // This one is ignored by gitignore anyway
 
   fs::path ignore_me_rel = "subdir1/ignore_me.txt";
   create_test_file(base_abs / ignore_me_rel, "ignore this content");
@@ -357,34 +482,23 @@ void test_should_ignore_file() {
       fs::file_size(base_abs / large_ignore_rel);
 
   // Gitignored file (*.txt)
-  assert(should_ignore_file(base_abs / "file2.txt", size_file2_txt,
-                            config.disableGitignore, base_abs,
-                            config.maxFileSizeB, config.ignoredFiles,
-                            rules_map) == true);
-  // Manually ignored file (relative path)
+  assert(ignored("file2.txt", size_file2_txt) == true);
+  // Manually ignored file (relative path); config.disableGitignore keeps
+  // the *.txt rule from deciding
+  config.disableGitignore = true;
   config.ignoredFiles.push_back(ignore_me_rel);
-  assert(should_ignore_file(base_abs / ignore_me_rel, size_ignore_me,
-                            config.disableGitignore, base_abs,
-                            config.maxFileSizeB, config.ignoredFiles,
-                            rules_map) == true);
+  assert(ignored(ignore_me_rel, size_ignore_me) == true);
   // Manually ignored file (filename only)
   config.ignoredFiles.clear();
   config.ignoredFiles.push_back("ignore_me.txt"); // filename
-  assert(should_ignore_file(base_abs / ignore_me_rel, size_ignore_me,
-                            config.disableGitignore, base_abs,
-                            config.maxFileSizeB, config.ignoredFiles,
-                            rules_map) == true);
+  assert(ignored(ignore_me_rel, size_ignore_me) == true);
   config.ignoredFiles.clear();
+  assert(ignored(ignore_me_rel, size_ignore_me) == false);
+  config.disableGitignore = false;
   // File exceeding max size
-  assert(should_ignore_file(base_abs / large_ignore_rel, size_large_ignore,
-                            config.disableGitignore, base_abs,
-                            config.maxFileSizeB, config.ignoredFiles,
-                            rules_map) == true);
+  assert(ignored(large_ignore_rel, size_large_ignore) == true);
   // Normal file, not ignored
-  assert(should_ignore_file(base_abs / "file1.cpp", size_file1_cpp,
-                            config.disableGitignore, base_abs,
-                            config.maxFileSizeB, config.ignoredFiles,
-                            rules_map) == false);
+  assert(ignored("file1.cpp", size_file1_cpp) == false);
 
   std::cout << " Passed\n";
 }
@@ -424,6 +538,87 @@ void test_matches_filename_regex_filters() {
   std::cout << " Passed\n";
 }
 
+void test_compiled_filters() {
+  std::cout << "Test: Compiled regex filters..." << std::flush;
+  Config config;
+  config.regexFilters = {"file[0-9]\\.txt", "^large_"};
+  config.filenameRegexFilters = {".*\\.cpp", "FILE.*", "large.*"};
+  auto filters = build_compiled_filters(config);
+  assert(filters->excludeRegexes.size() == 2);
+  assert(filters->includeRegexes.size() == 3);
+  assert(filters->is_filename_selected("file1.cpp") == true);
+  assert(filters->is_filename_selected("FILE3.HPP") == true);
+  assert(filters->is_filename_selected("file2.txt") == false); // Excluded
+  assert(filters->is_filename_selected("large_file.cpp") ==
+         false); // Exclusion wins over inclusion
+  assert(filters->is_filename_selected("file5") == false); // Not included
+
+  // No filters select everything; an invalid pattern matches nothing
+  Config empty_config;
+  assert(build_compiled_filters(empty_config)->is_filename_selected("any"));
+  Config invalid_config;
+  invalid_config.regexFilters = {"("};
+  assert(build_compiled_filters(invalid_config)->is_filename_selected("("));
+  std::cout << " Passed\n";
+}
+
+void test_compiled_ignore_filters() {
+  std::cout << "Test: Compiled extension and ignore lists..." << std::flush;
+  PathTrie trie;
+  assert(!trie.covers("build"));
+  trie.insert("build");
+  trie.insert("src/gen");
+  assert(trie.covers("build") && trie.covers("build/obj/a.o"));
+  assert(trie.covers("src/gen") && trie.covers("src/gen/x"));
+  assert(!trie.covers("src") && !trie.covers("src/general"));
+  assert(!trie.covers("builds") && !trie.covers("lib/build"));
+
+  Config config;
+  config.fileExtensions = {"cpp", "h"};
+  config.excludedFileExtensions = {"h"};
+  config.ignoredFolders = {"out", "third_party/vendor", "stale/"};
+  config.ignoredFiles = {"notes.txt", "src/skip.cpp", "docs/api"};
+  auto filters = build_compiled_filters(config);
+  assert(filters->is_extension_selected("cpp"));
+  assert(filters->is_extension_selected("CPP")); // Any case
+  assert(!filters->is_extension_selected("h")); // Exclusion wins
+  assert(!filters->is_extension_selected("txt"));
+  assert(!filters->is_extension_selected("")); // -e given: needs one
+  // File names match files anywhere, but no folder
+  assert(filters->is_file_ignored("a/b/notes.txt", "notes.txt"));
+  assert(!filters->is_folder_ignored("a/notes.txt"));
+  // File paths match that file only
+  assert(filters->is_file_ignored("src/skip.cpp", "skip.cpp"));
+  assert(!filters->is_file_ignored("lib/skip.cpp", "skip.cpp"));
+  assert(!filters->is_folder_ignored("docs/api"));
+  // Folder paths match that folder and its contents
+  assert(filters->is_folder_ignored("out"));
+  assert(filters->is_folder_ignored("third_party/vendor/zlib"));
+  assert(!filters->is_folder_ignored("third_party"));
+  assert(!filters->is_folder_ignored("src/out"));
+  assert(!filters->is_folder_ignored("stale")); // Trailing '/': no match
+  Config empty_config;
+  auto empty = build_compiled_filters(empty_config);
+  assert(empty->is_extension_selected("") && empty->is_extension_selected("x"));
+  assert(!empty->is_folder_ignored("a") && !empty->is_file_ignored("a", "a"));
+
+  // The walk applies them
+  create_test_directory_structure();
+  Config walk_config = get_default_config(TEST_DIR_PATH);
+  walk_config.ignoredFolders = {"not_ignored_folder"};
+  walk_config.ignoredFiles = {"file1.cpp", "subdir1/file6.cpp"};
+  walk_config.fileExtensions = {"cpp"};
+  std::atomic<bool> stop_flag{false};
+  auto [normal, last] = collect_file_records(walk_config, stop_flag);
+  std::vector<std::string> paths;
+  for (const auto &record : normal)
+    paths.push_back(record.relativePath);
+  assert(paths == std::vector<std::string>({".hidden_file.cpp", "file_abc.cpp",
+                                            "file_def.cpp"}));
+
+  std::cout << " Passed\n";
+}
+
 void test_remove_cpp_comments() {
   std::cout << "Test: Remove cpp comments..." << std::flush;
   std::string code_with_comments =
@@ -444,6 +639,196 @@ void test_remove_cpp_comments() {
   std::cout << " Passed\n";
 }
 
+// Byte-at-a-time comment stripper, kept as the reference for the jumping
+// implementation in lib.cpp
+std::string remove_cpp_comments_reference(const std::string &code) {
+  std::string result;
+  bool inString = false, inChar = false;
+  bool inSingleLineComment = false, inMultiLineComment = false;
+  for (size_t i = 0; i < code.size(); ++i) {
+    char current_char = code[i];
+    char next_char = (i + 1 < code.size()) ? code[i + 1] : '\0';
+    if (inString || inChar) {
+      result += current_char;
+      if (current_char == '\\' && next_char != '\0') {
+        result += next_char;
+        ++i;
+      } else if (current_char == (inString ? '"' : '\'')) {
+        inString = inChar = false;
+      }
+    } else if (inSingleLineComment) {
+      if (current_char == '\n') {
+        inSingleLineComment = false;
+        result += current_char;
+      }
+    } else if (inMultiLineComment) {
+      if (current_char == '*' && next_char == '/') {
+        inMultiLineComment = false;
+        ++i;
+      }
+    } else if (current_char == '"') {
+      inString = true;
+      result += current_char;
+    } else if (current_char == '\'') {
+      inChar = true;
+      result += current_char;
+    } else if (current_char == '/' && next_char == '/') {
+      inSingleLineComment = true;
+      ++i;
+    } else if (current_char == '/' && next_char == '*') {
+      inMultiLineComment = true;
+      ++i;
+    } else {
+      result += current_char;
+    }
+  }
+  return result;
+}
+
+// Line-by-line -l/-L formatting of a whole buffer, kept as the reference for
+// the streaming line stage in lib.cpp
+void append_transformed_content(std::string &out, std::string_view content,
+                                const Config &config) {
+  size_t line_start = 0;
+  int lineNumber = 1;
+  while (line_start < content.length()) {
+    size_t line_end = content.find('\n', line_start);
+    size_t line_len = (line_end == std::string_view::npos)
+                          ? (content.length() - line_start)
+                          : (line_end - line_start);
+    std::string_view line = content.substr(line_start, line_len);
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    bool is_empty_line =
+        (line.find_first_not_of(" \t") == std::string_view::npos);
+    if (!config.removeEmptyLines || !is_empty_line) {
+      if (config.showLineNumbers)
+        out += std::to_string(lineNumber++) + " | ";
+      out += line;
+      out += '\n';
+    }
+    if (line_end == std::string_view::npos)
+      break;
+    line_start = line_end + 1;
+  }
+}
+
+void test_fused_transform_pipeline() {
+  std::cout << "Test: Fused -c/-l/-L transform in random chunks..."
+            << std::flush;
+  const std::string alphabet = "/*\"'\\\n\r \tab";
+  unsigned int seed = 777;
+  auto next_random = [&seed]() {
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 16) & 0x7FFF;
+  };
+  for (int round = 0; round < 4000; ++round) {
+    std::string content;
+    const size_t length = next_random() % 60;
+    for (size_t i = 0; i < length; ++i)
+      content += alphabet[next_random() % alphabet.size()];
+
+    Config config;
+    config.removeComments = next_random() % 2;
+    config.removeEmptyLines = next_random() % 2;
+    config.showLineNumbers = next_random() % 2;
+
+    std::string expected;
+    append_transformed_content(
+        expected,
+        config.removeComments ? remove_cpp_comments_reference(content)
+                              : content,
+        config);
+
+    // Whole buffer at once
+    std::string whole = "x"; // Existing buffer contents are kept
+    append_file_content(whole, content, config, config.removeComments);
+    assert(whole == "x" + expected);
+
+    // The same bytes split at random points, including empty chunks
+    std::string chunked;
+    ContentTransformer transformer(chunked, config.removeComments,
+                                   config.removeEmptyLines,
+                                   config.showLineNumbers);
+    size_t pos = 0;
+    while (pos < content.size()) {
+      const size_t take =
+          std::min<size_t>(next_random() % 4, content.size() - pos);
+      transformer.feed(std::string_view(content).substr(pos, take));
+      pos += take;
+    }
+    transformer.finish();
+    assert(chunked == expected);
+  }
+  std::cout << " Passed\n";
+}
+
+void test_remove_cpp_comments_matches_reference() {
+  std::cout << "Test: Remove cpp comments matches byte-wise reference..."
+            << std::flush;
+  // Random programs over the bytes that drive the state machine
+  const std::string alphabet = "/*\"'\\\nab \t";
+  unsigned int seed = 12345;
+  auto next_random = [&seed]() {
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 16) & 0x7FFF;
+  };
+  for (int round = 0; round < 3000; ++round) {
+    std::string code;
+    const size_t length = next_random() % 80;
+    for (size_t i = 0; i < length; ++i)
+      code += alphabet[next_random() % alphabet.size()];
+    assert(remove_cpp_comments(code) == remove_cpp_comments_reference(code));
+  }
+  std::cout << " Passed\n";
+}
+
+void test_scan_kernels() {
+  std::cout << "Test: SIMD scan kernels (" << scan_kernels().name << ")..."
+            << std::flush;
+  std::vector<FindBytesKernel> find_kernels = {find_bytes_scalar};
+  std::vector<FindNonBlankKernel> blank_kernels = {find_non_blank_scalar};
+#if DIRCAT_SIMD_SSE2
+  find_kernels.push_back(find_bytes_sse2);
+  blank_kernels.push_back(find_non_blank_sse2);
+#endif
+#if DIRCAT_SIMD_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    find_kernels.push_back(find_bytes_avx2);
+    blank_kernels.push_back(find_non_blank_avx2);
+  }
+#endif
+#if DIRCAT_SIMD_NEON
+  find_kernels.push_back(find_bytes_neon);
+  blank_kernels.push_back(find_non_blank_neon);
+#endif
+
+  // Sparse matches at every offset and length, across vector boundaries
+  std::string data(100, ' ');
+  for (size_t hit = 0; hit <= data.size(); ++hit) {
+    std::string text = data;
+    if (hit < text.size())
+      text[hit] = '/';
+    for (size_t start = 0; start < 40; ++start) {
+      const char *p = text.data() + start;
+      const size_t n = text.size() - start;
+      const size_t expected = find_bytes_scalar(p, n, '"', '\'', '/');
+      const size_t expected_blank = find_non_blank_scalar(p, n);
+      for (auto kernel : find_kernels)
+        assert(kernel(p, n, '"', '\'', '/') == expected);
+      for (auto kernel : blank_kernels)
+        assert(kernel(p, n) == expected_blank);
+    }
+  }
+  assert(find_first_of_bytes("abc/def", 0, '/', '/', '/') == 3);
+  assert(find_first_of_bytes("abc/def", 4, '/', '/', '/') ==
+         std::string_view::npos);
+  assert(is_blank_line(" \t \t                    \t"));
+  assert(!is_blank_line("                             x"));
+  assert(is_blank_line(""));
+  std::cout << " Passed\n";
+}
+
 void test_format_file_output() {
   std::cout << "Test: Format file output..." << std::flush;
   fs::path base_abs = TEST_DIR_PATH;
@@ -500,6 +885,35 @@ void test_format_file_output_line_numbers() {
   std::cout << " Passed\n";
 }
 
+void test_format_file_output_plain_fast_path() {
+  std::cout << "Test: Format file output plain fast path..." << std::flush;
+  const std::vector<std::string> contents = {
+      "",          "a",          "a\n",      "a\r\nb\r\n", "a\rb\n",
+      "a\r",       "a\r\r\n",    "\n\n",     "x\r\ny",     "\r",
+      "tab\t \n ", "end\r\n\r\n"};
+  Config plain;
+  for (const auto &content : contents) {
+    // The line-by-line path with no transform enabled is the reference
+    std::string expected;
+    append_transformed_content(expected, content, plain);
+    std::string actual;
+    append_plain_content(actual, content);
+    assert(actual == expected);
+  }
+
+  // Appending keeps earlier buffer contents and numbers lines past 9
+  std::string buffer = "prefix";
+  Config numbered;
+  numbered.showLineNumbers = true;
+  std::string content;
+  for (int i = 0; i < 12; ++i)
+    content += "l\n";
+  append_transformed_content(buffer, content, numbered);
+  assert(buffer.rfind("prefix1 | l\n2 | l\n", 0) == 0);
+  assert(buffer.find("\n12 | l\n") != std::string::npos);
+  std::cout << " Passed\n";
+}
+
 void test_format_file_output_backticks() {
   std::cout << "Test: Format file output with backticks..." << std::flush;
   fs::path base_abs = TEST_DIR_PATH;
@@ -555,6 +969,155 @@ void test_process_single_file() {
   std::cout << " Passed\n";
 }
 
+void test_file_buffer_backends() {
+  std::cout << "Test: File buffer I/O backends..." << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH;
+  fs::path small_abs = base_abs / "io_small.cpp";
+  fs::path large_abs = base_abs / "io_large.cpp";
+  fs::path empty_abs = base_abs / "io_empty.cpp";
+  create_test_file(small_abs, "int a; // note\r\nint b;\n");
+  std::string large_content;
+  while (large_content.size() < kMmapThresholdB + 4096)
+    large_content += "line " + std::to_string(large_content.size()) + "\n";
+  create_test_file(large_abs, large_content);
+  create_test_file(empty_abs, "");
+
+  const IoBackend backends[] = {IoBackend::Auto, IoBackend::Read,
+                                IoBackend::Mmap, IoBackend::Stream};
+  for (IoBackend backend : backends) {
+    FileBuffer buffer;
+    std::error_code ec = buffer.load(small_abs, backend);
+    assert(!ec);
+    assert(buffer.view() == "int a; // note\r\nint b;\n");
+    assert(buffer.is_mapped() == (backend == IoBackend::Mmap));
+    ec = buffer.load(large_abs, backend);
+    assert(!ec);
+    assert(buffer.view() == large_content);
+    assert(buffer.is_mapped() ==
+           (backend == IoBackend::Auto || backend == IoBackend::Mmap));
+    ec = buffer.load(empty_abs, backend);
+    assert(!ec);
+    assert(buffer.view().empty());
+    ec = buffer.load(base_abs / "io_missing.cpp", backend);
+    assert(ec);
+
+    // Every backend produces the same formatted output
+    Config config = get_default_config(base_abs);
+    config.removeComments = true;
+    config.ioBackend = IoBackend::Stream;
+    std::string expected = process_single_file(small_abs, config, base_abs);
+    config.ioBackend = backend;
+    assert(process_single_file(small_abs, config, base_abs) == expected);
+  }
+
+  // Moving a mapped buffer keeps the mapping
+  FileBuffer mapped;
+  const std::error_code mapped_ec = mapped.load(large_abs, IoBackend::Mmap);
+  assert(!mapped_ec);
+  FileBuffer moved = std::move(mapped);
+  assert(moved.is_mapped() && moved.view() == large_content);
+  assert(mapped.view().empty());
+
+  fs::remove(small_abs);
+  fs::remove(large_abs);
+  fs::remove(empty_abs);
+  std::cout << " Passed\n";
+}
+
+void test_binary_detection() {
+  std::cout << "Test: Binary content prefilter..." << std::flush;
+  using namespace std::string_literals;
+  assert(!looks_binary("int main() {\n\treturn 0;\r\n}\n"));
+  assert(!looks_binary(""));
+  assert(!looks_binary(
+      "\xef\xbb\xbf// UTF-8 BOM, caf\xc3\xa9, \xe6\x97\xa5\xe6\x9c\xac\n"));
+  assert(!looks_binary( // Latin-1: 2 invalid bytes in 55
+      "// Le caf\xe9 de la r\xe9publique est ouvert tous les jours.\n"));
+  // A multi-byte sequence cut off by the end of the prefix is not counted
+  assert(!looks_binary(std::string(100, 'a') + "\xe6\x97"));
+  assert(looks_binary("text with a \0 byte"s));
+  assert(looks_binary("\x89PNG\r\n\x1a\nIHDR"));
+  assert(looks_binary("\x7f" "ELF\x02\x01\x01"));
+  assert(looks_binary("PK\x03\x04rest of zip"));
+  assert(looks_binary("\xff\xfeh\0i\0"s)); // UTF-16 LE
+  assert(looks_binary("%PDF-1.7\n"));
+  std::string noise;
+  uint32_t state = 12345;
+  while (noise.size() < 4096) {
+    state = state * 1103515245u + 12345u;
+    const char c = static_cast<char>(0x80 | (state >> 24)); // No NUL bytes
+    noise += c;
+  }
+  assert(looks_binary(noise));
+
+  // Rejected files are skipped before the full read, by every backend
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH;
+  fs::path image_abs = base_abs / "image.png";
+  std::string image = "\x89PNG\r\n\x1a\n"s + std::string(300000, '\0');
+  create_test_file(image_abs, image);
+  create_test_file(base_abs / "large.bin",
+                   std::string(kMmapThresholdB, '\x01'));
+  const IoBackend backends[] = {IoBackend::Auto, IoBackend::Read,
+                                IoBackend::Mmap, IoBackend::Stream};
+  for (IoBackend backend : backends) {
+    FileBuffer buffer;
+    std::error_code ec = buffer.load(image_abs, backend, looks_binary);
+    assert(!ec);
+    assert(buffer.was_rejected() && buffer.view().empty());
+    ec = buffer.load(base_abs / "large.bin", backend, looks_binary);
+    assert(!ec);
+    assert(buffer.was_rejected());
+    ec = buffer.load(base_abs / "file1.cpp", backend, looks_binary);
+    assert(!ec);
+    assert(!buffer.was_rejected() && !buffer.view().empty());
+    ec = buffer.load(image_abs, backend);
+    assert(!ec);
+    assert(!buffer.was_rejected() && buffer.view() == image);
+  }
+
+  // process_directory skips and counts them unless --include-binary is set
+  Config config = get_default_config(base_abs);
+  std::atomic<bool> stop_flag{false};
+  std::string output;
+  const std::string messages = capture_stderr([&]() {
+    output = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  });
+  assert(output.find("## File: image.png") == std::string::npos);
+  assert(output.find("## File: large.bin") == std::string::npos);
+  assert(output.find("## File: file1.cpp") != std::string::npos);
+  // Only the files written count as processed
+  size_t blocks = 0;
+  for (size_t at = output.find("\n## File: "); at != std::string::npos;
+       at = output.find("\n## File: ", at + 1))
+    ++blocks;
+  assert(messages.find("Processed " + std::to_string(blocks) + " files (") !=
+         std::string::npos);
+  assert(messages.find("Skipped 2 binary files (") != std::string::npos);
+  SkipCounters skips;
+  std::string block;
+  bool formatted =
+      process_single_file_into(block, image_abs, config, base_abs, &skips);
+  assert(!formatted);
+  assert(block.empty() && skips.binaryFiles == 1 &&
+         skips.binaryBytes == image.size());
+  config.includeBinary = true;
+  output = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  assert(output.find("## File: image.png") != std::string::npos);
+  assert(output.find("## File: large.bin") != std::string::npos);
+
+  fs::remove(image_abs);
+  fs::remove(base_abs / "large.bin");
+  std::cout << " Passed\n";
+}
+
 void test_is_last_file() {
   std::cout << "Test: Is last file..." << std::flush;
   create_test_directory_structure();
@@ -728,6 +1291,127 @@ void test_collect_files_only_last() {
   std::cout << " Passed\n";
 }
 
+void test_collect_files_nested_gitignore() {
+  std::cout << "Test: Collect files with nested gitignore scopes..."
+            << std::flush;
+  create_test_directory_gitignore_structure();
+  fs::path base_abs = TEST_GITIGNORE_DIR_PATH;
+  Config config = get_default_config(base_abs);
+  std::atomic<bool> stop_flag{false};
+
+  // Rules from subdir1/.gitignore apply only inside subdir1, and the negation
+  // there overrides the inherited root rule.
+  auto [normal_files, last_files] = collect_files(config, stop_flag);
+  check_collect_results(
+      normal_files, last_files, 3, 0,
+      {"file_root.level0", "important.level2", "file_sub2.level2"}, {});
+
+  // A --only-last walk that starts below the base still inherits the parent
+  // directories' rules
+  config.onlyLast = true;
+  config.lastDirs.push_back("subdir1");
+  config.lastDirsSetRel.insert(normalize_path("subdir1"));
+  auto [normal_only, last_only] = collect_files(config, stop_flag);
+  check_collect_results(normal_only, last_only, 0, 1, {},
+                        {"important.level2"});
+
+  std::cout << " Passed\n";
+}
+
+void test_collect_files_parallel_walk() {
+  std::cout << "Test: Parallel walk matches single-threaded walk..."
+            << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH;
+  for (int d = 0; d < 20; ++d) {
+    fs::path dir = base_abs / "tree" / ("d" + std::to_string(d)) / "nested";
+    create_test_file(dir / "a.cpp", "a\n");
+    create_test_file(dir.parent_path() / "b.cpp", "b\n");
+    create_test_file(dir.parent_path() / "c.txt", "ignored by *.txt\n");
+  }
+  Config config = get_default_config(base_abs);
+  std::atomic<bool> stop_flag{false};
+
+  config.numThreads = 1;
+  auto [serial_normal, serial_last] = collect_files(config, stop_flag);
+  config.numThreads = 8;
+  auto [parallel_normal, parallel_last] = collect_files(config, stop_flag);
+
+  assert(serial_normal.size() == 10 + 40);
+  assert(parallel_normal == serial_normal); // Same files, same sorted order
+  assert(parallel_last == serial_last);
+
+  // --no-recursive only looks at the top level, even with many threads
+  config.recursiveSearch = false;
+  auto [top_normal, top_last] = collect_files(config, stop_flag);
+  assert(top_normal.size() == 8); // 10 normal files minus the 2 in subdirs
+
+#ifndef _WIN32
+  // Symlinks leading back up the tree are skipped, so the walk ends
+  const fs::path loop_base = base_abs / "loop";
+  create_test_file(loop_base / "real" / "a.cpp", "a\n");
+  fs::create_directory_symlink("..", loop_base / "real" / "loop");
+  fs::create_directory_symlink("real", loop_base / "inner");
+  Config loop_config = get_default_config(loop_base);
+  loop_config.numThreads = 4;
+  std::vector<FileRecord> loop_files;
+  const std::string warnings = capture_stderr([&]() {
+    loop_files = collect_file_records(loop_config, stop_flag).first;
+  });
+  assert(loop_files.size() == 2);
+  assert(loop_files[0].relativePath == "inner/a.cpp");
+  assert(loop_files[1].relativePath == "real/a.cpp");
+  assert(warnings.find("Skipping a directory symlink loop: ") !=
+         std::string::npos);
+#endif
+
+  std::cout << " Passed\n";
+}
+
+void test_file_records() {
+  std::cout << "Test: File records and path ordering..." << std::flush;
+  FileRecord record = make_file_record(
+      (fs::path("/base") / "src" / "main.test.cpp").native(),
+      "src/main.test.cpp", 42);
+  assert(record.filename() == "main.test.cpp");
+  assert(record.extension() == "cpp");
+  FileRecord top = make_file_record((fs::path("/base") / ".bashrc").native(),
+                                    ".bashrc", 0);
+  assert(top.filename() == ".bashrc");
+  assert(top.extension().empty());
+
+  // Records sort exactly like their fs::path, component by component ('-'
+  // and '.' sort before '/' as characters, but not as components)
+  const std::vector<std::string> names = {
+      "a/b.cpp", "a-b/c.cpp", "a.b/c.cpp", "a/b/c.cpp", "ab.cpp",
+      "a_b.cpp", "A.cpp",     "a/a.cpp",   "a0.cpp",    "a"};
+  std::vector<FileRecord> records;
+  std::vector<fs::path> paths;
+  for (const auto &name : names) {
+    fs::path path = TEST_DIR_PATH / fs::path(name);
+    records.push_back(make_file_record(path.native(), name, 0));
+    paths.push_back(path);
+  }
+  sort_by_path(records);
+  std::sort(paths.begin(), paths.end());
+  assert(record_paths(records) == paths);
+
+  // Collected records carry the walk's relative path and size
+  create_test_directory_structure();
+  Config config = get_default_config(TEST_DIR_PATH);
+  std::atomic<bool> stop_flag{false};
+  auto [normal, last] = collect_file_records(config, stop_flag);
+  auto it = std::find_if(normal.begin(), normal.end(), [](const auto &r) {
+    return r.relativePath == "subdir1/file6.cpp";
+  });
+  assert(it != normal.end());
+  assert(it->filename() == "file6.cpp");
+  assert(fs::path(it->absolutePath) == TEST_DIR_PATH / "subdir1" / "file6.cpp");
+  assert(it->size == fs::file_size(TEST_DIR_PATH / "subdir1" / "file6.cpp"));
+
+  std::cout << " Passed\n";
+}
+
 void test_process_directory_output_order() {
   std::cout << "Test: Process directory output order (incl --last)..."
             << std::flush;
@@ -800,6 +1484,1279 @@ void test_process_directory_output_order() {
   std::cout << " Passed\n";
 }
 
+void test_process_directory_small_window() {
+  std::cout << "Test: Process directory with small output window..."
+            << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "window_test";
+  for (int i = 0; i < 40; ++i) {
+    std::string name = "file_" + std::string(i < 10 ? "0" : "") +
+                       std::to_string(i) + ".cpp";
+    create_test_file(base_abs / name, "// content " + std::to_string(i) + "\n");
+  }
+  Config config = get_default_config(base_abs);
+  config.outputWindow = 2; // Force workers to wait on the writer
+  config.numThreads = 4;   // More threads than window slots
+  config.showSummary = true;
+  std::atomic<bool> stop_flag{false};
+
+  std::string output = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+
+  // Every file must appear exactly once, in sorted order
+  size_t last_pos = 0;
+  for (int i = 0; i < 40; ++i) {
+    std::string name = "file_" + std::string(i < 10 ? "0" : "") +
+                       std::to_string(i) + ".cpp";
+    size_t pos = output.find("## File: " + name);
+    assert(pos != std::string::npos);
+    assert(pos >= last_pos);
+    assert(output.find("## File: " + name, pos + 1) == std::string::npos);
+    last_pos = pos;
+  }
+  assert(output.find("\n---\nProcessed Files (40):\n") != std::string::npos);
+
+  std::cout << " Passed\n";
+}
+
+void test_process_directory_parallel_last_files() {
+  std::cout << "Test: Process directory with many --last files in parallel..."
+            << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "last_pool_test";
+  create_test_file(base_abs / "a_normal.cpp", "// normal\n");
+  create_test_file(base_abs / "notes.txt", "notes\n");
+  for (int i = 0; i < 30; ++i) {
+    std::string suffix = std::string(i < 10 ? "0" : "") + std::to_string(i);
+    create_test_file(base_abs / "late" / ("late_" + suffix + ".cpp"),
+                     "// late " + suffix + "\n");
+    create_test_file(base_abs / "early" / ("early_" + suffix + ".cpp"),
+                     "// early " + suffix + "\n");
+  }
+  Config config = get_default_config(base_abs);
+  config.outputWindow = 3; // Last files must wait on the writer too
+  config.numThreads = 4;
+  config.showSummary = true;
+  // Groups in command-line order: late/, early/, then notes.txt
+  config.lastDirs = {"late", "early"};
+  config.lastFiles = {"notes.txt"};
+  config.lastDirsSetRel.insert("late");
+  config.lastDirsSetRel.insert("early");
+  config.lastFilesSetFilename.insert("notes.txt");
+  std::atomic<bool> stop_flag{false};
+
+  std::string output = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+
+  std::vector<std::string> expected = {"a_normal.cpp"};
+  for (const char *group : {"late", "early"}) {
+    for (int i = 0; i < 30; ++i) {
+      expected.push_back(std::string(group) + "/" + group + "_" +
+                         (i < 10 ? "0" : "") + std::to_string(i) + ".cpp");
+    }
+  }
+  expected.push_back("notes.txt");
+
+  size_t last_pos = 0;
+  for (const auto &path : expected) {
+    size_t pos = output.find("## File: " + path + "\n");
+    assert(pos != std::string::npos);
+    assert(pos >= last_pos);
+    assert(output.find("## File: " + path + "\n", pos + 1) ==
+           std::string::npos);
+    last_pos = pos;
+  }
+  // The summary lists the same order
+  size_t summary_pos = output.find("\n---\nProcessed Files (62):\n");
+  assert(summary_pos != std::string::npos);
+  last_pos = summary_pos;
+  for (const auto &path : expected) {
+    size_t pos = output.find("\n" + path + "\n", last_pos);
+    assert(pos != std::string::npos);
+    last_pos = pos;
+  }
+
+  std::cout << " Passed\n";
+}
+
+void test_async_io() {
+  std::cout << "Test: Read-ahead with --async-io..." << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "async_io_test";
+  std::string large_content;
+  while (large_content.size() < kMmapThresholdB + 4096)
+    large_content += "line " + std::to_string(large_content.size()) + "\n";
+  create_test_file(base_abs / "large.cpp", large_content);
+  create_test_file(base_abs / "binary.dat", std::string("\0\1\2bin", 6));
+  create_test_file(base_abs / "empty.cpp", "");
+  create_test_file(base_abs / "grown.cpp", "now ten b\n");
+  for (int i = 0; i < 40; ++i)
+    create_test_file(base_abs / "src" / ("f" + std::to_string(i) + ".cpp"),
+                     "// file " + std::to_string(i) + "\n");
+
+  std::vector<FileRecord> records;
+  for (const char *name : {"large.cpp", "binary.dat", "empty.cpp"})
+    records.push_back(make_file_record(base_abs / name, base_abs));
+  for (int i = 0; i < 3; ++i)
+    records.push_back(make_file_record(
+        base_abs / "src" / ("f" + std::to_string(i) + ".cpp"), base_abs));
+  // Sizes that no longer match: grew since the walk, and deleted
+  records.push_back(make_file_record((base_abs / "grown.cpp").native(),
+                                     "grown.cpp", 3));
+  records.push_back(
+      make_file_record((base_abs / "missing.cpp").native(), "missing.cpp", 5));
+
+  Config config = get_default_config(base_abs);
+  for (bool try_io_uring : {true, false}) {
+    ReadAheadEngine engine(config, 1, try_io_uring);
+    BatchReader reader(&engine);
+    for (int round = 0; round < 2; ++round) { // Slots are reused
+      reader.submit(records);
+      for (size_t i = 0; i < records.size(); ++i) {
+        FileBuffer *buffer = nullptr;
+        std::error_code ec;
+        FileBuffer expected;
+        const std::error_code expected_ec = expected.load(
+            records[i].absolutePath.c_str(), IoBackend::Auto, looks_binary);
+        if (!reader.take(i, buffer, ec))
+          continue; // Left to the worker's own load
+        assert(static_cast<bool>(ec) == static_cast<bool>(expected_ec));
+        assert(buffer->was_rejected() == expected.was_rejected());
+        assert(buffer->view() == expected.view());
+      }
+    }
+    reader.submit(records); // Abandoned batch: drained on destruction
+  }
+
+  // Whole runs match the plain reads, whichever engine is available
+  config.numThreads = 3;
+  config.outputWindow = 4;
+  std::atomic<bool> stop_flag{false};
+  std::string plain = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  config.asyncIo = true;
+  std::string ahead = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  assert(ahead == plain);
+  assert(plain.find("## File: src/f39.cpp") != std::string::npos);
+
+  std::cout << " Passed\n";
+}
+
+void test_output_sink() {
+  std::cout << "Test: Output sink with buffered and in-place pieces..."
+            << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "sink_test";
+  std::string large_content;
+  while (large_content.size() < kMmapThresholdB + 4096)
+    large_content += "line " + std::to_string(large_content.size()) + "\n";
+  large_content += "no newline at the end";
+  create_test_file(base_abs / "large.txt", large_content);
+
+  // Small pieces are copied, large ones written in place, in order
+  std::vector<OutputBlock> blocks(3);
+  blocks[0].text = "small\n";
+  blocks[1].text = std::string(200 * 1024, 'b');
+  FileBuffer mapped;
+  const std::error_code mapped_ec =
+      mapped.load(base_abs / "large.txt", IoBackend::Mmap);
+  assert(!mapped_ec);
+  assert(mapped.is_mapped());
+  blocks[2].text = "head|tail";
+  blocks[2].body_at = 5;
+  blocks[2].body = mapped.release_mapping();
+  assert(!mapped.is_mapped() && mapped.view().empty());
+  const std::string expected =
+      "# top\n" + blocks[0].text + blocks[1].text + "head|" + large_content +
+      "tail" + std::string(3000, 'e');
+
+  const fs::path out_path = base_abs / "out.md";
+  {
+    OutputSink sink;
+    std::error_code ec = sink.open(out_path);
+    assert(!ec);
+    sink.reserve(8 * 1024 * 1024);
+    sink.write("# top\n");
+    sink.write_blocks(blocks);
+    for (int i = 0; i < 3000; ++i)
+      sink.write("e");
+    ec = sink.close();
+    assert(!ec);
+  }
+  {
+    std::ifstream in(out_path, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(in)), {});
+    assert(text == expected);
+  }
+  assert(fs::file_size(out_path) == expected.size()); // Reservation released
+  OutputSink unwritable;
+  const std::error_code unwritable_ec =
+      unwritable.open(base_abs / "missing_dir" / "out.md");
+  assert(unwritable_ec);
+
+  // A redirected std::cout gets the same bytes through the stream
+  auto write_to_stdout = [&](bool direct_stdout) {
+    OutputSink sink(direct_stdout);
+    sink.write("# top\n");
+    sink.write_blocks(blocks);
+    sink.write(std::string(3000, 'e'));
+    const std::error_code ec = sink.close();
+    assert(!ec);
+  };
+  std::string captured = capture_stdout([&]() { write_to_stdout(false); });
+  assert(captured == expected);
+#ifndef _WIN32
+  // As does the stdout descriptor, written directly; nothing goes through
+  // std::cout then
+  std::string through_stream;
+  const std::string direct = capture_stdout_descriptor([&]() {
+    through_stream = capture_stdout([&]() { write_to_stdout(true); });
+  });
+  assert(direct == expected && through_stream.empty());
+#endif
+
+  // A mapped, untransformed file is written from its mapping unchanged
+  Config config = get_default_config(base_abs);
+  config.fileExtensions = {"txt"};
+  std::atomic<bool> stop_flag{false};
+  std::string output = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  assert(output ==
+         "# File generated by DirCat\n\n## File: large.txt\n\n```txt\n" +
+             large_content + "\n```\n");
+#ifndef _WIN32
+  // The tool's runs (Config::directStdout) take the descriptor path
+  config.directStdout = true;
+  const std::string direct_run = capture_stdout_descriptor([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  assert(direct_run == output);
+#endif
+
+  std::cout << " Passed\n";
+}
+
+void test_token_budget() {
+  std::cout << "Test: --max-tokens budget..." << std::flush;
+  // Word runs cost a token per four bytes, symbols one each, line breaks one
+  // per run, spaces nothing
+  assert(estimate_tokens("") == 0);
+  assert(estimate_tokens("abcd") == 1);
+  assert(estimate_tokens("abcde") == 2);
+  assert(estimate_tokens("int x = 1;") == 5);
+  assert(estimate_tokens("a\n\n\nb") == 3);
+  assert(estimate_tokens("    ") == 0);
+
+  // Last files first in --last order, then the others smallest first
+  std::vector<FileRecord> ranked;
+  for (auto [name, size] : {std::pair{"a", 30}, {"b", 10}, {"c", 20},
+                            {"d", 10}, {"z2", 99}, {"z1", 5}})
+    ranked.push_back(make_file_record(NativePath(), name,
+                                      static_cast<unsigned long long>(size)));
+  assert((prioritize_for_budget(ranked, 4) ==
+          std::vector<size_t>{4, 5, 1, 3, 2, 0}));
+
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "budget_test";
+  auto words = [](int count) {
+    std::string text;
+    for (int i = 0; i < count; ++i)
+      text += "abcd ";
+    return text + "\n";
+  };
+  create_test_file(base_abs / "a_small.txt", words(10));
+  create_test_file(base_abs / "b_medium.txt", words(100));
+  create_test_file(base_abs / "c_huge.txt", words(20000));
+  create_test_file(base_abs / "d_last.txt", words(20));
+  create_test_file(base_abs / "e_big_last.txt", words(4000));
+
+  Config config = get_default_config(base_abs);
+  config.fileExtensions = {"txt"};
+  config.lastFiles = {"e_big_last.txt", "d_last.txt"};
+  config.lastFilesSetFilename = {"e_big_last.txt", "d_last.txt"};
+  config.maxTokens = 1000;
+  std::atomic<bool> stop_flag{false};
+  std::string outputs[2];
+  for (int run = 0; run < 2; ++run) {
+    config.numThreads = run == 0 ? 1 : 4;
+    outputs[run] = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  }
+  assert(outputs[0] == outputs[1]);
+  const std::string &output = outputs[0];
+  // What fits is written in the usual order; the rest is left out
+  const size_t small_at = output.find("## File: a_small.txt");
+  const size_t medium_at = output.find("## File: b_medium.txt");
+  const size_t last_at = output.find("## File: d_last.txt");
+  assert(small_at != std::string::npos && medium_at != std::string::npos &&
+         last_at != std::string::npos);
+  assert(small_at < medium_at && medium_at < last_at);
+  assert(output.find("c_huge.txt") == std::string::npos);
+  assert(output.find("e_big_last.txt") == std::string::npos);
+  assert(estimate_tokens(output) <= config.maxTokens);
+
+  // A budget too small for any file leaves only the title
+  config.maxTokens = 10;
+  std::string title_only = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  assert(title_only.find("## File:") == std::string::npos);
+
+  // The title and the -s summary are charged too, so the whole output
+  // stays within the budget
+  config.showSummary = true;
+  for (unsigned long long max_tokens = 10; max_tokens <= 1400;
+       max_tokens += 13) {
+    config.maxTokens = max_tokens;
+    std::string summarized = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+    assert(estimate_tokens(summarized) <= config.maxTokens);
+  }
+
+  std::cout << " Passed\n";
+}
+
+// Reverses compress_text(): every member or frame, in order
+std::string decompress_text(Compression method, std::string_view data,
+                            size_t expected_size) {
+  std::string text;
+  if (method == Compression::Gzip) {
+#ifdef DIRCAT_HAVE_ZLIB
+    z_stream zs{};
+    int result = inflateInit2(&zs, 15 + 16);
+    assert(result == Z_OK);
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    std::array<char, 64 * 1024> out;
+    while (true) {
+      zs.next_out = reinterpret_cast<Bytef *>(out.data());
+      zs.avail_out = static_cast<uInt>(out.size());
+      result = inflate(&zs, Z_NO_FLUSH);
+      text.append(out.data(), out.size() - zs.avail_out);
+      if (result == Z_STREAM_END && zs.avail_in == 0)
+        break;
+      if (result == Z_STREAM_END)
+        result = inflateReset(&zs); // The next member
+      assert(result == Z_OK);
+    }
+    inflateEnd(&zs);
+#endif
+  } else if (method == Compression::Zstd) {
+#ifdef DIRCAT_HAVE_ZSTD
+    text.resize(expected_size);
+    const size_t size =
+        ZSTD_decompress(text.data(), text.size(), data.data(), data.size());
+    assert(!ZSTD_isError(size));
+    text.resize(size);
+#endif
+  } else {
+    text.assign(data);
+  }
+  (void)expected_size;
+  return text;
+}
+
+void test_compressed_output() {
+  std::cout << "Test: Compressed output (--compress)..." << std::flush;
+  assert(compression_available(Compression::None));
+  assert(compress_text(Compression::None, "abc") == "abc");
+#ifdef DIRCAT_HAVE_ZLIB
+  // A library failure keeps the library's own error
+  const std::error_code zlib_error(Z_STREAM_ERROR, zlib_category());
+  assert(zlib_error.message() ==
+         std::string("zlib: ") + zError(Z_STREAM_ERROR));
+#endif
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "compress_test";
+  std::string large_content;
+  while (large_content.size() < 3 * kCompressChunkB)
+    large_content += "line " + std::to_string(large_content.size()) + "\n";
+  create_test_file(base_abs / "large.txt", large_content);
+  for (int i = 0; i < 50; ++i)
+    create_test_file(base_abs / "src" / ("f" + std::to_string(i) + ".txt"),
+                     "file " + std::to_string(i) + "\n");
+  Config config = get_default_config(base_abs);
+  config.numThreads = 3;
+  std::atomic<bool> stop_flag{false};
+  std::string plain = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+
+  for (Compression method : {Compression::Gzip, Compression::Zstd}) {
+    if (!compression_available(method))
+      continue;
+    // Chunks compressed on several threads come back in order
+    const fs::path out_path = TEST_DIR_PATH / "compressed.bin";
+    {
+      OutputSink sink;
+      std::error_code ec = sink.open(out_path);
+      assert(!ec);
+      sink.compress(method, 3);
+      sink.write("# top\n");
+      std::vector<OutputBlock> blocks(2);
+      blocks[0].text = large_content;
+      blocks[1].text = "tail\n";
+      sink.write_blocks(blocks);
+      sink.flush(); // Does not cut the chunk being filled
+      sink.write(large_content);
+      ec = sink.close();
+      assert(!ec);
+    }
+    std::string expected = "# top\n" + large_content + "tail\n" + large_content;
+    std::string compressed;
+    {
+      std::ifstream in(out_path, std::ios::binary);
+      compressed.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    assert(compressed.size() < expected.size() / 2);
+    assert(decompress_text(method, compressed, expected.size()) == expected);
+    assert(compress_text(method, expected).size() == compressed.size());
+
+    // A full run decompresses to the uncompressed output
+    config.outputFile = TEST_DIR_PATH / "bundle.md"; // Outside the input
+    config.compression = method;
+    std::string message = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+    std::ifstream in(config.outputFile, std::ios::binary);
+    compressed.assign(std::istreambuf_iterator<char>(in), {});
+    assert(decompress_text(method, compressed, plain.size()) == plain);
+  }
+
+  std::cout << " Passed\n";
+}
+
+void test_dedupe() {
+  std::cout << "Test: --dedupe writes copies as references..." << std::flush;
+  assert(content_hash("") == 0xEF46DB3751D8E999ULL); // XXH64 test vectors
+  assert(content_hash("abc") == 0x44BC2CF5AD770999ULL);
+  const std::string long_text(100, 'x');
+  assert(content_hash(long_text) != content_hash(long_text.substr(1) + "y"));
+
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "dedupe_test";
+  std::string license;
+  for (int i = 0; i < 10; ++i)
+    license += "// Licensed under MIT\n";
+  std::string other = license;
+  other.replace(other.find("MIT"), 3, "BSD"); // Same size, other content
+  create_test_file(base_abs / "a" / "LICENSE.h", license);
+  create_test_file(base_abs / "a" / "tiny.h", "int x;\n");
+  create_test_file(base_abs / "other.h", other);
+  create_test_file(base_abs / "vendor" / "LICENSE.h", license);
+  create_test_file(base_abs / "vendor" / "tiny.h", "int x;\n");
+  create_test_file(base_abs / "z_last.h", license);
+
+  Config config = get_default_config(base_abs);
+  config.dedupe = true;
+  config.lastFiles = {"z_last.h"};
+  config.lastFilesSetFilename = {"z_last.h"};
+  config.cacheDir = TEST_DIR_PATH / "dedupe_cache";
+  std::atomic<bool> stop_flag{false};
+  // Aged, so that the small files are cached and the copies still hashed
+  const auto past = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  for (const auto &entry : fs::recursive_directory_iterator(base_abs))
+    fs::last_write_time(entry.path(), past);
+  fs::last_write_time(base_abs, past);
+  std::string outputs[3];
+  for (int run = 0; run < 3; ++run) { // Later runs find a warm cache
+    config.numThreads = run == 0 ? 1 : 4;
+    outputs[run] = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  }
+  assert(outputs[0] == outputs[1] && outputs[1] == outputs[2]);
+  const std::string &output = outputs[0];
+  // The first copy in output order is written in full, later ones refer to it
+  assert(output.find("## File: a/LICENSE.h\n\n```h\n" + license + "```\n") !=
+         std::string::npos);
+  assert(output.find("## File: vendor/LICENSE.h\n\nSame content as "
+                     "a/LICENSE.h.\n") != std::string::npos);
+  assert(output.find("## File: z_last.h\n\nSame content as a/LICENSE.h.\n") !=
+         std::string::npos);
+  assert(output.find("## File: other.h\n\n```h\n" + other) !=
+         std::string::npos);
+  // Small files are repeated
+  assert(output.find("## File: vendor/tiny.h\n\n```h\nint x;\n```\n") !=
+         std::string::npos);
+
+  std::cout << " Passed\n";
+}
+
+void test_large_file_stream() {
+  std::cout << "Test: large files are streamed in chunks..." << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "stream_test";
+  std::string content;
+  for (int i = 0; content.size() < 5 * kStreamChunkB; ++i) // Several chunks
+    content += "int v" + std::to_string(i) + " = " + std::to_string(i) +
+               "; /* a\r\n\r\n b */ // note\r\n\r\n";
+  create_test_file(base_abs / "five.cpp", content);
+  Config config = get_default_config(base_abs);
+  config.removeComments = true;
+  config.removeEmptyLines = true;
+  config.showLineNumbers = true;
+  std::string expected;
+  append_file_content(expected, content, config, true);
+  expected += "```\n";
+  std::atomic<bool> stop_flag{false};
+
+  // Chunks come out in order and add up to the one-buffer result
+  for (IoBackend backend : {IoBackend::Mmap, IoBackend::Read}) {
+    std::shared_ptr<ContentStream> stream;
+    if (backend == IoBackend::Mmap) {
+      FileBuffer buffer;
+      const std::error_code ec = buffer.load(base_abs / "five.cpp", backend);
+      assert(!ec);
+      stream = std::make_shared<ContentStream>(std::move(buffer));
+    } else {
+      auto file = std::make_unique<ChunkedFile>();
+      std::error_code ec = file->open((base_abs / "five.cpp").c_str(), backend);
+      assert(!ec);
+      std::string first(kStreamChunkB, '\0');
+      first.resize(file->read(first.data(), first.size(), ec));
+      assert(!ec);
+      stream = std::make_shared<ContentStream>(std::move(file),
+                                               std::move(first),
+                                               base_abs / "five.cpp");
+    }
+    std::thread producer([&] { stream->produce(config, stop_flag); });
+    std::string joined, chunk;
+    size_t chunk_count = 0;
+    while (stream->pop(chunk, stop_flag)) {
+      assert(chunk.size() < 4 * kStreamChunkB); // One input chunk at most
+      joined += chunk;
+      ++chunk_count;
+    }
+    producer.join();
+    assert(chunk_count > 1);
+    assert(joined == expected);
+  }
+
+  // A writer that gives up does not leave the worker waiting for room
+  {
+    FileBuffer buffer;
+    const std::error_code ec =
+        buffer.load(base_abs / "five.cpp", IoBackend::Mmap);
+    assert(!ec);
+    auto stream = std::make_shared<ContentStream>(std::move(buffer));
+    std::thread producer([&] { stream->produce(config, stop_flag); });
+    std::string chunk;
+    const bool popped = stream->pop(chunk, stop_flag);
+    assert(popped);
+    stream->abandon();
+    producer.join();
+  }
+
+  // Through process_directory: just over the threshold, read and mapped
+  std::string large;
+  large.reserve(kStreamThresholdB + 4096);
+  for (int i = 0; large.size() <= kStreamThresholdB; ++i)
+    large += "x" + std::to_string(i) + "(); // call\n\n";
+  create_test_file(base_abs / "large.cpp", large);
+  create_test_file(base_abs / "small.cpp", "int s; // small\n");
+  expected = "## File: five.cpp\n\n```cpp\n";
+  append_file_content(expected, content, config, true);
+  expected += "```\n\n## File: large.cpp\n\n```cpp\n";
+  append_file_content(expected, large, config, true);
+  expected += "```\n\n## File: small.cpp\n\n```cpp\n";
+  append_file_content(expected, "int s; // small\n", config, true);
+  expected += "```\n";
+  for (IoBackend backend : {IoBackend::Read, IoBackend::Mmap}) {
+    config.ioBackend = backend;
+    config.numThreads = 2;
+    std::string output = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+    assert(output.find(expected) != std::string::npos);
+  }
+  fs::remove(base_abs / "large.cpp"); // Keep later runs of the suite quick
+
+  std::cout << " Passed\n";
+}
+
+// Collects what an Engine run hands to its BlockSink
+class RecordingSink : public BlockSink {
+public:
+  void write_text(std::string_view text) override { bundle += text; }
+  void write_block(std::string_view relative_path,
+                   std::string_view bytes) override {
+    if (paths.empty() || paths.back() != relative_path)
+      paths.emplace_back(relative_path);
+    bundle += bytes;
+  }
+  void report(std::string_view message) override { status += message; }
+
+  std::string bundle;
+  std::string status;
+  std::vector<std::string> paths; // Of the blocks, in the order received
+};
+
+void test_engine() {
+  std::cout << "Test: Engine runs into a BlockSink..." << std::flush;
+  create_test_directory_structure();
+  create_test_file(TEST_DIR_PATH / "mapped.cpp",
+                   std::string(2 * 1024 * 1024, 'm') + "\n"); // Not copied
+  Config config = get_default_config(TEST_DIR_PATH);
+  config.showSummary = true;
+  Config stripped = config;
+  stripped.removeComments = true;
+  std::atomic<bool> stop_flag{false};
+  const std::string expected = capture_stdout([&] {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  const std::string expected_stripped = capture_stdout([&] {
+    bool success = process_directory(stripped, stop_flag);
+    assert(success);
+  });
+
+  // The sink sees the same bundle, block by block in output order
+  Engine engine;
+  RecordingSink sink;
+  bool success = engine.run(config, sink, stop_flag);
+  assert(success);
+  assert(sink.bundle == expected);
+  assert(sink.status.rfind("Processed ", 0) == 0);
+  assert(sink.paths.size() > 2);
+  size_t at = 0;
+  for (const auto &path : sink.paths) {
+    at = sink.bundle.find("\n## File: " + path + "\n", at);
+    assert(at != std::string::npos);
+  }
+
+  // Runs on several threads at once share the engine, and later runs reuse
+  // its warm caches and threads
+  for (int round = 0; round < 2; ++round) {
+    RecordingSink sinks[4];
+    std::vector<std::thread> runs;
+    for (int i = 0; i < 4; ++i)
+      runs.emplace_back([&, i] {
+        bool run_success =
+            engine.run(i % 2 ? stripped : config, sinks[i], stop_flag);
+        assert(run_success);
+      });
+    for (auto &run : runs)
+      run.join();
+    for (int i = 0; i < 4; ++i)
+      assert(sinks[i].bundle == (i % 2 ? expected_stripped : expected));
+    engine.clear_caches();
+  }
+
+  // Only a directory can be bundled into a sink
+  RecordingSink unused;
+  Config single = get_default_config(TEST_DIR_PATH / "file1.cpp");
+  std::string errors = capture_stderr(
+      [&] { success = engine.run(single, unused, stop_flag); });
+  assert(!success);
+  assert(errors.find("ERROR: A block sink needs a directory") !=
+         std::string::npos);
+  assert(unused.bundle.empty());
+  fs::remove(TEST_DIR_PATH / "mapped.cpp");
+
+  std::cout << " Passed\n";
+}
+
+void test_index() {
+  std::cout << "Test: --index records every block of the bundle..."
+            << std::flush;
+  Xxh64 pieces; // In pieces that do not follow 32-byte stripes
+  const std::string text(1000, 'q');
+  for (size_t at = 0; at < text.size(); at += 7)
+    pieces.update(std::string_view(text).substr(at, 7));
+  assert(pieces.digest() == content_hash(text));
+  std::string escaped;
+  append_json_string(escaped, "a\"b\\c\n");
+  assert(escaped == "\"a\\\"b\\\\c\\u000a\"");
+
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "index_test";
+  create_test_file(base_abs / "a.cpp", "int a; // note\n");
+  create_test_file(base_abs / "big.txt", // Mapped, written from the mapping
+                   std::string(1536 * 1024, 'b') + "\n");
+  create_test_file(base_abs / "sub" / "c.h", "int c;\n");
+  Config config = get_default_config(base_abs);
+  config.showSummary = true;
+  config.outputFile = TEST_DIR_PATH / "index_bundle.md"; // Outside the input
+  config.indexFile = TEST_DIR_PATH / "index_bundle.json";
+  config.numThreads = 4;
+  std::atomic<bool> stop_flag{false};
+  std::string message = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  assert(message.find("Index of 3 blocks written to: ") != std::string::npos);
+  std::ifstream bundle_in(config.outputFile, std::ios::binary);
+  const std::string bundle(std::istreambuf_iterator<char>(bundle_in), {});
+  std::ifstream index_in(config.indexFile, std::ios::binary);
+  const std::string index(std::istreambuf_iterator<char>(index_in), {});
+  assert(index.rfind("{\"version\": 1, \"compression\": \"none\"", 0) == 0);
+
+  auto number = [](const std::string &line, const std::string &name) {
+    const size_t at = line.find("\"" + name + "\": ");
+    assert(at != std::string::npos);
+    return std::stoull(line.substr(at + name.size() + 4));
+  };
+  const char *const paths[] = {"a.cpp", "big.txt", "sub/c.h"}; // Output order
+  size_t line_start = index.find('\n') + 1;
+  unsigned long long end = 0;
+  for (const char *path : paths) {
+    const size_t line_end = index.find('\n', line_start);
+    const std::string line = index.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    assert(line.find(std::string("{\"path\": \"") + path + '"') !=
+           std::string::npos);
+    const unsigned long long offset = number(line, "offset");
+    const unsigned long long length = number(line, "length");
+    assert(offset >= end && offset + length <= bundle.size());
+    end = offset + length;
+    const std::string block = bundle.substr(offset, length);
+    assert(block.rfind(std::string("\n## File: ") + path + "\n", 0) == 0);
+    assert(block.size() > fs::file_size(base_abs / path));
+    assert(number(line, "size") == fs::file_size(base_abs / path));
+    assert(static_cast<long long>(number(line, "mtime_ns")) ==
+           unix_time_ns(fs::last_write_time(base_abs / path)));
+    char hash[24];
+    std::snprintf(hash, sizeof(hash), "\"%016llx\"",
+                  static_cast<unsigned long long>(content_hash(block)));
+    assert(line.find(std::string("\"xxh64\": ") + hash) != std::string::npos);
+  }
+  assert(index.substr(line_start) == "]}\n");
+  // The summary follows the last block
+  assert(bundle.substr(end).rfind("\n---\nProcessed Files (3):", 0) == 0);
+  std::cout << " Passed\n";
+}
+
+void test_shards() {
+  std::cout << "Test: --shards splits the output at directories..."
+            << std::flush;
+  assert(shard_file_path("/o/out.md.gz", 3, 12) == "/o/out.03.md.gz");
+  assert(shard_file_path("/o/.out", 0, 2) == "/o/.out.0");
+  assert(shared_directory_depth("a/b/x", "a/c/y") == 1);
+  assert(shared_directory_depth("a/x", "a/y") == 2);
+  assert(shared_directory_depth("x", "a/y") == 0);
+
+  // Ten files of 1000 bytes; the cut near the middle moves to the edge of a
+  // directory within a quarter of a shard
+  std::vector<FileRecord> records;
+  const char *names[] = {"a/1", "a/2", "a/3", "a/4", "b/1",
+                         "b/2", "b/3", "b/4", "b/5", "b/6"};
+  for (const char *name : names)
+    records.push_back(make_file_record(NativePath(), name, 1000 - 32 - 3));
+  Config plan = get_default_config(TEST_DIR_PATH);
+  plan.shards = 2;
+  assert((plan_shards(records, plan) == std::vector<size_t>{0, 4, 10}));
+  plan.shards = 12; // More shards than files: one file each
+  assert((plan_shards(records, plan) ==
+          std::vector<size_t>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10}));
+  plan.shards = 0;
+  plan.shardSize = 2500;
+  // Two files each, the second cut at the edge of a/
+  assert((plan_shards(records, plan) ==
+          std::vector<size_t>{0, 2, 4, 6, 8, 10}));
+  // A file larger than --shard-size gets a shard of its own, and no shard
+  // is left without a file
+  std::vector<FileRecord> uneven;
+  for (unsigned long long bytes : {500ull, 5000ull, 500ull})
+    uneven.push_back(make_file_record(NativePath(), "a/1", bytes - 32 - 3));
+  plan.shardSize = 1000;
+  assert((plan_shards(uneven, plan) == std::vector<size_t>{0, 1, 2, 3}));
+  plan.shardSize = 1;
+  const std::vector<FileRecord> too_many(kMaxShards + 1, records[0]);
+  assert(plan_shards(too_many, plan).empty()); // More than kMaxShards
+
+  create_test_directory_structure();
+  Config config = get_default_config(TEST_DIR_PATH);
+  config.showSummary = true;
+  std::atomic<bool> stop_flag{false};
+  const std::string whole = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  const fs::path out_dir = TEST_DIR_PATH.parent_path() / "dircat_shards";
+  fs::remove_all(out_dir);
+  config.outputFile = out_dir / "bundle.md"; // Outside the input
+  config.shards = 3;
+  for (unsigned threads : {1u, 4u}) {
+    config.numThreads = threads;
+    const std::string message = capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+    assert(message.find("Output written to 3 shards: ") != std::string::npos);
+    assert(!fs::exists(config.outputFile));
+    // Without their titles and summaries, the shards make up the whole
+    // output in order; each summary lists the files of its shard
+    const std::string title = "# File generated by DirCat\n";
+    const std::string summary_mark = "\n---\nProcessed Files (";
+    std::string blocks;
+    size_t listed = 0;
+    for (size_t shard = 0; shard < 3; ++shard) {
+      std::ifstream in(shard_file_path(config.outputFile, shard, 3),
+                       std::ios::binary);
+      const std::string text(std::istreambuf_iterator<char>(in), {});
+      assert(text.rfind(title, 0) == 0);
+      const size_t summary = text.rfind(summary_mark);
+      assert(summary != std::string::npos);
+      blocks += text.substr(title.size(), summary - title.size());
+      listed += std::stoul(text.substr(summary + summary_mark.size()));
+    }
+    const size_t whole_summary = whole.rfind(summary_mark);
+    assert(whole.compare(0, title.size(), title) == 0);
+    assert(blocks == whole.substr(title.size(), whole_summary - title.size()));
+    assert(listed == std::stoul(whole.substr(whole_summary +
+                                             summary_mark.size())));
+  }
+
+  // --shard-size smaller than a file: every shard still lists a file
+  create_test_file(TEST_DIR_PATH / "big.cpp", std::string(3000, 'b') + "\n");
+  config.shards = 0;
+  config.shardSize = 1024;
+  const std::string message = capture_stdout([&]() {
+    bool success = process_directory(config, stop_flag);
+    assert(success);
+  });
+  const std::string written = "Output written to ";
+  const size_t count_at = message.find(written);
+  assert(count_at != std::string::npos);
+  const size_t shard_count = std::stoul(message.substr(count_at +
+                                                       written.size()));
+  assert(shard_count > 1);
+  for (size_t shard = 0; shard < shard_count; ++shard) {
+    std::ifstream in(shard_file_path(config.outputFile, shard, shard_count),
+                     std::ios::binary);
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    assert(text.find("\n## File: ") != std::string::npos);
+  }
+  fs::remove_all(out_dir);
+  std::cout << " Passed\n";
+}
+
+void test_stop_and_timeout() {
+  std::cout << "Test: a stop leaves well-formed output, --timeout stops..."
+            << std::flush;
+  // A --timeout sets the flag on time; a run that ends first cancels it
+  {
+    std::atomic<bool> stop_flag{false};
+    const auto start = std::chrono::steady_clock::now();
+    RunDeadline deadline(20, stop_flag);
+    while (!stop_flag)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    assert(std::chrono::steady_clock::now() - start <
+           std::chrono::seconds(5));
+    const bool expired = deadline.finish();
+    assert(expired);
+  }
+  {
+    std::atomic<bool> stop_flag{false};
+    const auto start = std::chrono::steady_clock::now();
+    RunDeadline deadline(60 * 1000, stop_flag);
+    const bool expired = deadline.finish();
+    assert(!expired && !stop_flag);
+    assert(std::chrono::steady_clock::now() - start <
+           std::chrono::seconds(5));
+  }
+
+  // A stop inside a streamed body still closes its fence
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH / "stop_test";
+  std::string content;
+  for (int i = 0; content.size() < 5 * kStreamChunkB; ++i)
+    content += "int v" + std::to_string(i) + ";\n";
+  create_test_file(base_abs / "five.cpp", content);
+  Config config = get_default_config(base_abs);
+  config.showLineNumbers = true;
+  std::string body;
+  append_file_content(body, content, config, true);
+
+  struct StoppingSink : BlockSink {
+    std::atomic<bool> &stop;
+    std::string bytes;
+    int parts = 0;
+    explicit StoppingSink(std::atomic<bool> &stop) : stop(stop) {}
+    void write_text(std::string_view text) override { bytes += text; }
+    void write_block(std::string_view, std::string_view data) override {
+      bytes += data;
+      if (++parts == 3) // The header and two chunks of the body
+        stop = true;
+    }
+  };
+  std::atomic<bool> stop_flag{false};
+  StoppingSink recorder(stop_flag);
+  FileBuffer buffer;
+  std::error_code ec = buffer.load(base_abs / "five.cpp", IoBackend::Mmap);
+  assert(!ec);
+  const FileRecord record =
+      make_file_record((base_abs / "five.cpp").native(), "five.cpp",
+                       content.size());
+  OutputBlock block;
+  block.record = &record;
+  block.text = "\n## File: five.cpp\n\n```cpp\n";
+  const std::string header = block.text;
+  block.stream = std::make_shared<ContentStream>(std::move(buffer));
+  std::shared_ptr<ContentStream> stream = block.stream;
+  std::thread producer([&] { stream->produce(config, stop_flag); });
+  OrderedOutputWriter writer(1, 4, 1);
+  writer.submit(0, std::move(block));
+  writer.worker_finished();
+  {
+    OutputSink sink;
+    sink.forward(&recorder);
+    writer.write_all(sink, stop_flag, [](size_t) {});
+  }
+  producer.join(); // The worker stops as well
+  assert(stop_flag);
+  const std::string &bytes = recorder.bytes;
+  assert(bytes.rfind(header, 0) == 0);
+  assert(bytes.size() >= 4 && bytes.compare(bytes.size() - 4, 4, "```\n") == 0);
+  // The body so far, then the fence, on a line of its own
+  std::string written =
+      bytes.substr(header.size(), bytes.size() - 4 - header.size());
+  assert(!written.empty() && written.back() == '\n');
+  if (body.compare(0, written.size(), written) != 0)
+    written.pop_back(); // Stopped inside a line: the newline was added
+  assert(written.size() < body.size());
+  assert(body.compare(0, written.size(), written) == 0); // A prefix
+  // Only the part of the file that went out counts as processed
+  const unsigned long long cut = writer.unwritten_bytes();
+  assert(cut > 0 && cut < content.size());
+  assert(content.size() - cut == stream->contents_bytes_delivered());
+
+  std::cout << " Passed\n";
+}
+
+void test_batch() {
+  std::cout << "Test: --batch bundles each root of its list..." << std::flush;
+  create_test_directory_structure();
+  const fs::path out_dir = TEST_DIR_PATH.parent_path() / "dircat_batch";
+  fs::remove_all(out_dir);
+  fs::create_directories(out_dir);
+  const fs::path list = out_dir / "roots.txt";
+  {
+    std::ofstream out(list, std::ios::binary);
+    out << "# Comments and blank lines are skipped\n\n"
+        << (TEST_DIR_PATH / "subdir1").string() << '\t'
+        << (out_dir / "one.md").string() << "\r\n"
+        << TEST_DIR_PATH.string() << '\t' << (out_dir / "all.md").string()
+        << '\n'
+        << (TEST_DIR_PATH / "missing").string() << '\t'
+        << (out_dir / "missing.md").string() << '\n';
+  }
+  Config config = get_default_config(fs::path());
+  config.batchRoots = read_batch_list(list);
+  assert(config.batchRoots.size() == 3);
+  assert(config.batchRoots[0].dirPath == TEST_DIR_PATH / "subdir1");
+  assert(config.batchRoots[0].outputFile == out_dir / "one.md");
+
+  // The roots share --cache-dir, each with listings of its own (settled
+  // mtimes, so that they are cached)
+  const auto past = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  for (const auto &entry : fs::recursive_directory_iterator(TEST_DIR_PATH))
+    fs::last_write_time(entry.path(), past);
+  fs::last_write_time(TEST_DIR_PATH, past);
+  config.cacheDir = out_dir / "cache";
+
+  // One root at a time, as capture_stdout() is not for several threads
+  config.numThreads = 1;
+  std::atomic<bool> stop_flag{false};
+  Engine engine;
+  std::string message;
+  const std::string errors = capture_stderr([&] {
+    message = capture_stdout([&] {
+      bool success = engine.run(config, stop_flag);
+      assert(!success); // The missing root
+    });
+  });
+  assert(errors.find("not a directory, skipped") != std::string::npos);
+  assert(message.find("Batch: 2 of 3 roots written, 1 failed.") !=
+         std::string::npos);
+  assert(!fs::exists(out_dir / "missing.md"));
+  for (size_t i = 0; i < 2; ++i) {
+    const fs::path listings =
+        config.cacheDir /
+        ("dirs-" +
+         cache_file_id("dircat-dirs-1|" +
+                       normalize_path(config.batchRoots[i].dirPath)) +
+         ".bin");
+    assert(fs::file_size(listings) > 64); // More than the header
+  }
+
+  // Each output is what a run of its own writes
+  for (size_t i = 0; i < 2; ++i) {
+    const BatchRoot &root = config.batchRoots[i];
+    Config single = get_default_config(root.dirPath);
+    const std::string expected = capture_stdout([&]() {
+      bool success = process_directory(single, stop_flag);
+      assert(success);
+    });
+    std::ifstream in(root.outputFile, std::ios::binary);
+    assert(std::string(std::istreambuf_iterator<char>(in), {}) == expected);
+  }
+  fs::remove_all(out_dir);
+  std::cout << " Passed\n";
+}
+
+void test_stats_output() {
+  std::cout << "Test: --stats counters and report..." << std::flush;
+  // Percentiles come from log buckets: within one bucket (~19%) of the truth
+  LatencyHistogram histogram;
+  for (uint64_t ns = 1; ns <= 1000; ++ns)
+    histogram.add(ns * 1000);
+  assert(histogram.count() == 1000);
+  assert(histogram.max() == 1000000);
+  assert(histogram.percentile(50) >= 500000 &&
+         histogram.percentile(50) <= 600000);
+  assert(histogram.percentile(99) >= 990000 &&
+         histogram.percentile(99) <= 1000000);
+  assert(histogram.percentile(100) == 1000000);
+  assert(LatencyHistogram().percentile(50) == 0);
+
+  create_test_directory_structure();
+  Config config = get_default_config(TEST_DIR_PATH);
+  config.numThreads = 2;
+  std::atomic<bool> stop_flag{false};
+
+  // Off: nothing is reported and no thread has a slot afterwards
+  std::string quiet = capture_stderr([&] {
+    capture_stdout([&] {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  });
+  assert(quiet.find("--- Stats ---") == std::string::npos);
+  assert(thread_stats == nullptr);
+
+  config.statsFormat = StatsFormat::Json;
+  std::string json = capture_stderr([&] {
+    capture_stdout([&] {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  });
+  assert(thread_stats == nullptr);
+  // 8 normal files plus FILE3.HPP and subdir1/file6.cpp, each read once
+  assert(json.find("\"read\": {\"files\": 10,") != std::string::npos);
+  assert(json.find("\"transform\": {\"files\": 10,") != std::string::npos);
+  assert(json.find("\"name\": \"worker-0\"") != std::string::npos);
+  assert(json.find("\"name\": \"writer\"") != std::string::npos);
+  assert(json.find("\"stages_ms\": {\"collect\": ") != std::string::npos);
+  // The tree has .gitignore files, so the walk evaluated rules
+  assert(json.find("\"gitignore\": {\"checks\": 0,") == std::string::npos);
+
+  config.statsFormat = StatsFormat::Text;
+  std::string text = capture_stderr([&] {
+    capture_stdout([&] {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  });
+  assert(text.find("--- Stats ---\nStages: collect ") != std::string::npos);
+  assert(text.find("Read: 10 files, ") != std::string::npos);
+  assert(text.find("  walk-0: ") != std::string::npos);
+
+  std::cout << " Passed\n";
+}
+
+void test_process_directory_cache() {
+  std::cout << "Test: Process directory with --cache-dir..." << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH;
+  fs::path cache_dir = fs::absolute("test_dircat_cache").lexically_normal();
+  fs::remove_all(cache_dir);
+  Config config = get_default_config(base_abs);
+  config.cacheDir = cache_dir;
+  std::atomic<bool> stop_flag{false};
+
+  // Entries changed within the last two seconds are never cached, so age
+  // everything first
+  const auto past = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  for (const auto &entry : fs::recursive_directory_iterator(TEST_DIR_PATH))
+    fs::last_write_time(entry.path(), past);
+  fs::last_write_time(TEST_DIR_PATH, past);
+
+  auto run = [&]() {
+    return capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  };
+  std::string first = run();
+  assert(fs::exists(cache_dir / ("dirs-" +
+                                  cache_file_id("dircat-dirs-1|" +
+                                                normalize_path(TEST_DIR_PATH)) +
+                                  ".bin")));
+  std::string second = run();
+  assert(second == first);
+
+  // Same size and restored mtime: the cached block is reused (stale on
+  // purpose, which proves the cache hit)
+  fs::path file1 = TEST_DIR_PATH / "file1.cpp";
+  {
+    std::ifstream in(file1, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(in)), {});
+    std::ofstream out(file1, std::ios::binary);
+    out << std::string(text.size(), 'x');
+  }
+  fs::last_write_time(file1, past);
+  assert(run() == first);
+
+  // A size change invalidates the block
+  {
+    std::ofstream out(file1, std::ios::binary);
+    out << "int changed = 1;\n";
+  }
+  fs::last_write_time(file1, past);
+  std::string third = run();
+  assert(third != first);
+  assert(third.find("int changed = 1;") != std::string::npos);
+
+  fs::remove_all(cache_dir);
+  std::cout << " Passed\n";
+}
+
+void test_watch_session_incremental() {
+  std::cout << "Test: Watch session updates match full runs..." << std::flush;
+  create_test_directory_structure();
+  fs::path base_abs = TEST_DIR_PATH;
+  Config config = get_default_config(base_abs);
+  config.showSummary = true;
+  config.lastFiles.push_back("FILE3.HPP");
+  config.lastFilesSetFilename.insert(normalize_path("FILE3.HPP"));
+  std::atomic<bool> stop_flag{false};
+
+  auto full_run = [&]() {
+    return capture_stdout([&]() {
+      bool success = process_directory(config, stop_flag);
+      assert(success);
+    });
+  };
+  WatchSession session(config, stop_flag);
+  session.build(nullptr, nullptr);
+  assert(session.render() == full_run());
+
+  // Changed contents: only that block is formatted again
+  create_test_file(TEST_DIR_PATH / "file1.cpp", "int changed() {}\n");
+  size_t formatted =
+      session.apply({{ChangeKind::Contents, TEST_DIR_PATH / "file1.cpp"}});
+  assert(formatted == 1);
+  assert(session.render() == full_run());
+
+  // New file, new directory, deleted file
+  create_test_file(TEST_DIR_PATH / "new_file.cpp", "// new\n");
+  fs::create_directories(TEST_DIR_PATH / "new_dir" / "deeper");
+  create_test_file(TEST_DIR_PATH / "new_dir" / "deeper" / "a.cpp", "// a\n");
+  fs::remove(TEST_DIR_PATH / "file_abc.cpp");
+  session.apply({{ChangeKind::Entry, TEST_DIR_PATH / "new_file.cpp"},
+                 {ChangeKind::Entry, TEST_DIR_PATH / "new_dir"},
+                 {ChangeKind::Entry, TEST_DIR_PATH / "file_abc.cpp"}});
+  std::string output = session.render();
+  assert(output == full_run());
+  assert(output.find("## File: new_dir/deeper/a.cpp") != std::string::npos);
+  assert(output.find("file_abc.cpp") == std::string::npos);
+
+  // A .gitignore edit re-evaluates its subtree without reformatting it
+  create_test_file(TEST_DIR_PATH / ".gitignore",
+                   "*.txt\n.hidden_dir/\nnew_dir/\n");
+  // ignored_folder/file7.cpp and large_file.cpp come back
+  formatted =
+      session.apply({{ChangeKind::Contents, TEST_DIR_PATH / ".gitignore"}});
+  assert(formatted == 2);
+  output = session.render();
+  assert(output == full_run());
+  assert(output.find("new_dir/") == std::string::npos);
+  assert(output.find("## File: ignored_folder/file7.cpp") != std::string::npos);
+
+  // Polling reports a changed directory without naming the entry
+  create_test_file(TEST_DIR_PATH / "subdir2" / "polled.cpp", "// polled\n");
+  session.apply({{ChangeKind::Listing, TEST_DIR_PATH / "subdir2"}});
+  assert(session.render() == full_run());
+  std::cout << " Passed\n";
+}
+
+void test_change_watcher_reports_changes() {
+  std::cout << "Test: Change watcher reports file changes..." << std::flush;
+  create_test_directory_structure();
+  ChangeWatcher watcher;
+  std::set<fs::path> dirs = {TEST_DIR_PATH, TEST_DIR_PATH / "subdir1"};
+  watcher.track(dirs, {TEST_DIR_PATH / "file1.cpp"});
+
+  std::atomic<bool> stop_flag{false};
+  std::thread writer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    create_test_file(TEST_DIR_PATH / "subdir1" / "created.cpp", "// new\n");
+    create_test_file(TEST_DIR_PATH / "file1.cpp", "// grown content\n");
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    stop_flag = true; // Fail instead of hanging if nothing is reported
+  });
+  std::vector<ChangeEvent> events;
+  const bool found = watcher.wait(events, stop_flag);
+  stop_flag = true;
+  writer.join();
+  assert(found);
+  auto reported = [&](const fs::path &path) {
+    return std::any_of(
+        events.begin(), events.end(), [&](const ChangeEvent &event) {
+          return event.path == path ||
+                 (event.kind == ChangeKind::Listing &&
+                  event.path == path.parent_path());
+        });
+  };
+  assert(reported(TEST_DIR_PATH / "subdir1" / "created.cpp"));
+  assert(reported(TEST_DIR_PATH / "file1.cpp"));
+  std::cout << " Passed\n";
+}
+
+void test_file_work_queue() {
+  std::cout << "Test: File work queue hands out every index once..."
+            << std::flush;
+  const size_t total = 1000;
+  FileWorkQueue queue(total, choose_batch_size(total, 8, 256));
+  std::vector<std::atomic<int>> seen(total);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&]() {
+      size_t begin = 0, end = 0;
+      while (queue.claim(begin, end)) {
+        assert(begin < end && end <= total);
+        for (size_t i = begin; i < end; ++i)
+          seen[i]++;
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (const auto &count : seen)
+    assert(count == 1);
+
+  // Batch size stays within [1, 16] and never exceeds the per-thread window
+  assert(choose_batch_size(0, 4, 256) == 1);
+  assert(choose_batch_size(1000000, 4, 256) == 16);
+  assert(choose_batch_size(1000000, 64, 64) == 1);
+
+  std::cout << " Passed\n";
+}
+
 void test_output_to_file() {
   std::cout << "Test: Output to file..." << std::flush;
   create_test_directory_structure();
@@ -1220,23 +3177,55 @@ int main() {
     test_is_path_ignored_by_gitignore();             // Uses TEST_DIR_PATH
     test_is_path_ignored_by_gitignore_multi_level(); // Uses
                                                      // TEST_GITIGNORE_DIR_PATH
+    test_gitignore_nested_precedence();              // Uses
+                                                     // TEST_GITIGNORE_DIR_PATH
+    test_gitignore_matcher_matches_regex_rules();
     test_is_file_size_valid();
     test_is_file_extension_allowed();
     test_should_ignore_folder(); // Uses TEST_DIR_PATH
     test_should_ignore_file();   // Uses TEST_DIR_PATH
     test_matches_regex_filters();
     test_matches_filename_regex_filters();
+    test_compiled_filters();
+    test_compiled_ignore_filters();                  // Uses TEST_DIR_PATH
     test_remove_cpp_comments();
+    test_remove_cpp_comments_matches_reference();
+    test_scan_kernels();
+    test_fused_transform_pipeline();
     test_format_file_output();              // Uses TEST_DIR_PATH
     test_format_file_output_line_numbers(); // Uses TEST_DIR_PATH
+    test_format_file_output_plain_fast_path();
     test_format_file_output_backticks();    // Uses TEST_DIR_PATH (NEW)
     test_process_single_file();             // Uses TEST_DIR_PATH
+    test_file_buffer_backends();            // Uses TEST_DIR_PATH
+    test_binary_detection();                // Uses TEST_DIR_PATH
     test_is_last_file();                    // Uses TEST_DIR_PATH
     test_collect_files_normal();            // Uses TEST_DIR_PATH
     test_collect_files_with_filters();      // Uses TEST_DIR_PATH
     test_collect_files_last();              // Uses TEST_DIR_PATH
     test_collect_files_only_last();         // Uses TEST_DIR_PATH
+    test_collect_files_nested_gitignore();  // Uses TEST_GITIGNORE_DIR_PATH
+    test_collect_files_parallel_walk();     // Uses TEST_DIR_PATH
+    test_file_records();                    // Uses TEST_DIR_PATH
     test_process_directory_output_order();  // Uses TEST_DIR_PATH
+    test_process_directory_small_window();  // Uses TEST_DIR_PATH
+    test_process_directory_parallel_last_files(); // Uses TEST_DIR_PATH
+    test_process_directory_cache();         // Uses TEST_DIR_PATH
+    test_stats_output();                    // Uses TEST_DIR_PATH
+    test_async_io();                        // Uses TEST_DIR_PATH
+    test_output_sink();                     // Uses TEST_DIR_PATH
+    test_token_budget();                    // Uses TEST_DIR_PATH
+    test_compressed_output();               // Uses TEST_DIR_PATH
+    test_dedupe();                          // Uses TEST_DIR_PATH
+    test_large_file_stream();               // Uses TEST_DIR_PATH
+    test_engine();                          // Uses TEST_DIR_PATH
+    test_index();                           // Uses TEST_DIR_PATH
+    test_shards();                          // Uses TEST_DIR_PATH
+    test_stop_and_timeout();                // Uses TEST_DIR_PATH
+    test_batch();                           // Uses TEST_DIR_PATH
+    test_watch_session_incremental();       // Uses TEST_DIR_PATH
+    test_change_watcher_reports_changes();  // Uses TEST_DIR_PATH
+    test_file_work_queue();
     test_output_to_file();                  // Uses TEST_DIR_PATH
     test_output_file_creation();            // Uses TEST_DIR_PATH
     test_dry_run_mode();                    // Uses TEST_DIR_PATH